@@ -87,6 +87,8 @@ struct lxc_arguments {
 	uint64_t fssize;
 	char *lvname, *vgname, *thinpool;
 	char *zfsroot, *lowerdir, *dir;
+	char *image;
+	int cache;
 
 	/* auto-start */
 	int all;
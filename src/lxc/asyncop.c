@@ -0,0 +1,766 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Asynchronous clone and create.
+ *
+ * Operations are queued to a pool of worker threads, started as needed up
+ * to the configured number and exiting once idle.  A worker runs each
+ * operation in a child process, in a process group of its own, so that a
+ * cancel can kill it along with the rsync or template it runs.  The child
+ * reports its phases, and rsync its progress, on a pipe the worker reads.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <lxc/lxccontainer.h>
+
+#include "asyncop.h"
+#include "bdev.h"
+#include "conf.h"
+#include "log.h"
+#include "utils.h"
+
+lxc_log_define(lxc_asyncop, lxc);
+
+/* how long an idle worker waits for an operation before exiting */
+#define OP_WORKER_IDLE 30
+/* how often a worker checks on its child when no progress comes */
+#define OP_POLL_MS 250
+
+int lxc_op_progress_fd = -1;
+
+enum {
+	OP_CLONE,
+	OP_CREATE,
+};
+
+struct lxc_op {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int refcount;
+	int kind;
+	struct lxc_container *c;
+	struct lxc_op_callbacks cb;
+
+	/* the arguments */
+	char *newname;
+	char *lxcpath;
+	char *bdevtype;
+	char *bdevdata;
+	uint64_t newsize;
+	int flags;
+	char **hookargs;
+	char *t;
+	struct bdev_specs *specs;
+	char **argv;
+
+	/* under lock */
+	struct lxc_op_progress progress;
+	pid_t pid;
+	bool cancelled;
+	bool finished;
+	struct lxc_container *result;
+	char *storage;
+
+	struct lxc_op *next;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static struct lxc_op *queue_head, *queue_tail;
+static int pool_max, pool_workers, pool_idle;
+
+static char **dup_strv(char * const *v)
+{
+	char **ret;
+	int i, n = 0;
+
+	if (!v)
+		return NULL;
+	while (v[n])
+		n++;
+	ret = calloc(n + 1, sizeof(char *));
+	if (!ret)
+		return NULL;
+	for (i = 0; i < n; i++) {
+		ret[i] = strdup(v[i]);
+		if (!ret[i]) {
+			lxc_free_array((void **)ret, free);
+			return NULL;
+		}
+	}
+	return ret;
+}
+
+static bool dup_str(char **dest, const char *src)
+{
+	*dest = NULL;
+	if (!src)
+		return true;
+	*dest = strdup(src);
+	return *dest != NULL;
+}
+
+static void free_specs(struct bdev_specs *specs)
+{
+	if (!specs)
+		return;
+	free(specs->fstype);
+	free(specs->zfs.zfsroot);
+	free(specs->lvm.vg);
+	free(specs->lvm.lv);
+	free(specs->lvm.thinpool);
+	free(specs->pool.image);
+	free(specs->pool.lxcpath);
+	free(specs->dir);
+	free(specs);
+}
+
+static struct bdev_specs *dup_specs(const struct bdev_specs *specs)
+{
+	struct bdev_specs *ret;
+
+	ret = calloc(1, sizeof(*ret));
+	if (!ret)
+		return NULL;
+	ret->fssize = specs->fssize;
+	if (!dup_str(&ret->fstype, specs->fstype) ||
+	    !dup_str(&ret->zfs.zfsroot, specs->zfs.zfsroot) ||
+	    !dup_str(&ret->lvm.vg, specs->lvm.vg) ||
+	    !dup_str(&ret->lvm.lv, specs->lvm.lv) ||
+	    !dup_str(&ret->lvm.thinpool, specs->lvm.thinpool) ||
+	    !dup_str(&ret->pool.image, specs->pool.image) ||
+	    !dup_str(&ret->pool.lxcpath, specs->pool.lxcpath) ||
+	    !dup_str(&ret->dir, specs->dir)) {
+		free_specs(ret);
+		return NULL;
+	}
+	return ret;
+}
+
+static void op_free(struct lxc_op *op)
+{
+	if (op->result)
+		lxc_container_put(op->result);
+	lxc_container_put(op->c);
+	free(op->newname);
+	free(op->lxcpath);
+	free(op->bdevtype);
+	free(op->bdevdata);
+	free(op->t);
+	free(op->storage);
+	if (op->hookargs)
+		lxc_free_array((void **)op->hookargs, free);
+	if (op->argv)
+		lxc_free_array((void **)op->argv, free);
+	free_specs(op->specs);
+	pthread_cond_destroy(&op->cond);
+	pthread_mutex_destroy(&op->lock);
+	free(op);
+}
+
+void lxc_op_put(struct lxc_op *op)
+{
+	int refcount;
+
+	if (!op)
+		return;
+	pthread_mutex_lock(&op->lock);
+	refcount = --op->refcount;
+	pthread_mutex_unlock(&op->lock);
+	if (refcount == 0)
+		op_free(op);
+}
+
+static struct lxc_op *op_new(struct lxc_container *c, int kind,
+			     const struct lxc_op_callbacks *cb)
+{
+	struct lxc_op *op;
+
+	op = calloc(1, sizeof(*op));
+	if (!op)
+		return NULL;
+	if (lxc_container_get(c) != 1) {
+		free(op);
+		return NULL;
+	}
+	pthread_mutex_init(&op->lock, NULL);
+	pthread_cond_init(&op->cond, NULL);
+	/* the caller's and the pool's */
+	op->refcount = 2;
+	op->kind = kind;
+	op->c = c;
+	if (cb)
+		op->cb = *cb;
+	op->progress.phase = LXC_OP_QUEUED;
+	return op;
+}
+
+void lxc_op_report_phase(int phase)
+{
+	char buf[32];
+	int len;
+
+	if (lxc_op_progress_fd < 0)
+		return;
+	len = snprintf(buf, sizeof(buf), "phase %d\n", phase);
+	if (write(lxc_op_progress_fd, buf, len) != len)
+		WARN("failed to report the progress: %s", strerror(errno));
+}
+
+void lxc_op_report_storage(const char *src)
+{
+	char buf[MAXPATHLEN + 16];
+	int len;
+
+	if (lxc_op_progress_fd < 0)
+		return;
+	len = snprintf(buf, sizeof(buf), "storage %s\n", src);
+	if (len < 0 || len >= sizeof(buf))
+		return;
+	if (write(lxc_op_progress_fd, buf, len) != len)
+		WARN("failed to report the storage: %s", strerror(errno));
+}
+
+static void op_notify(struct lxc_op *op)
+{
+	struct lxc_op_progress p;
+
+	if (!op->cb.progress)
+		return;
+	pthread_mutex_lock(&op->lock);
+	p = op->progress;
+	pthread_mutex_unlock(&op->lock);
+	op->cb.progress(op, &p, op->cb.data);
+}
+
+/*
+ * Parse a line the child wrote, either one of ours or one of rsync:
+ *	'      1,234,567  45%   12.34MB/s    0:00:01 (xfr#3, to-chk=0/10)'
+ */
+static void op_parse_line(struct lxc_op *op, const char *line)
+{
+	uint64_t bytes = 0;
+	int phase, pct = 0;
+	const char *p;
+
+	if (strncmp(line, "storage ", 8) == 0) {
+		pthread_mutex_lock(&op->lock);
+		free(op->storage);
+		op->storage = strdup(line + 8);
+		pthread_mutex_unlock(&op->lock);
+		return;
+	}
+	if (sscanf(line, "phase %d", &phase) == 1) {
+		pthread_mutex_lock(&op->lock);
+		op->progress.phase = phase;
+		pthread_mutex_unlock(&op->lock);
+		op_notify(op);
+		return;
+	}
+
+	for (p = line; *p == ' '; p++)
+		;
+	if (*p < '0' || *p > '9')
+		return;
+	for (; (*p >= '0' && *p <= '9') || *p == ','; p++)
+		if (*p != ',')
+			bytes = bytes * 10 + *p - '0';
+	if (*p != ' ' || sscanf(p, " %d%%", &pct) != 1)
+		return;
+
+	pthread_mutex_lock(&op->lock);
+	op->progress.bytes = bytes;
+	if (pct > 0)
+		op->progress.total = bytes * 100 / pct;
+	pthread_mutex_unlock(&op->lock);
+	op_notify(op);
+}
+
+static void op_read(struct lxc_op *op, int fd, char *line, size_t size,
+		    size_t *len)
+{
+	char buf[512];
+	ssize_t n, i;
+
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		for (i = 0; i < n; i++) {
+			if (buf[i] == '\r' || buf[i] == '\n') {
+				line[*len] = '\0';
+				if (*len)
+					op_parse_line(op, line);
+				*len = 0;
+			} else if (*len < size - 1) {
+				line[(*len)++] = buf[i];
+			}
+		}
+	}
+}
+
+/*
+ * Follow the progress of the child until it exits, leaving it to be
+ * reaped.  The pipe may be held open by the children of other workers,
+ * so its end of file does not tell that ours exited.
+ */
+static void op_watch(struct lxc_op *op, int fd, pid_t pid)
+{
+	char line[MAXPATHLEN + 16];
+	size_t len = 0;
+	siginfo_t si;
+
+	for (;;) {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+		if (poll(&pfd, 1, OP_POLL_MS) > 0)
+			op_read(op, fd, line, sizeof(line), &len);
+
+		memset(&si, 0, sizeof(si));
+		if (waitid(P_PID, pid, &si, WEXITED | WNOHANG | WNOWAIT) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (si.si_pid == pid)
+			break;
+		/* nothing more to read but the child is still around */
+		if (pfd.revents & POLLHUP)
+			usleep(OP_POLL_MS * 1000);
+	}
+	op_read(op, fd, line, sizeof(line), &len);
+}
+
+static bool op_child(struct lxc_op *op)
+{
+	struct lxc_container *c2;
+
+	if (op->kind == OP_CREATE)
+		return op->c->create(op->c, op->t, op->bdevtype, op->specs,
+				     op->flags, op->argv);
+
+	c2 = op->c->clone(op->c, op->newname, op->lxcpath, op->flags,
+			  op->bdevtype, op->bdevdata, op->newsize,
+			  op->hookargs);
+	if (!c2)
+		return false;
+	lxc_container_put(c2);
+	return true;
+}
+
+static void op_destroy_storage(const char *src)
+{
+	struct bdev *bdev;
+
+	bdev = bdev_init(src, NULL, NULL);
+	if (!bdev) {
+		ERROR("failed to find the storage %s of the partial clone", src);
+		return;
+	}
+	if (bdev->ops->destroy(bdev) < 0)
+		ERROR("failed to remove the storage %s of the partial clone", src);
+	bdev_put(bdev);
+}
+
+/* remove what a killed clone or create left of the new container */
+static void op_cleanup(struct lxc_op *op)
+{
+	struct lxc_container *c;
+	char path[MAXPATHLEN];
+	int ret;
+
+	/* a killed create left its partial file, which this takes care of */
+	c = lxc_container_new(op->newname, op->lxcpath);
+	if (op->kind == OP_CLONE) {
+		/* killed before it saved lxc.rootfs, which would lead to it */
+		if (op->storage && !(c && c->lxc_conf && c->lxc_conf->rootfs.path))
+			op_destroy_storage(op->storage);
+		if (c && c->is_defined(c)) {
+			if (!c->destroy(c))
+				ERROR("failed to remove the partial clone %s",
+				      op->newname);
+		} else {
+			ret = snprintf(path, MAXPATHLEN, "%s/%s/rootfs",
+				       op->lxcpath, op->newname);
+			if (ret > 0 && ret < MAXPATHLEN) {
+				rmdir(path);
+				*strrchr(path, '/') = '\0';
+				rmdir(path);
+			}
+		}
+	}
+	if (c)
+		lxc_container_put(c);
+}
+
+/* whether a clone to newname would overwrite an existing container */
+static bool op_clone_exists(struct lxc_op *op)
+{
+	char path[MAXPATHLEN];
+	int ret;
+
+	ret = snprintf(path, MAXPATHLEN, "%s/%s/config", op->lxcpath,
+		       op->newname);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return true;
+	return access(path, F_OK) == 0;
+}
+
+static void op_finish(struct lxc_op *op, int phase,
+		      struct lxc_container *result)
+{
+	pthread_mutex_lock(&op->lock);
+	op->progress.phase = phase;
+	op->result = result;
+	pthread_mutex_unlock(&op->lock);
+
+	op_notify(op);
+	if (op->cb.done)
+		op->cb.done(op, result, op->cb.data);
+
+	pthread_mutex_lock(&op->lock);
+	op->finished = true;
+	pthread_cond_broadcast(&op->cond);
+	pthread_mutex_unlock(&op->lock);
+	lxc_op_put(op);
+}
+
+static void op_run(struct lxc_op *op)
+{
+	struct lxc_container *result;
+	bool cancelled;
+	int p[2], status;
+	pid_t pid;
+
+	if (op->kind == OP_CLONE && op_clone_exists(op)) {
+		ERROR("clone: %s/%s exists", op->lxcpath, op->newname);
+		op_finish(op, LXC_OP_FAILED, NULL);
+		return;
+	}
+
+	if (pipe2(p, O_CLOEXEC) < 0) {
+		SYSERROR("failed to create the progress pipe");
+		op_finish(op, LXC_OP_FAILED, NULL);
+		return;
+	}
+
+	pthread_mutex_lock(&op->lock);
+	if (op->cancelled) {
+		pthread_mutex_unlock(&op->lock);
+		close(p[0]);
+		close(p[1]);
+		op_finish(op, LXC_OP_CANCELLED, NULL);
+		return;
+	}
+	pid = fork();
+	if (pid == 0) {
+		close(p[0]);
+		setpgid(0, 0);
+		lxc_op_progress_fd = p[1];
+		_exit(op_child(op) ? 0 : 1);
+	}
+	if (pid > 0) {
+		/* either of us may get there first */
+		setpgid(pid, pid);
+		op->pid = pid;
+	}
+	pthread_mutex_unlock(&op->lock);
+	close(p[1]);
+	if (pid < 0) {
+		SYSERROR("failed to fork");
+		close(p[0]);
+		op_finish(op, LXC_OP_FAILED, NULL);
+		return;
+	}
+
+	if (fcntl(p[0], F_SETFL, O_NONBLOCK) < 0)
+		WARN("failed to make the progress pipe non-blocking: %s",
+		     strerror(errno));
+	op_watch(op, p[0], pid);
+	close(p[0]);
+
+	/* the child is a zombie until reaped, so a cancel can't kill another */
+	pthread_mutex_lock(&op->lock);
+	op->pid = 0;
+	cancelled = op->cancelled;
+	pthread_mutex_unlock(&op->lock);
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			status = -1;
+			break;
+		}
+	}
+
+	if (status == 0) {
+		result = lxc_container_new(op->newname, op->lxcpath);
+		if (result && result->is_defined(result)) {
+			op_finish(op, LXC_OP_DONE, result);
+			return;
+		}
+		if (result)
+			lxc_container_put(result);
+		op_finish(op, LXC_OP_FAILED, NULL);
+		return;
+	}
+
+	/* a child which failed cleaned up after itself, a killed one did not */
+	if (status != -1 && WIFSIGNALED(status))
+		op_cleanup(op);
+	if (cancelled) {
+		INFO("cancelled the %s of %s", op->kind == OP_CLONE ?
+		     "clone" : "creation", op->newname);
+		op_finish(op, LXC_OP_CANCELLED, NULL);
+	} else {
+		ERROR("failed to %s %s", op->kind == OP_CLONE ?
+		      "clone" : "create", op->newname);
+		op_finish(op, LXC_OP_FAILED, NULL);
+	}
+}
+
+static void *op_worker(void *arg)
+{
+	struct lxc_op *op;
+	struct timespec ts;
+
+	pthread_mutex_lock(&pool_lock);
+	for (;;) {
+		while (!queue_head) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += OP_WORKER_IDLE;
+			pool_idle++;
+			pthread_cond_timedwait(&pool_cond, &pool_lock, &ts);
+			pool_idle--;
+			if (!queue_head && time(NULL) >= ts.tv_sec)
+				goto out;
+		}
+		if (pool_workers > pool_max)
+			goto out;
+
+		op = queue_head;
+		queue_head = op->next;
+		if (!queue_head)
+			queue_tail = NULL;
+		pthread_mutex_unlock(&pool_lock);
+
+		op_run(op);
+
+		pthread_mutex_lock(&pool_lock);
+	}
+out:
+	pool_workers--;
+	/* leave what is queued to another worker */
+	pthread_cond_signal(&pool_cond);
+	pthread_mutex_unlock(&pool_lock);
+	return NULL;
+}
+
+static int pool_default_workers(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return n > 0 ? n : 1;
+}
+
+void lxc_op_set_workers(int n)
+{
+	pthread_mutex_lock(&pool_lock);
+	pool_max = n > 0 ? n : pool_default_workers();
+	/* workers above the new maximum exit once done with their operation */
+	pthread_cond_broadcast(&pool_cond);
+	pthread_mutex_unlock(&pool_lock);
+}
+
+static void queue_unlink(struct lxc_op *op)
+{
+	struct lxc_op **p, *prev = NULL;
+
+	for (p = &queue_head; *p; prev = *p, p = &(*p)->next) {
+		if (*p != op)
+			continue;
+		*p = op->next;
+		if (queue_tail == op)
+			queue_tail = prev;
+		return;
+	}
+}
+
+static bool op_submit(struct lxc_op *op)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	bool ret = true;
+
+	pthread_mutex_lock(&pool_lock);
+	if (!pool_max)
+		pool_max = pool_default_workers();
+
+	if (queue_tail)
+		queue_tail->next = op;
+	else
+		queue_head = op;
+	queue_tail = op;
+
+	if (pool_idle == 0 && pool_workers < pool_max) {
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if (pthread_create(&thread, &attr, op_worker, NULL) == 0)
+			pool_workers++;
+		pthread_attr_destroy(&attr);
+		/* a busy worker will get to it */
+		if (pool_workers == 0) {
+			ERROR("failed to start a worker thread");
+			queue_unlink(op);
+			ret = false;
+		}
+	}
+	pthread_cond_signal(&pool_cond);
+	pthread_mutex_unlock(&pool_lock);
+	return ret;
+}
+
+struct lxc_op *lxc_clone_async(struct lxc_container *c, const char *newname,
+		const char *lxcpath, int flags, const char *bdevtype,
+		const char *bdevdata, uint64_t newsize, char **hookargs,
+		const struct lxc_op_callbacks *cb)
+{
+	struct lxc_op *op;
+
+	if (!c || !c->is_defined(c))
+		return NULL;
+
+	op = op_new(c, OP_CLONE, cb);
+	if (!op)
+		return NULL;
+	op->flags = flags;
+	op->newsize = newsize;
+	if (!dup_str(&op->newname, newname ? newname : c->name) ||
+	    !dup_str(&op->lxcpath, lxcpath ? lxcpath : c->config_path) ||
+	    !dup_str(&op->bdevtype, bdevtype) ||
+	    !dup_str(&op->bdevdata, bdevdata) ||
+	    (hookargs && !(op->hookargs = dup_strv(hookargs))))
+		goto err;
+
+	if (!op_submit(op))
+		goto err;
+	return op;
+
+err:
+	op_free(op);
+	return NULL;
+}
+
+struct lxc_op *lxc_create_async(struct lxc_container *c, const char *t,
+		const char *bdevtype, struct bdev_specs *specs, int flags,
+		char *const argv[], const struct lxc_op_callbacks *cb)
+{
+	struct lxc_op *op;
+
+	if (!c)
+		return NULL;
+
+	op = op_new(c, OP_CREATE, cb);
+	if (!op)
+		return NULL;
+	op->flags = flags;
+	if (!dup_str(&op->newname, c->name) ||
+	    !dup_str(&op->lxcpath, c->config_path) ||
+	    !dup_str(&op->t, t) ||
+	    !dup_str(&op->bdevtype, bdevtype) ||
+	    (specs && !(op->specs = dup_specs(specs))) ||
+	    (argv && !(op->argv = dup_strv(argv))))
+		goto err;
+
+	if (!op_submit(op))
+		goto err;
+	return op;
+
+err:
+	op_free(op);
+	return NULL;
+}
+
+bool lxc_op_cancel(struct lxc_op *op)
+{
+	bool ret;
+
+	if (!op)
+		return false;
+	pthread_mutex_lock(&op->lock);
+	ret = !op->finished && !op->cancelled;
+	op->cancelled = true;
+	if (ret && op->pid > 0 && kill(-op->pid, SIGKILL) < 0)
+		SYSERROR("failed to kill the operation on %s", op->newname);
+	pthread_mutex_unlock(&op->lock);
+	return ret;
+}
+
+bool lxc_op_wait(struct lxc_op *op, int timeout)
+{
+	struct timespec ts;
+	bool ret;
+
+	if (!op)
+		return false;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout;
+
+	pthread_mutex_lock(&op->lock);
+	while (!op->finished) {
+		if (timeout < 0)
+			pthread_cond_wait(&op->cond, &op->lock);
+		else if (pthread_cond_timedwait(&op->cond, &op->lock, &ts) == ETIMEDOUT)
+			break;
+	}
+	ret = op->finished;
+	pthread_mutex_unlock(&op->lock);
+	return ret;
+}
+
+void lxc_op_get_progress(struct lxc_op *op, struct lxc_op_progress *p)
+{
+	if (!op || !p)
+		return;
+	pthread_mutex_lock(&op->lock);
+	*p = op->progress;
+	pthread_mutex_unlock(&op->lock);
+}
+
+struct lxc_container *lxc_op_result(struct lxc_op *op)
+{
+	struct lxc_container *c = NULL;
+
+	if (!op)
+		return NULL;
+	pthread_mutex_lock(&op->lock);
+	if (op->result && lxc_container_get(op->result) == 1)
+		c = op->result;
+	pthread_mutex_unlock(&op->lock);
+	return c;
+}
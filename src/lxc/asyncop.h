@@ -0,0 +1,38 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef __LXC_ASYNCOP_H
+#define __LXC_ASYNCOP_H
+
+/*
+ * In the process running an asynchronous clone or create, the pipe to
+ * report progress on, else -1.  rsync writes its --info=progress2 lines
+ * there.
+ */
+extern int lxc_op_progress_fd;
+
+/* report that the operation entered phase, one of LXC_OP_* */
+extern void lxc_op_report_phase(int phase);
+
+/*
+ * report the src of the storage a clone made, before it is filled: a
+ * clone killed before it saved its configuration has no lxc.rootfs to
+ * find the storage by
+ */
+extern void lxc_op_report_storage(const char *src);
+
+#endif
@@ -37,6 +37,11 @@
 #include <sys/wait.h>
 #include <linux/unistd.h>
 #include <pwd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <stdint.h>
 
 #if !HAVE_DECL_PR_CAPBSET_DROP
 #define PR_CAPBSET_DROP 24
@@ -74,6 +79,8 @@
 
 lxc_log_define(lxc_attach, lxc);
 
+#define LXC_ATTACH_NS_MAX 6
+
 static struct lxc_proc_context_info *lxc_proc_get_context_info(pid_t pid)
 {
 	struct lxc_proc_context_info *info = calloc(1, sizeof(*info));
@@ -151,22 +158,37 @@ static void lxc_proc_put_context_info(struct lxc_proc_context_info *ctx)
 	free(ctx);
 }
 
-static int lxc_attach_to_ns(pid_t pid, int which)
+/* namespaces which can be attached to, in the order they are entered */
+static char *ns_names[LXC_ATTACH_NS_MAX] = {
+	"user", "mnt", "pid", "uts", "ipc", "net"
+};
+static int ns_flags[LXC_ATTACH_NS_MAX] = {
+	CLONE_NEWUSER, CLONE_NEWNS, CLONE_NEWPID, CLONE_NEWUTS, CLONE_NEWIPC,
+	CLONE_NEWNET
+};
+
+static void lxc_attach_close_ns(int nsfd[])
+{
+	int i;
+
+	for (i = 0; i < LXC_ATTACH_NS_MAX; i++) {
+		if (nsfd[i] >= 0)
+			close(nsfd[i]);
+		nsfd[i] = -1;
+	}
+}
+
+/*
+ * Open the namespaces of pid, namespaces the running kernel does not
+ * know about are left at -1.
+ */
+static int lxc_attach_open_ns(pid_t pid, int nsfd[])
 {
 	char path[MAXPATHLEN];
-	/* according to <http://article.gmane.org/gmane.linux.kernel.containers.lxc.devel/1429>,
-	 * the file for user namepsaces in /proc/$pid/ns will be called
-	 * 'user' once the kernel supports it
-	 */
-	static char *ns[] = { "user", "mnt", "pid", "uts", "ipc", "net" };
-	static int flags[] = {
-		CLONE_NEWUSER, CLONE_NEWNS, CLONE_NEWPID, CLONE_NEWUTS, CLONE_NEWIPC,
-		CLONE_NEWNET
-	};
-	static const int size = sizeof(ns) / sizeof(char *);
-	int fd[size];
-	int i, j, saved_errno;
+	int i, saved_errno;
 
+	for (i = 0; i < LXC_ATTACH_NS_MAX; i++)
+		nsfd[i] = -1;
 
 	snprintf(path, MAXPATHLEN, "/proc/%d/ns", pid);
 	if (access(path, X_OK)) {
@@ -174,45 +196,44 @@ static int lxc_attach_to_ns(pid_t pid, int which)
 		return -1;
 	}
 
-	for (i = 0; i < size; i++) {
-		/* ignore if we are not supposed to attach to that
-		 * namespace
-		 */
-		if (which != -1 && !(which & flags[i])) {
-			fd[i] = -1;
-			continue;
-		}
+	for (i = 0; i < LXC_ATTACH_NS_MAX; i++) {
+		snprintf(path, MAXPATHLEN, "/proc/%d/ns/%s", pid, ns_names[i]);
+		nsfd[i] = open(path, O_RDONLY | O_CLOEXEC);
+		if (nsfd[i] < 0) {
+			if (errno == ENOENT)
+				continue;
 
-		snprintf(path, MAXPATHLEN, "/proc/%d/ns/%s", pid, ns[i]);
-		fd[i] = open(path, O_RDONLY | O_CLOEXEC);
-		if (fd[i] < 0) {
 			saved_errno = errno;
-
-			/* close all already opened file descriptors before
-			 * we return an error, so we don't leak them
-			 */
-			for (j = 0; j < i; j++)
-				close(fd[j]);
-
+			lxc_attach_close_ns(nsfd);
 			errno = saved_errno;
 			SYSERROR("failed to open '%s'", path);
 			return -1;
 		}
 	}
 
-	for (i = 0; i < size; i++) {
-		if (fd[i] >= 0 && setns(fd[i], 0) != 0) {
-			saved_errno = errno;
+	return 0;
+}
 
-			for (j = i; j < size; j++)
-				close(fd[j]);
+static int lxc_attach_to_ns(int nsfd[], int which)
+{
+	int i;
 
-			errno = saved_errno;
-			SYSERROR("failed to set namespace '%s'", ns[i]);
+	for (i = 0; i < LXC_ATTACH_NS_MAX; i++) {
+		/* ignore if we are not supposed to attach to that
+		 * namespace
+		 */
+		if (which != -1 && !(which & ns_flags[i]))
+			continue;
+
+		if (nsfd[i] < 0) {
+			ERROR("namespace '%s' is not supported", ns_names[i]);
 			return -1;
 		}
 
-		close(fd[i]);
+		if (setns(nsfd[i], 0) != 0) {
+			SYSERROR("failed to set namespace '%s'", ns_names[i]);
+			return -1;
+		}
 	}
 
 	return 0;
@@ -605,6 +626,41 @@ struct attach_clone_payload {
 	void* exec_payload;
 };
 
+/*
+ * A helper is a process which already joined the namespaces (and the
+ * cgroups) of the container and forks attached processes on request,
+ * see lxc_attach_session_run_command.
+ */
+struct lxc_attach_helper {
+	pid_t pid;
+	int sock;
+	pthread_mutex_t lock;
+};
+
+/*
+ * What lxc_attach needs to know about the container, gathered once and
+ * reused by all attaches of a session.
+ */
+struct lxc_attach_session {
+	char *name;
+	char *lxcpath;
+	pthread_rwlock_t lock;
+	pid_t init_pid;
+	int clone_flags;
+	struct lxc_proc_context_info *init_ctx;
+	int nsfd[LXC_ATTACH_NS_MAX];
+	/* identity of one of the namespaces, to notice a restart */
+	int id_ns;
+	dev_t id_dev;
+	ino_t id_ino;
+	/* helpers join these namespaces, and the cgroups if asked to */
+	int helper_namespaces;
+	int helper_flags;
+	int nhelpers;
+	struct lxc_attach_helper *helpers;
+	unsigned int next_helper;
+};
+
 static int attach_child_main(void* data);
 
 /* help the optimizer along if it doesn't know that exit always exits */
@@ -617,8 +673,8 @@ static bool fetch_seccomp(const char *name, const char *lxcpath,
 		struct lxc_proc_context_info *i, lxc_attach_options_t *options)
 {
 	struct lxc_container *c;
-	
-	if (!(options->namespaces & CLONE_NEWNS) || !(options->attach_flags & LXC_ATTACH_LSM))
+
+	if (options && (!(options->namespaces & CLONE_NEWNS) || !(options->attach_flags & LXC_ATTACH_LSM)))
 		return true;
 
 	c = lxc_container_new(name, lxcpath);
@@ -635,50 +691,100 @@ static bool fetch_seccomp(const char *name, const char *lxcpath,
 	return true;
 }
 
-int lxc_attach(const char* name, const char* lxcpath, lxc_attach_exec_t exec_function, void* exec_payload, lxc_attach_options_t* options, pid_t* attached_process)
+/*
+ * Gather the context of the container's init. With options, only what
+ * an attach with those options needs is gathered, without everything.
+ */
+static int attach_session_init(struct lxc_attach_session *s, lxc_attach_options_t *options)
 {
-	int ret, status;
-	pid_t init_pid, pid, attached_pid, expected;
-	struct lxc_proc_context_info *init_ctx;
-	char* cwd;
-	char* new_cwd;
-	int ipc_sockets[2];
+	struct stat st;
+	int i;
 
-	if (!options)
-		options = &attach_static_default_options;
-
-	init_pid = lxc_cmd_get_init_pid(name, lxcpath);
-	if (init_pid < 0) {
+	s->init_pid = lxc_cmd_get_init_pid(s->name, s->lxcpath);
+	if (s->init_pid < 0) {
 		ERROR("failed to get the init pid");
 		return -1;
 	}
 
-	init_ctx = lxc_proc_get_context_info(init_pid);
-	if (!init_ctx) {
-		ERROR("failed to get context of the init process, pid = %ld", (long)init_pid);
+	s->init_ctx = lxc_proc_get_context_info(s->init_pid);
+	if (!s->init_ctx) {
+		ERROR("failed to get context of the init process, pid = %ld", (long)s->init_pid);
 		return -1;
 	}
 
-	if (!fetch_seccomp(name, lxcpath, init_ctx, options))
+	if (!fetch_seccomp(s->name, s->lxcpath, s->init_ctx, options))
 		WARN("Failed to get seccomp policy");
 
-	cwd = getcwd(NULL, 0);
-
 	/* determine which namespaces the container was created with
 	 * by asking lxc-start, if necessary
 	 */
-	if (options->namespaces == -1) {
-		options->namespaces = lxc_cmd_get_clone_flags(name, lxcpath);
+	s->clone_flags = -1;
+	if (!options || options->namespaces == -1) {
+		s->clone_flags = lxc_cmd_get_clone_flags(s->name, s->lxcpath);
 		/* call failed */
-		if (options->namespaces == -1) {
+		if (s->clone_flags == -1) {
 			ERROR("failed to automatically determine the "
 			      "namespaces which the container unshared");
-			free(cwd);
-			lxc_proc_put_context_info(init_ctx);
-			return -1;
+			goto out_error;
+		}
+	}
+
+	if (lxc_attach_open_ns(s->init_pid, s->nsfd) < 0)
+		goto out_error;
+
+	for (i = 0; i < LXC_ATTACH_NS_MAX; i++) {
+		if (s->nsfd[i] >= 0 && !fstat(s->nsfd[i], &st)) {
+			s->id_ns = i;
+			s->id_dev = st.st_dev;
+			s->id_ino = st.st_ino;
+			break;
 		}
 	}
 
+	return 0;
+
+out_error:
+	lxc_proc_put_context_info(s->init_ctx);
+	s->init_ctx = NULL;
+	return -1;
+}
+
+static void attach_session_fini(struct lxc_attach_session *s)
+{
+	lxc_attach_close_ns(s->nsfd);
+	if (s->init_ctx)
+		lxc_proc_put_context_info(s->init_ctx);
+	s->init_ctx = NULL;
+}
+
+/* whether the container still runs the init the session was set up for */
+static bool attach_session_current(struct lxc_attach_session *s)
+{
+	char path[MAXPATHLEN];
+	struct stat st;
+
+	if (!s->init_ctx)
+		return false;
+
+	snprintf(path, MAXPATHLEN, "/proc/%d/ns/%s", s->init_pid, ns_names[s->id_ns]);
+	if (stat(path, &st))
+		return false;
+
+	return st.st_dev == s->id_dev && st.st_ino == s->id_ino;
+}
+
+static int attach_session_attach(struct lxc_attach_session *s, lxc_attach_exec_t exec_function,
+				 void *exec_payload, lxc_attach_options_t *options,
+				 pid_t *attached_process)
+{
+	int ret, status;
+	pid_t pid, attached_pid, expected;
+	char* cwd;
+	char* new_cwd;
+	int ipc_sockets[2];
+
+	cwd = getcwd(NULL, 0);
+
 	/* create a socket pair for IPC communication; set SOCK_CLOEXEC in order
 	 * to make sure we don't irritate other threads that want to fork+exec away
 	 *
@@ -710,7 +816,6 @@ int lxc_attach(const char* name, const char* lxcpath, lxc_attach_exec_t exec_fun
 	if (ret < 0) {
 		SYSERROR("could not set up required IPC mechanism for attaching");
 		free(cwd);
-		lxc_proc_put_context_info(init_ctx);
 		return -1;
 	}
 
@@ -731,7 +836,6 @@ int lxc_attach(const char* name, const char* lxcpath, lxc_attach_exec_t exec_fun
 	if (pid < 0) {
 		SYSERROR("failed to create first subprocess");
 		free(cwd);
-		lxc_proc_put_context_info(init_ctx);
 		return -1;
 	}
 
@@ -746,7 +850,7 @@ int lxc_attach(const char* name, const char* lxcpath, lxc_attach_exec_t exec_fun
 
 		/* attach to cgroup, if requested */
 		if (options->attach_flags & LXC_ATTACH_MOVE_TO_CGROUP) {
-			if (!cgroup_attach(name, lxcpath, pid))
+			if (!cgroup_attach(s->name, s->lxcpath, pid))
 				goto cleanup_error;
 		}
 
@@ -802,7 +906,6 @@ int lxc_attach(const char* name, const char* lxcpath, lxc_attach_exec_t exec_fun
 		/* now shut down communication with child, we're done */
 		shutdown(ipc_sockets[0], SHUT_RDWR);
 		close(ipc_sockets[0]);
-		lxc_proc_put_context_info(init_ctx);
 
 		/* we're done, the child process should now execute whatever
 		 * it is that the user requested. The parent can now track it
@@ -820,7 +923,6 @@ int lxc_attach(const char* name, const char* lxcpath, lxc_attach_exec_t exec_fun
 		close(ipc_sockets[0]);
 		if (to_cleanup_pid)
 			(void) wait_for_pid(to_cleanup_pid);
-		lxc_proc_put_context_info(init_ctx);
 		return -1;
 	}
 
@@ -842,7 +944,7 @@ int lxc_attach(const char* name, const char* lxcpath, lxc_attach_exec_t exec_fun
 	/* attach now, create another subprocess later, since pid namespaces
 	 * only really affect the children of the current process
 	 */
-	ret = lxc_attach_to_ns(init_pid, options->namespaces);
+	ret = lxc_attach_to_ns(s->nsfd, options->namespaces);
 	if (ret < 0) {
 		ERROR("failed to enter the namespace");
 		shutdown(ipc_sockets[1], SHUT_RDWR);
@@ -864,7 +966,7 @@ int lxc_attach(const char* name, const char* lxcpath, lxc_attach_exec_t exec_fun
 		struct attach_clone_payload payload = {
 			.ipc_socket = ipc_sockets[1],
 			.options = options,
-			.init_ctx = init_ctx,
+			.init_ctx = s->init_ctx,
 			.exec_function = exec_function,
 			.exec_payload = exec_payload
 		};
@@ -900,35 +1002,44 @@ int lxc_attach(const char* name, const char* lxcpath, lxc_attach_exec_t exec_fun
 	rexit(0);
 }
 
-static int attach_child_main(void* data)
+int lxc_attach(const char* name, const char* lxcpath, lxc_attach_exec_t exec_function, void* exec_payload, lxc_attach_options_t* options, pid_t* attached_process)
+{
+	struct lxc_attach_session session;
+	int ret;
+
+	if (!options)
+		options = &attach_static_default_options;
+
+	memset(&session, 0, sizeof(session));
+	session.name = (char *)name;
+	session.lxcpath = (char *)lxcpath;
+
+	if (attach_session_init(&session, options) < 0)
+		return -1;
+
+	if (options->namespaces == -1)
+		options->namespaces = session.clone_flags;
+
+	ret = attach_session_attach(&session, exec_function, exec_payload,
+				    options, attached_process);
+	attach_session_fini(&session);
+	return ret;
+}
+
+/*
+ * Setup of the attached process which happens before the initial
+ * process puts it into the container's cgroups.
+ */
+static int attach_child_setup(lxc_attach_options_t* options,
+			      struct lxc_proc_context_info* init_ctx)
 {
-	struct attach_clone_payload* payload = (struct attach_clone_payload*)data;
-	int ipc_socket = payload->ipc_socket;
-	lxc_attach_options_t* options = payload->options;
-	struct lxc_proc_context_info* init_ctx = payload->init_ctx;
 #if HAVE_SYS_PERSONALITY_H
 	long new_personality;
 #endif
 	int ret;
-	int status;
-	int expected;
-	long flags;
-	int fd;
 	uid_t new_uid;
 	gid_t new_gid;
 
-	/* wait for the initial thread to signal us that it's ready
-	 * for us to start initializing
-	 */
-	expected = 0;
-	status = -1;
-	ret = lxc_read_nointr_expect(ipc_socket, &status, sizeof(status), &expected);
-	if (ret <= 0) {
-		ERROR("error using IPC to receive notification from initial process (0)");
-		shutdown(ipc_socket, SHUT_RDWR);
-		rexit(-1);
-	}
-
 	/* A description of the purpose of this functionality is
 	 * provided in the lxc-attach(1) manual page. We have to
 	 * remount here and not in the parent process, otherwise
@@ -936,10 +1047,8 @@ static int attach_child_main(void* data)
 	 */
 	if (!(options->namespaces & CLONE_NEWNS) && (options->attach_flags & LXC_ATTACH_REMOUNT_PROC_SYS)) {
 		ret = lxc_attach_remount_sys_proc();
-		if (ret < 0) {
-			shutdown(ipc_socket, SHUT_RDWR);
-			rexit(-1);
-		}
+		if (ret < 0)
+			return -1;
 	}
 
 	/* now perform additional attachments*/
@@ -953,8 +1062,7 @@ static int attach_child_main(void* data)
 		ret = personality(new_personality);
 		if (ret < 0) {
 			SYSERROR("could not ensure correct architecture");
-			shutdown(ipc_socket, SHUT_RDWR);
-			rexit(-1);
+			return -1;
 		}
 	}
 #endif
@@ -963,8 +1071,7 @@ static int attach_child_main(void* data)
 		ret = lxc_attach_drop_privs(init_ctx);
 		if (ret < 0) {
 			ERROR("could not drop privileges");
-			shutdown(ipc_socket, SHUT_RDWR);
-			rexit(-1);
+			return -1;
 		}
 	}
 
@@ -972,8 +1079,7 @@ static int attach_child_main(void* data)
 	ret = lxc_attach_set_environment(options->env_policy, options->extra_env_vars, options->extra_keep_env);
 	if (ret < 0) {
 		ERROR("could not set initial environment for attached process");
-		shutdown(ipc_socket, SHUT_RDWR);
-		rexit(-1);
+		return -1;
 	}
 
 	/* set user / group id */
@@ -994,39 +1100,27 @@ static int attach_child_main(void* data)
 	if ((new_gid != 0 || options->namespaces & CLONE_NEWUSER)) {
 		if (setgid(new_gid) || setgroups(0, NULL)) {
 			SYSERROR("switching to container gid");
-			shutdown(ipc_socket, SHUT_RDWR);
-			rexit(-1);
+			return -1;
 		}
 	}
 	if ((new_uid != 0 || options->namespaces & CLONE_NEWUSER) && setuid(new_uid)) {
 		SYSERROR("switching to container uid");
-		shutdown(ipc_socket, SHUT_RDWR);
-		rexit(-1);
-	}
-
-	/* tell initial process it may now put us into the cgroups */
-	status = 1;
-	ret = lxc_write_nointr(ipc_socket, &status, sizeof(status));
-	if (ret != sizeof(status)) {
-		ERROR("error using IPC to notify initial process for initialization (1)");
-		shutdown(ipc_socket, SHUT_RDWR);
-		rexit(-1);
+		return -1;
 	}
 
-	/* wait for the initial thread to signal us that it has done
-	 * everything for us when it comes to cgroups etc.
-	 */
-	expected = 2;
-	status = -1;
-	ret = lxc_read_nointr_expect(ipc_socket, &status, sizeof(status), &expected);
-	if (ret <= 0) {
-		ERROR("error using IPC to receive final notification from initial process (2)");
-		shutdown(ipc_socket, SHUT_RDWR);
-		rexit(-1);
-	}
+	return 0;
+}
 
-	shutdown(ipc_socket, SHUT_RDWR);
-	close(ipc_socket);
+/*
+ * Last steps of the attached process, once it is in the cgroups, up to
+ * running the requested function.
+ */
+static int attach_child_exec(lxc_attach_options_t* options,
+			     struct lxc_proc_context_info* init_ctx,
+			     lxc_attach_exec_t exec_function, void* exec_payload)
+{
+	long flags;
+	int fd, ret;
 
 	/* set new apparmor profile/selinux context */
 	if ((options->namespaces & CLONE_NEWNS) && (options->attach_flags & LXC_ATTACH_LSM)) {
@@ -1034,15 +1128,14 @@ static int attach_child_main(void* data)
 
 		on_exec = options->attach_flags & LXC_ATTACH_LSM_EXEC ? 1 : 0;
 		ret = lsm_process_label_set(init_ctx->lsm_label, 0, on_exec);
-		if (ret < 0) {
-			rexit(-1);
-		}
-	}
+		if (ret < 0)
+			return -1;
 
-	if (init_ctx->container && init_ctx->container->lxc_conf &&
-			lxc_seccomp_load(init_ctx->container->lxc_conf) != 0) {
-		ERROR("Loading seccomp policy");
-		rexit(-1);
+		if (init_ctx->container && init_ctx->container->lxc_conf &&
+				lxc_seccomp_load(init_ctx->container->lxc_conf) != 0) {
+			ERROR("Loading seccomp policy");
+			return -1;
+		}
 	}
 
 	lxc_proc_put_context_info(init_ctx);
@@ -1086,7 +1179,1385 @@ static int attach_child_main(void* data)
 	}
 
 	/* we're done, so we can now do whatever the user intended us to do */
-	rexit(payload->exec_function(payload->exec_payload));
+	return exec_function(exec_payload);
+}
+
+static int attach_child_main(void* data)
+{
+	struct attach_clone_payload* payload = (struct attach_clone_payload*)data;
+	int ipc_socket = payload->ipc_socket;
+	lxc_attach_options_t* options = payload->options;
+	struct lxc_proc_context_info* init_ctx = payload->init_ctx;
+	int ret;
+	int status;
+	int expected;
+
+	/* wait for the initial thread to signal us that it's ready
+	 * for us to start initializing
+	 */
+	expected = 0;
+	status = -1;
+	ret = lxc_read_nointr_expect(ipc_socket, &status, sizeof(status), &expected);
+	if (ret <= 0) {
+		ERROR("error using IPC to receive notification from initial process (0)");
+		shutdown(ipc_socket, SHUT_RDWR);
+		rexit(-1);
+	}
+
+	if (attach_child_setup(options, init_ctx) < 0) {
+		shutdown(ipc_socket, SHUT_RDWR);
+		rexit(-1);
+	}
+
+	/* tell initial process it may now put us into the cgroups */
+	status = 1;
+	ret = lxc_write_nointr(ipc_socket, &status, sizeof(status));
+	if (ret != sizeof(status)) {
+		ERROR("error using IPC to notify initial process for initialization (1)");
+		shutdown(ipc_socket, SHUT_RDWR);
+		rexit(-1);
+	}
+
+	/* wait for the initial thread to signal us that it has done
+	 * everything for us when it comes to cgroups etc.
+	 */
+	expected = 2;
+	status = -1;
+	ret = lxc_read_nointr_expect(ipc_socket, &status, sizeof(status), &expected);
+	if (ret <= 0) {
+		ERROR("error using IPC to receive final notification from initial process (2)");
+		shutdown(ipc_socket, SHUT_RDWR);
+		rexit(-1);
+	}
+
+	shutdown(ipc_socket, SHUT_RDWR);
+	close(ipc_socket);
+
+	rexit(attach_child_exec(options, init_ctx, payload->exec_function,
+				payload->exec_payload));
+}
+
+/*
+ * Attach helpers.
+ *
+ * A helper is forked by the session, put into the container's cgroups
+ * and then joins its namespaces.  From there it forks attached
+ * processes on request, with CLONE_PARENT so that they are children of
+ * the session's process as with lxc_attach.  Since the helper does not
+ * share our memory, only commands can be run through it: requests are
+ * serialized into a single SOCK_SEQPACKET message, with the stdio file
+ * descriptors passed along, and answered with the pid of the attached
+ * process.
+ */
+#define LXC_ATTACH_HELPER_MSGMAX 65536
+
+struct attach_helper_request {
+	int attach_flags;
+	long personality;
+	uid_t uid;
+	gid_t gid;
+	int env_policy;
+	int fds;	/* which of stdin, stdout and stderr are passed */
+	int argc;
+	int nenv;
+	int nkeep;
+	/* followed by the cwd, the program, argv, extra_env_vars and
+	 * extra_keep_env as nul terminated strings */
+};
+
+struct attach_helper_payload {
+	lxc_attach_options_t *options;
+	struct lxc_proc_context_info *init_ctx;
+	const char *cwd;
+	lxc_attach_command_t command;
+};
+
+static int attach_helper_pack_strings(char *buf, size_t size, size_t *len,
+				      char **strv, int *count)
+{
+	size_t l;
+
+	*count = 0;
+	for (; strv && *strv; strv++) {
+		l = strlen(*strv) + 1;
+		if (*len + l > size)
+			return -1;
+		memcpy(buf + *len, *strv, l);
+		*len += l;
+		(*count)++;
+	}
+
+	return 0;
+}
+
+static ssize_t attach_helper_pack(char *buf, size_t size, lxc_attach_options_t *options,
+				  const char *cwd, const char *program,
+				  const char * const argv[])
+{
+	struct attach_helper_request *req = (struct attach_helper_request *)buf;
+	char *strv[2] = { NULL, NULL };
+	size_t len = sizeof(*req);
+	int count;
+
+	memset(req, 0, sizeof(*req));
+	req->attach_flags = options->attach_flags;
+	req->personality = options->personality;
+	req->uid = options->uid;
+	req->gid = options->gid;
+	req->env_policy = options->env_policy;
+
+	strv[0] = (char *)cwd;
+	if (attach_helper_pack_strings(buf, size, &len, strv, &count) < 0)
+		return -1;
+	strv[0] = (char *)program;
+	if (attach_helper_pack_strings(buf, size, &len, strv, &count) < 0)
+		return -1;
+	if (attach_helper_pack_strings(buf, size, &len, (char **)argv, &req->argc) < 0 ||
+	    attach_helper_pack_strings(buf, size, &len, options->extra_env_vars, &req->nenv) < 0 ||
+	    attach_helper_pack_strings(buf, size, &len, options->extra_keep_env, &req->nkeep) < 0)
+		return -1;
+
+	return len;
+}
+
+/* point strv at count strings starting at *p, NULL terminated */
+static char **attach_helper_unpack_strings(char **p, char *end, int count)
+{
+	char **strv;
+	int i;
+
+	strv = calloc(count + 1, sizeof(char *));
+	if (!strv)
+		return NULL;
+
+	for (i = 0; i < count; i++) {
+		char *nul = memchr(*p, '\0', end - *p);
+
+		if (!nul) {
+			free(strv);
+			return NULL;
+		}
+		strv[i] = *p;
+		*p = nul + 1;
+	}
+
+	return strv;
+}
+
+static int attach_helper_child_main(void *data)
+{
+	struct attach_helper_payload *payload = data;
+
+	if (chdir(payload->cwd) < 0)
+		WARN("could not change directory to '%s'", payload->cwd);
+
+	if (attach_child_setup(payload->options, payload->init_ctx) < 0)
+		rexit(-1);
+
+	rexit(attach_child_exec(payload->options, payload->init_ctx,
+				lxc_attach_run_command, &payload->command));
+}
+
+/* handle one request in the helper, returns the pid of the attached process */
+static pid_t attach_helper_spawn(struct lxc_attach_session *s, int namespaces,
+				 char *buf, size_t len, int fds[3])
+{
+	struct attach_helper_request *req = (struct attach_helper_request *)buf;
+	lxc_attach_options_t options = LXC_ATTACH_OPTIONS_DEFAULT;
+	struct attach_helper_payload payload;
+	char **strv = NULL, *p, *end = buf + len;
+	int i, n = 0;
+	pid_t pid = -1;
+
+	if (len < sizeof(*req))
+		return -1;
+
+	options.attach_flags = req->attach_flags;
+	options.namespaces = namespaces;
+	options.personality = req->personality;
+	options.uid = req->uid;
+	options.gid = req->gid;
+	options.env_policy = req->env_policy;
+	options.stdin_fd = fds[0];
+	options.stdout_fd = fds[1];
+	options.stderr_fd = fds[2];
+
+	/* cwd, program, then the string arrays */
+	p = buf + sizeof(*req);
+	strv = attach_helper_unpack_strings(&p, end, 2 + req->argc + req->nenv + req->nkeep);
+	if (!strv)
+		return -1;
+
+	payload.options = &options;
+	payload.init_ctx = s->init_ctx;
+	payload.cwd = strv[0];
+	payload.command.program = strv[1];
+
+	/* split strv into its NULL terminated parts */
+	payload.command.argv = calloc(req->argc + 1, sizeof(char *));
+	options.extra_env_vars = calloc(req->nenv + 1, sizeof(char *));
+	options.extra_keep_env = calloc(req->nkeep + 1, sizeof(char *));
+	if (!payload.command.argv || !options.extra_env_vars || !options.extra_keep_env)
+		goto out;
+
+	n = 2;
+	for (i = 0; i < req->argc; i++)
+		payload.command.argv[i] = strv[n++];
+	for (i = 0; i < req->nenv; i++)
+		options.extra_env_vars[i] = strv[n++];
+	for (i = 0; i < req->nkeep; i++)
+		options.extra_keep_env[i] = strv[n++];
+
+	pid = lxc_clone(attach_helper_child_main, &payload, CLONE_PARENT);
+	if (pid < 0)
+		SYSERROR("failed to create attached process");
+
+out:
+	free(payload.command.argv);
+	free(options.extra_env_vars);
+	free(options.extra_keep_env);
+	free(strv);
+	return pid;
+}
+
+static ssize_t attach_helper_recv(int sock, char *buf, size_t size, int fds[3])
+{
+	char cmsgbuf[CMSG_SPACE(3 * sizeof(int))];
+	struct attach_helper_request *req = (struct attach_helper_request *)buf;
+	struct iovec iov = { .iov_base = buf, .iov_len = size };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	int i, k, n = 0, received[3];
+	ssize_t ret;
+
+	fds[0] = fds[1] = fds[2] = -1;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsgbuf;
+	msg.msg_controllen = sizeof(cmsgbuf);
+
+again:
+	ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	if (ret < 0 && errno == EINTR)
+		goto again;
+	if (ret <= 0)
+		return ret;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+		n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if (n > 3)
+			n = 3;
+		memcpy(received, CMSG_DATA(cmsg), n * sizeof(int));
+	}
+
+	if (ret < sizeof(*req) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+		for (i = 0; i < n; i++)
+			close(received[i]);
+		return -1;
+	}
+
+	/* the descriptors come in stdin, stdout, stderr order */
+	for (i = 0, k = 0; i < 3; i++) {
+		if ((req->fds & (1 << i)) && k < n)
+			fds[i] = received[k++];
+	}
+	for (; k < n; k++)
+		close(received[k]);
+
+	return ret;
+}
+
+static void attach_helper_close_fds(int fd_to_keep, int nsfd[])
+{
+	struct dirent *direntp;
+	DIR *dir;
+	int fd, i;
+
+restart:
+	dir = opendir("/proc/self/fd");
+	if (!dir)
+		return;
+
+	while ((direntp = readdir(dir))) {
+		fd = atoi(direntp->d_name);
+		if (fd <= 2 || fd == fd_to_keep || fd == lxc_log_fd ||
+		    fd == dirfd(dir))
+			continue;
+
+		for (i = 0; i < LXC_ATTACH_NS_MAX; i++)
+			if (fd == nsfd[i])
+				break;
+		if (i < LXC_ATTACH_NS_MAX)
+			continue;
+
+		close(fd);
+		closedir(dir);
+		goto restart;
+	}
+
+	closedir(dir);
+}
+
+static int attach_helper_main(struct lxc_attach_session *s, int sock)
+{
+	char *buf;
+	int fds[3], i, status, expected;
+	ssize_t ret;
+	pid_t pid;
+
+	/* don't keep the caller's descriptors, and the other helpers,
+	 * alive for as long as the session */
+	attach_helper_close_fds(sock, s->nsfd);
+
+	expected = 0;
+	status = -1;
+	ret = lxc_read_nointr_expect(sock, &status, sizeof(status), &expected);
+	if (ret <= 0)
+		return -1;
+
+	if (lxc_attach_to_ns(s->nsfd, s->helper_namespaces) < 0) {
+		ERROR("failed to enter the namespace");
+		return -1;
+	}
+	lxc_attach_close_ns(s->nsfd);
+
+	buf = malloc(LXC_ATTACH_HELPER_MSGMAX);
+	if (!buf)
+		return -1;
+
+	status = 1;
+	if (lxc_write_nointr(sock, &status, sizeof(status)) != sizeof(status))
+		return -1;
+
+	for (;;) {
+		ret = attach_helper_recv(sock, buf, LXC_ATTACH_HELPER_MSGMAX, fds);
+		if (ret == 0)
+			break;
+
+		pid = ret < 0 ? -1 : attach_helper_spawn(s, s->helper_namespaces,
+							  buf, ret, fds);
+		for (i = 0; i < 3; i++)
+			if (fds[i] >= 0)
+				close(fds[i]);
+
+		if (send(sock, &pid, sizeof(pid), MSG_NOSIGNAL) != sizeof(pid))
+			break;
+	}
+
+	free(buf);
+	return 0;
+}
+
+static void attach_helper_stop(struct lxc_attach_helper *h)
+{
+	if (h->pid <= 0)
+		return;
+
+	/* the helper exits once it sees the end of the socket */
+	close(h->sock);
+	(void) wait_for_pid(h->pid);
+	h->sock = -1;
+	h->pid = -1;
+}
+
+static int attach_helper_start(struct lxc_attach_session *s, struct lxc_attach_helper *h)
+{
+	int sv[2], status, expected, i, ret;
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+		SYSERROR("failed to create the attach helper socket");
+		return -1;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		SYSERROR("failed to fork attach helper");
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+
+	if (pid == 0) {
+		close(sv[0]);
+		for (i = 0; i < s->nhelpers; i++)
+			if (s->helpers[i].sock >= 0)
+				close(s->helpers[i].sock);
+		rexit(attach_helper_main(s, sv[1]));
+	}
+
+	close(sv[1]);
+	h->pid = pid;
+	h->sock = sv[0];
+
+	if ((s->helper_flags & LXC_ATTACH_MOVE_TO_CGROUP) &&
+	    !cgroup_attach(s->name, s->lxcpath, pid))
+		goto out_error;
+
+	status = 0;
+	if (lxc_write_nointr(h->sock, &status, sizeof(status)) != sizeof(status))
+		goto out_error;
+
+	/* wait for the helper to be in the namespaces */
+	expected = 1;
+	ret = lxc_read_nointr_expect(h->sock, &status, sizeof(status), &expected);
+	if (ret <= 0)
+		goto out_error;
+
+	return 0;
+
+out_error:
+	ERROR("failed to start attach helper for '%s'", s->name);
+	attach_helper_stop(h);
+	return -1;
+}
+
+static void attach_session_stop_helpers(struct lxc_attach_session *s)
+{
+	int i;
+
+	for (i = 0; i < s->nhelpers; i++) {
+		pthread_mutex_lock(&s->helpers[i].lock);
+		attach_helper_stop(&s->helpers[i]);
+		pthread_mutex_unlock(&s->helpers[i].lock);
+	}
+}
+
+static void attach_session_start_helpers(struct lxc_attach_session *s)
+{
+	int i;
+
+	for (i = 0; i < s->nhelpers; i++) {
+		pthread_mutex_lock(&s->helpers[i].lock);
+		if (s->helpers[i].pid <= 0)
+			attach_helper_start(s, &s->helpers[i]);
+		pthread_mutex_unlock(&s->helpers[i].lock);
+	}
+}
+
+/*
+ * Take the session's read lock, after having brought it up to date if
+ * the container was restarted since it was last used.
+ */
+static int attach_session_get(struct lxc_attach_session *s)
+{
+	pthread_rwlock_rdlock(&s->lock);
+	if (attach_session_current(s))
+		return 0;
+	pthread_rwlock_unlock(&s->lock);
+
+	pthread_rwlock_wrlock(&s->lock);
+	if (!attach_session_current(s)) {
+		INFO("refreshing attach session of '%s'", s->name);
+		attach_session_stop_helpers(s);
+		attach_session_fini(s);
+		if (attach_session_init(s, NULL) == 0)
+			attach_session_start_helpers(s);
+	}
+	pthread_rwlock_unlock(&s->lock);
+
+	pthread_rwlock_rdlock(&s->lock);
+	if (s->init_ctx)
+		return 0;
+	pthread_rwlock_unlock(&s->lock);
+	return -1;
+}
+
+/*
+ * Send a request to a helper, returns 0 on success, 1 if the request
+ * cannot be handled by a helper and -1 if the helper failed.
+ */
+static int attach_helper_request(struct lxc_attach_helper *h, lxc_attach_options_t *options,
+				 const char *program, const char * const argv[],
+				 pid_t *attached_process)
+{
+	char cmsgbuf[CMSG_SPACE(3 * sizeof(int))];
+	struct attach_helper_request *req;
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	int fds[3], n = 0;
+	char *buf, *cwd = NULL;
+	ssize_t len;
+	pid_t pid;
+	int ret = 1;
+
+	buf = malloc(LXC_ATTACH_HELPER_MSGMAX);
+	if (!buf)
+		return 1;
+
+	if (!options->initial_cwd)
+		cwd = getcwd(NULL, 0);
+
+	len = attach_helper_pack(buf, LXC_ATTACH_HELPER_MSGMAX, options,
+				 options->initial_cwd ? options->initial_cwd : (cwd ? cwd : "/"),
+				 program, argv);
+	free(cwd);
+	if (len < 0)
+		goto out;
+
+	req = (struct attach_helper_request *)buf;
+	if (options->stdin_fd >= 0) {
+		req->fds |= 1 << 0;
+		fds[n++] = options->stdin_fd;
+	}
+	if (options->stdout_fd >= 0) {
+		req->fds |= 1 << 1;
+		fds[n++] = options->stdout_fd;
+	}
+	if (options->stderr_fd >= 0) {
+		req->fds |= 1 << 2;
+		fds[n++] = options->stderr_fd;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (n) {
+		msg.msg_control = cmsgbuf;
+		msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, n * sizeof(int));
+	}
+
+	ret = -1;
+	if (sendmsg(h->sock, &msg, MSG_NOSIGNAL) != len)
+		goto out;
+
+	if (lxc_read_nointr(h->sock, &pid, sizeof(pid)) != sizeof(pid))
+		goto out;
+
+	/* the helper is fine, the request was not */
+	if (pid < 0) {
+		ret = 1;
+		goto out;
+	}
+
+	*attached_process = pid;
+	ret = 0;
+
+out:
+	free(buf);
+	return ret;
+}
+
+static int attach_session_helper_run(struct lxc_attach_session *s, lxc_attach_options_t *options,
+				     const char *program, const char * const argv[],
+				     pid_t *attached_process)
+{
+	struct lxc_attach_helper *h = NULL;
+	unsigned int start;
+	int i, ret;
+
+	/* take the first idle helper, or queue on one of them */
+	start = __sync_fetch_and_add(&s->next_helper, 1);
+	for (i = 0; i < s->nhelpers; i++) {
+		h = &s->helpers[(start + i) % s->nhelpers];
+		if (!pthread_mutex_trylock(&h->lock))
+			break;
+		h = NULL;
+	}
+	if (!h) {
+		h = &s->helpers[start % s->nhelpers];
+		pthread_mutex_lock(&h->lock);
+	}
+
+	if (h->pid <= 0 && attach_helper_start(s, h) < 0) {
+		pthread_mutex_unlock(&h->lock);
+		return 1;
+	}
+
+	ret = attach_helper_request(h, options, program, argv, attached_process);
+	if (ret < 0) {
+		WARN("attach helper %d of '%s' failed, restarting it", h->pid, s->name);
+		attach_helper_stop(h);
+		ret = 1;
+	}
+
+	pthread_mutex_unlock(&h->lock);
+	return ret;
+}
+
+lxc_attach_session_t *lxc_attach_session_open(struct lxc_container *c, lxc_attach_options_t *options, int helpers)
+{
+	struct lxc_attach_session *s;
+	int i;
+
+	if (!c || helpers < 0)
+		return NULL;
+
+	if (!options)
+		options = &attach_static_default_options;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+
+	for (i = 0; i < LXC_ATTACH_NS_MAX; i++)
+		s->nsfd[i] = -1;
+	pthread_rwlock_init(&s->lock, NULL);
+
+	s->name = strdup(c->name);
+	s->lxcpath = strdup(c->config_path);
+	if (!s->name || !s->lxcpath)
+		goto out_error;
+
+	if (attach_session_init(s, NULL) < 0)
+		goto out_error;
+
+	s->helper_flags = options->attach_flags;
+	s->helper_namespaces = options->namespaces;
+	if (s->helper_namespaces == -1)
+		s->helper_namespaces = s->clone_flags;
+
+	if (helpers) {
+		s->helpers = calloc(helpers, sizeof(*s->helpers));
+		if (!s->helpers)
+			goto out_error;
+		for (i = 0; i < helpers; i++) {
+			s->helpers[i].pid = -1;
+			s->helpers[i].sock = -1;
+			pthread_mutex_init(&s->helpers[i].lock, NULL);
+		}
+		s->nhelpers = helpers;
+		attach_session_start_helpers(s);
+	}
+
+	return s;
+
+out_error:
+	lxc_attach_session_close(s);
+	return NULL;
+}
+
+void lxc_attach_session_close(lxc_attach_session_t *s)
+{
+	int i;
+
+	if (!s)
+		return;
+
+	attach_session_stop_helpers(s);
+	for (i = 0; i < s->nhelpers; i++)
+		pthread_mutex_destroy(&s->helpers[i].lock);
+	free(s->helpers);
+	attach_session_fini(s);
+	pthread_rwlock_destroy(&s->lock);
+	free(s->name);
+	free(s->lxcpath);
+	free(s);
+}
+
+int lxc_attach_session_run(lxc_attach_session_t *s, lxc_attach_exec_t exec_function,
+			   void *exec_payload, lxc_attach_options_t *options,
+			   pid_t *attached_process)
+{
+	lxc_attach_options_t opts;
+	int ret;
+
+	if (!s)
+		return -1;
+
+	if (!options)
+		options = &attach_static_default_options;
+
+	if (attach_session_get(s) < 0)
+		return -1;
+
+	opts = *options;
+	if (opts.namespaces == -1)
+		opts.namespaces = s->clone_flags;
+
+	ret = attach_session_attach(s, exec_function, exec_payload, &opts,
+				    attached_process);
+	pthread_rwlock_unlock(&s->lock);
+	return ret;
+}
+
+int lxc_attach_session_run_command(lxc_attach_session_t *s, lxc_attach_options_t *options,
+				   const char *program, const char * const argv[],
+				   pid_t *attached_process)
+{
+	lxc_attach_command_t command;
+	lxc_attach_options_t opts;
+	int ret = 1;
+
+	if (!s || !program || !argv)
+		return -1;
+
+	if (!options)
+		options = &attach_static_default_options;
+
+	if (attach_session_get(s) < 0)
+		return -1;
+
+	opts = *options;
+	if (opts.namespaces == -1)
+		opts.namespaces = s->clone_flags;
+
+	/* helpers are already in their namespaces and cgroups */
+	if (s->nhelpers && opts.namespaces == s->helper_namespaces &&
+	    (opts.attach_flags & LXC_ATTACH_MOVE_TO_CGROUP) ==
+	    (s->helper_flags & LXC_ATTACH_MOVE_TO_CGROUP))
+		ret = attach_session_helper_run(s, &opts, program, argv,
+						attached_process);
+
+	if (ret > 0) {
+		command.program = (char *)program;
+		command.argv = (char **)argv;
+		ret = attach_session_attach(s, lxc_attach_run_command, &command,
+					    &opts, attached_process);
+	}
+
+	pthread_rwlock_unlock(&s->lock);
+	return ret;
+}
+
+int lxc_attach_session_run_wait(lxc_attach_session_t *s, lxc_attach_options_t *options,
+				const char *program, const char * const argv[])
+{
+	pid_t pid;
+	int ret;
+
+	ret = lxc_attach_session_run_command(s, options, program, argv, &pid);
+	if (ret < 0)
+		return ret;
+
+	return lxc_wait_for_pid_status(pid);
+}
+
+/*
+ * Command channels: a process attached once to the container which forks
+ * the commands of each batch it is sent and streams back their results.
+ *
+ * request: struct attach_batch_request, int argc[ncmds], then for each
+ *          command its program and argv strings
+ * reply:   one struct attach_batch_reply per command run, followed by
+ *          its stdout and stderr, then one with index -1
+ */
+#define LXC_ATTACH_BATCH_MAX 4096
+#define LXC_ATTACH_BATCH_MSGMAX (16 * LXC_ATTACH_HELPER_MSGMAX)
+
+struct attach_batch_request {
+	int flags;
+	int ncmds;
+	size_t len;
+};
+
+struct attach_batch_reply {
+	int index;
+	int status;
+	uint64_t out_len;
+	uint64_t err_len;
+};
+
+struct lxc_attach_channel {
+	pid_t pid;
+	int sock;
+};
+
+struct attach_batch_buf {
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+struct attach_batch_proc {
+	pid_t pid;
+	int status;
+	struct attach_batch_buf out;
+	struct attach_batch_buf err;
+};
+
+/* returns 1 when count bytes were read, 0 on EOF before any, -1 on error */
+static int attach_read_full(int fd, void *buf, size_t count)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < count) {
+		ret = lxc_read_nointr(fd, (char *)buf + done, count - done);
+		if (ret < 0)
+			return -1;
+		if (ret == 0) {
+			if (done)
+				errno = EPROTO;
+			return done ? -1 : 0;
+		}
+		done += ret;
+	}
+
+	return 1;
+}
+
+static int attach_write_full(int fd, const void *buf, size_t count)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	/* the peer of a channel may go away at any time, that must not
+	 * kill us with SIGPIPE */
+	while (done < count) {
+		ret = send(fd, (const char *)buf + done, count - done,
+			   MSG_NOSIGNAL);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		done += ret;
+	}
+
+	return 0;
+}
+
+static ssize_t attach_batch_buf_read(struct attach_batch_buf *b, int fd)
+{
+	ssize_t ret;
+
+	/* always keep room for the terminating NUL */
+	if (b->size - b->len < 4096) {
+		size_t size = b->size ? b->size * 2 : 8192;
+		char *data = realloc(b->data, size);
+
+		if (!data)
+			return -1;
+		b->data = data;
+		b->size = size;
+	}
+
+	ret = lxc_read_nointr(fd, b->data + b->len, b->size - b->len - 1);
+	if (ret > 0) {
+		b->len += ret;
+		b->data[b->len] = '\0';
+	}
+	return ret;
+}
+
+/*
+ * Fork the commands, connected by pipes when there are several, and
+ * collect their output until they all closed it.
+ */
+static void attach_batch_spawn(const lxc_attach_command_t *cmds, int n,
+			       struct attach_batch_proc *procs)
+{
+	struct pollfd *fds;
+	int i, in = -1, nopen;
+	int link[2], errpipe[2];
+
+	fds = calloc(n + 1, sizeof(*fds));
+	if (!fds)
+		return;
+	for (i = 0; i <= n; i++)
+		fds[i].fd = -1;
+
+	for (i = 0; i < n; i++) {
+		if (pipe2(link, O_CLOEXEC) < 0)
+			break;
+		if (pipe2(errpipe, O_CLOEXEC) < 0) {
+			close(link[0]);
+			close(link[1]);
+			break;
+		}
+
+		procs[i].pid = fork();
+		if (procs[i].pid == 0) {
+			if (in >= 0 && dup2(in, 0) < 0)
+				_exit(127);
+			if (dup2(link[1], 1) < 0 || dup2(errpipe[1], 2) < 0)
+				_exit(127);
+			execvp(cmds[i].program, cmds[i].argv);
+			fprintf(stderr, "failed to exec '%s': %s\n",
+				cmds[i].program, strerror(errno));
+			_exit(127);
+		}
+
+		close(link[1]);
+		close(errpipe[1]);
+		if (in >= 0)
+			close(in);
+		in = -1;
+
+		if (procs[i].pid < 0) {
+			SYSERROR("failed to fork '%s'", cmds[i].program);
+			close(link[0]);
+			close(errpipe[0]);
+			break;
+		}
+
+		fds[i].fd = errpipe[0];
+		if (i == n - 1)
+			fds[n].fd = link[0];
+		else
+			in = link[0];
+	}
+	if (in >= 0)
+		close(in);
+
+	for (;;) {
+		nopen = 0;
+		for (i = 0; i <= n; i++) {
+			fds[i].events = POLLIN;
+			if (fds[i].fd >= 0)
+				nopen++;
+		}
+		if (!nopen)
+			break;
+
+		if (poll(fds, n + 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			SYSERROR("failed to poll command output");
+			break;
+		}
+
+		for (i = 0; i <= n; i++) {
+			struct attach_batch_buf *b;
+
+			if (fds[i].fd < 0 || !fds[i].revents)
+				continue;
+			b = i < n ? &procs[i].err : &procs[n - 1].out;
+			if (attach_batch_buf_read(b, fds[i].fd) > 0)
+				continue;
+			close(fds[i].fd);
+			fds[i].fd = -1;
+		}
+	}
+
+	for (i = 0; i <= n; i++)
+		if (fds[i].fd >= 0)
+			close(fds[i].fd);
+	free(fds);
+
+	for (i = 0; i < n; i++)
+		if (procs[i].pid > 0)
+			procs[i].status = lxc_wait_for_pid_status(procs[i].pid);
+}
+
+static int attach_batch_send(int sock, int index, struct attach_batch_proc *proc)
+{
+	struct attach_batch_reply reply;
+
+	reply.index = index;
+	reply.status = proc->status;
+	reply.out_len = proc->out.len;
+	reply.err_len = proc->err.len;
+
+	if (attach_write_full(sock, &reply, sizeof(reply)) < 0 ||
+	    attach_write_full(sock, proc->out.data, proc->out.len) < 0 ||
+	    attach_write_full(sock, proc->err.data, proc->err.len) < 0)
+		return -1;
+
+	return 0;
+}
+
+static int attach_batch_run(int sock, const struct attach_batch_request *req,
+			    const lxc_attach_command_t *cmds)
+{
+	struct attach_batch_proc *procs;
+	struct attach_batch_reply end;
+	int i, ret = 0, run = 0;
+
+	procs = calloc(req->ncmds, sizeof(*procs));
+	if (!procs)
+		return -1;
+	for (i = 0; i < req->ncmds; i++) {
+		procs[i].pid = -1;
+		procs[i].status = -1;
+	}
+
+	if (req->flags & LXC_ATTACH_BATCH_PIPELINE) {
+		attach_batch_spawn(cmds, req->ncmds, procs);
+		for (i = 0; i < req->ncmds && ret == 0; i++, run++)
+			ret = attach_batch_send(sock, i, &procs[i]);
+	} else {
+		for (i = 0; i < req->ncmds && ret == 0; i++, run++) {
+			attach_batch_spawn(&cmds[i], 1, &procs[i]);
+			ret = attach_batch_send(sock, i, &procs[i]);
+			if ((req->flags & LXC_ATTACH_BATCH_STOP_ON_ERROR) &&
+			    procs[i].status != 0) {
+				run++;
+				break;
+			}
+		}
+	}
+
+	for (i = 0; i < req->ncmds; i++) {
+		free(procs[i].out.data);
+		free(procs[i].err.data);
+	}
+	free(procs);
+
+	if (ret < 0)
+		return -1;
+
+	memset(&end, 0, sizeof(end));
+	end.index = -1;
+	end.status = run;
+	return attach_write_full(sock, &end, sizeof(end));
+}
+
+static int attach_batch_unpack(char *buf, size_t len, int ncmds,
+			       lxc_attach_command_t *cmds)
+{
+	char *p = buf + ncmds * sizeof(int), *end = buf + len;
+	int *argc = (int *)buf;
+	char **strv;
+	int i;
+
+	if (len < ncmds * sizeof(int))
+		return -1;
+
+	for (i = 0; i < ncmds; i++) {
+		if (argc[i] < 1 || argc[i] > LXC_ATTACH_BATCH_MSGMAX)
+			return -1;
+		strv = attach_helper_unpack_strings(&p, end, argc[i] + 1);
+		if (!strv)
+			return -1;
+		/* argv is the tail of strv, the program its head */
+		cmds[i].program = strv[0];
+		cmds[i].argv = strv + 1;
+	}
+
+	return 0;
+}
+
+static int attach_batch_main(void *payload)
+{
+	int *sv = payload, sock = sv[1];
+	int nsfd[LXC_ATTACH_NS_MAX];
+	struct attach_batch_request req;
+	lxc_attach_command_t *cmds;
+	char *buf;
+	int i, ret;
+
+	/*
+	 * Other attaches running in this process, see lxc_attach_fanout,
+	 * may have left their channel sockets with us. Closing them needs
+	 * /proc, which is why lxc_attach_channel_close uses shutdown().
+	 */
+	close(sv[0]);
+	for (i = 0; i < LXC_ATTACH_NS_MAX; i++)
+		nsfd[i] = -1;
+	attach_helper_close_fds(sock, nsfd);
+
+	for (;;) {
+		ret = attach_read_full(sock, &req, sizeof(req));
+		if (ret <= 0)
+			return ret < 0 ? -1 : 0;
+
+		if (req.ncmds < 1 || req.ncmds > LXC_ATTACH_BATCH_MAX ||
+		    req.len > LXC_ATTACH_BATCH_MSGMAX) {
+			ERROR("invalid command batch");
+			return -1;
+		}
+
+		buf = malloc(req.len);
+		cmds = calloc(req.ncmds, sizeof(*cmds));
+		if (!buf || !cmds ||
+		    attach_read_full(sock, buf, req.len) <= 0 ||
+		    attach_batch_unpack(buf, req.len, req.ncmds, cmds) < 0) {
+			ERROR("failed to receive command batch");
+			return -1;
+		}
+
+		ret = attach_batch_run(sock, &req, cmds);
+
+		for (i = 0; i < req.ncmds; i++)
+			if (cmds[i].argv)
+				free(cmds[i].argv - 1);
+		free(cmds);
+		free(buf);
+
+		if (ret < 0)
+			return -1;
+	}
+}
+
+lxc_attach_channel_t *lxc_attach_channel_open(lxc_attach_session_t *s,
+					      lxc_attach_options_t *options)
+{
+	struct lxc_attach_channel *ch;
+	int sv[2];
+
+	ch = malloc(sizeof(*ch));
+	if (!ch)
+		return NULL;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+		SYSERROR("failed to create command channel");
+		free(ch);
+		return NULL;
+	}
+
+	if (lxc_attach_session_run(s, attach_batch_main, sv, options,
+				   &ch->pid) < 0) {
+		close(sv[0]);
+		close(sv[1]);
+		free(ch);
+		return NULL;
+	}
+
+	close(sv[1]);
+	ch->sock = sv[0];
+	return ch;
+}
+
+void lxc_attach_channel_close(lxc_attach_channel_t *ch)
+{
+	if (!ch)
+		return;
+
+	/* copies of the socket may exist in other attached processes */
+	shutdown(ch->sock, SHUT_RDWR);
+	close(ch->sock);
+	if (wait_for_pid(ch->pid) < 0)
+		WARN("command channel process %d failed", ch->pid);
+	free(ch);
+}
+
+static int attach_batch_recv_data(int sock, char **data, uint64_t len)
+{
+	if (!len)
+		return 0;
+
+	if (len > SIZE_MAX - 1)
+		return -1;
+
+	*data = malloc(len + 1);
+	if (!*data)
+		return -1;
+
+	if (attach_read_full(sock, *data, len) <= 0)
+		return -1;
+
+	(*data)[len] = '\0';
+	return 0;
+}
+
+int lxc_attach_channel_exec(lxc_attach_channel_t *ch, const lxc_attach_command_t *cmds,
+			    int ncmds, int flags, lxc_attach_result_t *results)
+{
+	struct attach_batch_request req;
+	struct attach_batch_reply reply;
+	size_t len, size;
+	char *buf;
+	int i, ret;
+
+	if (!ch || !cmds || !results || ncmds < 1 || ncmds > LXC_ATTACH_BATCH_MAX)
+		return -1;
+
+	memset(results, 0, ncmds * sizeof(*results));
+	for (i = 0; i < ncmds; i++)
+		results[i].status = -1;
+
+	size = sizeof(req) + ncmds * sizeof(int);
+	for (i = 0; i < ncmds; i++) {
+		char **arg;
+
+		if (!cmds[i].program || !cmds[i].argv || !cmds[i].argv[0])
+			return -1;
+		size += strlen(cmds[i].program) + 1;
+		for (arg = cmds[i].argv; *arg; arg++)
+			size += strlen(*arg) + 1;
+	}
+	if (size - sizeof(req) > LXC_ATTACH_BATCH_MSGMAX) {
+		ERROR("command batch too large");
+		return -1;
+	}
+
+	buf = malloc(size);
+	if (!buf)
+		return -1;
+
+	len = sizeof(req) + ncmds * sizeof(int);
+	for (i = 0; i < ncmds; i++) {
+		char *prog[2] = { cmds[i].program, NULL };
+		int *argc = (int *)(buf + sizeof(req)) + i;
+		int count;
+
+		attach_helper_pack_strings(buf, size, &len, prog, &count);
+		attach_helper_pack_strings(buf, size, &len, cmds[i].argv, argc);
+	}
+
+	req.flags = flags;
+	req.ncmds = ncmds;
+	req.len = len - sizeof(req);
+	memcpy(buf, &req, sizeof(req));
+
+	ret = attach_write_full(ch->sock, buf, len);
+	free(buf);
+	if (ret < 0) {
+		SYSERROR("failed to send command batch");
+		return -1;
+	}
+
+	for (;;) {
+		lxc_attach_result_t *r;
+
+		if (attach_read_full(ch->sock, &reply, sizeof(reply)) <= 0)
+			goto out_error;
+		if (reply.index == -1)
+			return reply.status;
+		if (reply.index < 0 || reply.index >= ncmds)
+			goto out_error;
+
+		r = &results[reply.index];
+		r->status = reply.status;
+		r->out_len = reply.out_len;
+		r->err_len = reply.err_len;
+		if (attach_batch_recv_data(ch->sock, &r->out, reply.out_len) < 0 ||
+		    attach_batch_recv_data(ch->sock, &r->err, reply.err_len) < 0)
+			goto out_error;
+	}
+
+out_error:
+	ERROR("failed to receive command batch results");
+	lxc_attach_result_free(results, ncmds);
+	return -1;
+}
+
+int lxc_attach_session_run_batch(lxc_attach_session_t *s, lxc_attach_options_t *options,
+				 const lxc_attach_command_t *cmds, int ncmds, int flags,
+				 lxc_attach_result_t *results)
+{
+	lxc_attach_channel_t *ch;
+	int ret;
+
+	ch = lxc_attach_channel_open(s, options);
+	if (!ch)
+		return -1;
+
+	ret = lxc_attach_channel_exec(ch, cmds, ncmds, flags, results);
+	lxc_attach_channel_close(ch);
+	return ret;
+}
+
+void lxc_attach_result_free(lxc_attach_result_t *results, int n)
+{
+	int i;
+
+	if (!results)
+		return;
+
+	for (i = 0; i < n; i++) {
+		free(results[i].out);
+		free(results[i].err);
+		results[i].out = results[i].err = NULL;
+		results[i].out_len = results[i].err_len = 0;
+	}
+}
+
+/* containers attached to at once by lxc_attach_fanout by default */
+#define LXC_ATTACH_FANOUT_WORKERS 16
+
+struct attach_fanout {
+	struct lxc_container **cs;
+	int count;
+	int next;
+	int failed;
+	lxc_attach_options_t *options;
+	const lxc_attach_command_t *cmd;
+	lxc_attach_fanout_cb cb;
+	void *data;
+	pthread_mutex_t lock;
+};
+
+static void *attach_fanout_worker(void *arg)
+{
+	struct attach_fanout *f = arg;
+	lxc_attach_result_t result;
+	lxc_attach_session_t *s;
+	int i, ret;
+
+	for (;;) {
+		pthread_mutex_lock(&f->lock);
+		i = f->next < f->count ? f->next++ : -1;
+		pthread_mutex_unlock(&f->lock);
+		if (i < 0)
+			break;
+
+		memset(&result, 0, sizeof(result));
+		result.status = -1;
+		ret = -1;
+
+		s = lxc_attach_session_open(f->cs[i], f->options, 0);
+		if (s) {
+			ret = lxc_attach_session_run_batch(s, f->options, f->cmd,
+							   1, 0, &result);
+			lxc_attach_session_close(s);
+		}
+		if (ret != 1)
+			ERROR("failed to run '%s' in '%s'", f->cmd->program,
+			      f->cs[i]->name);
+
+		pthread_mutex_lock(&f->lock);
+		if (ret != 1)
+			f->failed++;
+		if (f->cb)
+			f->cb(f->cs[i], &result, f->data);
+		pthread_mutex_unlock(&f->lock);
+
+		lxc_attach_result_free(&result, 1);
+	}
+
+	return NULL;
+}
+
+int lxc_attach_fanout(struct lxc_container **cs, int count,
+		      lxc_attach_options_t *options, const lxc_attach_command_t *cmd,
+		      int workers, lxc_attach_fanout_cb cb, void *data)
+{
+	struct attach_fanout f;
+	pthread_t *threads;
+	int i, nthreads = 0;
+
+	if (!cs || count < 0 || !cmd || !cmd->program || !cmd->argv || workers < 0)
+		return -1;
+
+	if (!workers)
+		workers = LXC_ATTACH_FANOUT_WORKERS;
+	if (workers > count)
+		workers = count;
+
+	memset(&f, 0, sizeof(f));
+	f.cs = cs;
+	f.count = count;
+	f.options = options;
+	f.cmd = cmd;
+	f.cb = cb;
+	f.data = data;
+	pthread_mutex_init(&f.lock, NULL);
+
+	/* the calling thread is one of the workers */
+	threads = workers > 1 ? malloc((workers - 1) * sizeof(*threads)) : NULL;
+	if (threads) {
+		for (i = 0; i < workers - 1; i++) {
+			if (pthread_create(&threads[nthreads], NULL,
+					   attach_fanout_worker, &f) != 0) {
+				WARN("failed to start attach worker, using %d",
+				     nthreads + 1);
+				break;
+			}
+			nthreads++;
+		}
+	}
+
+	attach_fanout_worker(&f);
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	pthread_mutex_destroy(&f.lock);
+
+	return f.failed;
 }
 
 int lxc_attach_run_command(void* payload)
@@ -172,6 +172,212 @@ extern int lxc_attach_run_command(void* payload);
  */
 extern int lxc_attach_run_shell(void* payload);
 
+struct lxc_container;
+
+/*!
+ * Attach session, see \ref lxc_attach_session_open.
+ */
+typedef struct lxc_attach_session lxc_attach_session_t;
+
+/*!
+ * \brief Prepare repeated attaches to a running container.
+ *
+ * The context of the container's init (capabilities, personality, LSM
+ * label, seccomp policy, namespaces) is gathered once and reused by
+ * every attach made through the session.  The session notices when the
+ * container was restarted and gathers it again.
+ *
+ * \param c Container.
+ * \param options Options the helpers are set up for (namespaces and
+ *  \c LXC_ATTACH_MOVE_TO_CGROUP), \c NULL for the defaults.
+ * \param helpers Number of helper processes to start inside the
+ *  container's namespaces, \c 0 for none.
+ *
+ * \return Session, or \c NULL on error.
+ *
+ * \note Helpers fork commands run with \ref lxc_attach_session_run_command
+ *  without entering the namespaces again.  They are a snapshot of the
+ *  calling process: changes made to its environment after the session
+ *  was opened are not seen by commands run through them.
+ */
+extern lxc_attach_session_t *lxc_attach_session_open(struct lxc_container *c,
+		lxc_attach_options_t *options, int helpers);
+
+/*!
+ * \brief Close an attach session and stop its helpers.
+ *
+ * \param s Session.
+ */
+extern void lxc_attach_session_close(lxc_attach_session_t *s);
+
+/*!
+ * \brief Run a function in the container, like \ref lxc_container \c attach().
+ *
+ * \param s Session.
+ * \param exec_function Function to run.
+ * \param exec_payload Data to pass to \p exec_function.
+ * \param options \ref lxc_attach_options_t.
+ * \param[out] attached_process Process ID of process running inside
+ *  container \p c that is running \p exec_function.
+ *
+ * \return \c 0 on success, \c -1 on error.
+ */
+extern int lxc_attach_session_run(lxc_attach_session_t *s, lxc_attach_exec_t exec_function,
+		void *exec_payload, lxc_attach_options_t *options, pid_t *attached_process);
+
+/*!
+ * \brief Run a program in the container, through a helper if possible.
+ *
+ * \param s Session.
+ * \param options \ref lxc_attach_options_t.
+ * \param program Full path inside container of program to run.
+ * \param argv Array of arguments to pass to \p program.
+ * \param[out] attached_process Process ID of the program.
+ *
+ * \return \c 0 on success, \c -1 on error.
+ *
+ * \note When run by a helper, errors happening in the attached process
+ *  before \p program is executed are only reported by its exit status.
+ */
+extern int lxc_attach_session_run_command(lxc_attach_session_t *s, lxc_attach_options_t *options,
+		const char *program, const char * const argv[], pid_t *attached_process);
+
+/*!
+ * \brief Run a program in the container and wait for it to exit, like
+ *  \ref lxc_container \c attach_run_wait().
+ *
+ * \param s Session.
+ * \param options \ref lxc_attach_options_t.
+ * \param program Full path inside container of program to run.
+ * \param argv Array of arguments to pass to \p program.
+ *
+ * \return \c waitpid(2) status of exited process that ran \p program,
+ *  or \c -1 on error.
+ */
+extern int lxc_attach_session_run_wait(lxc_attach_session_t *s, lxc_attach_options_t *options,
+		const char *program, const char * const argv[]);
+
+/*!
+ * Attach command channel, see \ref lxc_attach_channel_open.
+ */
+typedef struct lxc_attach_channel lxc_attach_channel_t;
+
+/*!
+ * Flags for \ref lxc_attach_channel_exec.
+ */
+enum {
+	LXC_ATTACH_BATCH_STOP_ON_ERROR   = 0x00000001, //!< Stop a sequence at the first command not exiting with 0
+	LXC_ATTACH_BATCH_PIPELINE        = 0x00000002, //!< Connect the commands' stdout to the next one's stdin
+};
+
+/*!
+ * Result of a command run by \ref lxc_attach_channel_exec.
+ */
+typedef struct lxc_attach_result_t {
+	int status;      /*!< waitpid(2) status of the command, -1 if it was not run */
+	char *out;       /*!< Captured standard output (NUL terminated), or \c NULL */
+	size_t out_len;  /*!< Length of \p out */
+	char *err;       /*!< Captured standard error (NUL terminated), or \c NULL */
+	size_t err_len;  /*!< Length of \p err */
+} lxc_attach_result_t;
+
+/*!
+ * \brief Start a process in the container which runs commands on request.
+ *
+ * The container is entered once, with \p options; every command run
+ * through the channel is then forked from that process.
+ *
+ * \param s Session.
+ * \param options \ref lxc_attach_options_t.
+ *
+ * \return Channel, or \c NULL on error.
+ *
+ * \note A channel must not be used by several threads at once.
+ */
+extern lxc_attach_channel_t *lxc_attach_channel_open(lxc_attach_session_t *s,
+		lxc_attach_options_t *options);
+
+/*!
+ * \brief Stop the process behind a channel and free it.
+ *
+ * \param ch Channel.
+ */
+extern void lxc_attach_channel_close(lxc_attach_channel_t *ch);
+
+/*!
+ * \brief Run a batch of commands through a channel.
+ *
+ * The commands are run one after the other, or all together as a
+ * pipeline with \ref LXC_ATTACH_BATCH_PIPELINE. Standard output and
+ * standard error of each command are captured; in a pipeline only the
+ * standard output of the last command is.
+ *
+ * \param ch Channel.
+ * \param cmds Commands to run.
+ * \param ncmds Number of commands.
+ * \param flags \c LXC_ATTACH_BATCH_* flags.
+ * \param[out] results Array of \p ncmds results, release with
+ *  \ref lxc_attach_result_free.
+ *
+ * \return Number of commands run, or \c -1 on error.
+ */
+extern int lxc_attach_channel_exec(lxc_attach_channel_t *ch, const lxc_attach_command_t *cmds,
+		int ncmds, int flags, lxc_attach_result_t *results);
+
+/*!
+ * \brief Run a batch of commands in the container, entering it once.
+ *
+ * Same as \ref lxc_attach_channel_exec on a channel opened for the
+ * batch.
+ *
+ * \return Number of commands run, or \c -1 on error.
+ */
+extern int lxc_attach_session_run_batch(lxc_attach_session_t *s, lxc_attach_options_t *options,
+		const lxc_attach_command_t *cmds, int ncmds, int flags,
+		lxc_attach_result_t *results);
+
+/*!
+ * \brief Free the output captured in results.
+ *
+ * \param results Results.
+ * \param n Number of results.
+ */
+extern void lxc_attach_result_free(lxc_attach_result_t *results, int n);
+
+/*!
+ * \brief Function called by \ref lxc_attach_fanout with the result of a
+ *  container.
+ *
+ * \param c Container.
+ * \param result Result of the command in \p c; \c status is \c -1 if
+ *  it could not be run.
+ * \param data Data passed to \ref lxc_attach_fanout.
+ */
+typedef void (*lxc_attach_fanout_cb)(struct lxc_container *c,
+		const lxc_attach_result_t *result, void *data);
+
+/*!
+ * \brief Run a command in many containers concurrently.
+ *
+ * \param cs Containers.
+ * \param count Number of containers.
+ * \param options \ref lxc_attach_options_t.
+ * \param cmd Command to run in every container.
+ * \param workers Maximum number of containers attached to at once,
+ *  \c 0 for a default.
+ * \param cb Function called with the result of each container as soon
+ *  as it is known, or \c NULL.
+ * \param data Data to pass to \p cb.
+ *
+ * \return Number of containers in which the command could not be run,
+ *  or \c -1 on error.
+ *
+ * \note \p cb is called from several threads, but never concurrently.
+ */
+extern int lxc_attach_fanout(struct lxc_container **cs, int count,
+		lxc_attach_options_t *options, const lxc_attach_command_t *cmd,
+		int workers, lxc_attach_fanout_cb cb, void *data);
+
 #ifdef  __cplusplus
 }
 #endif
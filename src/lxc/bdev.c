@@ -41,6 +41,12 @@
 #include <libgen.h>
 #include <linux/loop.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/file.h>
+#include <sys/sysmacros.h>
+#include <sys/vfs.h>
+#include <pthread.h>
 
 #include "lxc.h"
 #include "config.h"
@@ -52,6 +58,9 @@
 #include "namespace.h"
 #include "parse.h"
 #include "lxclock.h"
+#include "lxczfs.h"
+#include "asyncop.h"
+#include "dedup.h"
 
 #ifndef BLKGETSIZE64
 #define BLKGETSIZE64 _IOR(0x12,114,size_t)
@@ -61,6 +70,8 @@
 #define LO_FLAGS_AUTOCLEAR 4
 #endif
 
+#define LINELEN 4096
+
 #define DEFAULT_FS_SIZE 1073741824
 #define DEFAULT_FSTYPE "ext3"
 
@@ -87,7 +98,12 @@ static int do_rsync(const char *src, const char *dest)
 	s[l-2] = '/';
 	s[l-1] = '\0';
 
-	execlp("rsync", "rsync", "-a", s, dest, (char *)NULL);
+	/* report the bytes copied to an asynchronous clone */
+	if (lxc_op_progress_fd >= 0 && dup2(lxc_op_progress_fd, STDOUT_FILENO) >= 0)
+		execlp("rsync", "rsync", "-a", "--info=progress2",
+		       "--no-inc-recursive", s, dest, (char *)NULL);
+	else
+		execlp("rsync", "rsync", "-a", s, dest, (char *)NULL);
 	exit(1);
 }
 
@@ -158,9 +174,29 @@ static int find_fstype_cb(char* buffer, void *data)
 	return 1;
 }
 
+/*
+ * Mount rootfs on target with type fstype, as find_fstype_cb() does for
+ * each line of the filesystems files.
+ */
+static bool mount_fstype(const char *fstype, void *cbarg)
+{
+	char buf[32];
+	int ret;
+
+	ret = snprintf(buf, sizeof(buf), "%s", fstype);
+	if (ret < 0 || ret >= sizeof(buf))
+		return false;
+	return find_fstype_cb(buf, cbarg) == 1;
+}
+
+/*
+ * Mount rootfs, trying fstype (if not NULL) first, then the type its
+ * superblock tells, and only then every type the kernel knows.
+ */
 static int mount_unknown_fs(const char *rootfs, const char *target,
-			                const char *options)
+			    const char *options, const char *fstype)
 {
+	const char *probed;
 	int i;
 
 	struct cbarg {
@@ -173,6 +209,13 @@ static int mount_unknown_fs(const char *rootfs, const char *target,
 		.options = options,
 	};
 
+	if (fstype && mount_fstype(fstype, &cbarg))
+		return 0;
+	probed = lxc_probe_fstype(rootfs);
+	if (probed && (!fstype || strcmp(probed, fstype)) &&
+	    mount_fstype(probed, &cbarg))
+		return 0;
+
 	/*
 	 * find the filesystem type with brute force:
 	 * first we check with /etc/filesystems, in case the modules
@@ -250,8 +293,10 @@ static char *linkderef(char *path, char *dest)
 }
 
 /*
- * Given a bdev (presumably blockdev-based), detect the fstype
- * by trying mounting (in a private mntns) it.
+ * Given a bdev (presumably blockdev-based), detect the fstype by trying
+ * mounting (in a private mntns) it.  The type its superblock tells is
+ * tried first, but only what the kernel mounted is trusted, as it is
+ * recorded as lxc.rootfs.fstype.
  * @bdev: bdev to investigate
  * @type: preallocated char* in which to write the fstype
  * @len: length of passed in char*
@@ -309,7 +354,7 @@ static int detect_fs(struct bdev *bdev, char *type, int len)
 		}
 	}
 
-	ret = mount_unknown_fs(srcdev, bdev->dest, bdev->mntopts);
+	ret = mount_unknown_fs(srcdev, bdev->dest, bdev->mntopts, NULL);
 	if (ret < 0) {
 		ERROR("failed mounting %s onto %s to detect fstype", srcdev, bdev->dest);
 		exit(1);
@@ -528,39 +573,21 @@ static const struct bdev_ops dir_ops = {
 // sake of flexibility let's always bind-mount.
 //
 
-static int zfs_list_entry(const char *path, char *output, size_t inlen)
+static int zfs_detect(const char *path)
 {
-	struct lxc_popen_FILE *f;
-	int found=0;
-
-	f = lxc_popen("zfs list 2> /dev/null");
-	if (f == NULL) {
-		SYSERROR("popen failed");
-		return 0;
-	}
-	while (fgets(output, inlen, f->f)) {
-		if (strstr(output, path)) {
-			found = 1;
-			break;
-		}
-	}
-	(void) lxc_pclose(f);
+	char *dataset = lxc_zfs_dataset_of(path, true);
 
-	return found;
+	free(dataset);
+	return dataset != NULL;
 }
 
-static int zfs_detect(const char *path)
+/* a dataset is mounted on path, by mountinfo only */
+static bool zfs_is_mounted(const char *path)
 {
-	char *output = malloc(LXC_LOG_BUFFER_SIZE);
-	int found;
+	char *dataset = lxc_zfs_dataset_of(path, false);
 
-	if (!output) {
-		ERROR("out of memory");
-		return 0;
-	}
-	found = zfs_list_entry(path, output, LXC_LOG_BUFFER_SIZE);
-	free(output);
-	return found;
+	free(dataset);
+	return dataset != NULL;
 }
 
 static int zfs_mount(struct bdev *bdev)
@@ -596,83 +623,45 @@ static int zfs_umount(struct bdev *bdev)
 static int zfs_clone(const char *opath, const char *npath, const char *oname,
 			const char *nname, const char *lxcpath, int snapshot)
 {
-	// use the 'zfs list | grep opath' entry to get the zfsroot
-	char output[MAXPATHLEN], option[MAXPATHLEN], *p;
-	const char *zfsroot = output;
+	const struct lxc_zfs_ops *ops = lxc_zfs_get_ops();
+	char origin[MAXPATHLEN], dataset[MAXPATHLEN], root[MAXPATHLEN];
+	char *odataset, *p;
+	const char *zfsroot = root;
 	int ret;
-	pid_t pid;
 
-	if (zfs_list_entry(opath, output, MAXPATHLEN)) {
-		// zfsroot is output up to ' '
-		if ((p = index(output, ' ')) == NULL)
+	// the new dataset goes next to the original one
+	odataset = lxc_zfs_dataset_of(opath, true);
+	if (odataset) {
+		ret = snprintf(origin, MAXPATHLEN, "%s", odataset);
+		free(odataset);
+		if (ret < 0 || ret >= MAXPATHLEN)
 			return -1;
-		*p = '\0';
-		if ((p = strrchr(output, '/')) == NULL)
+		strcpy(root, origin);
+		if ((p = strrchr(root, '/')) == NULL)
 			return -1;
 		*p = '\0';
-	} else
-		zfsroot = lxc_global_config_value("lxc.bdev.zfs.root");
-
-	ret = snprintf(option, MAXPATHLEN, "-omountpoint=%s/%s/rootfs",
-		lxcpath, nname);
-	if (ret < 0  || ret >= MAXPATHLEN)
-		return -1;
-
-	// zfs create -omountpoint=$lxcpath/$lxcname $zfsroot/$nname
-	if (!snapshot) {
-		if ((pid = fork()) < 0)
-			return -1;
-		if (!pid) {
-			char dev[MAXPATHLEN];
-
-			ret = snprintf(dev, MAXPATHLEN, "%s/%s", zfsroot, nname);
-			if (ret < 0  || ret >= MAXPATHLEN)
-				exit(1);
-			execlp("zfs", "zfs", "create", option, dev, NULL);
-			exit(1);
-		}
-		return wait_for_pid(pid);
 	} else {
-		// if snapshot, do
-		// 'zfs snapshot zfsroot/oname@nname
-		// zfs clone zfsroot/oname@nname zfsroot/nname
-		char path1[MAXPATHLEN], path2[MAXPATHLEN];
-
-		ret = snprintf(path1, MAXPATHLEN, "%s/%s@%s", zfsroot,
-			oname, nname);
+		zfsroot = lxc_global_config_value("lxc.bdev.zfs.root");
+		ret = snprintf(origin, MAXPATHLEN, "%s/%s", zfsroot, oname);
 		if (ret < 0 || ret >= MAXPATHLEN)
 			return -1;
-		(void) snprintf(path2, MAXPATHLEN, "%s/%s", zfsroot, nname);
+	}
 
-		// if the snapshot exists, delete it
-		if ((pid = fork()) < 0)
-			return -1;
-		if (!pid) {
-			execlp("zfs", "zfs", "destroy", path1, NULL);
-			exit(1);
-		}
-		// it probably doesn't exist so destroy probably will fail.
-		(void) wait_for_pid(pid);
+	ret = snprintf(dataset, MAXPATHLEN, "%s/%s", zfsroot, nname);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -1;
 
-		// run first (snapshot) command
-		if ((pid = fork()) < 0)
-			return -1;
-		if (!pid) {
-			execlp("zfs", "zfs", "snapshot", path1, NULL);
-			exit(1);
-		}
-		if (wait_for_pid(pid) < 0)
-			return -1;
+	if (!snapshot)
+		return ops->create(dataset, npath);
 
-		// run second (clone) command
-		if ((pid = fork()) < 0)
-			return -1;
-		if (!pid) {
-			execlp("zfs", "zfs", "clone", option, path1, path2, NULL);
-			exit(1);
-		}
-		return wait_for_pid(pid);
-	}
+	// snapshot origin as origin@nname, and clone that
+	if (ops->snapshot(origin, nname) < 0)
+		return -1;
+	ret = snprintf(origin + strlen(origin), MAXPATHLEN - strlen(origin),
+		       "@%s", nname);
+	if (ret < 0 || ret >= MAXPATHLEN - strlen(origin))
+		return -1;
+	return ops->clone(origin, dataset, npath);
 }
 
 static int zfs_clonepaths(struct bdev *orig, struct bdev *new, const char *oldname,
@@ -710,35 +699,25 @@ static int zfs_clonepaths(struct bdev *orig, struct bdev *new, const char *oldna
  */
 static int zfs_destroy(struct bdev *orig)
 {
-	pid_t pid;
-	char output[MAXPATHLEN], *p;
-
-	if ((pid = fork()) < 0)
-		return -1;
-	if (pid)
-		return wait_for_pid(pid);
+	char *dataset;
+	int ret;
 
-	if (!zfs_list_entry(orig->src, output, MAXPATHLEN)) {
+	dataset = lxc_zfs_dataset_of(orig->src, true);
+	if (!dataset) {
 		ERROR("Error: zfs entry for %s not found", orig->src);
 		return -1;
 	}
-
-	// zfs mount is output up to ' '
-	if ((p = index(output, ' ')) == NULL)
-		return -1;
-	*p = '\0';
-
-	execlp("zfs", "zfs", "destroy", output, NULL);
-	exit(1);
+	ret = lxc_zfs_get_ops()->destroy(dataset, orig->src);
+	free(dataset);
+	return ret;
 }
 
 static int zfs_create(struct bdev *bdev, const char *dest, const char *n,
 			struct bdev_specs *specs)
 {
 	const char *zfsroot;
-	char option[MAXPATHLEN];
+	char dataset[MAXPATHLEN];
 	int ret;
-	pid_t pid;
 
 	if (!specs || !specs->zfs.zfsroot)
 		zfsroot = lxc_global_config_value("lxc.bdev.zfs.root");
@@ -754,20 +733,10 @@ static int zfs_create(struct bdev *bdev, const char *dest, const char *n,
 		return -1;
 	}
 
-	ret = snprintf(option, MAXPATHLEN, "-omountpoint=%s", bdev->dest);
-	if (ret < 0  || ret >= MAXPATHLEN)
-		return -1;
-	if ((pid = fork()) < 0)
+	ret = snprintf(dataset, MAXPATHLEN, "%s/%s", zfsroot, n);
+	if (ret < 0 || ret >= MAXPATHLEN)
 		return -1;
-	if (pid)
-		return wait_for_pid(pid);
-
-	char dev[MAXPATHLEN];
-	ret = snprintf(dev, MAXPATHLEN, "%s/%s", zfsroot, n);
-	if (ret < 0  || ret >= MAXPATHLEN)
-		exit(1);
-	execlp("zfs", "zfs", "create", option, dev, NULL);
-	exit(1);
+	return lxc_zfs_get_ops()->create(dataset, bdev->dest);
 }
 
 static const struct bdev_ops zfs_ops = {
@@ -828,7 +797,8 @@ static int lvm_mount(struct bdev *bdev)
 		return -22;
 	/* if we might pass in data sometime, then we'll have to enrich
 	 * mount_unknown_fs */
-	return mount_unknown_fs(bdev->src, bdev->dest, bdev->mntopts);
+	return mount_unknown_fs(bdev->src, bdev->dest, bdev->mntopts,
+				bdev->fstype);
 }
 
 static int lvm_umount(struct bdev *bdev)
@@ -840,7 +810,114 @@ static int lvm_umount(struct bdev *bdev)
 	return umount(bdev->dest);
 }
 
-static int lvm_compare_lv_attr(const char *path, int pos, const char expected) {
+/*
+ * lv_attr of the logical volumes, from a single lvs run rather than one
+ * per check.  The attributes we look at, whether an LV is a thin volume or
+ * a thin pool, do not change once the LV exists, so an entry stays valid
+ * until the LV is removed; an LV which is not known yet, i.e. one created
+ * since, makes the next lookup run lvs again.
+ *
+ * lvm_lock also guards the snapshots created by bdev_lvm_prepare().
+ */
+struct lvm_lv {
+	char *path;
+	char attr[12];
+};
+
+static struct lvm_lv *lvm_cache;
+static int lvm_cache_len;
+static bool lvm_cache_valid;
+
+/*
+ * The snapshots of orig made by one bdev_lvm_prepare() call.  The sets
+ * not released yet are on lvm_prepared, where lvm_snapshot() looks for
+ * them; each caller releases only its own.
+ */
+struct lvm_prepared {
+	char *orig;
+	char **paths;
+	int len;
+	struct lvm_prepared *next;
+};
+
+static struct lvm_prepared *lvm_prepared;
+
+static pthread_mutex_t lvm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void lvm_cache_clear(void)
+{
+	int i;
+
+	for (i = 0; i < lvm_cache_len; i++)
+		free(lvm_cache[i].path);
+	free(lvm_cache);
+	lvm_cache = NULL;
+	lvm_cache_len = 0;
+	lvm_cache_valid = false;
+}
+
+/* with lvm_lock held */
+static void lvm_cache_refresh(void)
+{
+	struct lxc_popen_FILE *f;
+	struct lvm_lv *tmp;
+	char line[MAXPATHLEN], path[MAXPATHLEN], attr[12];
+	int status;
+
+	lvm_cache_clear();
+	f = lxc_popen("lvs --unbuffered --noheadings -o lv_path,lv_attr 2>/dev/null");
+	if (!f) {
+		SYSERROR("popen failed");
+		return;
+	}
+	while (fgets(line, sizeof(line), f->f)) {
+		/* hidden LVs, i.e. the data of a thin pool, have no path */
+		if (sscanf(line, "%4095s %11s", path, attr) != 2 || path[0] != '/')
+			continue;
+		tmp = realloc(lvm_cache, (lvm_cache_len + 1) * sizeof(*tmp));
+		if (!tmp)
+			break;
+		lvm_cache = tmp;
+		lvm_cache[lvm_cache_len].path = strdup(path);
+		if (!lvm_cache[lvm_cache_len].path)
+			break;
+		strcpy(lvm_cache[lvm_cache_len].attr, attr);
+		lvm_cache_len++;
+	}
+	status = lxc_pclose(f);
+	if (status == -1 || WEXITSTATUS(status))
+		INFO("lvs failed, assuming there are no logical volumes");
+	/* if lvs fails, failing again for each check is no use */
+	lvm_cache_valid = true;
+}
+
+/* with lvm_lock held */
+static struct lvm_lv *lvm_cache_find(const char *path)
+{
+	int i;
+
+	for (i = 0; i < lvm_cache_len; i++)
+		if (strcmp(lvm_cache[i].path, path) == 0)
+			return &lvm_cache[i];
+	return NULL;
+}
+
+static void lvm_cache_forget(const char *path)
+{
+	struct lvm_lv *lv;
+
+	pthread_mutex_lock(&lvm_lock);
+	lv = lvm_cache_find(path);
+	if (lv) {
+		free(lv->path);
+		*lv = lvm_cache[--lvm_cache_len];
+	}
+	pthread_mutex_unlock(&lvm_lock);
+}
+
+/* ask lvs about path itself, which may not be the /dev/$vg/$lv we cache */
+static int lvm_query_lv_attr(const char *path, int pos, const char expected)
+{
 	struct lxc_popen_FILE *f;
 	int ret, len, status, start=0;
 	char *cmd, output[12];
@@ -878,6 +955,28 @@ static int lvm_compare_lv_attr(const char *path, int pos, const char expected) {
 	return 0;
 }
 
+static int lvm_compare_lv_attr(const char *path, int pos, const char expected)
+{
+	struct lvm_lv *lv;
+	int ret = -1;
+
+	pthread_mutex_lock(&lvm_lock);
+	if (!lvm_cache_valid)
+		lvm_cache_refresh();
+	lv = lvm_cache_find(path);
+	if (!lv) {
+		lvm_cache_refresh();
+		lv = lvm_cache_find(path);
+	}
+	if (lv)
+		ret = pos < strlen(lv->attr) && lv->attr[pos] == expected;
+	pthread_mutex_unlock(&lvm_lock);
+
+	if (ret < 0)
+		ret = lvm_query_lv_attr(path, pos, expected);
+	return ret;
+}
+
 static int lvm_is_thin_volume(const char *path)
 {
 	return lvm_compare_lv_attr(path, 6, 't');
@@ -888,6 +987,85 @@ static int lvm_is_thin_pool(const char *path)
 	return lvm_compare_lv_attr(path, 0, 't');
 }
 
+static int lvm_run(char *const argv[])
+{
+	pid_t pid;
+
+	if ((pid = fork()) < 0) {
+		SYSERROR("failed fork");
+		return -1;
+	}
+	if (pid > 0)
+		return wait_for_pid(pid);
+
+	execvp(argv[0], argv);
+	SYSERROR("failed to exec %s", argv[0]);
+	exit(1);
+}
+
+/*
+ * Run the lvm commands cmds in a single lvm shell, so that the devices
+ * are scanned and the configuration is read once for all of them.  The
+ * shell does not report which commands failed, the caller has to check.
+ */
+static int lvm_run_batch(char **cmds, int n)
+{
+	FILE *f;
+	pid_t pid;
+	int i, fd;
+
+	f = tmpfile();
+	if (!f) {
+		SYSERROR("failed to create the lvm command file");
+		return -1;
+	}
+	for (i = 0; i < n; i++)
+		fprintf(f, "%s\n", cmds[i]);
+	fprintf(f, "exit\n");
+	if (fflush(f) != 0 || fseek(f, 0, SEEK_SET) < 0) {
+		SYSERROR("failed to write the lvm command file");
+		fclose(f);
+		return -1;
+	}
+
+	if ((pid = fork()) < 0) {
+		SYSERROR("failed fork");
+		fclose(f);
+		return -1;
+	}
+	if (pid > 0) {
+		fclose(f);
+		return wait_for_pid(pid);
+	}
+
+	if (dup2(fileno(f), 0) < 0)
+		exit(1);
+	/* the prompts */
+	fd = open("/dev/null", O_WRONLY);
+	if (fd >= 0)
+		dup2(fd, 1);
+	execlp("lvm", "lvm", (char *)NULL);
+	SYSERROR("failed to exec lvm");
+	exit(1);
+}
+
+/* split /dev/$vg/$lv, returning $lv and setting *vgdir to /dev/$vg */
+static char *lvm_split_path(const char *path, char **vgdir)
+{
+	char *lv;
+
+	*vgdir = strdup(path);
+	if (!*vgdir)
+		return NULL;
+	lv = strrchr(*vgdir, '/');
+	if (!lv || lv == *vgdir) {
+		free(*vgdir);
+		return NULL;
+	}
+	*lv = '\0';
+	return lv + 1;
+}
+
 /*
  * path must be '/dev/$vg/$lv', $vg must be an existing VG, and $lv must not
  * yet exist.  This function will attempt to create /dev/$vg/$lv of size
@@ -897,35 +1075,23 @@ static int lvm_is_thin_pool(const char *path)
  */
 static int do_lvm_create(const char *path, uint64_t size, const char *thinpool)
 {
-	int ret, pid, len;
+	int ret, len;
 	char sz[24], *pathdup, *vg, *lv, *tp = NULL;
 
-	if ((pid = fork()) < 0) {
-		SYSERROR("failed fork");
-		return -1;
-	}
-	if (pid > 0)
-		return wait_for_pid(pid);
-
 	// specify bytes to lvcreate
 	ret = snprintf(sz, 24, "%"PRIu64"b", size);
 	if (ret < 0 || ret >= 24)
-		exit(1);
-
-	pathdup = strdup(path);
-	if (!pathdup)
-		exit(1);
+		return -1;
 
-	lv = strrchr(pathdup, '/');
+	lv = lvm_split_path(path, &pathdup);
 	if (!lv)
-		exit(1);
-
-	*lv = '\0';
-	lv++;
+		return -1;
 
 	vg = strrchr(pathdup, '/');
-	if (!vg)
-		exit(1);
+	if (!vg) {
+		free(pathdup);
+		return -1;
+	}
 	vg++;
 
 	if (thinpool) {
@@ -933,54 +1099,94 @@ static int do_lvm_create(const char *path, uint64_t size, const char *thinpool)
 		tp = alloca(len);
 
 		ret = snprintf(tp, len, "%s/%s", pathdup, thinpool);
-		if (ret < 0 || ret >= len)
-			exit(1);
+		if (ret < 0 || ret >= len) {
+			free(pathdup);
+			return -1;
+		}
 
 		ret = lvm_is_thin_pool(tp);
 		INFO("got %d for thin pool at path: %s", ret, tp);
-		if (ret < 0)
-			exit(1);
+		if (ret < 0) {
+			free(pathdup);
+			return -1;
+		}
 
 		if (!ret)
 			tp = NULL;
 	}
 
-	if (!tp)
-	    execlp("lvcreate", "lvcreate", "-L", sz, vg, "-n", lv, (char *)NULL);
-	else
-	    execlp("lvcreate", "lvcreate", "--thinpool", tp, "-V", sz, vg, "-n", lv, (char *)NULL);
+	if (!tp) {
+		char *argv[] = {"lvcreate", "-L", sz, vg, "-n", lv, NULL};
+		ret = lvm_run(argv);
+	} else {
+		char *argv[] = {"lvcreate", "--thinpool", tp, "-V", sz, vg, "-n", lv, NULL};
+		ret = lvm_run(argv);
+	}
+	free(pathdup);
+	return ret;
+}
 
-	SYSERROR("execlp");
-	exit(1);
+/* whether the snapshot path of orig was made by bdev_lvm_prepare() */
+static bool lvm_prepared_take(const char *orig, const char *path)
+{
+	struct lvm_prepared *p;
+	bool found = false;
+	int i;
+
+	pthread_mutex_lock(&lvm_lock);
+	for (p = lvm_prepared; p && !found; p = p->next) {
+		if (strcmp(p->orig, orig))
+			continue;
+		for (i = 0; i < p->len; i++) {
+			if (strcmp(p->paths[i], path))
+				continue;
+			free(p->paths[i]);
+			p->paths[i] = p->paths[--p->len];
+			found = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&lvm_lock);
+	return found;
+}
+
+/*
+ * The lvcreate arguments of a snapshot of orig named after path, with
+ * size unless orig is a thin volume: a thin snapshot cannot have a size
+ * different from the original one.
+ */
+static int lvm_snapshot_cmd(char *buf, size_t len, const char *orig,
+			    const char *lv, const char *sz, bool thin)
+{
+	int ret;
+
+	if (thin)
+		ret = snprintf(buf, len, "lvcreate -s -n %s %s", lv, orig);
+	else
+		ret = snprintf(buf, len, "lvcreate -s -L %s -n %s %s", sz, lv, orig);
+	if (ret < 0 || ret >= len)
+		return -1;
+	return 0;
 }
 
 static int lvm_snapshot(const char *orig, const char *path, uint64_t size)
 {
-	int ret, pid;
+	int ret;
 	char sz[24], *pathdup, *lv;
 
-	if ((pid = fork()) < 0) {
-		SYSERROR("failed fork");
-		return -1;
+	if (lvm_prepared_take(orig, path)) {
+		INFO("using the prepared snapshot %s of %s", path, orig);
+		return 0;
 	}
-	if (pid > 0)
-		return wait_for_pid(pid);
 
 	// specify bytes to lvcreate
 	ret = snprintf(sz, 24, "%"PRIu64"b", size);
 	if (ret < 0 || ret >= 24)
-		exit(1);
+		return -1;
 
-	pathdup = strdup(path);
-	if (!pathdup)
-		exit(1);
-	lv = strrchr(pathdup, '/');
-	if (!lv) {
-		free(pathdup);
-		exit(1);
-	}
-	*lv = '\0';
-	lv++;
+	lv = lvm_split_path(path, &pathdup);
+	if (!lv)
+		return -1;
 
 	// check if the original lv is backed by a thin pool, in which case we
 	// cannot specify a size that's different from the original size.
@@ -991,25 +1197,201 @@ static int lvm_snapshot(const char *orig, const char *path, uint64_t size)
 	}
 
 	if (!ret) {
-		ret = execlp("lvcreate", "lvcreate", "-s", "-L", sz, "-n", lv, orig, (char *)NULL);
+		char *argv[] = {"lvcreate", "-s", "-L", sz, "-n", lv, (char *)orig, NULL};
+		ret = lvm_run(argv);
 	} else {
-		ret = execlp("lvcreate", "lvcreate", "-s", "-n", lv, orig, (char *)NULL);
+		char *argv[] = {"lvcreate", "-s", "-n", lv, (char *)orig, NULL};
+		ret = lvm_run(argv);
 	}
 
 	free(pathdup);
-	exit(1);
+	return ret;
 }
 
-// this will return 1 for physical disks, qemu-nbd, loop, etc
-// right now only lvm is a block device
-static int is_blktype(struct bdev *b)
+/* whether name can go on an lvm shell command line unquoted */
+static bool lvm_valid_name(const char *name)
 {
-	if (strcmp(b->type, "lvm") == 0)
-		return 1;
-	return 0;
+	return *name && strspn(name, "abcdefghijklmnopqrstuvwxyz"
+			       "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789+_.-/") == strlen(name);
 }
 
-static int lvm_clonepaths(struct bdev *orig, struct bdev *new, const char *oldname,
+struct lvm_prepared *bdev_lvm_prepare(struct lxc_container *c0,
+		const char * const *names, int count, const char *lxcpath,
+		uint64_t newsize)
+{
+	struct bdev *orig;
+	struct lvm_prepared *prepared = NULL;
+	char **paths = NULL, **cmds = NULL, sz[24];
+	uint64_t size = newsize;
+	int i, n = 0, thin, ret;
+
+	if (!c0->lxc_conf->rootfs.path)
+		return NULL;
+	orig = bdev_init_rootfs(c0->lxc_conf->rootfs.path, NULL, NULL,
+				&c0->lxc_conf->rootfs.backend);
+	if (!orig)
+		return NULL;
+	if (strcmp(orig->type, "lvm") || count < 2 || !lvm_valid_name(orig->src) ||
+	    strstr(orig->src, c0->name) == NULL) {
+		bdev_put(orig);
+		return NULL;
+	}
+
+	if (!size && blk_getsize(orig, &size) < 0) {
+		ERROR("Error getting size of %s", orig->src);
+		goto out;
+	}
+	ret = snprintf(sz, 24, "%"PRIu64"b", size);
+	if (ret < 0 || ret >= 24)
+		goto out;
+	/* so that only the snapshots we create below are found after */
+	pthread_mutex_lock(&lvm_lock);
+	lvm_cache_refresh();
+	pthread_mutex_unlock(&lvm_lock);
+
+	thin = lvm_is_thin_volume(orig->src);
+	if (thin < 0)
+		goto out;
+
+	paths = calloc(count, sizeof(*paths));
+	cmds = calloc(count, sizeof(*cmds));
+	if (!paths || !cmds)
+		goto out;
+
+	for (i = 0; i < count; i++) {
+		char *path, *vgdir, *lv;
+		bool exists;
+
+		path = dir_new_path(orig->src, c0->name, names[i],
+				    c0->config_path, lxcpath);
+		if (!path)
+			goto out;
+		pthread_mutex_lock(&lvm_lock);
+		exists = lvm_cache_find(path) != NULL;
+		pthread_mutex_unlock(&lvm_lock);
+		/* left to the clone, which then reports the problem */
+		if (!lvm_valid_name(path) || exists) {
+			free(path);
+			continue;
+		}
+		lv = lvm_split_path(path, &vgdir);
+		cmds[n] = malloc(MAXPATHLEN);
+		if (!lv || !cmds[n] ||
+		    lvm_snapshot_cmd(cmds[n], MAXPATHLEN, orig->src, lv, sz, thin) < 0) {
+			if (lv)
+				free(vgdir);
+			free(cmds[n]);
+			cmds[n] = NULL;
+			free(path);
+			goto out;
+		}
+		free(vgdir);
+		paths[n++] = path;
+	}
+	if (!n)
+		goto out;
+
+	prepared = malloc(sizeof(*prepared));
+	if (!prepared)
+		goto out;
+	prepared->orig = strdup(orig->src);
+	if (!prepared->orig) {
+		free(prepared);
+		prepared = NULL;
+		goto out;
+	}
+	prepared->paths = paths;
+	prepared->len = 0;
+
+	INFO("creating %d snapshots of %s", n, orig->src);
+	if (lvm_run_batch(cmds, n) != 0)
+		WARN("lvm reported errors creating snapshots of %s", orig->src);
+
+	/* keep the snapshots which were made */
+	pthread_mutex_lock(&lvm_lock);
+	lvm_cache_refresh();
+	for (i = 0; i < n; i++) {
+		if (lvm_cache_find(paths[i]))
+			paths[prepared->len++] = paths[i];
+		else
+			free(paths[i]);
+	}
+	paths = NULL;
+	prepared->next = lvm_prepared;
+	lvm_prepared = prepared;
+	pthread_mutex_unlock(&lvm_lock);
+
+out:
+	for (i = 0; i < n; i++) {
+		if (paths)
+			free(paths[i]);
+		free(cmds[i]);
+	}
+	free(paths);
+	free(cmds);
+	bdev_put(orig);
+	return prepared;
+}
+
+void bdev_lvm_release(struct lvm_prepared *prepared)
+{
+	struct lvm_prepared **p;
+	char **cmds;
+	int i, n;
+
+	if (!prepared)
+		return;
+
+	pthread_mutex_lock(&lvm_lock);
+	for (p = &lvm_prepared; *p; p = &(*p)->next) {
+		if (*p == prepared) {
+			*p = prepared->next;
+			break;
+		}
+	}
+	n = prepared->len;
+	if (n)
+		lvm_cache_valid = false;
+	pthread_mutex_unlock(&lvm_lock);
+
+	cmds = calloc(n ? n : 1, sizeof(*cmds));
+	for (i = 0; cmds && i < n; i++) {
+		cmds[i] = malloc(MAXPATHLEN);
+		if (cmds[i])
+			snprintf(cmds[i], MAXPATHLEN, "lvremove -f %s",
+				 prepared->paths[i]);
+	}
+	if (cmds && n) {
+		INFO("removing %d unused snapshots", n);
+		for (i = 0; i < n; i++)
+			if (!cmds[i])
+				break;
+		if (i < n || lvm_run_batch(cmds, n) != 0)
+			ERROR("failed to remove unused lvm snapshots");
+	} else if (n) {
+		ERROR("failed to remove unused lvm snapshots");
+	}
+	for (i = 0; i < n; i++) {
+		if (cmds)
+			free(cmds[i]);
+		free(prepared->paths[i]);
+	}
+	free(cmds);
+	free(prepared->paths);
+	free(prepared->orig);
+	free(prepared);
+}
+
+// this will return 1 for physical disks, qemu-nbd, loop, etc
+// right now only lvm is a block device
+static int is_blktype(struct bdev *b)
+{
+	if (strcmp(b->type, "lvm") == 0)
+		return 1;
+	return 0;
+}
+
+static int lvm_clonepaths(struct bdev *orig, struct bdev *new, const char *oldname,
 		const char *cname, const char *oldpath, const char *lxcpath, int snap,
 		uint64_t newsize, struct lxc_conf *conf)
 {
@@ -1071,6 +1453,9 @@ static int lvm_clonepaths(struct bdev *orig, struct bdev *new, const char *oldna
 		if (!newsize)
 			size = DEFAULT_FS_SIZE;
 	}
+	new->fstype = strdup(fstype);
+	if (!new->fstype)
+		return -1;
 
 	if (snap) {
 		if (lvm_snapshot(orig->src, new->src, size) < 0) {
@@ -1094,15 +1479,13 @@ static int lvm_clonepaths(struct bdev *orig, struct bdev *new, const char *oldna
 
 static int lvm_destroy(struct bdev *orig)
 {
-	pid_t pid;
+	char *argv[] = {"lvremove", "-f", orig->src, NULL};
+	int ret;
 
-	if ((pid = fork()) < 0)
-		return -1;
-	if (!pid) {
-		execlp("lvremove", "lvremove", "-f", orig->src, NULL);
-		exit(1);
-	}
-	return wait_for_pid(pid);
+	ret = lvm_run(argv);
+	if (ret == 0)
+		lvm_cache_forget(orig->src);
+	return ret;
 }
 
 static int lvm_create(struct bdev *bdev, const char *dest, const char *n,
@@ -1154,6 +1537,8 @@ static int lvm_create(struct bdev *bdev, const char *dest, const char *n,
 			bdev->src);
 		return -1;
 	}
+	if (!(bdev->fstype = strdup(fstype)))
+		return -1;
 	if (!(bdev->dest = strdup(dest)))
 		return -1;
 
@@ -1478,11 +1863,10 @@ static int btrfs_clonepaths(struct bdev *orig, struct bdev *new, const char *old
 	return btrfs_subvolume_create(new->dest);
 }
 
-static int btrfs_destroy(struct bdev *orig)
+static int btrfs_subvolume_destroy(const char *path)
 {
 	int ret, fd = -1;
 	struct btrfs_ioctl_vol_args  args;
-	char *path = orig->src;
 	char *p, *newfull = strdup(path);
 
 	if (!newfull) {
@@ -1516,6 +1900,23 @@ static int btrfs_destroy(struct bdev *orig)
 	return ret;
 }
 
+static int btrfs_destroy(struct bdev *orig)
+{
+	char path[MAXPATHLEN];
+	int ret;
+
+	/* the read-only snapshot lxc_snapshot_export() sent from */
+	ret = snprintf(path, MAXPATHLEN, "%s.send", orig->src);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -1;
+	if (access(path, F_OK) == 0 && btrfs_subvolume_destroy(path) < 0) {
+		ERROR("Failed to destroy %s", path);
+		return -1;
+	}
+
+	return btrfs_subvolume_destroy(orig->src);
+}
+
 static int btrfs_create(struct bdev *bdev, const char *dest, const char *n,
 			struct bdev_specs *specs)
 {
@@ -1546,6 +1947,75 @@ static int loop_detect(const char *path)
 	return 0;
 }
 
+#ifndef LOOP_CTL_GET_FREE
+#define LOOP_CTL_GET_FREE 0x4C82
+#endif
+
+#ifndef LOOP_SET_DIRECT_IO
+#define LOOP_SET_DIRECT_IO 0x4C08
+#endif
+
+#ifndef LOOP_SET_BLOCK_SIZE
+#define LOOP_SET_BLOCK_SIZE 0x4C09
+#endif
+
+#define LOOP_MAJOR 7
+
+/* how often to retry when another process takes the free loop device */
+#define LOOP_ATTACH_TRIES 16
+
+/* lxc.rootfs.loop */
+struct loop_opts {
+	bool direct_io;
+	unsigned int block_size;
+};
+
+static int loop_parse_opts(const char *opts, struct loop_opts *lo)
+{
+	char *dup, *tok, *saveptr = NULL;
+	unsigned long bs;
+	int ret = 0;
+
+	memset(lo, 0, sizeof(*lo));
+	if (!opts)
+		return 0;
+	dup = strdup(opts);
+	if (!dup)
+		return -1;
+	for (tok = strtok_r(dup, ",", &saveptr); tok;
+	     tok = strtok_r(NULL, ",", &saveptr)) {
+		char *end;
+
+		if (strcmp(tok, "direct-io") == 0) {
+			lo->direct_io = true;
+			continue;
+		}
+		if (strncmp(tok, "blocksize=", 10) == 0) {
+			errno = 0;
+			bs = strtoul(tok + 10, &end, 10);
+			/* a power of two from 512 to the page size */
+			if (!errno && !*end && bs >= 512 &&
+			    bs <= sysconf(_SC_PAGESIZE) && !(bs & (bs - 1))) {
+				lo->block_size = bs;
+				continue;
+			}
+		}
+		ERROR("invalid lxc.rootfs.loop option '%s'", tok);
+		ret = -1;
+		break;
+	}
+	free(dup);
+	return ret;
+}
+
+int bdev_loop_check_opts(const char *opts)
+{
+	struct loop_opts lo;
+
+	return loop_parse_opts(opts, &lo);
+}
+
+/* for kernels without /dev/loop-control */
 static int find_free_loopdev(int *retfd, char *namep)
 {
 	struct dirent dirent, *direntp;
@@ -1586,37 +2056,134 @@ static int find_free_loopdev(int *retfd, char *namep)
 	return 0;
 }
 
-static int loop_mount(struct bdev *bdev)
+/*
+ * Attach ffd to the loop device lfd, set to autoclear, in one step if the
+ * kernel has LOOP_CONFIGURE.  Fails with errno EBUSY if the device is
+ * taken.
+ */
+static int loop_configure(int lfd, int ffd, const struct loop_opts *opts)
 {
-	int lfd, ffd = -1, ret = -1;
 	struct loop_info64 lo;
+	int saved_errno;
+
+#ifdef LOOP_CONFIGURE
+	struct loop_config config;
+
+	memset(&config, 0, sizeof(config));
+	config.fd = ffd;
+	config.block_size = opts->block_size;
+	config.info.lo_flags = LO_FLAGS_AUTOCLEAR;
+	if (opts->direct_io)
+		config.info.lo_flags |= LO_FLAGS_DIRECT_IO;
+	if (ioctl(lfd, LOOP_CONFIGURE, &config) == 0)
+		return 0;
+	/* older kernels do not know LOOP_CONFIGURE */
+	if (errno != EINVAL && errno != ENOTTY)
+		return -1;
+#endif
+
+	if (ioctl(lfd, LOOP_SET_FD, ffd) < 0)
+		return -1;
+	memset(&lo, 0, sizeof(lo));
+	lo.lo_flags = LO_FLAGS_AUTOCLEAR;
+	if (ioctl(lfd, LOOP_SET_STATUS64, &lo) < 0) {
+		saved_errno = errno;
+		SYSERROR("Error setting autoclear on loop dev");
+		ioctl(lfd, LOOP_CLR_FD, 0);
+		errno = saved_errno;
+		return -1;
+	}
+	if (opts->block_size &&
+	    ioctl(lfd, LOOP_SET_BLOCK_SIZE, (unsigned long)opts->block_size) < 0)
+		WARN("failed to set the loop device block size to %u: %s",
+		     opts->block_size, strerror(errno));
+	if (opts->direct_io && ioctl(lfd, LOOP_SET_DIRECT_IO, 1UL) < 0)
+		WARN("failed to enable direct-io on the loop device: %s",
+		     strerror(errno));
+	return 0;
+}
+
+/*
+ * Attach ffd to a free loop device, whose name goes into namep (100
+ * bytes), and return its fd.  A device handed out by LOOP_CTL_GET_FREE
+ * can be taken by a concurrent caller before we attach to it, in which
+ * case we ask for another one.
+ */
+static int loop_attach(int ffd, const struct loop_opts *opts, char *namep)
+{
+	int ctl, lfd = -1, nr, i;
+
+	ctl = open("/dev/loop-control", O_RDWR | O_CLOEXEC);
+	if (ctl < 0) {
+		if (find_free_loopdev(&lfd, namep) < 0)
+			return -1;
+		if (loop_configure(lfd, ffd, opts) < 0) {
+			SYSERROR("Error attaching backing file to loop dev");
+			close(lfd);
+			return -1;
+		}
+		return lfd;
+	}
+
+	for (i = 0; i < LOOP_ATTACH_TRIES; i++) {
+		nr = ioctl(ctl, LOOP_CTL_GET_FREE);
+		if (nr < 0) {
+			SYSERROR("No loop device found");
+			break;
+		}
+		snprintf(namep, 100, "/dev/loop%d", nr);
+		lfd = open(namep, O_RDWR | O_CLOEXEC);
+		/* /dev may be a static one which lacks the new device */
+		if (lfd < 0 && errno == ENOENT &&
+		    mknod(namep, S_IFBLK | 0660, makedev(LOOP_MAJOR, nr)) == 0)
+			lfd = open(namep, O_RDWR | O_CLOEXEC);
+		if (lfd < 0) {
+			SYSERROR("Error opening %s", namep);
+			break;
+		}
+		if (loop_configure(lfd, ffd, opts) == 0) {
+			close(ctl);
+			return lfd;
+		}
+		if (errno != EBUSY) {
+			SYSERROR("Error attaching backing file to %s", namep);
+			close(lfd);
+			break;
+		}
+		DEBUG("%s was taken, trying another loop device", namep);
+		close(lfd);
+	}
+	if (i == LOOP_ATTACH_TRIES)
+		ERROR("No loop device stayed free");
+	close(ctl);
+	return -1;
+}
+
+static int loop_mount(struct bdev *bdev)
+{
+	int lfd = -1, ffd = -1, ret = -1;
+	struct loop_opts opts;
 	char loname[100];
 
 	if (strcmp(bdev->type, "loop"))
 		return -22;
 	if (!bdev->src || !bdev->dest)
 		return -22;
-	if (find_free_loopdev(&lfd, loname) < 0)
+	if (loop_parse_opts(bdev->loopopts, &opts) < 0)
 		return -22;
 
-	ffd = open(bdev->src + 5, O_RDWR);
+	ffd = open(bdev->src + 5, O_RDWR | O_CLOEXEC);
 	if (ffd < 0) {
 		SYSERROR("Error opening backing file %s", bdev->src);
 		goto out;
 	}
 
-	if (ioctl(lfd, LOOP_SET_FD, ffd) < 0) {
-		SYSERROR("Error attaching backing file to loop dev");
-		goto out;
-	}
-	memset(&lo, 0, sizeof(lo));
-	lo.lo_flags = LO_FLAGS_AUTOCLEAR;
-	if (ioctl(lfd, LOOP_SET_STATUS64, &lo) < 0) {
-		SYSERROR("Error setting autoclear on loop dev");
+	lfd = loop_attach(ffd, &opts, loname);
+	if (lfd < 0)
 		goto out;
-	}
 
-	ret = mount_unknown_fs(loname, bdev->dest, bdev->mntopts);
+	ret = mount_unknown_fs(loname, bdev->dest, bdev->mntopts,
+			       bdev->fstype);
 	if (ret < 0)
 		ERROR("Error mounting %s", bdev->src);
 	else
@@ -1626,7 +2193,8 @@ out:
 	if (ffd > -1)
 		close(ffd);
 	if (ret < 0) {
-		close(lfd);
+		if (lfd > -1)
+			close(lfd);
 		bdev->lofd = -1;
 	}
 	return ret;
@@ -1741,6 +2309,8 @@ static int loop_clonepaths(struct bdev *orig, struct bdev *new, const char *oldn
 		if (!newsize)
 			size = DEFAULT_FS_SIZE;
 	}
+	if (!(new->fstype = strdup(fstype)))
+		return -1;
 	return do_loop_create(srcdev, size, fstype);
 }
 
@@ -1781,6 +2351,8 @@ static int loop_create(struct bdev *bdev, const char *dest, const char *n,
 	if (!fstype)
 		fstype = DEFAULT_FSTYPE;
 
+	if (!(bdev->fstype = strdup(fstype)))
+		return -1;
 	if (!(bdev->dest = strdup(dest)))
 		return -1;
 
@@ -1808,117 +2380,650 @@ static const struct bdev_ops loop_ops = {
 };
 
 //
-// overlayfs ops
+// image pool: a base rootfs registered once under $lxcpath/.pool/$image,
+// kept mounted read-only, and shared as the lower layer of the overlayfs
+// rootfs of every container instantiated from it.  The pool directory
+// holds 'rootfs' (the mount), 'source' (the bdev it is mounted from) and
+// 'users' (the overlay upper dirs currently layered on top of it).
 //
 
-static int overlayfs_detect(const char *path)
-{
-	if (strncmp(path, "overlayfs:", 10) == 0)
-		return 1; // take their word for it
-	return 0;
-}
+#define POOL_DIR ".pool"
 
-//
-// XXXXXXX plain directory bind mount ops
-//
-static int overlayfs_mount(struct bdev *bdev)
+static int pool_path(char *buf, size_t size, const char *lxcpath,
+		     const char *image, const char *file)
 {
-	char *options, *dup, *lower, *upper;
-	int len;
-	unsigned long mntflags;
-	char *mntdata;
 	int ret;
 
-	if (strcmp(bdev->type, "overlayfs"))
-		return -22;
-	if (!bdev->src || !bdev->dest)
-		return -22;
-
-	//  separately mount it first
-	//  mount -t overlayfs -oupperdir=${upper},lowerdir=${lower} lower dest
-	dup = alloca(strlen(bdev->src)+1);
-	strcpy(dup, bdev->src);
-	if (!(lower = index(dup, ':')))
-		return -22;
-	if (!(upper = index(++lower, ':')))
-		return -22;
-	*upper = '\0';
-	upper++;
-
-	if (parse_mntopts(bdev->mntopts, &mntflags, &mntdata) < 0) {
-		free(mntdata);
-		return -22;
-	}
-
-	// TODO We should check whether bdev->src is a blockdev, and if so
-	// but for now, only support overlays of a basic directory
-
-	if (mntdata) {
-		len = strlen(lower) + strlen(upper) + strlen("upperdir=,lowerdir=,") + strlen(mntdata) + 1;
-		options = alloca(len);
-		ret = snprintf(options, len, "upperdir=%s,lowerdir=%s,%s", upper, lower, mntdata);
-	}
-	else {
-		len = strlen(lower) + strlen(upper) + strlen("upperdir=,lowerdir=") + 1;
-		options = alloca(len);
-		ret = snprintf(options, len, "upperdir=%s,lowerdir=%s", upper, lower);
-	}
-	if (ret < 0 || ret >= len) {
-		free(mntdata);
+	if (!image || !*image || *image == '.' || index(image, '/')) {
+		ERROR("invalid image name '%s'", image ? image : "(null)");
 		return -1;
 	}
 
-	ret = mount(lower, bdev->dest, "overlayfs", MS_MGC_VAL | mntflags, options);
-	if (ret < 0)
-		SYSERROR("overlayfs: error mounting %s onto %s options %s",
-			lower, bdev->dest, options);
+	if (file)
+		ret = snprintf(buf, size, "%s/" POOL_DIR "/%s/%s", lxcpath, image, file);
 	else
-		INFO("overlayfs: mounted %s onto %s options %s",
-			lower, bdev->dest, options);
-	return ret;
+		ret = snprintf(buf, size, "%s/" POOL_DIR "/%s", lxcpath, image);
+	if (ret < 0 || ret >= size)
+		return -1;
+	return 0;
 }
 
-static int overlayfs_umount(struct bdev *bdev)
+/* lock a pool entry against concurrent registration and instantiation */
+static int pool_lock(const char *pooldir)
 {
-	if (strcmp(bdev->type, "overlayfs"))
-		return -22;
-	if (!bdev->src || !bdev->dest)
-		return -22;
-	return umount(bdev->dest);
-}
-
-struct rsync_data_char {
-	char *src;
-	char *dest;
-};
+	char path[MAXPATHLEN];
+	int fd, ret;
 
-static int rsync_delta(struct rsync_data_char *data)
-{
-	if (setgid(0) < 0) {
-		ERROR("Failed to setgid to 0");
+	ret = snprintf(path, MAXPATHLEN, "%s/lock", pooldir);
+	if (ret < 0 || ret >= MAXPATHLEN)
 		return -1;
-	}
-	if (setgroups(0, NULL) < 0)
-		WARN("Failed to clear groups");
-	if (setuid(0) < 0) {
-		ERROR("Failed to setuid to 0");
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		SYSERROR("failed to open %s", path);
 		return -1;
 	}
-	if (do_rsync(data->src, data->dest) < 0) {
-		ERROR("rsyncing %s to %s", data->src, data->dest);
+	if (flock(fd, LOCK_EX) < 0) {
+		SYSERROR("failed to lock %s", path);
+		close(fd);
 		return -1;
 	}
-
-	return 0;
+	return fd;
 }
 
-static int rsync_delta_wrapper(void *data)
+static char *pool_read_file(const char *pooldir, const char *file)
 {
-	struct rsync_data_char *arg = data;
-	return rsync_delta(arg);
+	char path[MAXPATHLEN], *buf = NULL;
+	size_t len = 0;
+	FILE *f;
+	int ret;
+
+	ret = snprintf(path, MAXPATHLEN, "%s/%s", pooldir, file);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return NULL;
+	f = fopen(path, "r");
+	if (!f)
+		return NULL;
+	if (getline(&buf, &len, f) < 0) {
+		free(buf);
+		buf = NULL;
+	} else {
+		buf[strcspn(buf, "\n")] = '\0';
+	}
+	fclose(f);
+	return buf;
 }
 
-static int overlayfs_clonepaths(struct bdev *orig, struct bdev *new, const char *oldname,
+/* whether path is the mount point of a mount in our mount namespace */
+static bool pool_is_mounted(const char *path)
+{
+	char buf[LINELEN], *p, *p2;
+	bool found = false;
+	FILE *f;
+	int i;
+
+	f = fopen("/proc/self/mountinfo", "r");
+	if (!f)
+		return false;
+	while (!found && fgets(buf, LINELEN, f)) {
+		for (p = buf, i = 0; p && i < 4; i++)
+			p = strchr(p + 1, ' ');
+		if (!p)
+			continue;
+		p2 = strchr(p + 1, ' ');
+		if (!p2)
+			continue;
+		*p2 = '\0';
+		found = strcmp(p + 1, path) == 0;
+	}
+	fclose(f);
+	return found;
+}
+
+/*
+ * Add or drop an overlay upper dir in the pool's users file.  Returns the
+ * resulting number of users.
+ */
+static int pool_users_update(const char *pooldir, const char *upper, bool add)
+{
+	char path[MAXPATHLEN], tmp[MAXPATHLEN], *line = NULL;
+	size_t len = 0;
+	FILE *in, *out;
+	int ret, n = 0;
+
+	ret = snprintf(path, MAXPATHLEN, "%s/users", pooldir);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -1;
+	ret = snprintf(tmp, MAXPATHLEN, "%s/users.new", pooldir);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -1;
+
+	out = fopen(tmp, "w");
+	if (!out) {
+		SYSERROR("failed to open %s", tmp);
+		return -1;
+	}
+	in = fopen(path, "r");
+	if (in) {
+		while (getline(&line, &len, in) >= 0) {
+			line[strcspn(line, "\n")] = '\0';
+			if (!*line || !strcmp(line, upper))
+				continue;
+			fprintf(out, "%s\n", line);
+			n++;
+		}
+		free(line);
+		fclose(in);
+	}
+	if (add) {
+		fprintf(out, "%s\n", upper);
+		n++;
+	}
+	if (fclose(out) != 0 || rename(tmp, path) < 0) {
+		SYSERROR("failed to update %s", path);
+		unlink(tmp);
+		return -1;
+	}
+	return n;
+}
+
+static int pool_count_users(const char *pooldir)
+{
+	char path[MAXPATHLEN], *line = NULL;
+	size_t len = 0;
+	FILE *f;
+	int ret, n = 0;
+
+	ret = snprintf(path, MAXPATHLEN, "%s/users", pooldir);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -1;
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	while (getline(&line, &len, f) >= 0)
+		if (*line != '\n')
+			n++;
+	free(line);
+	fclose(f);
+	return n;
+}
+
+/*
+ * Mount the pool's source read-only on its rootfs directory, in the
+ * current mount namespace.
+ */
+static int pool_mount(const char *pooldir)
+{
+	char rootfs[MAXPATHLEN], *source;
+	struct bdev *bdev;
+	int ret;
+
+	ret = snprintf(rootfs, MAXPATHLEN, "%s/rootfs", pooldir);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -1;
+
+	source = pool_read_file(pooldir, "source");
+	if (!source) {
+		ERROR("no source registered in %s", pooldir);
+		return -1;
+	}
+
+	bdev = bdev_init(source, rootfs, NULL);
+	if (!bdev) {
+		ERROR("failed to detect backing store type of %s", source);
+		free(source);
+		return -1;
+	}
+
+	ret = bdev->ops->mount(bdev);
+	if (ret < 0) {
+		ERROR("failed to mount pool image %s", source);
+		goto out;
+	}
+	/* the loop device is autocleared once the fs is unmounted */
+	if (strcmp(bdev->type, "loop") == 0 && bdev->lofd >= 0)
+		close(bdev->lofd);
+
+	ret = mount(NULL, rootfs, NULL, MS_REMOUNT | MS_BIND | MS_RDONLY, NULL);
+	if (ret < 0) {
+		SYSERROR("failed to make %s read-only", rootfs);
+		umount2(rootfs, MNT_DETACH);
+		goto out;
+	}
+	INFO("pool image %s mounted read-only on %s", source, rootfs);
+
+out:
+	bdev_put(bdev);
+	free(source);
+	return ret;
+}
+
+static int pool_warm_cb(const char *fpath, const struct stat *sb,
+			int typeflag, struct FTW *ftwbuf)
+{
+	int fd;
+
+	if (typeflag != FTW_F || !S_ISREG(sb->st_mode) || !sb->st_size)
+		return 0;
+	fd = open(fpath, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	readahead(fd, 0, sb->st_size);
+	close(fd);
+	return 0;
+}
+
+/*
+ * If lower is the rootfs of a pool entry, return the pool directory in
+ * buf.  The pool entry is recognized by its 'source' file.
+ */
+static bool pool_of_lower(const char *lower, char *buf, size_t size)
+{
+	char path[MAXPATHLEN];
+	size_t len = strlen(lower);
+	int ret;
+
+	if (len < 8 || strcmp(lower + len - 7, "/rootfs") || len - 7 >= size)
+		return false;
+	memcpy(buf, lower, len - 7);
+	buf[len - 7] = '\0';
+	if (!strstr(buf, "/" POOL_DIR "/"))
+		return false;
+	ret = snprintf(path, MAXPATHLEN, "%s/source", buf);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return false;
+	return access(path, F_OK) == 0;
+}
+
+/* register or drop an overlay upper dir layered on a pool rootfs */
+static void pool_hold(const char *lower, const char *upper, bool hold)
+{
+	char pooldir[MAXPATHLEN];
+	int fd;
+
+	if (!pool_of_lower(lower, pooldir, sizeof(pooldir)))
+		return;
+	fd = pool_lock(pooldir);
+	if (fd < 0)
+		return;
+	if (pool_users_update(pooldir, upper, hold) < 0)
+		WARN("failed to update the users of %s", pooldir);
+	close(fd);
+}
+
+/* pool_hold() for a complete overlayfs clone, bdev->src is overlayfs:lower:upper */
+static void pool_hold_clone(struct bdev *bdev)
+{
+	char *lower, *upper;
+
+	if (strcmp(bdev->type, "overlayfs") || !bdev->src ||
+	    strncmp(bdev->src, "overlayfs:", 10) != 0)
+		return;
+	upper = index(bdev->src + 10, ':');
+	if (!upper)
+		return;
+	lower = strndupa(bdev->src + 10, upper - bdev->src - 10);
+	pool_hold(lower, upper + 1, true);
+}
+
+/*
+ * Copy src to the directory copy, mounting src on the (still empty) pool
+ * rootfs in a private mount namespace.
+ */
+static int pool_copy(const char *pooldir, const char *src, char *copy)
+{
+	char rootfs[MAXPATHLEN];
+	struct bdev *bdev;
+	pid_t pid;
+	int ret;
+
+	ret = snprintf(rootfs, MAXPATHLEN, "%s/rootfs", pooldir);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -1;
+	if (mkdir_p(copy, 0755) < 0) {
+		ERROR("failed to create %s", copy);
+		return -1;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		SYSERROR("fork");
+		return -1;
+	}
+	if (pid > 0) {
+		ret = wait_for_pid(pid);
+		if (ret < 0) {
+			ERROR("failed to copy %s to %s", src, copy);
+			lxc_rmdir_onedev(copy);
+		}
+		return ret;
+	}
+
+	if (unshare(CLONE_NEWNS) < 0) {
+		SYSERROR("unshare CLONE_NEWNS");
+		exit(1);
+	}
+	if (detect_shared_rootfs() && mount(NULL, "/", NULL, MS_SLAVE|MS_REC, NULL))
+		SYSERROR("Failed to make / rslave");
+	bdev = bdev_init(src, rootfs, NULL);
+	if (!bdev || bdev->ops->mount(bdev) < 0) {
+		ERROR("failed to mount %s", src);
+		exit(1);
+	}
+	exit(do_rsync(rootfs, copy) < 0 ? 1 : 0);
+}
+
+int bdev_pool_add(const char *lxcpath, const char *image, const char *src,
+		  int flags)
+{
+	char pooldir[MAXPATHLEN], path[MAXPATHLEN], copy[MAXPATHLEN], *old;
+	FILE *f;
+	int fd, ret = -1;
+
+	if (pool_path(pooldir, MAXPATHLEN, lxcpath, image, NULL) < 0 ||
+	    pool_path(path, MAXPATHLEN, lxcpath, image, "rootfs") < 0)
+		return -1;
+	if (mkdir_p(path, 0755) < 0) {
+		ERROR("failed to create %s", path);
+		return -1;
+	}
+
+	fd = pool_lock(pooldir);
+	if (fd < 0)
+		return -1;
+
+	old = pool_read_file(pooldir, "source");
+	if (old && strcmp(old, src) && !(flags & BDEV_POOL_COPY)) {
+		ERROR("image %s is already registered from %s", image, old);
+		goto out;
+	}
+	if (!old && (flags & BDEV_POOL_COPY)) {
+		if (pool_path(copy, MAXPATHLEN, lxcpath, image, "image") < 0 ||
+		    pool_copy(pooldir, src, copy) < 0)
+			goto out;
+		src = copy;
+	}
+	if (!old) {
+		if (pool_path(path, MAXPATHLEN, lxcpath, image, "source") < 0)
+			goto out;
+		f = fopen(path, "w");
+		if (!f || fprintf(f, "%s\n", src) < 0 || fclose(f) != 0) {
+			SYSERROR("failed to write %s", path);
+			goto out;
+		}
+	}
+
+	if (pool_path(path, MAXPATHLEN, lxcpath, image, "rootfs") < 0)
+		goto out;
+	if (!pool_is_mounted(path) && pool_mount(pooldir) < 0)
+		goto out;
+
+	if (flags & BDEV_POOL_WARM)
+		nftw(path, pool_warm_cb, 20, FTW_PHYS | FTW_MOUNT);
+
+	ret = 0;
+out:
+	free(old);
+	close(fd);
+	return ret;
+}
+
+int bdev_pool_remove(const char *lxcpath, const char *image)
+{
+	char pooldir[MAXPATHLEN], path[MAXPATHLEN];
+	const char *files[] = { "source", "users", "lock", NULL };
+	int fd, i, ret = -1;
+
+	if (pool_path(pooldir, MAXPATHLEN, lxcpath, image, NULL) < 0)
+		return -1;
+	fd = pool_lock(pooldir);
+	if (fd < 0)
+		return -1;
+
+	i = pool_count_users(pooldir);
+	if (i != 0) {
+		ERROR("image %s is still used by %d containers", image, i);
+		goto out;
+	}
+
+	if (pool_path(path, MAXPATHLEN, lxcpath, image, "rootfs") < 0)
+		goto out;
+	if (pool_is_mounted(path) && umount2(path, MNT_DETACH) < 0) {
+		SYSERROR("failed to unmount %s", path);
+		goto out;
+	}
+	if (rmdir(path) < 0 && errno != ENOENT) {
+		SYSERROR("failed to remove %s", path);
+		goto out;
+	}
+	/* a copy made by BDEV_POOL_COPY */
+	if (pool_path(path, MAXPATHLEN, lxcpath, image, "image") < 0)
+		goto out;
+	if (dir_exists(path) && lxc_rmdir_onedev(path) < 0) {
+		ERROR("failed to remove %s", path);
+		goto out;
+	}
+	for (i = 0; files[i]; i++) {
+		if (pool_path(path, MAXPATHLEN, lxcpath, image, files[i]) < 0)
+			goto out;
+		unlink(path);
+	}
+	if (rmdir(pooldir) < 0)
+		SYSERROR("failed to remove %s", pooldir);
+	ret = 0;
+out:
+	close(fd);
+	return ret;
+}
+
+static int pool_stat_cmp(const void *a, const void *b)
+{
+	const struct bdev_pool_stat *s1 = a, *s2 = b;
+
+	return strcmp(s1->image, s2->image);
+}
+
+int bdev_pool_stats(const char *lxcpath, struct bdev_pool_stat **stats)
+{
+	char path[MAXPATHLEN], pooldir[MAXPATHLEN];
+	struct bdev_pool_stat *s = NULL, *tmp;
+	struct dirent *direntp;
+	DIR *dir;
+	int ret, n = 0;
+
+	*stats = NULL;
+	ret = snprintf(path, MAXPATHLEN, "%s/" POOL_DIR, lxcpath);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -1;
+	dir = opendir(path);
+	if (!dir)
+		return errno == ENOENT ? 0 : -1;
+
+	while ((direntp = readdir(dir))) {
+		char *source;
+
+		if (direntp->d_name[0] == '.')
+			continue;
+		if (pool_path(pooldir, MAXPATHLEN, lxcpath, direntp->d_name, NULL) < 0)
+			continue;
+		source = pool_read_file(pooldir, "source");
+		if (!source)
+			continue;
+
+		tmp = realloc(s, (n + 1) * sizeof(*s));
+		if (!tmp) {
+			free(source);
+			bdev_pool_stats_free(s, n);
+			closedir(dir);
+			return -1;
+		}
+		s = tmp;
+		s[n].image = strdup(direntp->d_name);
+		s[n].source = source;
+		s[n].users = pool_count_users(pooldir);
+		s[n].mounted = pool_path(path, MAXPATHLEN, lxcpath,
+					 direntp->d_name, "rootfs") == 0 &&
+			       pool_is_mounted(path);
+		n++;
+	}
+	closedir(dir);
+
+	if (n)
+		qsort(s, n, sizeof(*s), pool_stat_cmp);
+	*stats = s;
+	return n;
+}
+
+void bdev_pool_stats_free(struct bdev_pool_stat *stats, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		free(stats[i].image);
+		free(stats[i].source);
+	}
+	free(stats);
+}
+
+int bdev_pool_lookup(const char *src, char *image, size_t size)
+{
+	char *dup, *lower, *upper, pooldir[MAXPATHLEN], *p;
+	int n = -1;
+
+	if (!src || strncmp(src, "overlayfs:", 10))
+		return -1;
+	dup = alloca(strlen(src) + 1);
+	strcpy(dup, src);
+	lower = dup + 10;
+	upper = index(lower, ':');
+	if (upper)
+		*upper = '\0';
+	if (!pool_of_lower(lower, pooldir, sizeof(pooldir)))
+		return -1;
+
+	p = rindex(pooldir, '/');
+	if (image && snprintf(image, size, "%s", p + 1) >= size)
+		return -1;
+	n = pool_count_users(pooldir);
+	return n;
+}
+
+//
+// overlayfs ops
+//
+
+static int overlayfs_detect(const char *path)
+{
+	if (strncmp(path, "overlayfs:", 10) == 0)
+		return 1; // take their word for it
+	return 0;
+}
+
+//
+// XXXXXXX plain directory bind mount ops
+//
+static int overlayfs_mount(struct bdev *bdev)
+{
+	char *options, *dup, *lower, *upper, pooldir[MAXPATHLEN];
+	int len;
+	unsigned long mntflags;
+	char *mntdata;
+	int ret;
+
+	if (strcmp(bdev->type, "overlayfs"))
+		return -22;
+	if (!bdev->src || !bdev->dest)
+		return -22;
+
+	//  separately mount it first
+	//  mount -t overlayfs -oupperdir=${upper},lowerdir=${lower} lower dest
+	dup = alloca(strlen(bdev->src)+1);
+	strcpy(dup, bdev->src);
+	if (!(lower = index(dup, ':')))
+		return -22;
+	if (!(upper = index(++lower, ':')))
+		return -22;
+	*upper = '\0';
+	upper++;
+
+	// a pool image is mounted on first use after a reboot
+	if (pool_of_lower(lower, pooldir, sizeof(pooldir)) &&
+	    !pool_is_mounted(lower) && pool_mount(pooldir) < 0)
+		return -1;
+
+	if (parse_mntopts(bdev->mntopts, &mntflags, &mntdata) < 0) {
+		free(mntdata);
+		return -22;
+	}
+
+	// TODO We should check whether bdev->src is a blockdev, and if so
+	// but for now, only support overlays of a basic directory
+
+	if (mntdata) {
+		len = strlen(lower) + strlen(upper) + strlen("upperdir=,lowerdir=,") + strlen(mntdata) + 1;
+		options = alloca(len);
+		ret = snprintf(options, len, "upperdir=%s,lowerdir=%s,%s", upper, lower, mntdata);
+	}
+	else {
+		len = strlen(lower) + strlen(upper) + strlen("upperdir=,lowerdir=") + 1;
+		options = alloca(len);
+		ret = snprintf(options, len, "upperdir=%s,lowerdir=%s", upper, lower);
+	}
+	if (ret < 0 || ret >= len) {
+		free(mntdata);
+		return -1;
+	}
+
+	ret = mount(lower, bdev->dest, "overlayfs", MS_MGC_VAL | mntflags, options);
+	if (ret < 0)
+		SYSERROR("overlayfs: error mounting %s onto %s options %s",
+			lower, bdev->dest, options);
+	else
+		INFO("overlayfs: mounted %s onto %s options %s",
+			lower, bdev->dest, options);
+	return ret;
+}
+
+static int overlayfs_umount(struct bdev *bdev)
+{
+	if (strcmp(bdev->type, "overlayfs"))
+		return -22;
+	if (!bdev->src || !bdev->dest)
+		return -22;
+	return umount(bdev->dest);
+}
+
+struct rsync_data_char {
+	char *src;
+	char *dest;
+};
+
+static int rsync_delta(struct rsync_data_char *data)
+{
+	if (setgid(0) < 0) {
+		ERROR("Failed to setgid to 0");
+		return -1;
+	}
+	if (setgroups(0, NULL) < 0)
+		WARN("Failed to clear groups");
+	if (setuid(0) < 0) {
+		ERROR("Failed to setuid to 0");
+		return -1;
+	}
+	if (do_rsync(data->src, data->dest) < 0) {
+		ERROR("rsyncing %s to %s", data->src, data->dest);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int rsync_delta_wrapper(void *data)
+{
+	struct rsync_data_char *arg = data;
+	return rsync_delta(arg);
+}
+
+static int overlayfs_clonepaths(struct bdev *orig, struct bdev *new, const char *oldname,
 		const char *cname, const char *oldpath, const char *lxcpath, int snap,
 		uint64_t newsize, struct lxc_conf *conf)
 {
@@ -2026,86 +3131,594 @@ static int overlayfs_clonepaths(struct bdev *orig, struct bdev *new, const char
 		free(osrc);
 		free(ndelta);
 		if (ret < 0 || ret >= len)
-			return -ENOMEM;
-	} else {
-		ERROR("overlayfs clone of %s container is not yet supported",
-			orig->type);
-		// Note, supporting this will require overlayfs_mount supporting
-		// mounting of the underlay.  No big deal, just needs to be done.
-		return -1;
+			return -ENOMEM;
+	} else {
+		ERROR("overlayfs clone of %s container is not yet supported",
+			orig->type);
+		// Note, supporting this will require overlayfs_mount supporting
+		// mounting of the underlay.  No big deal, just needs to be done.
+		return -1;
+	}
+
+	return 0;
+}
+
+static int overlayfs_destroy(struct bdev *orig)
+{
+	char *lower, *upper;
+	int ret;
+
+	if (strncmp(orig->src, "overlayfs:", 10) != 0)
+		return -22;
+	upper = index(orig->src + 10, ':');
+	if (!upper)
+		return -22;
+	lower = strndupa(orig->src + 10, upper - orig->src - 10);
+	upper++;
+	ret = lxc_rmdir_onedev(upper);
+	if (ret == 0)
+		pool_hold(lower, upper, false);
+	return ret;
+}
+
+/*
+ * to say 'lxc-create -t ubuntu -n o1 -B overlayfs' means you want
+ * $lxcpath/$lxcname/rootfs to have the created container, while all
+ * changes after starting the container are written to
+ * $lxcpath/$lxcname/delta0
+ */
+static int overlayfs_create(struct bdev *bdev, const char *dest, const char *n,
+			struct bdev_specs *specs)
+{
+	char *delta;
+	int ret, len = strlen(dest), newlen;
+
+	if (len < 8 || strcmp(dest+len-7, "/rootfs") != 0)
+		return -1;
+
+	if (!(bdev->dest = strdup(dest))) {
+		ERROR("Out of memory");
+		return -1;
+	}
+
+	delta = alloca(strlen(dest)+1);
+	strcpy(delta, dest);
+	strcpy(delta+len-6, "delta0");
+
+	if (mkdir_p(delta, 0755) < 0) {
+		ERROR("Error creating %s", delta);
+		return -1;
+	}
+
+	/* overlayfs:lower:upper */
+	newlen = (2 * len) + strlen("overlayfs:") + 2;
+	bdev->src = malloc(newlen);
+	if (!bdev->src) {
+		ERROR("Out of memory");
+		return -1;
+	}
+	ret = snprintf(bdev->src, newlen, "overlayfs:%s:%s", dest, delta);
+	if (ret < 0 || ret >= newlen)
+		return -1;
+
+	if (mkdir_p(bdev->dest, 0755) < 0) {
+		ERROR("Error creating %s", bdev->dest);
+		return -1;
+	}
+
+	return 0;
+}
+
+static const struct bdev_ops overlayfs_ops = {
+	.detect = &overlayfs_detect,
+	.mount = &overlayfs_mount,
+	.umount = &overlayfs_umount,
+	.clone_paths = &overlayfs_clonepaths,
+	.destroy = &overlayfs_destroy,
+	.create = &overlayfs_create,
+	.can_snapshot = true,
+};
+
+/*
+ * 'lxc-create -B pool --image base' instantiates the container as an
+ * overlayfs rootfs whose lower layer is the pool's mount of 'base': only
+ * the upper dir, $lxcpath/$lxcname/delta0, is created.  The result is a
+ * plain overlayfs bdev.
+ */
+static int pool_create(struct bdev *bdev, const char *dest, const char *n,
+			struct bdev_specs *specs)
+{
+	char pooldir[MAXPATHLEN], rootfs[MAXPATHLEN], *source, *delta;
+	int fd, ret, len = strlen(dest), newlen;
+
+	if (!specs || !specs->pool.image || !specs->pool.lxcpath) {
+		ERROR("pool backing store needs an image");
+		return -1;
+	}
+	if (len < 8 || strcmp(dest+len-7, "/rootfs") != 0)
+		return -1;
+
+	if (pool_path(pooldir, MAXPATHLEN, specs->pool.lxcpath,
+		      specs->pool.image, NULL) < 0 ||
+	    pool_path(rootfs, MAXPATHLEN, specs->pool.lxcpath,
+		      specs->pool.image, "rootfs") < 0)
+		return -1;
+
+	source = pool_read_file(pooldir, "source");
+	if (!source) {
+		ERROR("image %s is not in the pool", specs->pool.image);
+		return -1;
+	}
+	free(source);
+
+	fd = pool_lock(pooldir);
+	if (fd < 0)
+		return -1;
+	ret = -1;
+	if (!pool_is_mounted(rootfs) && pool_mount(pooldir) < 0)
+		goto out;
+
+	if (!(bdev->dest = strdup(dest))) {
+		ERROR("Out of memory");
+		goto out;
+	}
+
+	delta = alloca(len+1);
+	strcpy(delta, dest);
+	strcpy(delta+len-6, "delta0");
+
+	if (mkdir_p(delta, 0755) < 0 || mkdir_p(bdev->dest, 0755) < 0) {
+		ERROR("Error creating %s", delta);
+		goto out;
+	}
+
+	/* overlayfs:lower:upper */
+	newlen = strlen(rootfs) + strlen(delta) + strlen("overlayfs:") + 2;
+	bdev->src = malloc(newlen);
+	if (!bdev->src) {
+		ERROR("Out of memory");
+		goto out;
+	}
+	ret = snprintf(bdev->src, newlen, "overlayfs:%s:%s", rootfs, delta);
+	if (ret < 0 || ret >= newlen) {
+		ret = -1;
+		goto out;
+	}
+
+	ret = pool_users_update(pooldir, delta, true);
+	if (ret < 0)
+		goto out;
+	INFO("%s is user %d of pool image %s", n, ret, specs->pool.image);
+
+	bdev->ops = &overlayfs_ops;
+	bdev->type = "overlayfs";
+	ret = 0;
+out:
+	close(fd);
+	return ret;
+}
+
+static int pool_detect(const char *path)
+{
+	/* instantiated containers are overlayfs */
+	return 0;
+}
+
+static int pool_mount_op(struct bdev *bdev)
+{
+	return -22;
+}
+
+static int pool_clonepaths(struct bdev *orig, struct bdev *new, const char *oldname,
+		const char *cname, const char *oldpath, const char *lxcpath, int snap,
+		uint64_t newsize, struct lxc_conf *conf)
+{
+	ERROR("pool is only for lxc-create, snapshot clones use overlayfs");
+	return -22;
+}
+
+static const struct bdev_ops pool_ops = {
+	.detect = &pool_detect,
+	.mount = &pool_mount_op,
+	.umount = &pool_mount_op,
+	.clone_paths = &pool_clonepaths,
+	.destroy = &pool_mount_op,
+	.create = &pool_create,
+	.can_snapshot = false,
+};
+
+//
+// image ops
+//
+
+/*
+ * A read-only squashfs or erofs image of a rootfs, loop mounted, under an
+ * overlayfs upper dir: the src is 'image:$image:$upper'.  The image is
+ * $lxcpath/$lxcname/rootfs.img and the upper dir $lxcpath/$lxcname/delta0,
+ * with the overlay work dir beside it.  Clones share the image through a
+ * hard link, so destroying a container only removes its own name for it.
+ */
+#define IMAGE_FILE "rootfs.img"
+#define IMAGE_DEFAULT_FSTYPE "squashfs"
+
+static int image_detect(const char *path)
+{
+	if (strncmp(path, "image:", 6) == 0)
+		return 1;
+	return 0;
+}
+
+/* split 'image:$image:$upper' into a copy holding both */
+static char *image_split(const char *src, char **image, char **upper)
+{
+	char *dup;
+
+	if (strncmp(src, "image:", 6) != 0)
+		return NULL;
+	dup = strdup(src + 6);
+	if (!dup)
+		return NULL;
+	*upper = index(dup, ':');
+	if (!*upper) {
+		free(dup);
+		return NULL;
+	}
+	**upper = '\0';
+	(*upper)++;
+	*image = dup;
+	return dup;
+}
+
+/* the overlay work dir of upper $dir/delta0, $dir/work0 */
+static int image_workdir(const char *upper, char *buf, size_t size)
+{
+	size_t len = strlen(upper);
+	int ret;
+
+	if (len < 7 || strcmp(upper + len - 6, "delta0"))
+		return -1;
+	ret = snprintf(buf, size, "%.*swork0", (int)(len - 6), upper);
+	if (ret < 0 || ret >= size)
+		return -1;
+	return 0;
+}
+
+static int image_mkdirs(const char *upper)
+{
+	char work[MAXPATHLEN];
+
+	if (image_workdir(upper, work, sizeof(work)) < 0) {
+		ERROR("bad image upper dir %s", upper);
+		return -1;
+	}
+	if (mkdir_p(upper, 0755) < 0 || mkdir_p(work, 0755) < 0) {
+		ERROR("Error creating %s", upper);
+		return -1;
+	}
+	return 0;
+}
+
+static int image_mount(struct bdev *bdev)
+{
+	char *dup, *image, *upper, work[MAXPATHLEN], loname[100];
+	char *options = NULL, *mntdata = NULL;
+	unsigned long mntflags;
+	struct loop_opts opts;
+	int ffd, lfd, len, ret = -1;
+
+	if (strcmp(bdev->type, "image"))
+		return -22;
+	if (!bdev->src || !bdev->dest)
+		return -22;
+	if (!(dup = image_split(bdev->src, &image, &upper)))
+		return -22;
+	if (loop_parse_opts(bdev->loopopts, &opts) < 0 ||
+	    parse_mntopts(bdev->mntopts, &mntflags, &mntdata) < 0)
+		goto out;
+	if (image_mkdirs(upper) < 0 ||
+	    image_workdir(upper, work, sizeof(work)) < 0)
+		goto out;
+
+	/* the loop device is read-only since the image is opened so */
+	ffd = open(image, O_RDONLY | O_CLOEXEC);
+	if (ffd < 0) {
+		SYSERROR("Error opening image %s", image);
+		goto out;
+	}
+	lfd = loop_attach(ffd, &opts, loname);
+	close(ffd);
+	if (lfd < 0)
+		goto out;
+	ret = mount_unknown_fs(loname, bdev->dest, "ro", bdev->fstype);
+	/* autoclear releases the loop device once the image is unmounted */
+	close(lfd);
+	if (ret < 0) {
+		ERROR("Error mounting image %s", image);
+		goto out;
+	}
+
+	/* the overlay goes on top of the image, which is its lower dir */
+	len = strlen(bdev->dest) + strlen(upper) + strlen(work) +
+	      (mntdata ? strlen(mntdata) : 0) +
+	      strlen("lowerdir=,upperdir=,workdir=,") + 1;
+	options = malloc(len);
+	if (!options)
+		goto out_umount;
+	ret = snprintf(options, len, "lowerdir=%s,upperdir=%s,workdir=%s%s%s",
+		       bdev->dest, upper, work, mntdata ? "," : "",
+		       mntdata ? mntdata : "");
+	if (ret < 0 || ret >= len)
+		goto out_umount;
+	ret = mount("overlay", bdev->dest, "overlay", MS_MGC_VAL | mntflags, options);
+	if (ret < 0 && errno == ENODEV) {
+		/* kernels before 3.18 have overlayfs, without a work dir */
+		ret = snprintf(options, len, "lowerdir=%s,upperdir=%s%s%s",
+			       bdev->dest, upper, mntdata ? "," : "",
+			       mntdata ? mntdata : "");
+		if (ret < 0 || ret >= len)
+			goto out_umount;
+		ret = mount("overlayfs", bdev->dest, "overlayfs",
+			    MS_MGC_VAL | mntflags, options);
+	}
+	if (ret < 0) {
+		SYSERROR("image: error mounting overlay onto %s options %s",
+			 bdev->dest, options);
+		goto out_umount;
 	}
+	INFO("image: mounted %s with upper %s onto %s", image, upper, bdev->dest);
+	ret = 0;
+	goto out;
 
-	return 0;
+out_umount:
+	ret = -1;
+	umount2(bdev->dest, MNT_DETACH);
+out:
+	free(options);
+	free(mntdata);
+	free(dup);
+	return ret;
 }
 
-static int overlayfs_destroy(struct bdev *orig)
+static int image_umount(struct bdev *bdev)
 {
-	char *upper;
-
-	if (strncmp(orig->src, "overlayfs:", 10) != 0)
+	if (strcmp(bdev->type, "image"))
 		return -22;
-	upper = index(orig->src + 10, ':');
-	if (!upper)
+	if (!bdev->src || !bdev->dest)
 		return -22;
-	upper++;
-	return lxc_rmdir_onedev(upper);
+	/* the overlay, then the image */
+	if (umount(bdev->dest) < 0)
+		return -1;
+	return umount(bdev->dest);
 }
 
-/*
- * to say 'lxc-create -t ubuntu -n o1 -B overlayfs' means you want
- * $lxcpath/$lxcname/rootfs to have the created container, while all
- * changes after starting the container are written to
- * $lxcpath/$lxcname/delta0
- */
-static int overlayfs_create(struct bdev *bdev, const char *dest, const char *n,
-			struct bdev_specs *specs)
+/* build an image of type fstype at image from the directory rootfs */
+static int image_build(const char *image, const char *rootfs,
+		       const char *fstype)
 {
-	char *delta;
-	int ret, len = strlen(dest), newlen;
+	pid_t pid;
+	int fd;
 
-	if (len < 8 || strcmp(dest+len-7, "/rootfs") != 0)
+	if ((pid = fork()) < 0) {
+		SYSERROR("failed fork");
 		return -1;
+	}
+	if (pid > 0)
+		return wait_for_pid(pid);
 
-	if (!(bdev->dest = strdup(dest))) {
-		ERROR("Out of memory");
-		return -1;
+	fd = open("/dev/null", O_RDWR);
+	if (fd >= 0) {
+		dup2(fd, 0);
+		dup2(fd, 1);
 	}
+	if (strcmp(fstype, "squashfs") == 0)
+		execlp("mksquashfs", "mksquashfs", rootfs, image, "-noappend",
+		       (char *)NULL);
+	else
+		execlp("mkfs.erofs", "mkfs.erofs", image, rootfs, (char *)NULL);
+	SYSERROR("failed to exec the %s image builder", fstype);
+	exit(1);
+}
 
-	delta = alloca(strlen(dest)+1);
-	strcpy(delta, dest);
-	strcpy(delta+len-6, "delta0");
+/* build the image from the rootfs of orig, mounted in a private mntns */
+static int image_build_from(struct bdev *orig, const char *image,
+			    const char *fstype)
+{
+	pid_t pid;
 
-	if (mkdir_p(delta, 0755) < 0) {
-		ERROR("Error creating %s", delta);
+	if ((pid = fork()) < 0) {
+		SYSERROR("failed fork");
 		return -1;
 	}
+	if (pid > 0)
+		return wait_for_pid(pid);
 
-	/* overlayfs:lower:upper */
-	newlen = (2 * len) + strlen("overlayfs:") + 2;
-	bdev->src = malloc(newlen);
-	if (!bdev->src) {
-		ERROR("Out of memory");
+	if (unshare(CLONE_NEWNS) < 0) {
+		SYSERROR("unshare CLONE_NEWNS");
+		exit(1);
+	}
+	if (detect_shared_rootfs() &&
+	    mount(NULL, "/", NULL, MS_SLAVE|MS_REC, NULL) < 0)
+		SYSERROR("Failed to make / rslave");
+	if (orig->ops->mount(orig) < 0) {
+		ERROR("failed mounting %s onto %s", orig->src, orig->dest);
+		exit(1);
+	}
+	exit(image_build(image, orig->dest, fstype) == 0 ? 0 : 1);
+}
+
+static bool image_valid_fstype(const char *fstype)
+{
+	if (strcmp(fstype, "squashfs") && strcmp(fstype, "erofs")) {
+		ERROR("image filesystem type must be squashfs or erofs, not %s",
+		      fstype);
+		return false;
+	}
+	return true;
+}
+
+/* $lxcpath/$name/{rootfs.img,delta0} for the rootfs dest $lxcpath/$name/rootfs */
+static char *image_new_src(const char *dest)
+{
+	size_t len = strlen(dest);
+	char *src;
+	int ret;
+
+	if (len < 8 || strcmp(dest + len - 7, "/rootfs"))
+		return NULL;
+	len = 2 * len + strlen("image:" IMAGE_FILE ":delta0") + 1;
+	src = malloc(len);
+	if (!src)
+		return NULL;
+	ret = snprintf(src, len, "image:%.*s" IMAGE_FILE ":%.*sdelta0",
+		       (int)strlen(dest) - 6, dest, (int)strlen(dest) - 6, dest);
+	if (ret < 0 || ret >= len) {
+		free(src);
+		return NULL;
+	}
+	return src;
+}
+
+/*
+ * A clone of an image container shares the image and gets a copy of the
+ * upper dir; the image of a clone of any other container is built from
+ * its rootfs.  The image being read-only, both kinds of clone are full
+ * copies.
+ */
+static int image_clonepaths(struct bdev *orig, struct bdev *new, const char *oldname,
+		const char *cname, const char *oldpath, const char *lxcpath, int snap,
+		uint64_t newsize, struct lxc_conf *conf)
+{
+	char *dup = NULL, *image, *upper, *odup = NULL, *oimage, *oupper;
+	bool made = false;
+	int ret = -1;
+
+	if (!orig->src || !orig->dest)
+		return -1;
+	if (am_unpriv()) {
+		ERROR("image containers can only be cloned by root");
 		return -1;
 	}
-	ret = snprintf(bdev->src, newlen, "overlayfs:%s:%s", dest, delta);
-	if (ret < 0 || ret >= newlen)
+
+	new->dest = dir_new_path(orig->dest, oldname, cname, oldpath, lxcpath);
+	if (!new->dest || mkdir_p(new->dest, 0755) < 0)
 		return -1;
+	new->src = image_new_src(new->dest);
+	if (!new->src || !(dup = image_split(new->src, &image, &upper)))
+		goto out;
+	if (image_mkdirs(upper) < 0)
+		goto out;
 
-	if (mkdir_p(bdev->dest, 0755) < 0) {
-		ERROR("Error creating %s", bdev->dest);
+	if (strcmp(orig->type, "image") == 0) {
+		struct rsync_data_char rdata;
+
+		if (!(odup = image_split(orig->src, &oimage, &oupper)))
+			goto out;
+		if (link(oimage, image) < 0) {
+			SYSERROR("failed to link %s to %s", image, oimage);
+			goto out;
+		}
+		made = true;
+		rdata.src = oupper;
+		rdata.dest = upper;
+		if (rsync_delta(&rdata) < 0) {
+			ERROR("copying image upper dir %s", oupper);
+			goto out;
+		}
+		if (orig->fstype && !(new->fstype = strdup(orig->fstype)))
+			goto out;
+	} else {
+		const char *fstype = IMAGE_DEFAULT_FSTYPE;
+
+		made = true;
+		if (image_build_from(orig, image, fstype) < 0) {
+			ERROR("failed to build image %s from %s", image, orig->src);
+			goto out;
+		}
+		if (!(new->fstype = strdup(fstype)))
+			goto out;
+	}
+	ret = 0;
+out:
+	/*
+	 * the caller knows nothing of the storage of a failed clone: drop
+	 * its link to the image, or the half built image, here
+	 */
+	if (ret < 0 && made && unlink(image) < 0 && errno != ENOENT)
+		SYSERROR("failed to remove %s", image);
+	free(dup);
+	free(odup);
+	return ret;
+}
+
+static int image_destroy(struct bdev *orig)
+{
+	char *dup, *image, *upper, work[MAXPATHLEN];
+	int ret = 0;
+
+	if (!(dup = image_split(orig->src, &image, &upper)))
+		return -22;
+	if (unlink(image) < 0 && errno != ENOENT) {
+		SYSERROR("failed to remove %s", image);
+		ret = -1;
+	}
+	if (lxc_rmdir_onedev(upper) < 0)
+		ret = -1;
+	if (image_workdir(upper, work, sizeof(work)) == 0 &&
+	    lxc_rmdir_onedev(work) < 0)
+		ret = -1;
+	free(dup);
+	return ret;
+}
+
+/*
+ * 'lxc-create -B image --dir $rootfs [--fstype erofs]' builds the image
+ * from the directory $rootfs.
+ */
+static int image_create(struct bdev *bdev, const char *dest, const char *n,
+			struct bdev_specs *specs)
+{
+	const char *fstype = IMAGE_DEFAULT_FSTYPE;
+	char *dup = NULL, *image, *upper;
+	int ret = -1;
+
+	if (am_unpriv()) {
+		ERROR("image containers can only be created by root");
 		return -1;
 	}
+	if (!specs || !specs->dir) {
+		ERROR("image backing store needs the rootfs to build it from");
+		return -1;
+	}
+	if (specs->fstype)
+		fstype = specs->fstype;
+	if (!image_valid_fstype(fstype))
+		return -1;
 
-	return 0;
+	bdev->src = image_new_src(dest);
+	if (!bdev->src || !(dup = image_split(bdev->src, &image, &upper)))
+		goto out;
+	if (!(bdev->dest = strdup(dest)) || !(bdev->fstype = strdup(fstype)))
+		goto out;
+	if (mkdir_p(bdev->dest, 0755) < 0 || image_mkdirs(upper) < 0)
+		goto out;
+	if (image_build(image, specs->dir, fstype) < 0) {
+		ERROR("failed to build %s image %s from %s", fstype, image,
+		      specs->dir);
+		goto out;
+	}
+	ret = 0;
+out:
+	free(dup);
+	return ret;
 }
 
-static const struct bdev_ops overlayfs_ops = {
-	.detect = &overlayfs_detect,
-	.mount = &overlayfs_mount,
-	.umount = &overlayfs_umount,
-	.clone_paths = &overlayfs_clonepaths,
-	.destroy = &overlayfs_destroy,
-	.create = &overlayfs_create,
+static const struct bdev_ops image_ops = {
+	.detect = &image_detect,
+	.mount = &image_mount,
+	.umount = &image_umount,
+	.clone_paths = &image_clonepaths,
+	.destroy = &image_destroy,
+	.create = &image_create,
 	.can_snapshot = true,
 };
 
@@ -2395,6 +4008,8 @@ static const struct bdev_type bdevs[] = {
 	{.name = "aufs", .ops = &aufs_ops,},
 	{.name = "overlayfs", .ops = &overlayfs_ops,},
 	{.name = "loop", .ops = &loop_ops,},
+	{.name = "pool", .ops = &pool_ops,},
+	{.name = "image", .ops = &image_ops,},
 };
 
 static const size_t numbdevs = sizeof(bdevs) / sizeof(struct bdev_type);
@@ -2403,6 +4018,8 @@ void bdev_put(struct bdev *bdev)
 {
 	if (bdev->mntopts)
 		free(bdev->mntopts);
+	free(bdev->loopopts);
+	free(bdev->fstype);
 	if (bdev->src)
 		free(bdev->src);
 	if (bdev->dest)
@@ -2410,6 +4027,67 @@ void bdev_put(struct bdev *bdev)
 	free(bdev);
 }
 
+/* add up the blocks used under the directory dfd, which this closes */
+static void dir_usage(int dfd, dev_t dev, uint64_t *total)
+{
+	struct dirent *direntp;
+	struct stat sb;
+	DIR *dir;
+
+	dir = fdopendir(dfd);
+	if (!dir) {
+		close(dfd);
+		return;
+	}
+	while ((direntp = readdir(dir))) {
+		int fd;
+
+		if (!strcmp(direntp->d_name, ".") || !strcmp(direntp->d_name, ".."))
+			continue;
+		if (fstatat(dfd, direntp->d_name, &sb, AT_SYMLINK_NOFOLLOW) < 0 ||
+		    sb.st_dev != dev)
+			continue;
+		*total += (uint64_t)sb.st_blocks * 512;
+		if (!S_ISDIR(sb.st_mode))
+			continue;
+		fd = openat(dfd, direntp->d_name,
+			    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (fd >= 0)
+			dir_usage(fd, dev, total);
+	}
+	closedir(dir);
+}
+
+int bdev_disk_usage(struct bdev *bdev, uint64_t *size)
+{
+	const char *path = bdev->src;
+	struct stat sb;
+	int fd;
+
+	if (strcmp(bdev->type, "lvm") == 0)
+		return blk_getsize(bdev, size);
+	if (strcmp(bdev->type, "loop") == 0)
+		path = bdev->src + 5;
+	else if (strcmp(bdev->type, "overlayfs") == 0 ||
+		 strcmp(bdev->type, "aufs") == 0)
+		path = strrchr(bdev->src, ':') + 1;
+	else if (strncmp(path, "dir:", 4) == 0)
+		path += 4;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &sb) < 0) {
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	*size = (uint64_t)sb.st_blocks * 512;
+	if (S_ISDIR(sb.st_mode))
+		dir_usage(fd, sb.st_dev, size);
+	else
+		close(fd);
+	return 0;
+}
+
 struct bdev *bdev_get(const char *type)
 {
 	int i;
@@ -2430,26 +4108,137 @@ struct bdev *bdev_get(const char *type)
 	return bdev;
 }
 
-struct bdev *bdev_init(const char *src, const char *dst, const char *mntopts)
+#ifndef ZFS_SUPER_MAGIC
+#define ZFS_SUPER_MAGIC 0x2fc12fc1
+#endif
+#ifndef BTRFS_SUPER_MAGIC
+#define BTRFS_SUPER_MAGIC 0x9123683e
+#endif
+
+static const struct bdev_type *bdev_type_by_name(const char *name, size_t len)
 {
 	int i;
-	struct bdev *bdev;
 
-	for (i=0; i<numbdevs; i++) {
-		int r;
-		r = bdevs[i].ops->detect(src);
-		if (r)
+	for (i = 0; i < numbdevs; i++)
+		if (strlen(bdevs[i].name) == len &&
+		    strncmp(bdevs[i].name, name, len) == 0)
+			return &bdevs[i];
+	return NULL;
+}
+
+/*
+ * The results of the probes of bdev_detect, by path.  A result holds as
+ * long as the path is the same inode, which it is not any more if
+ * another filesystem was mounted on it.
+ */
+#define BDEV_CACHE_SIZE 16
+
+static struct bdev_cache_entry {
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	const struct bdev_type *type;
+} bdev_cache[BDEV_CACHE_SIZE];
+static int bdev_cache_next;
+static pthread_mutex_t bdev_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool bdev_cache_get(const char *path, struct stat *st,
+			   const struct bdev_type **type)
+{
+	bool found = false;
+	int i;
+
+	pthread_mutex_lock(&bdev_cache_lock);
+	for (i = 0; i < BDEV_CACHE_SIZE; i++) {
+		struct bdev_cache_entry *e = &bdev_cache[i];
+
+		if (e->path && strcmp(e->path, path) == 0 &&
+		    e->dev == st->st_dev && e->ino == st->st_ino) {
+			*type = e->type;
+			found = true;
 			break;
+		}
 	}
+	pthread_mutex_unlock(&bdev_cache_lock);
+	return found;
+}
 
-	if (i == numbdevs)
+static void bdev_cache_put(const char *path, struct stat *st,
+			   const struct bdev_type *type)
+{
+	struct bdev_cache_entry *e;
+	char *copy = strdup(path);
+
+	if (!copy)
+		return;
+	pthread_mutex_lock(&bdev_cache_lock);
+	e = &bdev_cache[bdev_cache_next];
+	bdev_cache_next = (bdev_cache_next + 1) % BDEV_CACHE_SIZE;
+	free(e->path);
+	e->path = copy;
+	e->dev = st->st_dev;
+	e->ino = st->st_ino;
+	e->type = type;
+	pthread_mutex_unlock(&bdev_cache_lock);
+}
+
+/*
+ * Find the bdev type of src.  Rather than asking each type in turn, which
+ * for zfs means running 'zfs list', src is classified by its prefix, then
+ * by stat and statfs, so that only a directory on a zfs filesystem is
+ * looked up with zfs, and only a block device with lvm.
+ */
+static const struct bdev_type *bdev_detect(const char *src)
+{
+	const struct bdev_type *type = NULL;
+	const char *colon;
+	struct statfs sfs;
+	struct stat st;
+
+	/* 'dir:', 'lvm:', 'loop:', 'overlayfs:', 'aufs:' and 'image:' */
+	colon = strchr(src, ':');
+	if (colon) {
+		type = bdev_type_by_name(src, colon - src);
+		if (type && strcmp(type->name, "zfs") != 0 &&
+		    type->ops->detect(src))
+			return type;
+		type = NULL;
+	}
+
+	if (stat(src, &st) < 0)
 		return NULL;
+	if (bdev_cache_get(src, &st, &type))
+		return type;
+
+	if (S_ISBLK(st.st_mode)) {
+		if (lvm_detect(src))
+			type = bdev_type_by_name("lvm", 3);
+	} else if (S_ISDIR(st.st_mode)) {
+		type = bdev_type_by_name("dir", 3);
+		if (statfs(src, &sfs) == 0) {
+			if (sfs.f_type == ZFS_SUPER_MAGIC && zfs_detect(src))
+				type = bdev_type_by_name("zfs", 3);
+			else if (sfs.f_type == BTRFS_SUPER_MAGIC && btrfs_detect(src))
+				type = bdev_type_by_name("btrfs", 5);
+		}
+	}
+
+	DEBUG("detected %s as %s", src, type ? type->name : "no bdev");
+	bdev_cache_put(src, &st, type);
+	return type;
+}
+
+static struct bdev *bdev_new(const struct bdev_type *type, const char *src,
+			     const char *dst, const char *mntopts)
+{
+	struct bdev *bdev;
+
 	bdev = malloc(sizeof(struct bdev));
 	if (!bdev)
 		return NULL;
 	memset(bdev, 0, sizeof(struct bdev));
-	bdev->ops = bdevs[i].ops;
-	bdev->type = bdevs[i].name;
+	bdev->ops = type->ops;
+	bdev->type = type->name;
 	if (mntopts)
 		bdev->mntopts = strdup(mntopts);
 	if (src)
@@ -2460,15 +4249,63 @@ struct bdev *bdev_init(const char *src, const char *dst, const char *mntopts)
 	return bdev;
 }
 
+struct bdev *bdev_init(const char *src, const char *dst, const char *mntopts)
+{
+	const struct bdev_type *type;
+
+	if (!src)
+		return NULL;
+	type = bdev_detect(src);
+	if (!type)
+		return NULL;
+	return bdev_new(type, src, dst, mntopts);
+}
+
+struct bdev *bdev_init_rootfs(const char *src, const char *dst,
+			      const char *mntopts, char **backend)
+{
+	const struct bdev_type *type = NULL;
+
+	if (!src)
+		return NULL;
+
+	/*
+	 * Only check that the recorded type still fits; for zfs, whose
+	 * check runs 'zfs list', that a dataset is mounted on src, which
+	 * is found in mountinfo.
+	 */
+	if (*backend)
+		type = bdev_type_by_name(*backend, strlen(*backend));
+	if (type && !(strcmp(type->name, "zfs") == 0 ? zfs_is_mounted(src) :
+		      type->ops->detect(src))) {
+		INFO("%s is not %s any more", src, type->name);
+		type = NULL;
+	}
+
+	if (!type) {
+		type = bdev_detect(src);
+		if (!type)
+			return NULL;
+		free(*backend);
+		*backend = strdup(type->name);
+	}
+	return bdev_new(type, src, dst, mntopts);
+}
+
 struct rsync_data {
 	struct bdev *orig;
 	struct bdev *new;
+	int flags;
+	const char *lxcpath;
 };
 
 static int rsync_rootfs(struct rsync_data *data)
 {
 	struct bdev *orig = data->orig,
 		    *new = data->new;
+	/* linked between in place, bind mounts can't be linked across */
+	bool dedup = (data->flags & LXC_CLONE_DEDUP) &&
+		     strcmp(orig->type, "dir") == 0 && strcmp(new->type, "dir") == 0;
 
 	if (unshare(CLONE_NEWNS) < 0) {
 		SYSERROR("unshare CLONE_NEWNS");
@@ -2482,11 +4319,11 @@ static int rsync_rootfs(struct rsync_data *data)
 	}
 
 	// If not a snapshot, copy the fs.
-	if (orig->ops->mount(orig) < 0) {
+	if (!dedup && orig->ops->mount(orig) < 0) {
 		ERROR("failed mounting %s onto %s", orig->src, orig->dest);
 		return -1;
 	}
-	if (new->ops->mount(new) < 0) {
+	if (!dedup && new->ops->mount(new) < 0) {
 		ERROR("failed mounting %s onto %s", new->src, new->dest);
 		return -1;
 	}
@@ -2500,6 +4337,13 @@ static int rsync_rootfs(struct rsync_data *data)
 		ERROR("Failed to setuid to 0");
 		return -1;
 	}
+	if (dedup) {
+		if (lxc_dedup_copy(orig->src, new->src, data->lxcpath, 0, NULL) < 0) {
+			ERROR("copying %s to %s", orig->src, new->src);
+			return -1;
+		}
+		return 0;
+	}
 	if (do_rsync(orig->dest, new->dest) < 0) {
 		ERROR("rsyncing %s to %s", orig->src, new->src);
 		return -1;
@@ -2580,11 +4424,13 @@ struct bdev *bdev_copy(struct lxc_container *c0, const char *cname,
 		return NULL;
 	}
 
-	orig = bdev_init(src, NULL, NULL);
+	orig = bdev_init_rootfs(src, NULL, NULL, &c0->lxc_conf->rootfs.backend);
 	if (!orig) {
 		ERROR("failed to detect blockdev type for %s", src);
 		return NULL;
 	}
+	if (c0->lxc_conf->rootfs.fstype)
+		orig->fstype = strdup(c0->lxc_conf->rootfs.fstype);
 
 	if (!orig->dest) {
 		int ret;
@@ -2640,12 +4486,16 @@ struct bdev *bdev_copy(struct lxc_container *c0, const char *cname,
 		ERROR("failed getting pathnames for cloned storage: %s", src);
 		goto err;
 	}
+	lxc_op_report_storage(new->src);
 
 	if (am_unpriv() && chown_mapped_root(new->src, c0->lxc_conf) < 0)
 		WARN("Failed to update ownership of %s", new->dest);
 
-	if (snap)
+	/* an image is built or shared by clone_paths */
+	if (snap || strcmp(new->type, "image") == 0) {
+		pool_hold_clone(new);
 		return new;
+	}
 
 	/*
 	 * https://github.com/lxc/lxc/issues/131
@@ -2670,6 +4520,22 @@ struct bdev *bdev_copy(struct lxc_container *c0, const char *cname,
 		return new;
 	}
 
+	/* a loop image of the same size is shared until written */
+	if ((flags & LXC_CLONE_DEDUP) && strcmp(orig->type, "loop") == 0 &&
+	    strcmp(new->type, "loop") == 0) {
+		if (lxc_reflink_file(orig->src + 5, new->src + 5) == 0) {
+			INFO("reflinked %s to %s", orig->src + 5, new->src + 5);
+			bdev_put(orig);
+			return new;
+		}
+		INFO("failed to reflink %s, copying it: %s", orig->src + 5,
+		     strerror(errno));
+	}
+
+	/* so that the rest of the clone reuses the user namespace */
+	if (am_unpriv() && userns_exec_prepare(c0->lxc_conf) < 0)
+		goto err;
+
 	pid = fork();
 	if (pid < 0) {
 		SYSERROR("fork");
@@ -2683,11 +4549,14 @@ struct bdev *bdev_copy(struct lxc_container *c0, const char *cname,
 			bdev_put(new);
 			return NULL;
 		}
+		pool_hold_clone(new);
 		return new;
 	}
 
 	data.orig = orig;
 	data.new = new;
+	data.flags = flags;
+	data.lxcpath = lxcpath;
 	if (am_unpriv())
 		ret = userns_exec_1(c0->lxc_conf, rsync_rootfs_wrapper, &data);
 	else
@@ -48,6 +48,10 @@ struct bdev_specs {
 		char *lv;
 		char *thinpool; // lvm thin pool to use, if any
 	} lvm;
+	struct {
+		char *image;   // image pool entry to layer the rootfs on
+		char *lxcpath; // lxcpath holding the pool
+	} pool;
 	char *dir;
 };
 
@@ -80,6 +84,10 @@ struct bdev {
 	char *src;
 	char *dest;
 	char *mntopts;
+	// lxc.rootfs.loop, for a loop device
+	char *loopopts;
+	// filesystem type of a block device, if known (lxc.rootfs.fstype)
+	char *fstype;
 	// turn the following into a union if need be
 	// lofd is the open fd for the mounted loopback file
 	int lofd;
@@ -101,6 +109,13 @@ bool bdev_is_dir(const char *path);
  * as the upper, writeable layer.
  */
 struct bdev *bdev_init(const char *src, const char *dst, const char *data);
+/*
+ * bdev_init for a container rootfs whose type was recorded in *backend
+ * (lxc.rootfs.backend) when it was created, which saves detecting it.  If
+ * *backend is unset or wrong, it is replaced by the detected type.
+ */
+struct bdev *bdev_init_rootfs(const char *src, const char *dst,
+			      const char *mntopts, char **backend);
 
 struct bdev *bdev_copy(struct lxc_container *c0, const char *cname,
 			const char *lxcpath, const char *bdevtype,
@@ -109,6 +124,61 @@ struct bdev *bdev_copy(struct lxc_container *c0, const char *cname,
 struct bdev *bdev_create(const char *dest, const char *type,
 			const char *cname, struct bdev_specs *specs);
 void bdev_put(struct bdev *bdev);
+/*
+ * Bytes of storage used by bdev itself, i.e. only by the upper layer of
+ * an overlay
+ */
+int bdev_disk_usage(struct bdev *bdev, uint64_t *size);
+/* 0 if opts is a valid lxc.rootfs.loop, -1 otherwise */
+int bdev_loop_check_opts(const char *opts);
+
+/*
+ * Create, in a single lvm run, the lvm snapshots which cloning c0 into
+ * lxcpath as each of names with LXC_CLONE_SNAPSHOT will make, so that the
+ * clones do not run lvcreate one by one.  Returns the set of snapshots
+ * created, or NULL if c0 is not on lvm or none could be made.  The set
+ * belongs to the caller: bdev_lvm_release() removes the snapshots of it
+ * which no clone used, and frees it.
+ */
+struct lvm_prepared;
+struct lvm_prepared *bdev_lvm_prepare(struct lxc_container *c0,
+		const char * const *names, int count, const char *lxcpath,
+		uint64_t newsize);
+void bdev_lvm_release(struct lvm_prepared *prepared);
+
+/*
+ * Image pool: a base rootfs registered once as $lxcpath/.pool/$image,
+ * kept mounted read-only, which 'pool' containers share as the lower
+ * layer of their overlayfs rootfs.
+ */
+#define BDEV_POOL_WARM (1 << 0) /* read the image into the page cache */
+#define BDEV_POOL_COPY (1 << 1) /* register a private copy of src */
+
+struct bdev_pool_stat {
+	char *image;
+	char *source;  // bdev the image is mounted from
+	int users;     // containers layered on it
+	bool mounted;
+};
+
+/*
+ * Register src (any bdev src, i.e. a directory or 'loop:/path') as image
+ * and mount it.  Registering the same src again is a no-op.  With
+ * BDEV_POOL_COPY, src is copied to $lxcpath/.pool/$image/image, which is
+ * registered instead, and an image already in the pool is kept as is.
+ */
+int bdev_pool_add(const char *lxcpath, const char *image, const char *src,
+		  int flags);
+/* Unmount and forget an image which no container uses any more */
+int bdev_pool_remove(const char *lxcpath, const char *image);
+/* Returns the number of pool entries, sorted by image, or -1 */
+int bdev_pool_stats(const char *lxcpath, struct bdev_pool_stat **stats);
+void bdev_pool_stats_free(struct bdev_pool_stat *stats, int n);
+/*
+ * If the rootfs src is layered on a pool image, copy the image name into
+ * image and return its number of users.  Otherwise return -1.
+ */
+int bdev_pool_lookup(const char *src, char *image, size_t size);
 
 /* define constants if the kernel/glibc headers don't define them */
 #ifndef MS_DIRSYNC
@@ -33,6 +33,8 @@
 #include <malloc.h>
 #include <stdlib.h>
 
+#include <lxc/lxccontainer.h>
+
 #include "log.h"
 #include "lxc.h"
 #include "conf.h"
@@ -105,6 +107,7 @@ static const char *lxc_cmd_str(lxc_cmd_t cmd)
 		[LXC_CMD_GET_CLONE_FLAGS] = "get_clone_flags",
 		[LXC_CMD_GET_CGROUP]      = "get_cgroup",
 		[LXC_CMD_GET_CONFIG_ITEM] = "get_config_item",
+		[LXC_CMD_CONSOLE_LOG]     = "console_log",
 	};
 
 	if (cmd >= LXC_CMD_MAX)
@@ -163,7 +166,10 @@ static int lxc_cmd_rsp_recv(int sock, struct lxc_cmd_rr *cmd)
 
 	if (rsp->datalen == 0)
 		return ret;
-	if (rsp->datalen > LXC_CMD_DATA_MAX) {
+	/* the console log is the only response allowed to be large */
+	if (rsp->datalen > LXC_CMD_DATA_MAX &&
+	    (cmd->req.cmd != LXC_CMD_CONSOLE_LOG ||
+	     rsp->datalen > LXC_CONSOLE_BUFFER_MAX)) {
 		ERROR("command %s response data %d too long",
 		      lxc_cmd_str(cmd->req.cmd), rsp->datalen);
 		errno = EFBIG;
@@ -176,7 +182,7 @@ static int lxc_cmd_rsp_recv(int sock, struct lxc_cmd_rr *cmd)
 		      lxc_cmd_str(cmd->req.cmd));
 		return -1;
 	}
-	ret = recv(sock, rsp->data, rsp->datalen, 0);
+	ret = recv(sock, rsp->data, rsp->datalen, MSG_WAITALL);
 	if (ret != rsp->datalen) {
 		ERROR("command %s failed to receive response data",
 		      lxc_cmd_str(cmd->req.cmd));
@@ -713,7 +719,116 @@ out_close:
 	return 1;
 }
 
+/*
+ * lxc_cmd_console_log: Read and/or clear the in-memory console buffer of
+ * a running container
+ *
+ * @name      : name of container to connect to
+ * @lxcpath   : the lxcpath in which the container is running
+ * @log       : what to do, see struct lxc_console_log
+ *
+ * Returns 0 on success, < 0 on failure. On success and if @log->read is
+ * set, @log->data holds the NUL terminated console output which the caller
+ * must free(), and @log->read_max (if given) its length.
+ */
+int lxc_cmd_console_log(const char *name, const char *lxcpath,
+			struct lxc_console_log *log)
+{
+	int ret, stopped;
+	char *data;
+	struct lxc_cmd_console_log req = {
+		.clear = log->clear,
+		.read = log->read,
+		.read_max = log->read_max ? *log->read_max : 0,
+	};
+	struct lxc_cmd_rr cmd = {
+		.req = {
+			.cmd = LXC_CMD_CONSOLE_LOG,
+			.data = &req,
+			.datalen = sizeof(req),
+		},
+	};
+
+	log->data = NULL;
+	ret = lxc_cmd(name, &cmd, &stopped, lxcpath);
+	if (ret < 0)
+		return ret;
 
+	if (!ret) {
+		WARN("'%s' has stopped before sending its console log", name);
+		return -1;
+	}
+
+	if (cmd.rsp.ret < 0) {
+		ERROR("command %s failed for '%s': %s",
+		      lxc_cmd_str(cmd.req.cmd), name, strerror(-cmd.rsp.ret));
+		if (cmd.rsp.datalen > 0)
+			free(cmd.rsp.data);
+		return cmd.rsp.ret;
+	}
+
+	if (!log->read)
+		return 0;
+
+	/* the buffer is raw console output, make it a string */
+	data = realloc(cmd.rsp.datalen > 0 ? cmd.rsp.data : NULL,
+		       cmd.rsp.datalen + 1);
+	if (!data) {
+		free(cmd.rsp.data);
+		return -ENOMEM;
+	}
+	data[cmd.rsp.datalen] = '\0';
+	log->data = data;
+	if (log->read_max)
+		*log->read_max = cmd.rsp.datalen;
+
+	return 0;
+}
+
+static int lxc_cmd_console_log_callback(int fd, struct lxc_cmd_req *req,
+					struct lxc_handler *handler)
+{
+	const struct lxc_cmd_console_log *log = req->data;
+	struct lxc_ringbuf *buf = &handler->conf->console.ringbuf;
+	struct lxc_cmd_rsp rsp;
+	uint64_t len;
+	int ret;
+
+	memset(&rsp, 0, sizeof(rsp));
+	if (req->datalen != sizeof(*log)) {
+		rsp.ret = -EINVAL;
+		goto out;
+	}
+
+	if (!buf->size) {
+		rsp.ret = -ENODATA;
+		goto out;
+	}
+
+	if (log->read) {
+		len = lxc_ringbuf_used(buf);
+		if (log->read_max && log->read_max < len)
+			len = log->read_max;
+
+		if (len) {
+			rsp.data = malloc(len);
+			if (!rsp.data) {
+				rsp.ret = -ENOMEM;
+				goto out;
+			}
+			/* the most recent output is the interesting part */
+			rsp.datalen = lxc_ringbuf_tail(buf, rsp.data, len);
+		}
+	}
+
+	if (log->clear)
+		lxc_ringbuf_clear(buf);
+
+out:
+	ret = lxc_cmd_rsp_send(fd, &rsp);
+	free(rsp.datalen > 0 ? rsp.data : NULL);
+	return ret;
+}
 
 static int lxc_cmd_process(int fd, struct lxc_cmd_req *req,
 			   struct lxc_handler *handler)
@@ -729,6 +844,7 @@ static int lxc_cmd_process(int fd, struct lxc_cmd_req *req,
 		[LXC_CMD_GET_CLONE_FLAGS] = lxc_cmd_get_clone_flags_callback,
 		[LXC_CMD_GET_CGROUP]      = lxc_cmd_get_cgroup_callback,
 		[LXC_CMD_GET_CONFIG_ITEM] = lxc_cmd_get_config_item_callback,
+		[LXC_CMD_CONSOLE_LOG]     = lxc_cmd_console_log_callback,
 	};
 
 	if (req->cmd >= LXC_CMD_MAX) {
@@ -880,6 +996,23 @@ int lxc_cmd_init(const char *name, struct lxc_handler *handler,
 	return 0;
 }
 
+static void lxc_cmd_client_cleanup(int fd, void *data,
+				   struct lxc_epoll_descr *descr)
+{
+	lxc_cmd_fd_cleanup(fd, data, descr);
+}
+
+/*
+ * Stop serving commands and disconnect the clients, which see the socket
+ * closed as they would when the monitor exits.
+ */
+void lxc_cmd_mainloop_del(struct lxc_epoll_descr *descr,
+			  struct lxc_handler *handler)
+{
+	lxc_mainloop_for_each(descr, lxc_cmd_handler, lxc_cmd_client_cleanup);
+	lxc_mainloop_del_handler(descr, handler->conf->maincmd_fd);
+}
+
 int lxc_cmd_mainloop_add(const char *name,
 			 struct lxc_epoll_descr *descr,
 			 struct lxc_handler *handler)
@@ -24,6 +24,8 @@
 #ifndef __commands_h
 #define __commands_h
 
+#include <stdint.h>
+
 #include "state.h"
 
 #define LXC_CMD_DATA_MAX (MAXPATHLEN*2)
@@ -41,6 +43,7 @@ typedef enum {
 	LXC_CMD_GET_CLONE_FLAGS,
 	LXC_CMD_GET_CGROUP,
 	LXC_CMD_GET_CONFIG_ITEM,
+	LXC_CMD_CONSOLE_LOG,
 	LXC_CMD_MAX,
 } lxc_cmd_t;
 
@@ -66,9 +69,19 @@ struct lxc_cmd_console_rsp_data {
 	int ttynum;
 };
 
+struct lxc_cmd_console_log {
+	int clear;
+	int read;
+	uint64_t read_max;
+};
+
+struct lxc_console_log;
+
 extern int lxc_cmd_console_winch(const char *name, const char *lxcpath);
 extern int lxc_cmd_console(const char *name, int *ttynum, int *fd,
 			   const char *lxcpath);
+extern int lxc_cmd_console_log(const char *name, const char *lxcpath,
+			       struct lxc_console_log *log);
 /*
  * Get the 'real' cgroup path (as seen in /proc/self/cgroup) for a container
  * for a particular subsystem
@@ -88,6 +101,8 @@ extern int lxc_cmd_init(const char *name, struct lxc_handler *handler,
 			    const char *lxcpath);
 extern int lxc_cmd_mainloop_add(const char *name, struct lxc_epoll_descr *descr,
 				    struct lxc_handler *handler);
+extern void lxc_cmd_mainloop_del(struct lxc_epoll_descr *descr,
+				 struct lxc_handler *handler);
 extern int lxc_try_cmd(const char *name, const char *lxcpath);
 
 #endif /* __commands_h */
@@ -46,6 +46,7 @@
 #include <sys/utsname.h>
 #include <sys/param.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/socket.h>
 #include <sys/mount.h>
 #include <sys/mman.h>
@@ -56,6 +57,7 @@
 #include <netinet/in.h>
 #include <net/if.h>
 #include <libgen.h>
+#include <pthread.h>
 
 #include "network.h"
 #include "error.h"
@@ -462,6 +464,8 @@ static int find_fstype_cb(char* buffer, void *data)
 static int mount_unknown_fs(const char *rootfs, const char *target,
 			                const char *options)
 {
+	const char *fstype;
+	char buf[32];
 	int i;
 
 	struct cbarg {
@@ -474,6 +478,14 @@ static int mount_unknown_fs(const char *rootfs, const char *target,
 		.options = options,
 	};
 
+	/* a superblock we know saves trying every filesystem type */
+	fstype = lxc_probe_fstype(rootfs);
+	if (fstype) {
+		snprintf(buf, sizeof(buf), "%s", fstype);
+		if (find_fstype_cb(buf, &cbarg) == 1)
+			return 0;
+	}
+
 	/*
 	 * find the filesystem type with brute force:
 	 * first we check with /etc/filesystems, in case the modules
@@ -1198,6 +1210,91 @@ static int mount_check_fs( const char *dir, char *fstype )
  * the devtmpfs subdirectory.
  */
 
+struct lxc_devs {
+	const char *name;
+	mode_t mode;
+	int maj;
+	int min;
+};
+
+static const struct lxc_devs lxc_devs[] = {
+	{ "null",	S_IFCHR | S_IRWXU | S_IRWXG | S_IRWXO, 1, 3	},
+	{ "zero",	S_IFCHR | S_IRWXU | S_IRWXG | S_IRWXO, 1, 5	},
+	{ "full",	S_IFCHR | S_IRWXU | S_IRWXG | S_IRWXO, 1, 7	},
+	{ "urandom",	S_IFCHR | S_IRWXU | S_IRWXG | S_IRWXO, 1, 9	},
+	{ "random",	S_IFCHR | S_IRWXU | S_IRWXG | S_IRWXO, 1, 8	},
+	{ "tty",	S_IFCHR | S_IRWXU | S_IRWXG | S_IRWXO, 5, 0	},
+	{ "console",	S_IFCHR | S_IRUSR | S_IWUSR,	       5, 1	},
+};
+
+/* create the lxc_devs nodes in the directory devfd */
+static int autodev_populate(int devfd)
+{
+	mode_t cmask;
+	int i, ret = 0;
+
+	cmask = umask(S_IXUSR | S_IXGRP | S_IXOTH);
+	for (i = 0; i < sizeof(lxc_devs) / sizeof(lxc_devs[0]); i++) {
+		const struct lxc_devs *d = &lxc_devs[i];
+
+		if (mknodat(devfd, d->name, d->mode, makedev(d->maj, d->min)) &&
+		    errno != EEXIST) {
+			SYSERROR("Error creating %s", d->name);
+			ret = -1;
+			break;
+		}
+	}
+	umask(cmask);
+
+	return ret;
+}
+
+/*
+ * The devtmpfs directory of a container outlives it.  It is built once,
+ * with /dev/pts and the lxc_devs nodes, under a temporary name and then
+ * renamed into place, so that it is complete whenever it exists: the
+ * later starts only bind mount it.
+ */
+static int autodev_make_template(char *path)
+{
+	char tmp[MAXPATHLEN];
+	int ret, devfd;
+
+	ret = snprintf(tmp, MAXPATHLEN, "%s.new", path);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -1;
+
+	/* left over by a start which failed half way */
+	if (access(tmp, F_OK) == 0 && lxc_rmdir_onedev(tmp) < 0)
+		return -1;
+
+	if (mkdir(tmp, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH))
+		return -1;
+
+	devfd = open(tmp, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (devfd < 0)
+		goto err;
+	ret = mkdirat(devfd, "pts", S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+	if (!ret)
+		ret = autodev_populate(devfd);
+	close(devfd);
+	if (ret < 0)
+		goto err;
+
+	if (rename(tmp, path) == 0)
+		return 0;
+	/* built meanwhile by another start of the container */
+	if (errno == EEXIST || errno == ENOTEMPTY) {
+		lxc_rmdir_onedev(tmp);
+		return 0;
+	}
+
+err:
+	SYSERROR("Failed to build %s", path);
+	lxc_rmdir_onedev(tmp);
+	return -1;
+}
+
 static char *mk_devtmpfs(const char *name, char *path, const char *lxcpath)
 {
 	int ret;
@@ -1276,7 +1373,7 @@ static char *mk_devtmpfs(const char *name, char *path, const char *lxcpath)
 		return NULL;
 
 	if ( 0 != access(tmp_path, F_OK) || 0 != stat(tmp_path, &s) || 0 == S_ISDIR(s.st_mode) ) {
-		ret = mkdir(tmp_path, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+		ret = autodev_make_template(tmp_path);
 		if ( ret ) {
 			/* Something must have failed with the base_path...
 			 * Maybe unpriv user.  Try user_path now... */
@@ -1287,7 +1384,7 @@ static char *mk_devtmpfs(const char *name, char *path, const char *lxcpath)
 				return NULL;
 
 			if ( 0 != access(tmp_path, F_OK) || 0 != stat(tmp_path, &s) || 0 == S_ISDIR(s.st_mode) ) {
-				ret = mkdir(tmp_path, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+				ret = autodev_make_template(tmp_path);
 				if ( ret ) {
 					ERROR("Container /dev setup in host /dev failed - taking fallback" );
 					return NULL;
@@ -1304,8 +1401,12 @@ static char *mk_devtmpfs(const char *name, char *path, const char *lxcpath)
 /*
  * Do we want to add options for max size of /dev and a file to
  * specify which devices to create?
+ *
+ * *populated is set when /dev is the prepared devtmpfs directory, which
+ * setup_autodev then does not have to populate.
  */
-static int mount_autodev(const char *name, char *root, const char *lxcpath)
+static int mount_autodev(const char *name, char *root, const char *lxcpath,
+			 bool *populated)
 {
 	int ret;
 	struct stat s;
@@ -1341,6 +1442,7 @@ static int mount_autodev(const char *name, char *root, const char *lxcpath)
 		}
 		DEBUG("Bind mounting %s to %s", devtmpfs_path , path );
 		ret = mount(devtmpfs_path, path, NULL, MS_BIND, 0 );
+		*populated = true;
 	} else {
 		/* Only mount a tmpfs on here if we don't already a mount */
 		if ( ! mount_check_fs( host_path, NULL ) ) {
@@ -1375,29 +1477,10 @@ static int mount_autodev(const char *name, char *root, const char *lxcpath)
 	return 0;
 }
 
-struct lxc_devs {
-	const char *name;
-	mode_t mode;
-	int maj;
-	int min;
-};
-
-static const struct lxc_devs lxc_devs[] = {
-	{ "null",	S_IFCHR | S_IRWXU | S_IRWXG | S_IRWXO, 1, 3	},
-	{ "zero",	S_IFCHR | S_IRWXU | S_IRWXG | S_IRWXO, 1, 5	},
-	{ "full",	S_IFCHR | S_IRWXU | S_IRWXG | S_IRWXO, 1, 7	},
-	{ "urandom",	S_IFCHR | S_IRWXU | S_IRWXG | S_IRWXO, 1, 9	},
-	{ "random",	S_IFCHR | S_IRWXU | S_IRWXG | S_IRWXO, 1, 8	},
-	{ "tty",	S_IFCHR | S_IRWXU | S_IRWXG | S_IRWXO, 5, 0	},
-	{ "console",	S_IFCHR | S_IRUSR | S_IWUSR,	       5, 1	},
-};
-
 static int setup_autodev(const char *root)
 {
-	int ret;
+	int ret, devfd;
 	char path[MAXPATHLEN];
-	int i;
-	mode_t cmask;
 
 	INFO("Creating initial consoles under %s/dev", root);
 
@@ -1408,19 +1491,15 @@ static int setup_autodev(const char *root)
 	}
 
 	INFO("Populating /dev under %s", root);
-	cmask = umask(S_IXUSR | S_IXGRP | S_IXOTH);
-	for (i = 0; i < sizeof(lxc_devs) / sizeof(lxc_devs[0]); i++) {
-		const struct lxc_devs *d = &lxc_devs[i];
-		ret = snprintf(path, MAXPATHLEN, "%s/dev/%s", root, d->name);
-		if (ret < 0 || ret >= MAXPATHLEN)
-			return -1;
-		ret = mknod(path, d->mode, makedev(d->maj, d->min));
-		if (ret && errno != EEXIST) {
-			SYSERROR("Error creating %s", d->name);
-			return -1;
-		}
+	devfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (devfd < 0) {
+		SYSERROR("Failed to open %s", path);
+		return -1;
 	}
-	umask(cmask);
+	ret = autodev_populate(devfd);
+	close(devfd);
+	if (ret < 0)
+		return -1;
 
 	INFO("Populated /dev under %s", root);
 	return 0;
@@ -1519,7 +1598,12 @@ static int setup_rootfs(struct lxc_conf *conf)
 	}
 
 	// First try mounting rootfs using a bdev
-	struct bdev *bdev = bdev_init(rootfs->path, rootfs->mount, rootfs->options);
+	struct bdev *bdev = bdev_init_rootfs(rootfs->path, rootfs->mount,
+					     rootfs->options, &conf->rootfs.backend);
+	if (bdev && rootfs->loop)
+		bdev->loopopts = strdup(rootfs->loop);
+	if (bdev && rootfs->fstype)
+		bdev->fstype = strdup(rootfs->fstype);
 	if (bdev && bdev->ops->mount(bdev) == 0) {
 		bdev_put(bdev);
 		DEBUG("mounted '%s' on '%s'", rootfs->path, rootfs->mount);
@@ -1734,7 +1818,7 @@ static int setup_console(const struct lxc_rootfs *rootfs,
 static int setup_kmsg(const struct lxc_rootfs *rootfs,
 		       const struct lxc_console *console)
 {
-	char kpath[MAXPATHLEN];
+	char kpath[MAXPATHLEN], link[sizeof("console")];
 	int ret;
 
 	if (!rootfs->path)
@@ -1743,6 +1827,11 @@ static int setup_kmsg(const struct lxc_rootfs *rootfs,
 	if (ret < 0 || ret >= sizeof(kpath))
 		return -1;
 
+	/* a persistent autodev /dev already has it, leave it untouched */
+	ret = readlink(kpath, link, sizeof(link));
+	if (ret == strlen("console") && !strncmp(link, "console", ret))
+		return 0;
+
 	ret = unlink(kpath);
 	if (ret && errno != ENOENT) {
 		SYSERROR("error unlinking %s", kpath);
@@ -1846,308 +1935,346 @@ static int mount_entry(const char *fsname, const char *target,
 	return 0;
 }
 
-/*
- * Remove 'optional', 'create=dir', and 'create=file' from mntopt
- */
-static void cull_mntent_opt(struct mntent *mntent)
+/* undo the octal escapes of an fstab field in place, as getmntent does */
+static char *mntent_unescape(char *s)
 {
+	static const struct { const char *seq; char c; } escapes[] = {
+		{ "\\040", ' ' }, { "\\011", '\t' }, { "\\012", '\n' },
+		{ "\\134", '\\' }, { "\\\\", '\\' },
+	};
+	char *r = s, *w = s;
 	int i;
-	char *p, *p2;
-	char *list[] = {"create=dir",
-			"create=file",
-			"optional",
-			NULL };
-
-	for (i=0; list[i]; i++) {
-		if (!(p = strstr(mntent->mnt_opts, list[i])))
-			continue;
-		p2 = strchr(p, ',');
-		if (!p2) {
-			/* no more mntopts, so just chop it here */
-			*p = '\0';
-			continue;
+
+	while (*r) {
+		for (i = 0; i < sizeof(escapes) / sizeof(escapes[0]); i++) {
+			size_t len = strlen(escapes[i].seq);
+
+			if (!strncmp(r, escapes[i].seq, len)) {
+				*w++ = escapes[i].c;
+				r += len;
+				break;
+			}
 		}
-		memmove(p, p2+1, strlen(p2+1)+1);
+		if (i == sizeof(escapes) / sizeof(escapes[0]))
+			*w++ = *r++;
 	}
+	*w = '\0';
+
+	return s;
 }
 
-static inline int mount_entry_on_systemfs(struct mntent *mntent)
+void lxc_mount_entry_free(struct lxc_mount_entry *entry)
 {
-	unsigned long mntflags;
-	char *mntdata;
-	int ret;
-	FILE *pathfile = NULL;
-	char* pathdirname = NULL;
-	bool optional = hasmntopt(mntent, "optional") != NULL;
+	if (!entry)
+		return;
+	free(entry->fsname);
+	free(entry->target);
+	free(entry->fstype);
+	free(entry->data);
+	free(entry);
+}
 
-	if (hasmntopt(mntent, "create=dir")) {
-		if (mkdir_p(mntent->mnt_dir, 0755) < 0) {
-			WARN("Failed to create mount target '%s'", mntent->mnt_dir);
-			ret = -1;
-		}
-	}
+/*
+ * Parse a fstab line once, so that only the mounts are left to do when
+ * the container starts. The dump and pass fields are ignored. Returns NULL
+ * with errno set to EINVAL for a line getmntent would skip.
+ */
+struct lxc_mount_entry *lxc_mount_entry_compile(const char *line)
+{
+	struct lxc_mount_entry *entry;
+	char *buf, *fields[4], *saveptr = NULL, *opt, *data = NULL;
+	int i;
 
-	if (hasmntopt(mntent, "create=file") && access(mntent->mnt_dir, F_OK)) {
-		pathdirname = strdup(mntent->mnt_dir);
-		pathdirname = dirname(pathdirname);
-		if (mkdir_p(pathdirname, 0755) < 0) {
-			WARN("Failed to create target directory");
-		}
-		pathfile = fopen(mntent->mnt_dir, "wb");
-		if (!pathfile) {
-			WARN("Failed to create mount target '%s'", mntent->mnt_dir);
-			ret = -1;
-		}
+	buf = strdup(line);
+	if (!buf)
+		return NULL;
+
+	for (i = 0; i < 4; i++) {
+		fields[i] = strtok_r(i ? NULL : buf, " \t\n", &saveptr);
+		if (!fields[i])
+			break;
+		mntent_unescape(fields[i]);
+	}
+	if (i < 3) {
+		free(buf);
+		errno = EINVAL;
+		return NULL;
+	}
+	if (i == 3)
+		fields[3] = "";
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry)
+		goto out_error;
+
+	entry->fsname = strdup(fields[0]);
+	entry->target = strdup(fields[1]);
+	entry->fstype = strdup(fields[2]);
+	data = malloc(strlen(fields[3]) + 1);
+	if (!entry->fsname || !entry->target || !entry->fstype || !data)
+		goto out_error;
+	*data = '\0';
+
+	for (opt = strtok_r(fields[3], ",", &saveptr); opt;
+	     opt = strtok_r(NULL, ",", &saveptr)) {
+		if (!strcmp(opt, "optional"))
+			entry->optional = true;
+		else if (!strcmp(opt, "create=dir"))
+			entry->create = LXC_MOUNT_CREATE_DIR;
+		else if (!strcmp(opt, "create=file"))
+			entry->create = LXC_MOUNT_CREATE_FILE;
 		else
-			fclose(pathfile);
+			parse_mntopt(opt, &entry->flags, &data);
 	}
 
-	cull_mntent_opt(mntent);
-
-	if (parse_mntopts(mntent->mnt_opts, &mntflags, &mntdata) < 0) {
-		free(mntdata);
-		return -1;
-	}
+	if (*data)
+		entry->data = data;
+	else
+		free(data);
+	free(buf);
+	return entry;
+
+out_error:
+	SYSERROR("failed to allocate memory");
+	free(data);
+	lxc_mount_entry_free(entry);
+	free(buf);
+	return NULL;
+}
 
-	ret = mount_entry(mntent->mnt_fsname, mntent->mnt_dir,
-			  mntent->mnt_type, mntflags, mntdata);
+static void mount_plan_free(struct lxc_list *plan)
+{
+	struct lxc_list *it, *next;
 
-	if (optional)
-		ret = 0;
+	lxc_list_for_each_safe(it, plan, next) {
+		lxc_list_del(it);
+		lxc_mount_entry_free(it->elem);
+		free(it);
+	}
+}
 
-	free(pathdirname);
-	free(mntdata);
+/*
+ * State of one run of mount_plan_apply: the rootfs, opened once for the
+ * targets to be created relative to it.  Bind sources are resolved by
+ * path at each mount, as an earlier entry may have mounted over them.
+ */
+struct mount_plan_ctx {
+	const struct lxc_rootfs *rootfs;
+	int rootfd;
+	char varlib_rootfs[MAXPATHLEN];
+};
 
-	return ret;
+static void mount_plan_ctx_fini(struct mount_plan_ctx *ctx)
+{
+	if (ctx->rootfd >= 0)
+		close(ctx->rootfd);
 }
 
-static int mount_entry_on_absolute_rootfs(struct mntent *mntent,
-					  const struct lxc_rootfs *rootfs,
-					  const char *lxc_name)
+static int mount_plan_ctx_init(struct mount_plan_ctx *ctx,
+			       const struct lxc_rootfs *rootfs,
+			       const char *lxc_name)
 {
-	char *aux;
-	char path[MAXPATHLEN];
-	unsigned long mntflags;
-	char *mntdata;
-	int r, ret = 0, offset;
 	const char *lxcpath;
-	FILE *pathfile = NULL;
-	char *pathdirname = NULL;
-	bool optional = hasmntopt(mntent, "optional") != NULL;
+	int ret;
 
-	lxcpath = lxc_global_config_value("lxc.lxcpath");
-	if (!lxcpath) {
-		ERROR("Out of memory");
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->rootfs = rootfs;
+	ctx->rootfd = -1;
+
+	if (!rootfs->path)
+		return 0;
+
+	ctx->rootfd = open(rootfs->mount, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (ctx->rootfd < 0) {
+		SYSERROR("failed to open '%s'", rootfs->mount);
 		return -1;
 	}
 
 	/* if rootfs->path is a blockdev path, allow container fstab to
 	 * use $lxcpath/CN/rootfs as the target prefix */
-	r = snprintf(path, MAXPATHLEN, "%s/%s/rootfs", lxcpath, lxc_name);
-	if (r < 0 || r >= MAXPATHLEN)
-		goto skipvarlib;
-
-	aux = strstr(mntent->mnt_dir, path);
-	if (aux) {
-		offset = strlen(path);
-		goto skipabs;
-	}
-
-skipvarlib:
-	aux = strstr(mntent->mnt_dir, rootfs->path);
-	if (!aux) {
-		WARN("ignoring mount point '%s'", mntent->mnt_dir);
-		goto out;
-	}
-	offset = strlen(rootfs->path);
-
-skipabs:
-
-	r = snprintf(path, MAXPATHLEN, "%s/%s", rootfs->mount,
-		 aux + offset);
-	if (r < 0 || r >= MAXPATHLEN) {
-		WARN("pathnme too long for '%s'", mntent->mnt_dir);
-		ret = -1;
-		goto out;
-	}
-
-	if (hasmntopt(mntent, "create=dir")) {
-		if (mkdir_p(path, 0755) < 0) {
-			WARN("Failed to create mount target '%s'", path);
-			ret = -1;
-		}
+	lxcpath = lxc_global_config_value("lxc.lxcpath");
+	if (!lxcpath) {
+		ERROR("Out of memory");
+		return -1;
 	}
+	ret = snprintf(ctx->varlib_rootfs, MAXPATHLEN, "%s/%s/rootfs",
+		       lxcpath, lxc_name);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		ctx->varlib_rootfs[0] = '\0';
 
-	if (hasmntopt(mntent, "create=file") && access(path, F_OK)) {
-		pathdirname = strdup(path);
-		pathdirname = dirname(pathdirname);
-		if (mkdir_p(pathdirname, 0755) < 0) {
-			WARN("Failed to create target directory");
-		}
-		pathfile = fopen(path, "wb");
-		if (!pathfile) {
-			WARN("Failed to create mount target '%s'", path);
-			ret = -1;
-		}
-		else
-			fclose(pathfile);
-	}
-	cull_mntent_opt(mntent);
+	return 0;
+}
 
-	if (parse_mntopts(mntent->mnt_opts, &mntflags, &mntdata) < 0) {
-		free(mntdata);
-		return -1;
-	}
+/*
+ * Path of the target of e relative to ctx->rootfd, or absolute without a
+ * rootfs. NULL if the entry is to be ignored.
+ */
+static const char *mount_plan_target(struct mount_plan_ctx *ctx,
+				     const struct lxc_mount_entry *e)
+{
+	const char *aux;
 
-	ret = mount_entry(mntent->mnt_fsname, path, mntent->mnt_type,
-			  mntflags, mntdata);
+	if (!ctx->rootfs->path || e->target[0] != '/')
+		return e->target;
 
-	free(mntdata);
+	if (ctx->varlib_rootfs[0] &&
+	    (aux = strstr(e->target, ctx->varlib_rootfs)))
+		return aux + strlen(ctx->varlib_rootfs);
 
-	if (optional)
-		ret = 0;
+	aux = strstr(e->target, ctx->rootfs->path);
+	if (aux)
+		return aux + strlen(ctx->rootfs->path);
 
-out:
-	free(pathdirname);
-	return ret;
+	WARN("ignoring mount point '%s'", e->target);
+	return NULL;
 }
 
-static int mount_entry_on_relative_rootfs(struct mntent *mntent,
-					  const char *rootfs)
+static void mount_plan_create(int dirfd, const char *rel, const char *path,
+			      int create)
 {
-	char path[MAXPATHLEN];
-	unsigned long mntflags;
-	char *mntdata;
-	int ret;
-	FILE *pathfile = NULL;
-	char *pathdirname = NULL;
-	bool optional = hasmntopt(mntent, "optional") != NULL;
+	char *parent, *slash;
+	int fd;
 
-	/* relative to root mount point */
-	ret = snprintf(path, sizeof(path), "%s/%s", rootfs, mntent->mnt_dir);
-	if (ret >= sizeof(path)) {
-		ERROR("path name too long");
-		return -1;
-	}
-
-	if (hasmntopt(mntent, "create=dir")) {
-		if (mkdir_p(path, 0755) < 0) {
+	if (create == LXC_MOUNT_CREATE_DIR) {
+		if (mkdirat_p(dirfd, rel, 0755) < 0)
 			WARN("Failed to create mount target '%s'", path);
-			ret = -1;
-		}
+		return;
 	}
 
-	if (hasmntopt(mntent, "create=file") && access(path, F_OK)) {
-		pathdirname = strdup(path);
-		pathdirname = dirname(pathdirname);
-		if (mkdir_p(pathdirname, 0755) < 0) {
-			WARN("Failed to create target directory");
-		}
-		pathfile = fopen(path, "wb");
-		if (!pathfile) {
-			WARN("Failed to create mount target '%s'", path);
-			ret = -1;
-		}
-		else
-			fclose(pathfile);
-	}
-	cull_mntent_opt(mntent);
+	if (!faccessat(dirfd, rel, F_OK, 0))
+		return;
 
-	if (parse_mntopts(mntent->mnt_opts, &mntflags, &mntdata) < 0) {
-		free(mntdata);
-		return -1;
+	parent = strdup(rel);
+	if (parent) {
+		slash = strrchr(parent, '/');
+		if (slash) {
+			*slash = '\0';
+			if (*parent && mkdirat_p(dirfd, parent, 0755) < 0)
+				WARN("Failed to create target directory");
+		}
+		free(parent);
 	}
 
-	ret = mount_entry(mntent->mnt_fsname, path, mntent->mnt_type,
-			  mntflags, mntdata);
-
-	if (optional)
-		ret = 0;
-
-	free(pathdirname);
-	free(mntdata);
-
-	return ret;
+	fd = openat(dirfd, rel, O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+	if (fd < 0)
+		WARN("Failed to create mount target '%s'", path);
+	else
+		close(fd);
 }
 
-static int mount_file_entries(const struct lxc_rootfs *rootfs, FILE *file,
-	const char *lxc_name)
+int lxc_mount_plan_apply(const struct lxc_rootfs *rootfs, struct lxc_list *plan,
+			 const char *lxc_name)
 {
-	struct mntent mntent;
-	char buf[4096];
+	struct mount_plan_ctx ctx;
+	struct lxc_list *it;
+	char path[MAXPATHLEN];
 	int ret = -1;
 
-	while (getmntent_r(file, &mntent, buf, sizeof(buf))) {
+	if (mount_plan_ctx_init(&ctx, rootfs, lxc_name) < 0)
+		goto out;
 
-		if (!rootfs->path) {
-			if (mount_entry_on_systemfs(&mntent))
-				goto out;
+	lxc_list_for_each(it, plan) {
+		struct lxc_mount_entry *e = it->elem;
+		const char *rel;
+		int dirfd = AT_FDCWD;
+
+		rel = mount_plan_target(&ctx, e);
+		if (!rel)
 			continue;
-		}
 
-		/* We have a separate root, mounts are relative to it */
-		if (mntent.mnt_dir[0] != '/') {
-			if (mount_entry_on_relative_rootfs(&mntent,
-							   rootfs->mount))
+		if (rootfs->path) {
+			ret = snprintf(path, MAXPATHLEN, "%s/%s", rootfs->mount, rel);
+			if (ret < 0 || ret >= MAXPATHLEN) {
+				ERROR("path name too long for '%s'", e->target);
+				ret = -1;
 				goto out;
-			continue;
+			}
+			dirfd = ctx.rootfd;
+			rel += strspn(rel, "/");
+			if (!*rel)
+				rel = ".";
+		} else {
+			ret = snprintf(path, MAXPATHLEN, "%s", rel);
+			if (ret < 0 || ret >= MAXPATHLEN) {
+				ERROR("path name too long for '%s'", e->target);
+				ret = -1;
+				goto out;
+			}
 		}
 
-		if (mount_entry_on_absolute_rootfs(&mntent, rootfs, lxc_name))
+		if (e->create)
+			mount_plan_create(dirfd, rel, path, e->create);
+
+		ret = mount_entry(e->fsname, path, e->fstype, e->flags,
+				  e->data);
+		if (ret < 0 && !e->optional)
 			goto out;
+
+		/* the rootfs itself was mounted over */
+		if (dirfd != AT_FDCWD && !strcmp(rel, ".")) {
+			close(ctx.rootfd);
+			ctx.rootfd = open(rootfs->mount, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (ctx.rootfd < 0) {
+				SYSERROR("failed to open '%s'", rootfs->mount);
+				ret = -1;
+				goto out;
+			}
+		}
 	}
 
 	ret = 0;
-
 	INFO("mount points have been setup");
+
 out:
+	mount_plan_ctx_fini(&ctx);
 	return ret;
 }
 
 static int setup_mount(const struct lxc_rootfs *rootfs, const char *fstab,
 	const char *lxc_name)
 {
+	struct lxc_mount_entry *e;
+	struct lxc_list plan, *it;
+	char *line = NULL, *p;
+	size_t len = 0;
 	FILE *file;
-	int ret;
+	int ret = -1;
 
 	if (!fstab)
 		return 0;
 
-	file = setmntent(fstab, "r");
+	file = fopen(fstab, "r");
 	if (!file) {
 		SYSERROR("failed to use '%s'", fstab);
 		return -1;
 	}
 
-	ret = mount_file_entries(rootfs, file, lxc_name);
-
-	endmntent(file);
-	return ret;
-}
-
-static int setup_mount_entries(const struct lxc_rootfs *rootfs, struct lxc_list *mount,
-	const char *lxc_name)
-{
-	FILE *file;
-	struct lxc_list *iterator;
-	char *mount_entry;
-	int ret;
-
-	file = tmpfile();
-	if (!file) {
-		ERROR("tmpfile error: %m");
-		return -1;
-	}
+	lxc_list_init(&plan);
+	while (getline(&line, &len, file) != -1) {
+		p = line + strspn(line, " \t\n");
+		if (!*p || *p == '#')
+			continue;
 
-	lxc_list_for_each(iterator, mount) {
-		mount_entry = iterator->elem;
-		fprintf(file, "%s\n", mount_entry);
+		e = lxc_mount_entry_compile(p);
+		if (!e && errno == EINVAL) {
+			WARN("ignoring invalid mount entry '%s'", p);
+			continue;
+		}
+		it = malloc(sizeof(*it));
+		if (!e || !it) {
+			lxc_mount_entry_free(e);
+			free(it);
+			goto out;
+		}
+		it->elem = e;
+		lxc_list_add_tail(&plan, it);
 	}
 
-	rewind(file);
-
-	ret = mount_file_entries(rootfs, file, lxc_name);
+	ret = lxc_mount_plan_apply(rootfs, &plan, lxc_name);
 
+out:
+	mount_plan_free(&plan);
+	free(line);
 	fclose(file);
 	return ret;
 }
@@ -2599,6 +2726,8 @@ struct lxc_conf *lxc_conf_init(void)
 	new->console.master = -1;
 	new->console.slave = -1;
 	new->console.name[0] = '\0';
+	new->console.log_pipe[0] = new->console.log_pipe[1] = -1;
+	new->console.tee_pipe[0] = new->console.tee_pipe[1] = -1;
 	new->maincmd_fd = -1;
 	new->rootfs.mount = strdup(default_rootfs_mount);
 	if (!new->rootfs.mount) {
@@ -2610,6 +2739,7 @@ struct lxc_conf *lxc_conf_init(void)
 	lxc_list_init(&new->cgroup);
 	lxc_list_init(&new->network);
 	lxc_list_init(&new->mount_list);
+	lxc_list_init(&new->mount_plan);
 	lxc_list_init(&new->caps);
 	lxc_list_init(&new->keepcaps);
 	lxc_list_init(&new->id_map);
@@ -3591,6 +3721,14 @@ static int check_autodev( const char *rootfs, void *data )
 	return 0;
 }
 
+int lxc_check_autodev(struct lxc_conf *conf, const char *command)
+{
+	char *argv[] = { (char *)command, NULL };
+	struct start_args arg = { .argv = argv };
+
+	return check_autodev(conf->rootfs.mount, command ? &arg : NULL);
+}
+
 /*
  * _do_tmp_proc_mount: Mount /proc inside container if not already
  * mounted
@@ -3668,6 +3806,7 @@ int lxc_setup(struct lxc_handler *handler)
 	struct lxc_conf *lxc_conf = handler->conf;
 	const char *lxcpath = handler->lxcpath;
 	void *data = handler->data;
+	bool dev_populated = false;
 
 	if (lxc_conf->inherit_ns_fd[LXC_NS_UTS] == -1) {
 		if (setup_utsname(lxc_conf->utsname)) {
@@ -3692,11 +3831,14 @@ int lxc_setup(struct lxc_handler *handler)
 	}
 
 	if (lxc_conf->autodev < 0) {
-		lxc_conf->autodev = check_autodev(lxc_conf->rootfs.mount, data);
+		struct start_args *arg = data;
+
+		lxc_conf->autodev = lxc_check_autodev(lxc_conf,
+						      arg ? arg->argv[0] : NULL);
 	}
 
 	if (lxc_conf->autodev > 0) {
-		if (mount_autodev(name, lxc_conf->rootfs.mount, lxcpath)) {
+		if (mount_autodev(name, lxc_conf->rootfs.mount, lxcpath, &dev_populated)) {
 			ERROR("failed to mount /dev in the container");
 			return -1;
 		}
@@ -3715,7 +3857,7 @@ int lxc_setup(struct lxc_handler *handler)
 		return -1;
 	}
 
-	if (!lxc_list_empty(&lxc_conf->mount_list) && setup_mount_entries(&lxc_conf->rootfs, &lxc_conf->mount_list, name)) {
+	if (!lxc_list_empty(&lxc_conf->mount_plan) && lxc_mount_plan_apply(&lxc_conf->rootfs, &lxc_conf->mount_plan, name)) {
 		ERROR("failed to setup the mount entries for '%s'", name);
 		return -1;
 	}
@@ -3739,7 +3881,7 @@ int lxc_setup(struct lxc_handler *handler)
 			ERROR("failed to run autodev hooks for container '%s'.", name);
 			return -1;
 		}
-		if (setup_autodev(lxc_conf->rootfs.mount)) {
+		if (!dev_populated && setup_autodev(lxc_conf->rootfs.mount)) {
 			ERROR("failed to populate /dev in the container");
 			return -1;
 		}
@@ -4056,6 +4198,7 @@ int lxc_clear_mount_entries(struct lxc_conf *c)
 		free(it->elem);
 		free(it);
 	}
+	mount_plan_free(&c->mount_plan);
 	return 0;
 }
 
@@ -4104,10 +4247,15 @@ void lxc_conf_free(struct lxc_conf *conf)
 		return;
 	if (conf->console.path)
 		free(conf->console.path);
+	free(conf->console.log_path);
 	if (conf->rootfs.mount)
 		free(conf->rootfs.mount);
 	if (conf->rootfs.options)
 		free(conf->rootfs.options);
+	if (conf->rootfs.backend)
+		free(conf->rootfs.backend);
+	free(conf->rootfs.loop);
+	free(conf->rootfs.fstype);
 	if (conf->rootfs.path)
 		free(conf->rootfs.path);
 	if (conf->rootfs.pivot)
@@ -4221,60 +4369,190 @@ err:
 	return NULL;
 }
 
+static bool idmap_equal(struct lxc_list *a, struct lxc_list *b)
+{
+	struct lxc_list *ita, *itb;
+
+	for (ita = a->next, itb = b->next; ita != a && itb != b;
+	     ita = ita->next, itb = itb->next) {
+		struct id_map *ma = ita->elem, *mb = itb->elem;
+
+		if (ma->idtype != mb->idtype || ma->nsid != mb->nsid ||
+		    ma->hostid != mb->hostid || ma->range != mb->range)
+			return false;
+	}
+	return ita == a && itb == b;
+}
+
+static int userns_fn_idle(void *data)
+{
+	return 0;
+}
+
 /*
- * Run a function in a new user namespace.
- * The caller's euid will be mapped in if it is not already.
+ * Create a user namespace with the given id map, and return an fd for it.
+ * The namespace outlives the child which created it as long as the fd is
+ * open.
  */
-int userns_exec_1(struct lxc_conf *conf, int (*fn)(void *), void *data)
+static int userns_create(struct lxc_list *idmap)
 {
-	int ret, pid;
 	struct userns_fn_data d;
-	char c = '1';
-	int p[2];
-	struct lxc_list *idmap;
+	char path[MAXPATHLEN], c = '1';
+	int nsfd = -1, pid, ret;
 
-	ret = pipe(p);
-	if (ret < 0) {
+	if (pipe2(d.p, O_CLOEXEC) < 0) {
 		SYSERROR("opening pipe");
 		return -1;
 	}
-	d.fn = fn;
-	d.arg = data;
-	d.p[0] = p[0];
-	d.p[1] = p[1];
+	d.fn = userns_fn_idle;
+	d.arg = NULL;
 	pid = lxc_clone(run_userns_fn, &d, CLONE_NEWUSER);
-	if (pid < 0)
-		goto err;
-	close(p[0]);
-	p[0] = -1;
-
-	if ((idmap = idmap_add_id(conf, geteuid())) == NULL) {
-		ERROR("Error adding self to container uid map");
-		goto err;
+	close(d.p[0]);
+	if (pid < 0) {
+		close(d.p[1]);
+		return -1;
 	}
 
-	ret = lxc_map_ids(idmap, pid);
-	lxc_free_idmap(idmap);
-	free(idmap);
-	if (ret) {
+	if (lxc_map_ids(idmap, pid)) {
 		ERROR("Error setting up child mappings");
-		goto err;
+		goto out;
 	}
 
+	ret = snprintf(path, MAXPATHLEN, "/proc/%d/ns/user", pid);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		goto out;
+	nsfd = open(path, O_RDONLY | O_CLOEXEC);
+	if (nsfd < 0)
+		SYSERROR("opening %s", path);
+
 	// kick the child
-	if (write(p[1], &c, 1) != 1) {
+	if (write(d.p[1], &c, 1) != 1)
 		SYSERROR("writing to pipe to child");
-		goto err;
+out:
+	close(d.p[1]);
+	if (wait_for_pid(pid) < 0 && nsfd >= 0) {
+		close(nsfd);
+		nsfd = -1;
 	}
+	return nsfd;
+}
 
-	ret = wait_for_pid(pid);
+/*
+ * The user namespaces set up by userns_exec_1, kept by id map: the clone,
+ * snapshot and destroy of an unprivileged container call it several times
+ * with the same map, and each new namespace costs a newuidmap and a
+ * newgidmap run.  The fds are inherited by forked children, which can
+ * keep using them.
+ */
+#define USERNS_CACHE_SIZE 8
 
-	close(p[1]);
-	return ret;
+static struct userns_cache_entry {
+	struct lxc_list *idmap;
+	int nsfd;
+} userns_cache[USERNS_CACHE_SIZE];
+static int userns_cache_next;
+static pthread_mutex_t userns_cache_lock = PTHREAD_MUTEX_INITIALIZER;
 
-err:
-	if (p[0] != -1)
-		close(p[0]);
-	close(p[1]);
-	return -1;
+/*
+ * Return an fd for a user namespace with the given id map, which this
+ * takes over, and which the caller must close.
+ */
+static int userns_get(struct lxc_list *idmap)
+{
+	struct userns_cache_entry *e;
+	int i, nsfd = -1;
+
+	pthread_mutex_lock(&userns_cache_lock);
+	for (i = 0; i < USERNS_CACHE_SIZE; i++) {
+		e = &userns_cache[i];
+		if (e->idmap && idmap_equal(e->idmap, idmap)) {
+			nsfd = fcntl(e->nsfd, F_DUPFD_CLOEXEC, 0);
+			lxc_free_idmap(idmap);
+			free(idmap);
+			goto out;
+		}
+	}
+
+	nsfd = userns_create(idmap);
+	if (nsfd < 0) {
+		lxc_free_idmap(idmap);
+		free(idmap);
+		goto out;
+	}
+
+	e = &userns_cache[userns_cache_next];
+	userns_cache_next = (userns_cache_next + 1) % USERNS_CACHE_SIZE;
+	if (e->idmap) {
+		lxc_free_idmap(e->idmap);
+		free(e->idmap);
+		close(e->nsfd);
+	}
+	e->idmap = idmap;
+	e->nsfd = fcntl(nsfd, F_DUPFD_CLOEXEC, 0);
+	if (e->nsfd < 0) {
+		lxc_free_idmap(e->idmap);
+		free(e->idmap);
+		e->idmap = NULL;
+	}
+out:
+	pthread_mutex_unlock(&userns_cache_lock);
+	return nsfd;
+}
+
+/*
+ * Set up the user namespace userns_exec_1 will use for conf ahead of time,
+ * for callers which fork before calling it.
+ */
+int userns_exec_prepare(struct lxc_conf *conf)
+{
+	struct lxc_list *idmap;
+	int nsfd;
+
+	if ((idmap = idmap_add_id(conf, geteuid())) == NULL) {
+		ERROR("Error adding self to container uid map");
+		return -1;
+	}
+	nsfd = userns_get(idmap);
+	if (nsfd < 0)
+		return -1;
+	close(nsfd);
+	return 0;
+}
+
+/*
+ * Run a function in a new user namespace.
+ * The caller's euid will be mapped in if it is not already.
+ * The namespace is reused by later calls with the same id map.
+ */
+int userns_exec_1(struct lxc_conf *conf, int (*fn)(void *), void *data)
+{
+	struct lxc_list *idmap;
+	int nsfd, pid;
+
+	if ((idmap = idmap_add_id(conf, geteuid())) == NULL) {
+		ERROR("Error adding self to container uid map");
+		return -1;
+	}
+
+	nsfd = userns_get(idmap);
+	if (nsfd < 0)
+		return -1;
+
+	pid = fork();
+	if (pid < 0) {
+		SYSERROR("failed to fork");
+		close(nsfd);
+		return -1;
+	}
+	if (pid == 0) {
+		if (setns(nsfd, CLONE_NEWUSER) < 0) {
+			SYSERROR("failed to enter the user namespace");
+			_exit(1);
+		}
+		close(nsfd);
+		_exit(fn(data));
+	}
+
+	close(nsfd);
+	return wait_for_pid(pid);
 }
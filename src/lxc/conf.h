@@ -32,6 +32,7 @@
 #include <stdbool.h>
 
 #include "list.h"
+#include "ringbuf.h"
 #include "start.h" /* for lxc_handler */
 
 #if HAVE_SCMP_FILTER_CTX
@@ -178,6 +179,28 @@ struct lxc_pty_info {
 	int busy;
 };
 
+/*
+ * A lxc.mount.entry or lxc.mount fstab line, parsed once
+ * @fsname, @target, @fstype : the fstab fields, unescaped
+ * @flags, @data : mount(2) flags and data from the options
+ * @create : LXC_MOUNT_CREATE_DIR or LXC_MOUNT_CREATE_FILE, or 0
+ * @optional : a failure to mount the entry is ignored
+ */
+enum {
+	LXC_MOUNT_CREATE_DIR = 1,
+	LXC_MOUNT_CREATE_FILE = 2,
+};
+
+struct lxc_mount_entry {
+	char *fsname;
+	char *target;
+	char *fstype;
+	unsigned long flags;
+	char *data;
+	int create;
+	bool optional;
+};
+
 /*
  * Defines the number of tty configured and contains the
  * instanciated ptys
@@ -194,6 +217,16 @@ struct lxc_tty_state;
  * Defines the structure to store the console information
  * @peer   : the file descriptor put/get console traffic
  * @name   : the file name of the slave pty
+ * @master_buf : data read from the peer not yet accepted by the master
+ * @peer_buf   : data read from the master not yet accepted by the peer
+ * @log_pipe   : pipe used to splice master output into the log file
+ * @tee_pipe   : pipe used to duplicate master output for the log file
+ *               when there is also a peer
+ * @log_size   : size at which the log file is rotated, 0 for no limit
+ * @log_rotate : number of rotated log files to keep
+ * @log_written: current size of the log file
+ * @buffer_size: size of the in-memory buffer of recent console output
+ * @ringbuf    : the in-memory buffer, queried with LXC_CMD_CONSOLE_LOG
  */
 struct lxc_console {
 	int slave;
@@ -207,8 +240,22 @@ struct lxc_console {
 	char name[MAXPATHLEN];
 	struct termios *tios;
 	struct lxc_tty_state *tty_state;
+	struct lxc_ringbuf master_buf;
+	struct lxc_ringbuf peer_buf;
+	uint32_t master_events;
+	uint32_t peer_events;
+	int log_pipe[2];
+	int tee_pipe[2];
+	uint64_t log_size;
+	unsigned int log_rotate;
+	uint64_t log_written;
+	uint64_t buffer_size;
+	struct lxc_ringbuf ringbuf;
 };
 
+/* upper limit for lxc.console.buffer_size */
+#define LXC_CONSOLE_BUFFER_MAX (16 * 1024 * 1024)
+
 /*
  * Defines a structure to store the rootfs location, the
  * optionals pivot_root, rootfs mount paths
@@ -220,6 +267,9 @@ struct lxc_rootfs {
 	char *mount;
 	char *pivot;
 	char *options;
+	char *backend;  // bdev type of path, recorded when it was created
+	char *loop;     // loop device options, for a loop rootfs
+	char *fstype;   // filesystem type of a block device path, if known
 };
 
 /*
@@ -253,6 +303,7 @@ enum {
  * @tty        : numbers of tty
  * @pts        : new pts instance
  * @mount_list : list of mount point (alternative to fstab file)
+ * @mount_plan : the entries of mount_list, parsed
  * @network    : network configuration
  * @utsname    : container utsname
  * @fstab      : path to a fstab file format
@@ -290,6 +341,7 @@ struct lxc_conf {
 	int num_savednics;
 	int auto_mounts;
 	struct lxc_list mount_list;
+	struct lxc_list mount_plan;
 	struct lxc_list caps;
 	struct lxc_list keepcaps;
 	struct lxc_tty_info tty_info;
@@ -308,6 +360,7 @@ struct lxc_conf {
 #endif
 	int maincmd_fd;
 	int autodev;  // if 1, mount and fill a /dev at start
+	int monitor_shared;  // if 1, monitored by the lxcpath's supervisor
 	int haltsignal; // signal used to halt container
 	int stopsignal; // signal used to hard stop container
 	int kmsg;  // if 1, create /dev/kmsg symlink
@@ -369,6 +422,12 @@ extern int lxc_clear_groups(struct lxc_conf *c);
 struct cgroup_process_info;
 extern int lxc_setup(struct lxc_handler *handler);
 
+/*
+ * Whether a container running command (/sbin/init if NULL) needs autodev,
+ * 1 or 0, negative if it can not be told.
+ */
+extern int lxc_check_autodev(struct lxc_conf *conf, const char *command);
+
 extern void lxc_rename_phys_nics_on_shutdown(struct lxc_conf *conf);
 
 extern int find_unmapped_nsuid(struct lxc_conf *conf, enum idtype idtype);
@@ -376,7 +435,13 @@ extern int mapped_hostid(unsigned id, struct lxc_conf *conf, enum idtype idtype)
 extern int chown_mapped_root(char *path, struct lxc_conf *conf);
 extern int ttys_shift_ids(struct lxc_conf *c);
 extern int userns_exec_1(struct lxc_conf *conf, int (*fn)(void *), void *data);
+extern int userns_exec_prepare(struct lxc_conf *conf);
 extern int parse_mntopts(const char *mntopts, unsigned long *mntflags,
 			 char **mntdata);
+extern struct lxc_mount_entry *lxc_mount_entry_compile(const char *line);
+extern void lxc_mount_entry_free(struct lxc_mount_entry *entry);
+/* mount the entries of plan, a list of compiled entries, in order */
+extern int lxc_mount_plan_apply(const struct lxc_rootfs *rootfs,
+				struct lxc_list *plan, const char *lxc_name);
 extern void tmp_proc_unmount(struct lxc_conf *lxc_conf);
 #endif
@@ -45,6 +45,7 @@
 #include "conf.h"
 #include "network.h"
 #include "lxcseccomp.h"
+#include "bdev.h"
 
 #if HAVE_SYS_PERSONALITY_H
 #include <sys/personality.h>
@@ -67,6 +68,9 @@ static int config_mount(const char *, const char *, struct lxc_conf *);
 static int config_rootfs(const char *, const char *, struct lxc_conf *);
 static int config_rootfs_mount(const char *, const char *, struct lxc_conf *);
 static int config_rootfs_options(const char *, const char *, struct lxc_conf *);
+static int config_rootfs_backend(const char *, const char *, struct lxc_conf *);
+static int config_rootfs_loop(const char *, const char *, struct lxc_conf *);
+static int config_rootfs_fstype(const char *, const char *, struct lxc_conf *);
 static int config_pivotdir(const char *, const char *, struct lxc_conf *);
 static int config_utsname(const char *, const char *, struct lxc_conf *);
 static int config_hook(const char *, const char *, struct lxc_conf *lxc_conf);
@@ -92,6 +96,7 @@ static int config_seccomp(const char *, const char *, struct lxc_conf *);
 static int config_includefile(const char *, const char *, struct lxc_conf *);
 static int config_network_nic(const char *, const char *, struct lxc_conf *);
 static int config_autodev(const char *, const char *, struct lxc_conf *);
+static int config_monitor_shared(const char *, const char *, struct lxc_conf *);
 static int config_haltsignal(const char *, const char *, struct lxc_conf *);
 static int config_stopsignal(const char *, const char *, struct lxc_conf *);
 static int config_start(const char *, const char *, struct lxc_conf *);
@@ -113,6 +118,9 @@ static struct lxc_config_t config[] = {
 	{ "lxc.mount",                config_mount                },
 	{ "lxc.rootfs.mount",         config_rootfs_mount         },
 	{ "lxc.rootfs.options",       config_rootfs_options       },
+	{ "lxc.rootfs.backend",       config_rootfs_backend       },
+	{ "lxc.rootfs.loop",          config_rootfs_loop          },
+	{ "lxc.rootfs.fstype",        config_rootfs_fstype        },
 	{ "lxc.rootfs",               config_rootfs               },
 	{ "lxc.pivotdir",             config_pivotdir             },
 	{ "lxc.utsname",              config_utsname              },
@@ -142,10 +150,15 @@ static struct lxc_config_t config[] = {
 	{ "lxc.network.",             config_network_nic          },
 	{ "lxc.cap.drop",             config_cap_drop             },
 	{ "lxc.cap.keep",             config_cap_keep             },
+	{ "lxc.console.logfile",      config_console              },
+	{ "lxc.console.logsize",      config_console              },
+	{ "lxc.console.rotate",       config_console              },
+	{ "lxc.console.buffer_size",  config_console              },
 	{ "lxc.console",              config_console              },
 	{ "lxc.seccomp",              config_seccomp              },
 	{ "lxc.include",              config_includefile          },
 	{ "lxc.autodev",              config_autodev              },
+	{ "lxc.monitor.shared",       config_monitor_shared       },
 	{ "lxc.haltsignal",           config_haltsignal           },
 	{ "lxc.stopsignal",           config_stopsignal           },
 	{ "lxc.start.auto",           config_start                },
@@ -246,6 +259,54 @@ static int config_string_item(char **conf_item, const char *value)
 	return 0;
 }
 
+/*
+ * config_size_item: parse a size in bytes, optionally followed by one of
+ * the (binary) unit suffixes K, M or G
+ */
+static int config_size_item(uint64_t *conf_item, const char *value)
+{
+	unsigned long long v;
+	char *end;
+
+	if (!value || strlen(value) == 0) {
+		*conf_item = 0;
+		return 0;
+	}
+
+	errno = 0;
+	v = strtoull(value, &end, 10);
+	if (errno || end == value) {
+		ERROR("invalid size '%s'", value);
+		return -1;
+	}
+
+	switch (*end) {
+	case 'g': case 'G':
+		v *= 1024;
+		/* fall through */
+	case 'm': case 'M':
+		v *= 1024;
+		/* fall through */
+	case 'k': case 'K':
+		v *= 1024;
+		end++;
+		/* fall through */
+	case '\0':
+		break;
+	default:
+		ERROR("invalid size suffix in '%s'", value);
+		return -1;
+	}
+
+	if (*end && strcmp(end, "B") && strcmp(end, "iB")) {
+		ERROR("invalid size suffix in '%s'", value);
+		return -1;
+	}
+
+	*conf_item = v;
+	return 0;
+}
+
 static int config_string_item_max(char **conf_item, const char *value,
 				  size_t max)
 {
@@ -1127,6 +1188,24 @@ static int config_autodev(const char *key, const char *value,
 	return 0;
 }
 
+static int config_monitor_shared(const char *key, const char *value,
+				 struct lxc_conf *lxc_conf)
+{
+	unsigned int v;
+
+	if (!value || strlen(value) == 0) {
+		lxc_conf->monitor_shared = 0;
+		return 0;
+	}
+	if (lxc_safe_uint(value, &v) < 0 || v > 1) {
+		ERROR("invalid lxc.monitor.shared value '%s', must be 0 or 1", value);
+		return -1;
+	}
+	lxc_conf->monitor_shared = v;
+
+	return 0;
+}
+
 static int sig_num(const char *sig)
 {
 	int n;
@@ -1409,7 +1488,8 @@ static int config_mount(const char *key, const char *value,
 	char *auto_token = "lxc.mount.auto";
 	char *subkey;
 	char *mntelem;
-	struct lxc_list *mntlist;
+	struct lxc_list *mntlist, *planlist;
+	struct lxc_mount_entry *entry;
 
 	if (!value || strlen(value) == 0)
 		return lxc_clear_mount_entries(lxc_conf);
@@ -1434,20 +1514,44 @@ static int config_mount(const char *key, const char *value,
 	if (!strlen(subkey))
 		return -1;
 
+	/* like getmntent used to, skip what can't be parsed but keep it in
+	 * the configuration */
+	entry = lxc_mount_entry_compile(value);
+	if (!entry) {
+		if (errno != EINVAL)
+			return -1;
+		WARN("ignoring invalid mount entry '%s'", value);
+	}
+
+	planlist = malloc(sizeof(*planlist));
+	if (!planlist)
+		goto out_entry;
+
 	mntlist = malloc(sizeof(*mntlist));
 	if (!mntlist)
-		return -1;
+		goto out_planlist;
 
 	mntelem = strdup(value);
-	if (!mntelem) {
-		free(mntlist);
-		return -1;
-	}
+	if (!mntelem)
+		goto out_mntlist;
 	mntlist->elem = mntelem;
+	planlist->elem = entry;
 
 	lxc_list_add_tail(&lxc_conf->mount_list, mntlist);
+	if (entry)
+		lxc_list_add_tail(&lxc_conf->mount_plan, planlist);
+	else
+		free(planlist);
 
 	return 0;
+
+out_mntlist:
+	free(mntlist);
+out_planlist:
+	free(planlist);
+out_entry:
+	lxc_mount_entry_free(entry);
+	return -1;
 }
 
 static int config_cap_keep(const char *key, const char *value,
@@ -1545,7 +1649,42 @@ static int config_cap_drop(const char *key, const char *value,
 static int config_console(const char *key, const char *value,
 			  struct lxc_conf *lxc_conf)
 {
-	return config_path_item(&lxc_conf->console.path, value);
+	struct lxc_console *console = &lxc_conf->console;
+
+	if (strcmp(key, "lxc.console") == 0)
+		return config_path_item(&console->path, value);
+
+	if (strcmp(key, "lxc.console.logfile") == 0)
+		return config_path_item(&console->log_path, value);
+
+	if (strcmp(key, "lxc.console.logsize") == 0)
+		return config_size_item(&console->log_size, value);
+
+	if (strcmp(key, "lxc.console.rotate") == 0) {
+		if (!value || strlen(value) == 0) {
+			console->log_rotate = 0;
+			return 0;
+		}
+		if (lxc_safe_uint(value, &console->log_rotate) < 0) {
+			ERROR("invalid number of rotated console logs '%s'", value);
+			return -1;
+		}
+		return 0;
+	}
+
+	if (strcmp(key, "lxc.console.buffer_size") == 0) {
+		if (config_size_item(&console->buffer_size, value))
+			return -1;
+		if (console->buffer_size > LXC_CONSOLE_BUFFER_MAX) {
+			ERROR("console buffer size %s is larger than %d bytes",
+			      value, LXC_CONSOLE_BUFFER_MAX);
+			return -1;
+		}
+		return 0;
+	}
+
+	ERROR("unknown key %s", key);
+	return -1;
 }
 
 static int config_includefile(const char *key, const char *value,
@@ -1557,6 +1696,11 @@ static int config_includefile(const char *key, const char *value,
 static int config_rootfs(const char *key, const char *value,
 			 struct lxc_conf *lxc_conf)
 {
+	/* what was recorded for the old path does not hold for the new one */
+	free(lxc_conf->rootfs.backend);
+	lxc_conf->rootfs.backend = NULL;
+	free(lxc_conf->rootfs.fstype);
+	lxc_conf->rootfs.fstype = NULL;
 	return config_path_item(&lxc_conf->rootfs.path, value);
 }
 
@@ -1572,6 +1716,26 @@ static int config_rootfs_options(const char *key, const char *value,
 	return config_string_item(&lxc_conf->rootfs.options, value);
 }
 
+static int config_rootfs_backend(const char *key, const char *value,
+			       struct lxc_conf *lxc_conf)
+{
+	return config_string_item(&lxc_conf->rootfs.backend, value);
+}
+
+static int config_rootfs_loop(const char *key, const char *value,
+			       struct lxc_conf *lxc_conf)
+{
+	if (bdev_loop_check_opts(value) < 0)
+		return -1;
+	return config_string_item(&lxc_conf->rootfs.loop, value);
+}
+
+static int config_rootfs_fstype(const char *key, const char *value,
+			       struct lxc_conf *lxc_conf)
+{
+	return config_string_item(&lxc_conf->rootfs.fstype, value);
+}
+
 static int config_pivotdir(const char *key, const char *value,
 			   struct lxc_conf *lxc_conf)
 {
@@ -1784,6 +1948,16 @@ static int lxc_get_conf_int(struct lxc_conf *c, char *retv, int inlen, int v)
 	return snprintf(retv, inlen, "%d", v);
 }
 
+static int lxc_get_conf_uint64(struct lxc_conf *c, char *retv, int inlen,
+			       uint64_t v)
+{
+	if (!retv)
+		inlen = 0;
+	else
+		memset(retv, 0, inlen);
+	return snprintf(retv, inlen, "%llu", (unsigned long long)v);
+}
+
 static int lxc_get_arch_entry(struct lxc_conf *c, char *retv, int inlen)
 {
 	int fulllen = 0;
@@ -2100,10 +2274,24 @@ int lxc_get_config_item(struct lxc_conf *c, const char *key, char *retv,
 		v = c->utsname ? c->utsname->nodename : NULL;
 	else if (strcmp(key, "lxc.console") == 0)
 		v = c->console.path;
+	else if (strcmp(key, "lxc.console.logfile") == 0)
+		v = c->console.log_path;
+	else if (strcmp(key, "lxc.console.logsize") == 0)
+		return lxc_get_conf_uint64(c, retv, inlen, c->console.log_size);
+	else if (strcmp(key, "lxc.console.rotate") == 0)
+		return lxc_get_conf_uint64(c, retv, inlen, c->console.log_rotate);
+	else if (strcmp(key, "lxc.console.buffer_size") == 0)
+		return lxc_get_conf_uint64(c, retv, inlen, c->console.buffer_size);
 	else if (strcmp(key, "lxc.rootfs.mount") == 0)
 		v = c->rootfs.mount;
 	else if (strcmp(key, "lxc.rootfs.options") == 0)
 		v = c->rootfs.options;
+	else if (strcmp(key, "lxc.rootfs.backend") == 0)
+		v = c->rootfs.backend;
+	else if (strcmp(key, "lxc.rootfs.loop") == 0)
+		v = c->rootfs.loop;
+	else if (strcmp(key, "lxc.rootfs.fstype") == 0)
+		v = c->rootfs.fstype;
 	else if (strcmp(key, "lxc.rootfs") == 0)
 		v = c->rootfs.path;
 	else if (strcmp(key, "lxc.pivotdir") == 0)
@@ -2226,6 +2414,8 @@ void write_config(FILE *fout, struct lxc_conf *c)
 		fprintf(fout, "lxc.kmsg = 0\n");
 	if (c->autodev > 0)
 		fprintf(fout, "lxc.autodev = 1\n");
+	if (c->monitor_shared > 0)
+		fprintf(fout, "lxc.monitor.shared = 1\n");
 	if (c->loglevel != LXC_LOG_PRIORITY_NOTSET)
 		fprintf(fout, "lxc.loglevel = %s\n", lxc_log_priority_to_string(c->loglevel));
 	if (c->logfile)
@@ -2331,12 +2521,28 @@ void write_config(FILE *fout, struct lxc_conf *c)
 	}
 	if (c->console.path)
 		fprintf(fout, "lxc.console = %s\n", c->console.path);
+	if (c->console.log_path)
+		fprintf(fout, "lxc.console.logfile = %s\n", c->console.log_path);
+	if (c->console.log_size)
+		fprintf(fout, "lxc.console.logsize = %llu\n",
+			(unsigned long long)c->console.log_size);
+	if (c->console.log_rotate)
+		fprintf(fout, "lxc.console.rotate = %u\n", c->console.log_rotate);
+	if (c->console.buffer_size)
+		fprintf(fout, "lxc.console.buffer_size = %llu\n",
+			(unsigned long long)c->console.buffer_size);
 	if (c->rootfs.path)
 		fprintf(fout, "lxc.rootfs = %s\n", c->rootfs.path);
+	if (c->rootfs.path && c->rootfs.backend)
+		fprintf(fout, "lxc.rootfs.backend = %s\n", c->rootfs.backend);
+	if (c->rootfs.path && c->rootfs.fstype)
+		fprintf(fout, "lxc.rootfs.fstype = %s\n", c->rootfs.fstype);
 	if (c->rootfs.mount && strcmp(c->rootfs.mount, LXCROOTFSMOUNT) != 0)
 		fprintf(fout, "lxc.rootfs.mount = %s\n", c->rootfs.mount);
 	if (c->rootfs.options)
 		fprintf(fout, "lxc.rootfs.options = %s\n", c->rootfs.options);
+	if (c->rootfs.loop)
+		fprintf(fout, "lxc.rootfs.loop = %s\n", c->rootfs.loop);
 	if (c->rootfs.pivot)
 		fprintf(fout, "lxc.pivotdir = %s\n", c->rootfs.pivot);
 	if (c->start_auto)
@@ -21,13 +21,16 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#define _GNU_SOURCE
 #include <assert.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sys/epoll.h>
 #include <sys/types.h>
 #include <termios.h>
 
@@ -210,15 +213,322 @@ static void lxc_console_sigwinch_fini(struct lxc_tty_state *ts)
 	free(ts);
 }
 
+/* size of a single read from a console fd */
+#define LXC_CONSOLE_BUFSIZE 16384
+/* amount of data buffered for a console sink that can't keep up */
+#define LXC_CONSOLE_RINGSIZE (256 * 1024)
+
+static int lxc_console_set_nonblock(int fd)
+{
+	int flags;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0)
+		return -1;
+
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void lxc_close_pipe(int p[2])
+{
+	if (p[0] >= 0)
+		close(p[0]);
+	if (p[1] >= 0)
+		close(p[1]);
+	p[0] = p[1] = -1;
+}
+
+/*
+ * lxc_console_update_events: recompute which events the master and the
+ * peer are polled for
+ *
+ * An fd is polled for EPOLLOUT as long as data is queued for it, and for
+ * EPOLLIN as long as the sink it feeds has room left. A slow peer thus
+ * throttles reading from the master (and vice versa) instead of blocking
+ * the mainloop.
+ */
+static void lxc_console_update_events(struct lxc_console *console)
+{
+	uint32_t events;
+
+	if (!console->descr)
+		return;
+
+	if (console->master >= 0) {
+		events = 0;
+		if (console->peer < 0 || lxc_ringbuf_free(&console->peer_buf))
+			events |= EPOLLIN;
+		if (!lxc_ringbuf_empty(&console->master_buf))
+			events |= EPOLLOUT;
+		if (events != console->master_events &&
+		    !lxc_mainloop_mod_handler(console->descr, console->master,
+					      events))
+			console->master_events = events;
+	}
+
+	if (console->peer >= 0) {
+		events = 0;
+		if (lxc_ringbuf_free(&console->master_buf))
+			events |= EPOLLIN;
+		if (!lxc_ringbuf_empty(&console->peer_buf))
+			events |= EPOLLOUT;
+		if (events != console->peer_events &&
+		    !lxc_mainloop_mod_handler(console->descr, console->peer,
+					      events))
+			console->peer_events = events;
+	}
+}
+
+/*
+ * lxc_console_sink_write: send data to a non-blocking console sink
+ *
+ * Data is written directly if nothing is pending for @fd, whatever can't
+ * be written right away is queued in @rb and sent on EPOLLOUT.
+ */
+static void lxc_console_sink_write(int fd, struct lxc_ringbuf *rb,
+				   const char *buf, size_t len)
+{
+	ssize_t w = 0;
+
+	if (lxc_ringbuf_empty(rb)) {
+		w = lxc_write_nointr(fd, buf, len);
+		if (w < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				WARN("failed to write to console fd %d: %s",
+				     fd, strerror(errno));
+				return;
+			}
+			w = 0;
+		}
+	}
+
+	if (w < len && lxc_ringbuf_write(rb, buf + w, len - w, false) != len - w)
+		WARN("console buffer for fd %d full, data dropped", fd);
+}
+
+static void lxc_console_write_log(struct lxc_console *console,
+				  const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	ret = lxc_write_nointr(console->log_fd, buf, len);
+	if (ret > 0)
+		console->log_written += ret;
+	if (ret != len)
+		WARN("console log short write");
+}
+
+/*
+ * lxc_console_splice_log: move @len bytes from the pipe @pipefd to the
+ * console log without copying them to userspace
+ */
+static void lxc_console_splice_log(struct lxc_console *console, int pipefd,
+				   size_t len)
+{
+	char buf[LXC_CONSOLE_BUFSIZE];
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = splice(pipefd, NULL, console->log_fd, NULL, len,
+			     SPLICE_F_MOVE);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		console->log_written += ret;
+		len -= ret;
+	}
+
+	/* the log is not splice()able after all, copy what is left */
+	while (len > 0) {
+		ret = lxc_read_nointr(pipefd, buf,
+				      len < sizeof(buf) ? len : sizeof(buf));
+		if (ret <= 0)
+			break;
+		lxc_console_write_log(console, buf, ret);
+		len -= ret;
+	}
+}
+
+static int lxc_console_log_open(struct lxc_console *console)
+{
+	off_t off;
+
+	/* not O_APPEND, splice() refuses to write to such files */
+	console->log_fd = lxc_unpriv(open(console->log_path,
+					  O_CLOEXEC | O_RDWR | O_CREAT, 0600));
+	if (console->log_fd < 0) {
+		SYSERROR("failed to open '%s'", console->log_path);
+		return -1;
+	}
+
+	off = lseek(console->log_fd, 0, SEEK_END);
+	if (off < 0) {
+		SYSERROR("failed to seek to end of '%s'", console->log_path);
+		close(console->log_fd);
+		console->log_fd = -1;
+		return -1;
+	}
+	console->log_written = off;
+
+	return 0;
+}
+
+/*
+ * lxc_console_log_rotate: rotate the console log once it reached
+ * lxc.console.logsize
+ *
+ * The log is moved to <log>.1, <log>.1 to <log>.2 and so on up to
+ * lxc.console.rotate files. If no rotated logs are to be kept, the log
+ * is simply truncated.
+ */
+static void lxc_console_log_rotate(struct lxc_console *console)
+{
+	char src[MAXPATHLEN], dst[MAXPATHLEN];
+	unsigned int i;
+	int ret;
+
+	if (console->log_fd < 0 || !console->log_size ||
+	    console->log_written < console->log_size)
+		return;
+
+	if (!console->log_rotate) {
+		if (ftruncate(console->log_fd, 0) ||
+		    lseek(console->log_fd, 0, SEEK_SET) < 0)
+			SYSERROR("failed to truncate '%s'", console->log_path);
+		console->log_written = 0;
+		return;
+	}
+
+	for (i = console->log_rotate; i > 0; i--) {
+		ret = snprintf(dst, sizeof(dst), "%s.%u", console->log_path, i);
+		if (ret < 0 || ret >= sizeof(dst))
+			return;
+		if (i > 1)
+			ret = snprintf(src, sizeof(src), "%s.%u",
+				       console->log_path, i - 1);
+		else
+			ret = snprintf(src, sizeof(src), "%s",
+				       console->log_path);
+		if (ret < 0 || ret >= sizeof(src))
+			return;
+		if (rename(src, dst) && errno != ENOENT)
+			SYSERROR("failed to rename '%s' to '%s'", src, dst);
+	}
+
+	close(console->log_fd);
+	if (lxc_console_log_open(console))
+		ERROR("console log disabled");
+	else
+		INFO("rotated console log '%s'", console->log_path);
+}
+
+/*
+ * lxc_console_read_master: read console output and write it to the log
+ *
+ * If a log is configured, the output is spliced from the master into a
+ * pipe and from there to the log file. When the data is also needed in
+ * userspace (for a peer or the in-memory buffer) the pipe is tee()d first
+ * and the copy is read into @buf. Kernels which can't splice from a pty
+ * get the plain read()/write() path.
+ *
+ * Returns the number of bytes consumed from the master, @buf only holds
+ * them if there is a peer or an in-memory buffer.
+ */
+static ssize_t lxc_console_read_master(struct lxc_console *console,
+				       char *buf, size_t len)
+{
+	bool copy = console->peer >= 0 || console->ringbuf.size;
+	ssize_t r, t;
+
+	if (console->log_fd < 0 || console->log_pipe[0] < 0)
+		goto read;
+
+again:
+	r = splice(console->master, NULL, console->log_pipe[1], NULL,
+		   len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (r < 0 && errno == EINTR)
+		goto again;
+	if (r < 0 && errno == EINVAL) {
+		INFO("console does not support splice, using read");
+		lxc_close_pipe(console->log_pipe);
+		lxc_close_pipe(console->tee_pipe);
+		goto read;
+	}
+	if (r <= 0)
+		return r;
+
+	if (!copy) {
+		lxc_console_splice_log(console, console->log_pipe[0], r);
+		return r;
+	}
+
+	t = tee(console->log_pipe[0], console->tee_pipe[1], r, SPLICE_F_NONBLOCK);
+	if (t > 0)
+		lxc_console_splice_log(console, console->tee_pipe[0], t);
+	else
+		t = 0;
+
+	if (lxc_read_nointr(console->log_pipe[0], buf, r) != r) {
+		SYSERROR("failed to read console data back from pipe");
+		return -1;
+	}
+
+	if (t < r)
+		lxc_console_write_log(console, buf + t, r - t);
+
+	return r;
+
+read:
+	r = lxc_read_nointr(console->master, buf, len);
+	if (r > 0 && console->log_fd >= 0)
+		lxc_console_write_log(console, buf, r);
+	return r;
+}
+
 static int lxc_console_cb_con(int fd, uint32_t events, void *data,
 			      struct lxc_epoll_descr *descr)
 {
 	struct lxc_console *console = (struct lxc_console *)data;
-	char buf[1024];
-	int r,w;
+	struct lxc_ringbuf *rb;
+	char buf[LXC_CONSOLE_BUFSIZE];
+	size_t len = sizeof(buf);
+	ssize_t r;
+
+	if (events & EPOLLOUT) {
+		rb = fd == console->master ? &console->master_buf
+					   : &console->peer_buf;
+		if (lxc_ringbuf_flush(rb, fd) < 0) {
+			WARN("failed to flush console data to fd %d: %s",
+			     fd, strerror(errno));
+			lxc_ringbuf_clear(rb);
+		}
+		lxc_console_update_events(console);
+	}
+
+	if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+		return 0;
+
+	/* never read more than the receiving side can queue */
+	if (fd == console->peer) {
+		if (lxc_ringbuf_free(&console->master_buf) < len)
+			len = lxc_ringbuf_free(&console->master_buf);
+	} else if (console->peer >= 0) {
+		if (lxc_ringbuf_free(&console->peer_buf) < len)
+			len = lxc_ringbuf_free(&console->peer_buf);
+	}
+	if (!len && !(events & (EPOLLHUP | EPOLLERR))) {
+		lxc_console_update_events(console);
+		return 0;
+	}
 
-	w = r = read(fd, buf, sizeof(buf));
+	if (fd == console->master)
+		r = lxc_console_read_master(console, buf, len ? len : 1);
+	else
+		r = lxc_read_nointr(fd, buf, len ? len : 1);
 	if (r < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
 		SYSERROR("failed to read");
 		return 1;
 	}
@@ -226,32 +536,40 @@ static int lxc_console_cb_con(int fd, uint32_t events, void *data,
 	if (!r) {
 		INFO("console client on fd %d has exited", fd);
 		lxc_mainloop_del_handler(descr, fd);
+		if (fd == console->peer)
+			lxc_ringbuf_clear(&console->peer_buf);
 		close(fd);
 		return 0;
 	}
 
-	if (fd == console->peer)
-		w = write(console->master, buf, r);
-
-	if (fd == console->master) {
-		if (console->log_fd >= 0)
-			w = write(console->log_fd, buf, r);
-
+	if (fd == console->peer) {
+		lxc_console_sink_write(console->master, &console->master_buf,
+				       buf, r);
+	} else {
+		if (console->ringbuf.size)
+			lxc_ringbuf_write(&console->ringbuf, buf, r, true);
 		if (console->peer >= 0)
-			w = write(console->peer, buf, r);
+			lxc_console_sink_write(console->peer, &console->peer_buf,
+					       buf, r);
+		lxc_console_log_rotate(console);
 	}
 
-	if (w != r)
-		WARN("console short write r:%d w:%d", r, w);
+	lxc_console_update_events(console);
 	return 0;
 }
 
 static void lxc_console_mainloop_add_peer(struct lxc_console *console)
 {
 	if (console->peer >= 0) {
+		/* a peer which can't be polled (ie a regular file) is written
+		 * to synchronously
+		 */
 		if (lxc_mainloop_add_handler(console->descr, console->peer,
 					     lxc_console_cb_con, console))
 			WARN("console peer not added to mainloop");
+		else if (lxc_console_set_nonblock(console->peer))
+			WARN("failed to set console peer non-blocking");
+		console->peer_events = EPOLLIN;
 	}
 
 	if (console->tty_state) {
@@ -292,6 +610,12 @@ int lxc_console_mainloop_add(struct lxc_epoll_descr *descr,
 		      console->master);
 		return -1;
 	}
+	console->master_events = EPOLLIN;
+
+	if (lxc_console_set_nonblock(console->master)) {
+		SYSERROR("failed to set console master non-blocking");
+		return -1;
+	}
 
 	/* we cache the descr so that we can add an fd to it when someone
 	 * does attach to it in lxc_console_allocate()
@@ -349,6 +673,8 @@ static void lxc_console_peer_proxy_free(struct lxc_console *console)
 	console->peerpty.busy = -1;
 	console->peerpty.name[0] = '\0';
 	console->peer = -1;
+	lxc_ringbuf_clear(&console->peer_buf);
+	lxc_console_update_events(console);
 }
 
 static int lxc_console_peer_proxy_alloc(struct lxc_console *console, int sockfd)
@@ -549,6 +875,11 @@ void lxc_console_delete(struct lxc_console *console)
 	close(console->slave);
 	if (console->log_fd >= 0)
 		close(console->log_fd);
+	lxc_close_pipe(console->log_pipe);
+	lxc_close_pipe(console->tee_pipe);
+	lxc_ringbuf_release(&console->master_buf);
+	lxc_ringbuf_release(&console->peer_buf);
+	lxc_ringbuf_release(&console->ringbuf);
 
 	console->peer = -1;
 	console->master = -1;
@@ -593,13 +924,26 @@ int lxc_console_create(struct lxc_conf *conf)
 
 	lxc_console_peer_default(console);
 
+	if (lxc_ringbuf_create(&console->master_buf, LXC_CONSOLE_RINGSIZE) ||
+	    lxc_ringbuf_create(&console->peer_buf, LXC_CONSOLE_RINGSIZE)) {
+		ERROR("failed to allocate console buffers");
+		goto err;
+	}
+
+	if (console->buffer_size &&
+	    lxc_ringbuf_create(&console->ringbuf, console->buffer_size)) {
+		ERROR("failed to allocate console ring buffer");
+		goto err;
+	}
+
 	if (console->log_path) {
-		console->log_fd = lxc_unpriv(open(console->log_path,
-						  O_CLOEXEC | O_RDWR |
-						  O_CREAT | O_APPEND, 0600));
-		if (console->log_fd < 0) {
-			SYSERROR("failed to open '%s'", console->log_path);
+		if (lxc_console_log_open(console))
 			goto err;
+		if (pipe2(console->log_pipe, O_CLOEXEC | O_NONBLOCK) ||
+		    pipe2(console->tee_pipe, O_CLOEXEC | O_NONBLOCK)) {
+			WARN("failed to create console log pipes, not splicing");
+			lxc_close_pipe(console->log_pipe);
+			lxc_close_pipe(console->tee_pipe);
 		}
 		DEBUG("using '%s' as console log", console->log_path);
 	}
@@ -617,47 +961,58 @@ static int lxc_console_cb_tty_stdin(int fd, uint32_t events, void *cbdata,
 				    struct lxc_epoll_descr *descr)
 {
 	struct lxc_tty_state *ts = cbdata;
-	char c;
+	char buf[LXC_CONSOLE_BUFSIZE];
+	ssize_t r, i, j;
+	int quit = 0;
 
 	assert(fd == ts->stdinfd);
-	if (read(ts->stdinfd, &c, 1) < 0) {
+	r = lxc_read_nointr(ts->stdinfd, buf, sizeof(buf));
+	if (r < 0) {
 		SYSERROR("failed to read");
 		return 1;
 	}
 
-	/* we want to exit the console with Ctrl+a q */
-	if (c == ts->escape && !ts->saw_escape) {
-		ts->saw_escape = 1;
-		return 0;
-	}
+	/* we want to exit the console with Ctrl+a q, strip the escape
+	 * sequence out of the data in place and forward the rest at once
+	 */
+	for (i = 0, j = 0; i < r; i++) {
+		if (buf[i] == ts->escape && !ts->saw_escape) {
+			ts->saw_escape = 1;
+			continue;
+		}
 
-	if (c == 'q' && ts->saw_escape)
-		return 1;
+		if (buf[i] == 'q' && ts->saw_escape) {
+			quit = 1;
+			break;
+		}
 
-	ts->saw_escape = 0;
-	if (write(ts->masterfd, &c, 1) < 0) {
+		ts->saw_escape = 0;
+		buf[j++] = buf[i];
+	}
+
+	if (j > 0 && lxc_write_nointr(ts->masterfd, buf, j) != j) {
 		SYSERROR("failed to write");
 		return 1;
 	}
 
-	return 0;
+	return quit;
 }
 
 static int lxc_console_cb_tty_master(int fd, uint32_t events, void *cbdata,
 				     struct lxc_epoll_descr *descr)
 {
 	struct lxc_tty_state *ts = cbdata;
-	char buf[1024];
-	int r,w;
+	char buf[LXC_CONSOLE_BUFSIZE];
+	ssize_t r, w;
 
 	assert(fd == ts->masterfd);
-	r = read(fd, buf, sizeof(buf));
+	r = lxc_read_nointr(fd, buf, sizeof(buf));
 	if (r < 0) {
 		SYSERROR("failed to read");
 		return 1;
 	}
 
-	w = write(ts->stdoutfd, buf, r);
+	w = lxc_write_nointr(ts->stdoutfd, buf, r);
 	if (w < 0 || w != r) {
 		SYSERROR("failed to write");
 		return 1;
@@ -713,6 +1068,7 @@ int lxc_console(struct lxc_container *c, int ttynum,
 		goto err2;
 	}
 	ts->escape = escape;
+	ts->stdoutfd = stdoutfd;
 	ts->winch_proxy = c->name;
 	ts->winch_proxy_lxcpath = c->config_path;
 
@@ -0,0 +1,841 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Dedup-aware copy of a container rootfs.
+ *
+ * $lxcpath/.dedup/index lists files of the rootfs under lxcpath by
+ * content, as 'hash size path' lines, hash being the 64-bit FNV-1a of the
+ * contents.  Only one file per content needs to be listed, as the copies
+ * are linked to it.  Entries are hints: a file is compared byte for byte
+ * before it is linked to, and the entries found stale are dropped when
+ * the index is updated.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "dedup.h"
+#include "log.h"
+#include "utils.h"
+
+lxc_log_define(lxc_dedup, lxc);
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+#define DEDUP_MAX_THREADS 16
+#define DEDUP_DIR "/.dedup"
+#define DEDUP_BUCKETS (1 << 16)
+/* not worth a lookup */
+#define DEDUP_MIN_SIZE 512
+/* candidates tried per file */
+#define DEDUP_MAX_CANDIDATES 4
+#define DEDUP_BUFSIZE (128 * 1024)
+
+/* top level directories of a rootfs whose files are replaced, not modified */
+static const char *dedup_immutable_dirs[] = {
+	"usr", "bin", "sbin", "lib", "lib32", "lib64", "libx32", NULL
+};
+
+struct dedup_entry {
+	uint64_t hash;
+	uint64_t size;
+	bool stale;
+	bool added;
+	struct dedup_entry *next;
+	char path[];
+};
+
+struct dedup_dir_times {
+	char *path;
+	struct timespec times[2];
+};
+
+struct dedup_ctx {
+	int srcfd, destfd;
+	const char *src;
+	char indexdir[MAXPATHLEN];
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* directories to copy, relative to srcfd and destfd */
+	char **queue;
+	size_t nqueue, queue_size;
+	int busy;
+	bool failed;
+
+	/* the content index */
+	struct dedup_entry **buckets;
+	bool index_changed;
+
+	/* directories whose times to set once their contents are copied */
+	struct dedup_dir_times *dirs;
+	size_t ndirs, dirs_size;
+
+	struct lxc_dedup_stats stats;
+};
+
+static struct dedup_entry **dedup_bucket(struct dedup_ctx *ctx, uint64_t hash)
+{
+	return &ctx->buckets[hash % DEDUP_BUCKETS];
+}
+
+static struct dedup_entry *dedup_find(struct dedup_ctx *ctx, uint64_t hash,
+				      uint64_t size, const char *path)
+{
+	struct dedup_entry *e;
+
+	for (e = *dedup_bucket(ctx, hash); e; e = e->next)
+		if (e->hash == hash && e->size == size && !strcmp(e->path, path))
+			return e;
+	return NULL;
+}
+
+/* called with ctx->lock held, or before the workers start */
+static struct dedup_entry *dedup_add(struct dedup_ctx *ctx, uint64_t hash,
+				     uint64_t size, const char *path)
+{
+	struct dedup_entry *e, **b;
+
+	e = malloc(sizeof(*e) + strlen(path) + 1);
+	if (!e)
+		return NULL;
+	e->hash = hash;
+	e->size = size;
+	e->stale = false;
+	e->added = false;
+	strcpy(e->path, path);
+	b = dedup_bucket(ctx, hash);
+	e->next = *b;
+	*b = e;
+	return e;
+}
+
+static int dedup_index_path(struct dedup_ctx *ctx, char *buf, const char *file)
+{
+	int ret;
+
+	ret = snprintf(buf, MAXPATHLEN, "%s/%s", ctx->indexdir, file);
+	return ret < 0 || ret >= MAXPATHLEN ? -1 : 0;
+}
+
+static int dedup_index_lock(struct dedup_ctx *ctx, int op)
+{
+	char path[MAXPATHLEN];
+	int fd;
+
+	if (dedup_index_path(ctx, path, "lock") < 0)
+		return -1;
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		SYSERROR("failed to open %s", path);
+		return -1;
+	}
+	if (flock(fd, op) < 0) {
+		SYSERROR("failed to lock %s", path);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* parse an index line, returning the path in it */
+static char *dedup_parse_line(char *line, uint64_t *hash, uint64_t *size)
+{
+	unsigned long long h, s;
+	size_t len;
+	int n = 0;
+
+	if (sscanf(line, "%llx %llu %n", &h, &s, &n) != 2 || !n)
+		return NULL;
+	len = strlen(line + n);
+	if (len && line[n + len - 1] == '\n')
+		line[n + len - 1] = '\0';
+	if (line[n] != '/')
+		return NULL;
+	*hash = h;
+	*size = s;
+	return line + n;
+}
+
+static void dedup_index_load(struct dedup_ctx *ctx)
+{
+	char path[MAXPATHLEN], *line = NULL, *p;
+	uint64_t hash, size;
+	size_t len = 0;
+	FILE *f;
+	int fd;
+
+	if (dedup_index_path(ctx, path, "index") < 0)
+		return;
+	fd = dedup_index_lock(ctx, LOCK_SH);
+	if (fd < 0)
+		return;
+	f = fopen(path, "r");
+	if (f) {
+		while (getline(&line, &len, f) != -1) {
+			p = dedup_parse_line(line, &hash, &size);
+			if (p && !dedup_find(ctx, hash, size, p))
+				dedup_add(ctx, hash, size, p);
+		}
+		fclose(f);
+		free(line);
+	}
+	close(fd);
+}
+
+/*
+ * Write the index again, without the entries found stale and with the
+ * ones added, keeping what concurrent copies added meanwhile.
+ */
+static int dedup_index_update(struct dedup_ctx *ctx)
+{
+	char path[MAXPATHLEN], tmp[MAXPATHLEN], *line = NULL, *p;
+	struct dedup_entry *e;
+	uint64_t hash, size;
+	FILE *in, *out;
+	size_t len = 0;
+	int fd, i, ret = -1;
+
+	if (dedup_index_path(ctx, path, "index") < 0 ||
+	    dedup_index_path(ctx, tmp, "index.new") < 0)
+		return -1;
+	fd = dedup_index_lock(ctx, LOCK_EX);
+	if (fd < 0)
+		return -1;
+
+	out = fopen(tmp, "w");
+	if (!out) {
+		SYSERROR("failed to open %s", tmp);
+		goto out;
+	}
+	in = fopen(path, "r");
+	if (in) {
+		while (getline(&line, &len, in) != -1) {
+			p = dedup_parse_line(line, &hash, &size);
+			if (!p)
+				continue;
+			e = dedup_find(ctx, hash, size, p);
+			if (e && (e->stale || e->added))
+				continue;
+			fprintf(out, "%016llx %llu %s\n", (unsigned long long)hash,
+				(unsigned long long)size, p);
+		}
+		fclose(in);
+		free(line);
+	}
+	for (i = 0; i < DEDUP_BUCKETS; i++)
+		for (e = ctx->buckets[i]; e; e = e->next)
+			if (e->added && !e->stale)
+				fprintf(out, "%016llx %llu %s\n",
+					(unsigned long long)e->hash,
+					(unsigned long long)e->size, e->path);
+	if (fclose(out) != 0 || rename(tmp, path) < 0) {
+		SYSERROR("failed to write %s", path);
+		unlink(tmp);
+		goto out;
+	}
+	ret = 0;
+out:
+	close(fd);
+	return ret;
+}
+
+static char *dedup_join(const char *dir, const char *name)
+{
+	char *path;
+
+	if (!strcmp(dir, "."))
+		return strdup(name);
+	if (asprintf(&path, "%s/%s", dir, name) < 0)
+		return NULL;
+	return path;
+}
+
+static bool dedup_immutable(const char *path)
+{
+	size_t len = strcspn(path, "/");
+	int i;
+
+	/* only files in those directories, not at their top */
+	if (!path[len])
+		return false;
+	for (i = 0; dedup_immutable_dirs[i]; i++)
+		if (strlen(dedup_immutable_dirs[i]) == len &&
+		    !strncmp(path, dedup_immutable_dirs[i], len))
+			return true;
+	return false;
+}
+
+static int dedup_hash(int fd, uint64_t *hash)
+{
+	char *buf;
+	uint64_t h = FNV1A_64_INIT;
+	off_t off = 0;
+	ssize_t n;
+
+	buf = malloc(DEDUP_BUFSIZE);
+	if (!buf)
+		return -1;
+	while ((n = pread(fd, buf, DEDUP_BUFSIZE, off)) > 0) {
+		h = fnv_64a_buf(buf, n, h);
+		off += n;
+	}
+	free(buf);
+	if (n < 0)
+		return -1;
+	*hash = h;
+	return 0;
+}
+
+/* whether the files open as fd1 and fd2 hold the same size bytes */
+static bool dedup_same_data(int fd1, int fd2, uint64_t size)
+{
+	char *buf1, *buf2;
+	off_t off = 0;
+	bool ret = false;
+	ssize_t n;
+
+	buf1 = malloc(DEDUP_BUFSIZE);
+	buf2 = malloc(DEDUP_BUFSIZE);
+	if (!buf1 || !buf2)
+		goto out;
+	while (off < size) {
+		n = pread(fd1, buf1, DEDUP_BUFSIZE, off);
+		if (n <= 0 || pread(fd2, buf2, n, off) != n || memcmp(buf1, buf2, n))
+			goto out;
+		off += n;
+	}
+	ret = true;
+out:
+	free(buf1);
+	free(buf2);
+	return ret;
+}
+
+enum {
+	DEDUP_SAME,
+	DEDUP_OTHER,	/* a valid entry, but not usable for this file */
+	DEDUP_STALE,
+};
+
+static int dedup_check(int fd, const struct stat *st, const char *path)
+{
+	struct stat cst;
+	int cfd, ret;
+
+	if (lstat(path, &cst) < 0 || !S_ISREG(cst.st_mode) ||
+	    cst.st_size != st->st_size)
+		return DEDUP_STALE;
+	/* the source itself, or a link to it */
+	if (cst.st_dev == st->st_dev && cst.st_ino == st->st_ino)
+		return DEDUP_SAME;
+	if (cst.st_uid != st->st_uid || cst.st_gid != st->st_gid ||
+	    cst.st_mode != st->st_mode)
+		return DEDUP_OTHER;
+
+	cfd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (cfd < 0)
+		return DEDUP_STALE;
+	ret = dedup_same_data(fd, cfd, st->st_size) ? DEDUP_SAME : DEDUP_STALE;
+	close(cfd);
+	return ret;
+}
+
+/*
+ * Hardlink dest/path to a file identical to the source file open as fd,
+ * one from the index or else the source file itself.
+ */
+static int dedup_link(struct dedup_ctx *ctx, int fd, int sdfd, int ddfd,
+		      const char *name, const char *path, const struct stat *st,
+		      struct lxc_dedup_stats *stats)
+{
+	struct dedup_entry *e, *cands[DEDUP_MAX_CANDIDATES];
+	char *cpaths[DEDUP_MAX_CANDIDATES], *srcpath;
+	uint64_t hash;
+	int i, n = 0, ret = -1;
+
+	if (dedup_hash(fd, &hash) < 0)
+		return -1;
+	stats->hashed += st->st_size;
+
+	pthread_mutex_lock(&ctx->lock);
+	for (e = *dedup_bucket(ctx, hash); e && n < DEDUP_MAX_CANDIDATES; e = e->next) {
+		if (e->hash != hash || e->size != st->st_size || e->stale)
+			continue;
+		cpaths[n] = strdup(e->path);
+		if (cpaths[n])
+			cands[n++] = e;
+	}
+	pthread_mutex_unlock(&ctx->lock);
+
+	for (i = 0; i < n; i++) {
+		int check = ret < 0 ? dedup_check(fd, st, cpaths[i]) : DEDUP_OTHER;
+
+		if (check == DEDUP_SAME &&
+		    linkat(AT_FDCWD, cpaths[i], ddfd, name, 0) == 0) {
+			ret = 0;
+		} else if (check == DEDUP_STALE) {
+			pthread_mutex_lock(&ctx->lock);
+			cands[i]->stale = true;
+			ctx->index_changed = true;
+			pthread_mutex_unlock(&ctx->lock);
+		}
+		free(cpaths[i]);
+	}
+	if (ret == 0)
+		goto linked;
+
+	/* the source becomes the file of this content in the index */
+	if (linkat(sdfd, name, ddfd, name, 0) < 0)
+		return -1;
+	if (asprintf(&srcpath, "%s/%s", ctx->src, path) >= 0) {
+		pthread_mutex_lock(&ctx->lock);
+		e = dedup_find(ctx, hash, st->st_size, srcpath);
+		if (!e && (e = dedup_add(ctx, hash, st->st_size, srcpath)))
+			e->added = true;
+		if (e && e->stale) {
+			e->stale = false;
+			e->added = true;
+		}
+		ctx->index_changed = true;
+		pthread_mutex_unlock(&ctx->lock);
+		free(srcpath);
+	}
+
+linked:
+	stats->linked++;
+	stats->saved += st->st_size;
+	return 0;
+}
+
+static int dedup_copy_data(int fd, int dfd)
+{
+	char *buf;
+	ssize_t n, w, off;
+	int ret = 0;
+
+	buf = malloc(DEDUP_BUFSIZE);
+	if (!buf)
+		return -1;
+	while ((n = read(fd, buf, DEDUP_BUFSIZE)) > 0) {
+		for (off = 0; off < n; off += w) {
+			w = write(dfd, buf + off, n - off);
+			if (w < 0) {
+				ret = -1;
+				goto out;
+			}
+		}
+	}
+	if (n < 0)
+		ret = -1;
+out:
+	free(buf);
+	return ret;
+}
+
+static int dedup_file(struct dedup_ctx *ctx, int sdfd, int ddfd,
+		      const char *name, const char *path, const struct stat *st,
+		      struct lxc_dedup_stats *stats)
+{
+	int fd, dfd, ret = -1;
+
+	stats->files++;
+	fd = openat(sdfd, name, O_RDONLY | O_NOFOLLOW | O_NOCTTY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (st->st_size >= DEDUP_MIN_SIZE && dedup_immutable(path) &&
+	    dedup_link(ctx, fd, sdfd, ddfd, name, path, st, stats) == 0) {
+		close(fd);
+		return 0;
+	}
+
+	dfd = openat(ddfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW |
+		     O_CLOEXEC, 0600);
+	if (dfd < 0)
+		goto out;
+	if (st->st_size > 0 && ioctl(dfd, FICLONE, fd) == 0) {
+		stats->reflinked++;
+		stats->saved += st->st_size;
+	} else if (dedup_copy_data(fd, dfd) < 0) {
+		goto out;
+	}
+	/* chown first, it clears the setuid bits */
+	if (fchown(dfd, st->st_uid, st->st_gid) < 0 ||
+	    fchmod(dfd, st->st_mode & 07777) < 0 ||
+	    futimens(dfd, (struct timespec[2]){ st->st_atim, st->st_mtim }) < 0)
+		goto out;
+	ret = 0;
+out:
+	if (dfd >= 0)
+		close(dfd);
+	close(fd);
+	return ret;
+}
+
+static int dedup_special(int sdfd, int ddfd, const char *name,
+			 const struct stat *st)
+{
+	char target[MAXPATHLEN];
+	ssize_t len;
+
+	if (S_ISLNK(st->st_mode)) {
+		len = readlinkat(sdfd, name, target, sizeof(target) - 1);
+		if (len < 0)
+			return -1;
+		target[len] = '\0';
+		if (symlinkat(target, ddfd, name) < 0)
+			return -1;
+	} else if (mknodat(ddfd, name, st->st_mode, st->st_rdev) < 0) {
+		return -1;
+	}
+
+	if (fchownat(ddfd, name, st->st_uid, st->st_gid, AT_SYMLINK_NOFOLLOW) < 0)
+		return -1;
+	if (!S_ISLNK(st->st_mode) && fchmodat(ddfd, name, st->st_mode & 07777, 0) < 0)
+		return -1;
+	return utimensat(ddfd, name, (struct timespec[2]){ st->st_atim, st->st_mtim },
+			 AT_SYMLINK_NOFOLLOW);
+}
+
+/* queue path, relative to srcfd and destfd, for a worker to copy */
+static int queue_dir(struct dedup_ctx *ctx, char *path)
+{
+	int ret = 0;
+
+	if (!path)
+		return -1;
+
+	pthread_mutex_lock(&ctx->lock);
+	if (ctx->nqueue == ctx->queue_size) {
+		size_t size = ctx->queue_size ? 2 * ctx->queue_size : 64;
+		char **queue = realloc(ctx->queue, size * sizeof(*queue));
+
+		if (!queue) {
+			free(path);
+			ret = -1;
+			goto out;
+		}
+		ctx->queue = queue;
+		ctx->queue_size = size;
+	}
+	ctx->queue[ctx->nqueue++] = path;
+	pthread_cond_signal(&ctx->cond);
+out:
+	pthread_mutex_unlock(&ctx->lock);
+	return ret;
+}
+
+static int dedup_dir_created(struct dedup_ctx *ctx, const char *path,
+			     const struct stat *st)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&ctx->lock);
+	if (ctx->ndirs == ctx->dirs_size) {
+		size_t size = ctx->dirs_size ? 2 * ctx->dirs_size : 64;
+		struct dedup_dir_times *dirs = realloc(ctx->dirs, size * sizeof(*dirs));
+
+		if (!dirs) {
+			ret = -1;
+			goto out;
+		}
+		ctx->dirs = dirs;
+		ctx->dirs_size = size;
+	}
+	ctx->dirs[ctx->ndirs].path = strdup(path);
+	if (!ctx->dirs[ctx->ndirs].path) {
+		ret = -1;
+		goto out;
+	}
+	ctx->dirs[ctx->ndirs].times[0] = st->st_atim;
+	ctx->dirs[ctx->ndirs].times[1] = st->st_mtim;
+	ctx->ndirs++;
+out:
+	pthread_mutex_unlock(&ctx->lock);
+	return ret;
+}
+
+static int dedup_dir(struct dedup_ctx *ctx, const char *dir,
+		     struct lxc_dedup_stats *stats)
+{
+	struct dirent *direntp;
+	struct stat st;
+	DIR *d;
+	int sdfd, ddfd, ret = 0;
+
+	sdfd = openat(ctx->srcfd, dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (sdfd < 0) {
+		SYSERROR("failed to open %s/%s", ctx->src, dir);
+		return -1;
+	}
+	ddfd = openat(ctx->destfd, dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (ddfd < 0) {
+		SYSERROR("failed to open the copy of %s", dir);
+		close(sdfd);
+		return -1;
+	}
+
+	d = fdopendir(sdfd);
+	if (!d) {
+		close(sdfd);
+		close(ddfd);
+		return -1;
+	}
+	while (ret == 0 && (direntp = readdir(d))) {
+		const char *name = direntp->d_name;
+		char *path;
+
+		if (!strcmp(name, ".") || !strcmp(name, ".."))
+			continue;
+		if (fstatat(sdfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+			SYSERROR("failed to stat %s/%s", dir, name);
+			ret = -1;
+			break;
+		}
+		path = dedup_join(dir, name);
+		if (!path) {
+			ret = -1;
+			break;
+		}
+
+		if (S_ISDIR(st.st_mode)) {
+			if ((mkdirat(ddfd, name, 0700) < 0 && errno != EEXIST) ||
+			    fchownat(ddfd, name, st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW) < 0 ||
+			    fchmodat(ddfd, name, st.st_mode & 07777, 0) < 0 ||
+			    dedup_dir_created(ctx, path, &st) < 0) {
+				ret = -1;
+				free(path);
+			} else {
+				ret = queue_dir(ctx, path);
+			}
+		} else {
+			if (S_ISREG(st.st_mode))
+				ret = dedup_file(ctx, sdfd, ddfd, name, path, &st, stats);
+			else
+				ret = dedup_special(sdfd, ddfd, name, &st);
+			free(path);
+		}
+		if (ret < 0)
+			SYSERROR("failed to copy %s/%s", dir, name);
+	}
+	closedir(d);
+	close(ddfd);
+	return ret;
+}
+
+static void *dedup_worker(void *data)
+{
+	struct dedup_ctx *ctx = data;
+	struct lxc_dedup_stats stats;
+	char *dir;
+	int ret;
+
+	for (;;) {
+		pthread_mutex_lock(&ctx->lock);
+		while (!ctx->nqueue && ctx->busy && !ctx->failed)
+			pthread_cond_wait(&ctx->cond, &ctx->lock);
+		if (!ctx->nqueue || ctx->failed) {
+			/* nothing left and nobody to queue more */
+			pthread_cond_broadcast(&ctx->cond);
+			pthread_mutex_unlock(&ctx->lock);
+			return NULL;
+		}
+		dir = ctx->queue[--ctx->nqueue];
+		ctx->busy++;
+		pthread_mutex_unlock(&ctx->lock);
+
+		memset(&stats, 0, sizeof(stats));
+		ret = dedup_dir(ctx, dir, &stats);
+		free(dir);
+
+		pthread_mutex_lock(&ctx->lock);
+		if (ret < 0)
+			ctx->failed = true;
+		ctx->stats.files += stats.files;
+		ctx->stats.hashed += stats.hashed;
+		ctx->stats.linked += stats.linked;
+		ctx->stats.reflinked += stats.reflinked;
+		ctx->stats.saved += stats.saved;
+		ctx->busy--;
+		if (!ctx->busy)
+			pthread_cond_broadcast(&ctx->cond);
+		pthread_mutex_unlock(&ctx->lock);
+	}
+}
+
+static void dedup_free(struct dedup_ctx *ctx)
+{
+	struct dedup_entry *e, *next;
+	size_t i;
+
+	for (i = 0; ctx->buckets && i < DEDUP_BUCKETS; i++) {
+		for (e = ctx->buckets[i]; e; e = next) {
+			next = e->next;
+			free(e);
+		}
+	}
+	free(ctx->buckets);
+	for (i = 0; i < ctx->nqueue; i++)
+		free(ctx->queue[i]);
+	free(ctx->queue);
+	for (i = 0; i < ctx->ndirs; i++)
+		free(ctx->dirs[i].path);
+	free(ctx->dirs);
+}
+
+int lxc_dedup_copy(const char *src, const char *dest, const char *lxcpath,
+		   int threads, struct lxc_dedup_stats *stats)
+{
+	struct dedup_ctx ctx;
+	struct timespec start, end;
+	struct stat st;
+	pthread_t tids[DEDUP_MAX_THREADS];
+	int i, started = 0, ret = -1;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.src = src;
+	ctx.srcfd = ctx.destfd = -1;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	ret = snprintf(ctx.indexdir, MAXPATHLEN, "%s" DEDUP_DIR, lxcpath);
+	if (ret < 0 || ret >= MAXPATHLEN || mkdir_p(ctx.indexdir, 0700) < 0) {
+		ERROR("failed to create the content index of %s", lxcpath);
+		return -1;
+	}
+	ret = -1;
+
+	ctx.srcfd = open(src, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	ctx.destfd = open(dest, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (ctx.srcfd < 0 || ctx.destfd < 0 || fstat(ctx.srcfd, &st) < 0) {
+		SYSERROR("failed to open %s or %s", src, dest);
+		goto out;
+	}
+	if (fchown(ctx.destfd, st.st_uid, st.st_gid) < 0 ||
+	    fchmod(ctx.destfd, st.st_mode & 07777) < 0) {
+		SYSERROR("failed to set the owner of %s", dest);
+		goto out;
+	}
+
+	ctx.buckets = calloc(DEDUP_BUCKETS, sizeof(*ctx.buckets));
+	if (!ctx.buckets)
+		goto out;
+	dedup_index_load(&ctx);
+
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads <= 0)
+		threads = 1;
+	if (threads > DEDUP_MAX_THREADS)
+		threads = DEDUP_MAX_THREADS;
+
+	pthread_mutex_init(&ctx.lock, NULL);
+	pthread_cond_init(&ctx.cond, NULL);
+	if (dedup_dir_created(&ctx, ".", &st) < 0 ||
+	    queue_dir(&ctx, strdup(".")) < 0)
+		goto out_destroy;
+
+	for (i = 1; i < threads; i++) {
+		if (pthread_create(&tids[started], NULL, dedup_worker, &ctx))
+			break;
+		started++;
+	}
+	dedup_worker(&ctx);
+	for (i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+
+	if (ctx.failed) {
+		ERROR("failed to copy %s to %s", src, dest);
+		goto out_destroy;
+	}
+
+	/* the directory contents are complete */
+	for (i = 0; i < (int)ctx.ndirs; i++)
+		if (utimensat(ctx.destfd, ctx.dirs[i].path, ctx.dirs[i].times,
+			      AT_SYMLINK_NOFOLLOW) < 0)
+			WARN("failed to set the times of %s: %s", ctx.dirs[i].path,
+			     strerror(errno));
+	if (ctx.index_changed && dedup_index_update(&ctx) < 0)
+		WARN("failed to update the content index of %s", lxcpath);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ctx.stats.seconds = (end.tv_sec - start.tv_sec) +
+			    (end.tv_nsec - start.tv_nsec) / 1e9;
+	INFO("copied %s to %s in %.2fs: %llu files, %llu linked and %llu "
+	     "reflinked, %llu bytes not copied, %llu bytes hashed (%d threads)",
+	     src, dest, ctx.stats.seconds, (unsigned long long)ctx.stats.files,
+	     (unsigned long long)ctx.stats.linked,
+	     (unsigned long long)ctx.stats.reflinked,
+	     (unsigned long long)ctx.stats.saved,
+	     (unsigned long long)ctx.stats.hashed, started + 1);
+	if (stats)
+		*stats = ctx.stats;
+	ret = 0;
+
+out_destroy:
+	pthread_cond_destroy(&ctx.cond);
+	pthread_mutex_destroy(&ctx.lock);
+out:
+	dedup_free(&ctx);
+	if (ctx.srcfd >= 0)
+		close(ctx.srcfd);
+	if (ctx.destfd >= 0)
+		close(ctx.destfd);
+	return ret;
+}
+
+int lxc_reflink_file(const char *src, const char *dest)
+{
+	struct stat sst, dst;
+	int fd, dfd, ret = -1;
+
+	fd = open(src, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	dfd = open(dest, O_WRONLY | O_CLOEXEC);
+	if (dfd < 0)
+		goto out;
+	if (fstat(fd, &sst) < 0 || fstat(dfd, &dst) < 0 ||
+	    sst.st_size != dst.st_size) {
+		errno = EINVAL;
+		goto out;
+	}
+	ret = ioctl(dfd, FICLONE, fd);
+out:
+	if (dfd >= 0)
+		close(dfd);
+	close(fd);
+	return ret;
+}
@@ -0,0 +1,49 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef __LXC_DEDUP_H
+#define __LXC_DEDUP_H
+
+#include <stdint.h>
+
+struct lxc_dedup_stats {
+	uint64_t files;     /* regular files copied or linked */
+	uint64_t hashed;    /* bytes hashed */
+	uint64_t linked;    /* files hardlinked to an identical one */
+	uint64_t reflinked; /* files cloned by reflink */
+	uint64_t saved;     /* bytes not copied */
+	double seconds;
+};
+
+/*
+ * Copy the tree src into the existing directory dest like 'rsync -a',
+ * except that files under the immutable top level directories of a
+ * rootfs (usr, bin, lib...) are hardlinked to an identical file found
+ * through the content index of lxcpath, or else to their source, and
+ * that other files are reflinked where the filesystem can.
+ *
+ * The files are hashed by 'threads' workers (the number of cpus if
+ * <= 0).  Returns 0 on success, with the counters in stats if not NULL.
+ */
+extern int lxc_dedup_copy(const char *src, const char *dest,
+			  const char *lxcpath, int threads,
+			  struct lxc_dedup_stats *stats);
+
+/* Reflink the whole file src over dest, which must be of the same size */
+extern int lxc_reflink_file(const char *src, const char *dest);
+
+#endif
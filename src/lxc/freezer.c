@@ -54,6 +54,7 @@ static int do_freeze_thaw(int freeze, const char *name, const char *lxcpath)
 {
 	char v[100];
 	const char *state = freeze ? "FROZEN" : "THAWED";
+	useconds_t delay = 1000;
 
 	if (lxc_cgroup_set("freezer.state", state, name, lxcpath) < 0) {
 		ERROR("Failed to freeze %s:%s", lxcpath, name);
@@ -71,7 +72,10 @@ static int do_freeze_thaw(int freeze, const char *name, const char *lxcpath)
 				lxc_monitor_send_state(name, freeze ? FROZEN : THAWED, lxcpath);
 			return 0;
 		}
-		sleep(1);
+		/* thawing is usually immediate, freezing takes a moment */
+		usleep(delay);
+		if (delay < 1000000)
+			delay *= 2;
 	}
 }
 
@@ -0,0 +1,762 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <endian.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+
+#include "idshift.h"
+#include "conf.h"
+#include "list.h"
+#include "log.h"
+
+lxc_log_define(lxc_idshift, lxc);
+
+#define IDSHIFT_MAX_THREADS 16
+
+/* on-disk layouts of the xattrs carrying ids, see linux/xattr.h */
+#define XATTR_ACL_ACCESS  "system.posix_acl_access"
+#define XATTR_ACL_DEFAULT "system.posix_acl_default"
+#define XATTR_CAPS        "security.capability"
+
+#define ACL_XATTR_VERSION 0x0002
+#define ACL_USER          0x02
+#define ACL_GROUP         0x08
+
+struct acl_xattr_entry {
+	uint16_t tag;
+	uint16_t perm;
+	uint32_t id;
+};
+
+#define VFS_CAP_REVISION_MASK 0xFF000000
+#define VFS_CAP_REVISION_3    0x03000000
+#define VFS_CAP_V3_SIZE       24 /* magic, 2 x (permitted, inheritable), rootid */
+
+/* a path, relative to rootfd, of a regular file with several links */
+struct idshift_link {
+	ino_t ino;
+	char *path;
+};
+
+struct idshift_ctx {
+	int rootfd;
+	dev_t dev;
+	struct lxc_list *from, *to;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* directories to walk, relative to rootfd */
+	char **queue;
+	size_t nqueue, queue_size;
+	int busy;
+	bool failed;
+
+	/* special files with several links, to shift only once */
+	ino_t *inos;
+	size_t ninos, inos_size;
+
+	/* regular files with several links, shifted once the walk is done */
+	struct idshift_link *links;
+	size_t nlinks, links_size;
+
+	struct lxc_shift_stats stats;
+};
+
+/* container id of host id 'id' under map, or id itself without a map */
+static bool map_to_ns(struct lxc_list *map, enum idtype type, unsigned long id,
+		      unsigned long *ret)
+{
+	struct lxc_list *it;
+
+	if (!map || lxc_list_empty(map)) {
+		*ret = id;
+		return true;
+	}
+	lxc_list_for_each(it, map) {
+		struct id_map *m = it->elem;
+
+		if (m->idtype == type && id >= m->hostid && id - m->hostid < m->range) {
+			*ret = m->nsid + (id - m->hostid);
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool map_to_host(struct lxc_list *map, enum idtype type, unsigned long id,
+			unsigned long *ret)
+{
+	struct lxc_list *it;
+
+	if (!map || lxc_list_empty(map)) {
+		*ret = id;
+		return true;
+	}
+	lxc_list_for_each(it, map) {
+		struct id_map *m = it->elem;
+
+		if (m->idtype == type && id >= m->nsid && id - m->nsid < m->range) {
+			*ret = m->hostid + (id - m->nsid);
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool shift_id(struct idshift_ctx *ctx, enum idtype type, unsigned long id,
+		     unsigned long *ret, struct lxc_shift_stats *stats)
+{
+	unsigned long nsid;
+
+	if (map_to_ns(ctx->from, type, id, &nsid) &&
+	    map_to_host(ctx->to, type, nsid, ret))
+		return true;
+	stats->unmapped++;
+	*ret = id;
+	return false;
+}
+
+/* returns true if ino was seen before */
+static bool seen_inode(struct idshift_ctx *ctx, ino_t ino)
+{
+	size_t i, mask;
+	bool seen = false;
+
+	pthread_mutex_lock(&ctx->lock);
+	if (2 * (ctx->ninos + 1) > ctx->inos_size) {
+		size_t size = ctx->inos_size ? 2 * ctx->inos_size : 1024, j;
+		ino_t *inos = calloc(size, sizeof(*inos));
+
+		if (!inos) {
+			ctx->failed = true;
+			pthread_mutex_unlock(&ctx->lock);
+			return true;
+		}
+		for (j = 0; j < ctx->inos_size; j++) {
+			if (!ctx->inos[j])
+				continue;
+			for (i = ctx->inos[j] & (size - 1); inos[i]; i = (i + 1) & (size - 1))
+				;
+			inos[i] = ctx->inos[j];
+		}
+		free(ctx->inos);
+		ctx->inos = inos;
+		ctx->inos_size = size;
+	}
+
+	mask = ctx->inos_size - 1;
+	for (i = ino & mask; ctx->inos[i]; i = (i + 1) & mask) {
+		if (ctx->inos[i] == ino) {
+			seen = true;
+			break;
+		}
+	}
+	if (!seen) {
+		ctx->inos[i] = ino;
+		ctx->ninos++;
+	}
+	pthread_mutex_unlock(&ctx->lock);
+	return seen;
+}
+
+static int shift_acl(struct idshift_ctx *ctx, int fd, const char *name,
+		     struct lxc_shift_stats *stats)
+{
+	char *buf;
+	struct acl_xattr_entry *e;
+	ssize_t len;
+	size_t i, n;
+	unsigned long id;
+	bool changed = false;
+	int ret = -1;
+
+	len = fgetxattr(fd, name, NULL, 0);
+	if (len < 0)
+		return errno == ENODATA ? 0 : -1;
+	if (len < 4)
+		return 0;
+	buf = malloc(len);
+	if (!buf)
+		return -1;
+	len = fgetxattr(fd, name, buf, len);
+	if (len < 0) {
+		/* it went away, or grew since the probe */
+		if (errno == ENODATA)
+			ret = 0;
+		goto out;
+	}
+	if (len < 4 || le32toh(*(uint32_t *)buf) != ACL_XATTR_VERSION) {
+		ret = 0;
+		goto out;
+	}
+
+	n = (len - 4) / sizeof(*e);
+	e = (struct acl_xattr_entry *)(buf + 4);
+	for (i = 0; i < n; i++) {
+		enum idtype type;
+
+		if (le16toh(e[i].tag) == ACL_USER)
+			type = ID_TYPE_UID;
+		else if (le16toh(e[i].tag) == ACL_GROUP)
+			type = ID_TYPE_GID;
+		else
+			continue;
+		if (!shift_id(ctx, type, le32toh(e[i].id), &id, stats) ||
+		    id == le32toh(e[i].id))
+			continue;
+		e[i].id = htole32(id);
+		changed = true;
+	}
+	if (changed) {
+		if (fsetxattr(fd, name, buf, len, 0) < 0)
+			goto out;
+		stats->xattrs++;
+	}
+	ret = 0;
+out:
+	free(buf);
+	return ret;
+}
+
+/*
+ * Re-own the inode open as fd.  chown drops the file capabilities, so
+ * they are read first and written back, with a v3 rootid shifted.
+ */
+static int shift_fd(struct idshift_ctx *ctx, int fd, const struct stat *st,
+		    struct lxc_shift_stats *stats)
+{
+	char buf[1024], *names = buf, caps[64], *name;
+	ssize_t len, capslen = -1;
+	unsigned long uid, gid;
+	bool chowned = false;
+	int ret = -1;
+
+	len = flistxattr(fd, names, sizeof(buf));
+	if (len < 0 && errno == ERANGE) {
+		len = flistxattr(fd, NULL, 0);
+		names = len > 0 ? malloc(len) : NULL;
+		if (!names)
+			return -1;
+		len = flistxattr(fd, names, len);
+	}
+	if (len < 0) {
+		if (errno != ENOTSUP)
+			goto out;
+		len = 0;
+	}
+	for (name = names; name < names + len; name += strlen(name) + 1) {
+		if (strcmp(name, XATTR_CAPS) == 0)
+			capslen = fgetxattr(fd, XATTR_CAPS, caps, sizeof(caps));
+	}
+
+	stats->inodes++;
+	shift_id(ctx, ID_TYPE_UID, st->st_uid, &uid, stats);
+	shift_id(ctx, ID_TYPE_GID, st->st_gid, &gid, stats);
+	if (uid != st->st_uid || gid != st->st_gid) {
+		if (fchown(fd, uid, gid) < 0)
+			goto out;
+		if (S_ISREG(st->st_mode) && (st->st_mode & (S_ISUID | S_ISGID)) &&
+		    fchmod(fd, st->st_mode & 07777) < 0)
+			goto out;
+		stats->changed++;
+		chowned = true;
+	}
+
+	if (capslen >= 4) {
+		uint32_t magic = le32toh(*(uint32_t *)caps);
+		bool rewrite = chowned;
+
+		if ((magic & VFS_CAP_REVISION_MASK) == VFS_CAP_REVISION_3 &&
+		    capslen >= VFS_CAP_V3_SIZE) {
+			uint32_t rootid = le32toh(*(uint32_t *)(caps + 20));
+
+			if (shift_id(ctx, ID_TYPE_UID, rootid, &uid, stats) &&
+			    uid != rootid) {
+				*(uint32_t *)(caps + 20) = htole32(uid);
+				rewrite = true;
+			}
+		}
+		if (rewrite) {
+			if (fsetxattr(fd, XATTR_CAPS, caps, capslen, 0) < 0)
+				goto out;
+			stats->xattrs++;
+		}
+	}
+
+	for (name = names; name < names + len; name += strlen(name) + 1) {
+		if ((strcmp(name, XATTR_ACL_ACCESS) == 0 ||
+		     strcmp(name, XATTR_ACL_DEFAULT) == 0) &&
+		    shift_acl(ctx, fd, name, stats) < 0)
+			goto out;
+	}
+	ret = 0;
+out:
+	if (names != buf)
+		free(names);
+	return ret;
+}
+
+static int copy_xattrs(int fd, int dfd)
+{
+	char *names = NULL, *name, *value = NULL;
+	ssize_t len, vlen;
+	int ret = -1;
+
+	len = flistxattr(fd, NULL, 0);
+	if (len <= 0)
+		return len < 0 && errno != ENOTSUP ? -1 : 0;
+	names = malloc(len);
+	if (!names)
+		return -1;
+	len = flistxattr(fd, names, len);
+	if (len < 0)
+		goto out;
+	for (name = names; name < names + len; name += strlen(name) + 1) {
+		vlen = fgetxattr(fd, name, NULL, 0);
+		if (vlen < 0)
+			goto out;
+		free(value);
+		value = malloc(vlen ? vlen : 1);
+		if (!value)
+			goto out;
+		vlen = fgetxattr(fd, name, value, vlen);
+		if (vlen < 0 || fsetxattr(dfd, name, value, vlen, 0) < 0)
+			goto out;
+	}
+	ret = 0;
+out:
+	free(value);
+	free(names);
+	return ret;
+}
+
+/*
+ * Replace dfd/name, a regular file with links outside of the tree, by a
+ * copy of its own, whose owner can change.  Returns the copy, open for
+ * shift_fd, or -1.
+ */
+static int break_link(int dfd, const char *name, const struct stat *st)
+{
+	char tmp[64], buf[65536];
+	ssize_t n, w, off;
+	int fd, cfd;
+
+	fd = openat(dfd, name, O_RDONLY | O_NOFOLLOW | O_NOCTTY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	snprintf(tmp, sizeof(tmp), ".lxc-idshift.%lu.%lx", (unsigned long)st->st_ino,
+		 (unsigned long)pthread_self());
+	cfd = openat(dfd, tmp, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (cfd < 0) {
+		close(fd);
+		return -1;
+	}
+
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		for (off = 0; off < n; off += w) {
+			w = write(cfd, buf + off, n - off);
+			if (w < 0)
+				goto err;
+		}
+	}
+	/* chown first, it clears the setuid bits and the file capabilities */
+	if (n < 0 || fchown(cfd, st->st_uid, st->st_gid) < 0 ||
+	    fchmod(cfd, st->st_mode & 07777) < 0 || copy_xattrs(fd, cfd) < 0 ||
+	    futimens(cfd, (struct timespec[2]){ st->st_atim, st->st_mtim }) < 0 ||
+	    renameat(dfd, tmp, dfd, name) < 0)
+		goto err;
+	close(fd);
+	return cfd;
+
+err:
+	unlinkat(dfd, tmp, 0);
+	close(cfd);
+	close(fd);
+	return -1;
+}
+
+/* re-own an inode which we do not open: symlinks, devices, fifos... */
+static int shift_at(struct idshift_ctx *ctx, int dfd, const char *name,
+		    const struct stat *st, struct lxc_shift_stats *stats)
+{
+	unsigned long uid, gid;
+
+	stats->inodes++;
+	shift_id(ctx, ID_TYPE_UID, st->st_uid, &uid, stats);
+	shift_id(ctx, ID_TYPE_GID, st->st_gid, &gid, stats);
+	if (uid == st->st_uid && gid == st->st_gid)
+		return 0;
+	if (fchownat(dfd, name, uid, gid, AT_SYMLINK_NOFOLLOW) < 0)
+		return -1;
+	stats->changed++;
+	return 0;
+}
+
+/* queue path, relative to rootfd, for a worker to walk */
+static int queue_dir(struct idshift_ctx *ctx, char *path)
+{
+	int ret = 0;
+
+	if (!path)
+		return -1;
+
+	pthread_mutex_lock(&ctx->lock);
+	if (ctx->nqueue == ctx->queue_size) {
+		size_t size = ctx->queue_size ? 2 * ctx->queue_size : 64;
+		char **queue = realloc(ctx->queue, size * sizeof(*queue));
+
+		if (!queue) {
+			free(path);
+			ret = -1;
+			goto out;
+		}
+		ctx->queue = queue;
+		ctx->queue_size = size;
+	}
+	ctx->queue[ctx->nqueue++] = path;
+	pthread_cond_signal(&ctx->cond);
+out:
+	pthread_mutex_unlock(&ctx->lock);
+	return ret;
+}
+
+static int defer_link(struct idshift_ctx *ctx, const char *dir,
+		      const char *name, const struct stat *st)
+{
+	char *path;
+	int ret = 0;
+
+	if (asprintf(&path, "%s/%s", dir, name) < 0)
+		return -1;
+
+	pthread_mutex_lock(&ctx->lock);
+	if (ctx->nlinks == ctx->links_size) {
+		size_t size = ctx->links_size ? 2 * ctx->links_size : 64;
+		struct idshift_link *links = realloc(ctx->links, size * sizeof(*links));
+
+		if (!links) {
+			free(path);
+			ret = -1;
+			goto out;
+		}
+		ctx->links = links;
+		ctx->links_size = size;
+	}
+	ctx->links[ctx->nlinks].ino = st->st_ino;
+	ctx->links[ctx->nlinks++].path = path;
+out:
+	pthread_mutex_unlock(&ctx->lock);
+	return ret;
+}
+
+static int cmp_link(const void *a, const void *b)
+{
+	const struct idshift_link *la = a, *lb = b;
+
+	if (la->ino != lb->ino)
+		return la->ino < lb->ino ? -1 : 1;
+	return strcmp(la->path, lb->path);
+}
+
+/* the directory of path, relative to rootfd, with name pointing to its last component */
+static int open_parent(struct idshift_ctx *ctx, char *path, const char **name)
+{
+	char *slash = strrchr(path, '/');
+	int dfd;
+
+	*slash = '\0';
+	dfd = openat(ctx->rootfd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	*slash = '/';
+	*name = slash + 1;
+	return dfd;
+}
+
+/*
+ * Shift the n paths of one inode with several links.  If they are all of
+ * its links, it is shifted in place.  Otherwise the others are outside of
+ * the tree, like those a dedup clone shares with other rootfses, so the
+ * inode is copied up and its paths in the tree are linked to the copy.
+ */
+static int shift_links(struct idshift_ctx *ctx, struct idshift_link *links,
+		       size_t n)
+{
+	char tmp[64];
+	const char *name, *name0;
+	struct stat st;
+	int dfd0, dfd, fd = -1, ret = -1;
+	size_t i;
+
+	dfd0 = open_parent(ctx, links[0].path, &name0);
+	if (dfd0 < 0 || fstatat(dfd0, name0, &st, AT_SYMLINK_NOFOLLOW) < 0 ||
+	    st.st_ino != links[0].ino)
+		goto out;
+
+	if (n >= st.st_nlink) {
+		fd = openat(dfd0, name0, O_RDONLY | O_NOFOLLOW | O_NOCTTY | O_CLOEXEC);
+		if (fd < 0)
+			goto out;
+		ret = shift_fd(ctx, fd, &st, &ctx->stats);
+		goto out;
+	}
+
+	fd = break_link(dfd0, name0, &st);
+	if (fd < 0)
+		goto out;
+	ctx->stats.copied++;
+	for (i = 1; i < n; i++) {
+		dfd = open_parent(ctx, links[i].path, &name);
+		if (dfd < 0)
+			goto out;
+		snprintf(tmp, sizeof(tmp), ".lxc-idshift.%lu", (unsigned long)links[i].ino);
+		if (linkat(dfd0, name0, dfd, tmp, 0) < 0 ||
+		    renameat(dfd, tmp, dfd, name) < 0) {
+			unlinkat(dfd, tmp, 0);
+			close(dfd);
+			goto out;
+		}
+		close(dfd);
+	}
+	ret = shift_fd(ctx, fd, &st, &ctx->stats);
+out:
+	if (ret < 0)
+		SYSERROR("failed to shift %s", links[0].path);
+	if (fd >= 0)
+		close(fd);
+	if (dfd0 >= 0)
+		close(dfd0);
+	return ret;
+}
+
+static int shift_dir(struct idshift_ctx *ctx, const char *dir,
+		     struct lxc_shift_stats *stats)
+{
+	struct dirent *direntp;
+	struct stat st;
+	DIR *d;
+	int dfd, fd, ret = 0;
+
+	dfd = openat(ctx->rootfd, dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (dfd < 0) {
+		SYSERROR("failed to open %s", dir);
+		return -1;
+	}
+	if (fstat(dfd, &st) < 0 || shift_fd(ctx, dfd, &st, stats) < 0) {
+		SYSERROR("failed to shift %s", dir);
+		close(dfd);
+		return -1;
+	}
+
+	d = fdopendir(dfd);
+	if (!d) {
+		close(dfd);
+		return -1;
+	}
+	while (ret == 0 && (direntp = readdir(d))) {
+		const char *name = direntp->d_name;
+
+		if (!strcmp(name, ".") || !strcmp(name, ".."))
+			continue;
+		if (fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+			SYSERROR("failed to stat %s/%s", dir, name);
+			ret = -1;
+			break;
+		}
+		/* stay on this filesystem */
+		if (st.st_dev != ctx->dev)
+			continue;
+
+		if (S_ISDIR(st.st_mode)) {
+			char *path;
+
+			if (asprintf(&path, "%s/%s", dir, name) < 0)
+				path = NULL;
+			ret = queue_dir(ctx, path);
+			continue;
+		}
+		if (S_ISREG(st.st_mode) && st.st_nlink > 1) {
+			ret = defer_link(ctx, dir, name, &st);
+			if (ret < 0)
+				SYSERROR("failed to record %s/%s", dir, name);
+			continue;
+		}
+		if (st.st_nlink > 1 && seen_inode(ctx, st.st_ino))
+			continue;
+		if (S_ISREG(st.st_mode)) {
+			fd = openat(dfd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK |
+				    O_NOCTTY | O_CLOEXEC);
+			if (fd >= 0) {
+				ret = shift_fd(ctx, fd, &st, stats);
+				close(fd);
+			} else {
+				ret = shift_at(ctx, dfd, name, &st, stats);
+			}
+		} else {
+			ret = shift_at(ctx, dfd, name, &st, stats);
+		}
+		if (ret < 0)
+			SYSERROR("failed to shift %s/%s", dir, name);
+	}
+	closedir(d);
+	return ret;
+}
+
+static void *idshift_worker(void *data)
+{
+	struct idshift_ctx *ctx = data;
+	struct lxc_shift_stats stats;
+	char *dir;
+	int ret;
+
+	for (;;) {
+		pthread_mutex_lock(&ctx->lock);
+		while (!ctx->nqueue && ctx->busy && !ctx->failed)
+			pthread_cond_wait(&ctx->cond, &ctx->lock);
+		if (!ctx->nqueue || ctx->failed) {
+			/* nothing left and nobody to queue more */
+			pthread_cond_broadcast(&ctx->cond);
+			pthread_mutex_unlock(&ctx->lock);
+			return NULL;
+		}
+		dir = ctx->queue[--ctx->nqueue];
+		ctx->busy++;
+		pthread_mutex_unlock(&ctx->lock);
+
+		memset(&stats, 0, sizeof(stats));
+		ret = shift_dir(ctx, dir, &stats);
+		free(dir);
+
+		pthread_mutex_lock(&ctx->lock);
+		if (ret < 0)
+			ctx->failed = true;
+		ctx->stats.inodes += stats.inodes;
+		ctx->stats.changed += stats.changed;
+		ctx->stats.xattrs += stats.xattrs;
+		ctx->stats.unmapped += stats.unmapped;
+		ctx->stats.copied += stats.copied;
+		ctx->busy--;
+		if (!ctx->busy)
+			pthread_cond_broadcast(&ctx->cond);
+		pthread_mutex_unlock(&ctx->lock);
+	}
+}
+
+int lxc_idshift(const char *path, struct lxc_list *from, struct lxc_list *to,
+		int threads, struct lxc_shift_stats *stats)
+{
+	struct idshift_ctx ctx;
+	struct timespec start, end;
+	struct stat st;
+	pthread_t tids[IDSHIFT_MAX_THREADS];
+	size_t n, next;
+	int i, started = 0, ret = -1;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.from = from;
+	ctx.to = to;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	ctx.rootfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (ctx.rootfd < 0 || fstat(ctx.rootfd, &st) < 0) {
+		SYSERROR("failed to open %s", path);
+		goto out;
+	}
+	ctx.dev = st.st_dev;
+
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads <= 0)
+		threads = 1;
+	if (threads > IDSHIFT_MAX_THREADS)
+		threads = IDSHIFT_MAX_THREADS;
+
+	pthread_mutex_init(&ctx.lock, NULL);
+	pthread_cond_init(&ctx.cond, NULL);
+	if (queue_dir(&ctx, strdup(".")) < 0)
+		goto out_destroy;
+
+	for (i = 1; i < threads; i++) {
+		if (pthread_create(&tids[started], NULL, idshift_worker, &ctx))
+			break;
+		started++;
+	}
+	idshift_worker(&ctx);
+	for (i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+
+	/* the walk is done, so the links of each inode in the tree are known */
+	qsort(ctx.links, ctx.nlinks, sizeof(*ctx.links), cmp_link);
+	for (n = 0; !ctx.failed && n < ctx.nlinks; n = next) {
+		for (next = n + 1; next < ctx.nlinks &&
+		     ctx.links[next].ino == ctx.links[n].ino; next++)
+			;
+		if (shift_links(&ctx, &ctx.links[n], next - n) < 0)
+			ctx.failed = true;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ctx.stats.seconds = (end.tv_sec - start.tv_sec) +
+			    (end.tv_nsec - start.tv_nsec) / 1e9;
+	if (ctx.failed) {
+		ERROR("failed to shift the ids under %s", path);
+	} else {
+		INFO("shifted %llu of %llu inodes and %llu xattrs under %s in %.2fs "
+		     "(%.0f inodes/s, %d threads)",
+		     (unsigned long long)ctx.stats.changed,
+		     (unsigned long long)ctx.stats.inodes,
+		     (unsigned long long)ctx.stats.xattrs, path, ctx.stats.seconds,
+		     ctx.stats.seconds > 0 ? ctx.stats.inodes / ctx.stats.seconds : 0,
+		     started + 1);
+		if (ctx.stats.copied)
+			INFO("copied up %llu files linked from outside of %s",
+			     (unsigned long long)ctx.stats.copied, path);
+		if (ctx.stats.unmapped)
+			WARN("%llu ids under %s have no mapping and were left alone",
+			     (unsigned long long)ctx.stats.unmapped, path);
+		ret = 0;
+	}
+	if (stats)
+		*stats = ctx.stats;
+
+	for (i = 0; i < ctx.nqueue; i++)
+		free(ctx.queue[i]);
+	free(ctx.queue);
+	free(ctx.inos);
+	for (n = 0; n < ctx.nlinks; n++)
+		free(ctx.links[n].path);
+	free(ctx.links);
+out_destroy:
+	pthread_cond_destroy(&ctx.cond);
+	pthread_mutex_destroy(&ctx.lock);
+out:
+	if (ctx.rootfd >= 0)
+		close(ctx.rootfd);
+	return ret;
+}
@@ -0,0 +1,43 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef __LXC_IDSHIFT_H
+#define __LXC_IDSHIFT_H
+
+#include <lxc/lxccontainer.h>
+
+struct lxc_list;
+
+/*
+ * Re-own the tree under path, which does not cross mount points: an id
+ * owned as container id N under the 'from' id map (a list of struct
+ * id_map, or NULL if the tree is not shifted) is changed to the host id
+ * of container id N under the 'to' id map (or to N if 'to' is NULL).
+ * POSIX ACLs and file capabilities are shifted along, and the setuid and
+ * setgid bits which chown clears are restored.  Ids which either map does
+ * not cover are left alone.  A regular file with links outside of the
+ * tree is copied up first, and its links in the tree point to the copy.
+ *
+ * The tree is walked by 'threads' workers (the number of cpus if <= 0),
+ * each taking whole directories.  Returns 0 on success, with the counters
+ * in stats if not NULL.
+ */
+extern int lxc_idshift(const char *path, struct lxc_list *from,
+		       struct lxc_list *to, int threads,
+		       struct lxc_shift_stats *stats);
+
+#endif
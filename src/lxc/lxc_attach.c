@@ -27,6 +27,8 @@
 #include <sys/types.h>
 #include <stdlib.h>
 
+#include <lxc/lxccontainer.h>
+
 #include "attach.h"
 #include "arguments.h"
 #include "config.h"
@@ -48,6 +50,9 @@ static const struct option my_longopts[] = {
 	{"keep-env", no_argument, 0, 501},
 	{"keep-var", required_argument, 0, 502},
 	{"set-var", required_argument, 0, 'v'},
+	{"all", no_argument, 0, 503},
+	{"groups", required_argument, 0, 504},
+	{"workers", required_argument, 0, 505},
 	LXC_COMMON_OPTIONS
 };
 
@@ -60,6 +65,7 @@ static char **extra_env = NULL;
 static ssize_t extra_env_size = 0;
 static char **extra_keep = NULL;
 static ssize_t extra_keep_size = 0;
+static int workers = 0;
 
 static int add_to_simple_array(char ***array, ssize_t *capacity, char *value)
 {
@@ -133,6 +139,15 @@ static int my_parser(struct lxc_arguments* args, int c, char* arg)
 			return -1;
 		}
 		break;
+	case 503: args->all = 1; break;
+	case 504: args->groups = arg; break;
+	case 505:
+		workers = lxc_arguments_str_to_int(args, arg);
+		if (workers <= 0) {
+			lxc_error(args, "invalid number of workers: %s", arg);
+			return -1;
+		}
+		break;
 	}
 
 	return 0;
@@ -142,6 +157,7 @@ static struct lxc_arguments my_args = {
 	.progname = "lxc-attach",
 	.help     = "\
 --name=NAME [-- COMMAND]\n\
+lxc-attach --all|--groups=GROUPS -- COMMAND\n\
 \n\
 Execute the specified COMMAND - enter the container NAME\n\
 \n\
@@ -180,12 +196,119 @@ Options :\n\
                     multiple times.\n\
       --keep-var    Keep an additional environment variable. Only\n\
                     applicable if --clear-env is specified. May be used\n\
-                    multiple times.\n",
+                    multiple times.\n\
+      --all         Run COMMAND in all running containers.\n\
+      --groups=GROUPS\n\
+                    Run COMMAND in the running containers of any of the\n\
+                    comma separated GROUPS.\n\
+      --workers=N   Attach to at most N containers at once with --all\n\
+                    or --groups.\n",
 	.options  = my_longopts,
 	.parser   = my_parser,
 	.checker  = NULL,
 };
 
+static bool in_groups(struct lxc_container *c, const char *groups)
+{
+	char *value, *list, *group, *saveptr, *p;
+	bool found = false;
+	size_t len;
+	int ret;
+
+	ret = c->get_config_item(c, "lxc.group", NULL, 0);
+	if (ret <= 0)
+		return false;
+
+	value = malloc(ret + 1);
+	list = strdup(groups);
+	if (!value || !list ||
+	    c->get_config_item(c, "lxc.group", value, ret + 1) != ret)
+		goto out;
+
+	/* lxc.group values are newline separated */
+	for (group = strtok_r(list, ",", &saveptr); group && !found;
+	     group = strtok_r(NULL, ",", &saveptr)) {
+		len = strlen(group);
+		for (p = value; *p && !found; p = strchrnul(p, '\n')) {
+			if (*p == '\n')
+				p++;
+			found = strncmp(p, group, len) == 0 &&
+				(p[len] == '\n' || p[len] == '\0');
+		}
+	}
+
+out:
+	free(value);
+	free(list);
+	return found;
+}
+
+static void print_prefixed(FILE *f, const char *name, const char *buf, size_t len)
+{
+	const char *end = buf + len, *nl;
+
+	while (buf && buf < end) {
+		nl = memchr(buf, '\n', end - buf);
+		fprintf(f, "%s: ", name);
+		fwrite(buf, 1, (nl ? nl : end) - buf, f);
+		fputc('\n', f);
+		buf = nl ? nl + 1 : end;
+	}
+}
+
+static void print_result(struct lxc_container *c, const lxc_attach_result_t *result,
+			 void *data)
+{
+	int *failed = data;
+
+	print_prefixed(stdout, c->name, result->out, result->out_len);
+	fflush(stdout);
+	print_prefixed(stderr, c->name, result->err, result->err_len);
+
+	if (result->status == -1)
+		fprintf(stderr, "%s: failed to run command\n", c->name);
+	else if (!WIFEXITED(result->status))
+		fprintf(stderr, "%s: command killed by signal %d\n", c->name,
+			WTERMSIG(result->status));
+	else if (WEXITSTATUS(result->status))
+		fprintf(stderr, "%s: command exited with status %d\n", c->name,
+			WEXITSTATUS(result->status));
+	else
+		return;
+
+	(*failed)++;
+}
+
+static int attach_many(lxc_attach_options_t *options, lxc_attach_command_t *command)
+{
+	struct lxc_container **cs = NULL;
+	int i, n = 0, count, failed = 0, ret;
+
+	count = list_active_containers(my_args.lxcpath[0], NULL, &cs);
+	if (count < 0)
+		return -1;
+
+	for (i = 0; i < count; i++) {
+		if (!my_args.all && !in_groups(cs[i], my_args.groups)) {
+			lxc_container_put(cs[i]);
+			continue;
+		}
+		cs[n++] = cs[i];
+	}
+
+	ret = lxc_attach_fanout(cs, n, options, command, workers, print_result, &failed);
+	if (ret < 0)
+		ERROR("failed to attach to the containers");
+
+	for (i = 0; i < n; i++)
+		lxc_container_put(cs[i]);
+	free(cs);
+
+	if (ret < 0)
+		return -1;
+	return failed ? 1 : 0;
+}
+
 int main(int argc, char *argv[])
 {
 	int ret;
@@ -220,6 +343,16 @@ int main(int argc, char *argv[])
 	attach_options.extra_env_vars = extra_env;
 	attach_options.extra_keep_env = extra_keep;
 
+	if (my_args.all || my_args.groups) {
+		if (!my_args.argc) {
+			lxc_error(&my_args, "--all and --groups need a command");
+			return -1;
+		}
+		command.program = my_args.argv[0];
+		command.argv = (char**)my_args.argv;
+		return attach_many(&attach_options, &command);
+	}
+
 	if (my_args.argc) {
 		command.program = my_args.argv[0];
 		command.argv = (char**)my_args.argv;
@@ -74,10 +74,13 @@ static uint64_t get_fssize(char *s)
 
 static void usage(const char *me)
 {
-	printf("Usage: %s [-s] [-B backingstore] [-L size[unit]] [-K] [-M] [-H]\n", me);
-	printf("          [-p lxcpath] [-P newlxcpath] orig new\n");
+	printf("Usage: %s [-s] [-D] [-B backingstore] [-L size[unit]] [-K] [-M] [-H]\n", me);
+	printf("          [-p lxcpath] [-P newlxcpath] [-I idmap]... orig new\n");
 	printf("\n");
 	printf("  -s: snapshot rather than copy\n");
+	printf("  -D: copy a dir or loop rootfs sharing the files it has in common\n");
+	printf("      with the containers in newlxcpath: hardlinks for files under\n");
+	printf("      /usr, /bin, /sbin and /lib, reflinks where supported\n");
 	printf("  -B: use specified new backingstore.  Default is the same as\n");
 	printf("      the original.  Options include aufs, btrfs, lvm, overlayfs, \n");
 	printf("      dir and loop\n");
@@ -88,11 +91,45 @@ static void usage(const char *me)
 	printf("  -M: Keep macaddr - do not choose a random new mac address\n");
 	printf("  -p: use container orig from custom lxcpath\n");
 	printf("  -P: create container new in custom lxcpath\n");
+	printf("  -I: give new the id map entry idmap (as in lxc.id_map, i.e.\n");
+	printf("      'u 0 100000 65536'), and shift the ownership of its\n");
+	printf("      rootfs accordingly.  Can be repeated.  Not for snapshots\n");
 	exit(1);
 }
 
+/*
+ * Give c2 the id map entries idmaps, replacing the ones it inherited from
+ * c1, and shift the rootfs copied from c1 accordingly.
+ */
+static bool shift_clone(struct lxc_container *c1, struct lxc_container *c2,
+			char **idmaps, int nidmaps)
+{
+	struct lxc_shift_stats stats;
+	int i;
+
+	if (!c2->set_config_item(c2, "lxc.id_map", ""))
+		return false;
+	for (i = 0; i < nidmaps; i++) {
+		if (!c2->set_config_item(c2, "lxc.id_map", idmaps[i])) {
+			fprintf(stderr, "Error: bad id map '%s'\n", idmaps[i]);
+			return false;
+		}
+	}
+	if (!c2->save_config(c2, NULL))
+		return false;
+
+	if (!lxc_shift_rootfs(c2, c1, 0, &stats))
+		return false;
+	printf("Shifted %llu of %llu inodes in %.2fs (%.0f inodes/s)\n",
+		(unsigned long long)stats.changed,
+		(unsigned long long)stats.inodes, stats.seconds,
+		stats.seconds > 0 ? stats.inodes / stats.seconds : 0);
+	return true;
+}
+
 static struct option options[] = {
 	{ "snapshot", no_argument, 0, 's'},
+	{ "dedup", no_argument, 0, 'D'},
 	{ "backingstore", required_argument, 0, 'B'},
 	{ "size", required_argument, 0, 'L'},
 	{ "orig", required_argument, 0, 'o'},
@@ -103,6 +140,7 @@ static struct option options[] = {
 	{ "lxcpath", required_argument, 0, 'p'},
 	{ "newpath", required_argument, 0, 'P'},
 	{ "fstype", required_argument, 0, 't'},
+	{ "idmap", required_argument, 0, 'I'},
 	{ "help", no_argument, 0, 'h'},
 	{ 0, 0, 0, 0 },
 };
@@ -110,23 +148,26 @@ static struct option options[] = {
 int main(int argc, char *argv[])
 {
 	struct lxc_container *c1 = NULL, *c2 = NULL;
-	int snapshot = 0, keepname = 0, keepmac = 0;
+	int snapshot = 0, dedup = 0, keepname = 0, keepmac = 0;
 	int flags = 0, option_index;
 	uint64_t newsize = 0;
 	char *bdevtype = NULL, *lxcpath = NULL, *newpath = NULL, *fstype = NULL;
 	char *orig = NULL, *new = NULL, *vgname = NULL;
 	char **args = NULL;
+	char **idmaps = NULL;
+	int nidmaps = 0;
 	int c;
 
 	if (argc < 3)
 		usage(argv[0]);
 
 	while (1) {
-		c = getopt_long(argc, argv, "sB:L:o:n:v:KMHp:P:t:h", options, &option_index);
+		c = getopt_long(argc, argv, "sDB:L:o:n:v:KMHp:P:t:I:h", options, &option_index);
 		if (c == -1)
 			break;
 		switch (c) {
 		case 's': snapshot = 1; break;
+		case 'D': dedup = 1; break;
 		case 'B': bdevtype = optarg; break;
 		case 'L': newsize = get_fssize(optarg); break;
 		case 'o': orig = optarg; break;
@@ -137,6 +178,12 @@ int main(int argc, char *argv[])
 		case 'p': lxcpath = optarg; break;
 		case 'P': newpath = optarg; break;
 		case 't': fstype = optarg; break;
+		case 'I':
+			idmaps = realloc(idmaps, (nidmaps + 1) * sizeof(*idmaps));
+			if (!idmaps)
+				exit(1);
+			idmaps[nidmaps++] = optarg;
+			break;
 		case 'h': usage(argv[0]);
 		default: break;
 		}
@@ -154,6 +201,7 @@ int main(int argc, char *argv[])
 	}
 
 	if (snapshot)  flags |= LXC_CLONE_SNAPSHOT;
+	if (dedup)     flags |= LXC_CLONE_DEDUP;
 	if (keepname)  flags |= LXC_CLONE_KEEPNAME;
 	if (keepmac)   flags |= LXC_CLONE_KEEPMACADDR;
 
@@ -168,6 +216,14 @@ int main(int argc, char *argv[])
 		printf("Error: fstype not supported\n");
 		usage(argv[0]);
 	}
+	if (nidmaps && snapshot) {
+		printf("Error: a snapshot shares its original's files, it cannot get its own id map\n");
+		usage(argv[0]);
+	}
+	if (nidmaps && dedup) {
+		printf("Error: a dedup copy shares files with other containers, it cannot get its own id map\n");
+		usage(argv[0]);
+	}
 
 	c1 = lxc_container_new(orig, lxcpath);
 	if (!c1)
@@ -192,6 +248,12 @@ int main(int argc, char *argv[])
 	}
 	printf("Created container %s as %s of %s\n", new,
 		snapshot ? "snapshot" : "copy", orig);
+	if (nidmaps && !shift_clone(c1, c2, idmaps, nidmaps)) {
+		fprintf(stderr, "Error: failed to shift %s to its new id map\n", new);
+		lxc_container_put(c1);
+		lxc_container_put(c2);
+		exit(1);
+	}
 	lxc_container_put(c1);
 	lxc_container_put(c2);
 	return(0);
@@ -81,6 +81,8 @@ static int my_parser(struct lxc_arguments* args, int c, char* arg)
 	case '4': args->fssize = get_fssize(arg); break;
 	case '5': args->zfsroot = arg; break;
 	case '6': args->dir = arg; break;
+	case '7': args->image = arg; break;
+	case '8': args->cache = 1; break;
 	}
 	return 0;
 }
@@ -96,6 +98,8 @@ static const struct option my_longopts[] = {
 	{"fssize", required_argument, 0, '4'},
 	{"zfsroot", required_argument, 0, '5'},
 	{"dir", required_argument, 0, '6'},
+	{"image", required_argument, 0, '7'},
+	{"cache", no_argument, 0, '8'},
 	LXC_COMMON_OPTIONS
 };
 
@@ -153,8 +157,14 @@ Options :\n\
   --fssize=SIZE[U]   Create filesystem of size SIZE * unit U (bBkKmMgGtT)\n\
                      (Default: 1G, default unit: M)\n\
   --dir=DIR          Place rootfs directory under DIR\n\
+                     (with -B image, build the image from DIR)\n\
   --zfsroot=PATH     Create zfs under given zfsroot\n\
-                     (Default: tank/lxc)\n",
+                     (Default: tank/lxc)\n\
+  --image=NAME       With -B pool, layer the rootfs over the pool image\n\
+                     NAME, registering container NAME's rootfs as that\n\
+                     image if it is not in the pool yet\n\
+  --cache            Keep the template result in PATH/.cache and clone it\n\
+                     when creating with the same template and options\n",
 	.options  = my_longopts,
 	.parser   = my_parser,
 	.checker  = NULL,
@@ -165,7 +175,8 @@ static bool validate_bdev_args(struct lxc_arguments *a)
 	if (strcmp(a->bdevtype, "best") != 0) {
 		if (a->fstype || a->fssize) {
 			if (strcmp(a->bdevtype, "lvm") != 0 &&
-			    strcmp(a->bdevtype, "loop") != 0) {
+			    strcmp(a->bdevtype, "loop") != 0 &&
+			    strcmp(a->bdevtype, "image") != 0) {
 				fprintf(stderr, "filesystem type and size are only valid with block devices\n");
 				return false;
 			}
@@ -182,6 +193,14 @@ static bool validate_bdev_args(struct lxc_arguments *a)
 				return false;
 			}
 		}
+		if (strcmp(a->bdevtype, "image") == 0 && !a->dir) {
+			fprintf(stderr, "-B image needs --dir, the rootfs to build the image from\n");
+			return false;
+		}
+		if ((strcmp(a->bdevtype, "pool") == 0) != !!a->image) {
+			fprintf(stderr, "--image is needed by and only valid with -B pool\n");
+			return false;
+		}
 	}
 	return true;
 }
@@ -258,11 +277,17 @@ int main(int argc, char *argv[])
 	if (my_args.dir) {
 		spec.dir = my_args.dir;
 	}
+	if (my_args.image) {
+		spec.pool.image = my_args.image;
+		spec.pool.lxcpath = (char *)my_args.lxcpath[0];
+	}
 
 	if (strcmp(my_args.bdevtype, "_unset") == 0)
 		my_args.bdevtype = NULL;
 	if (my_args.quiet)
 		flags = LXC_CREATE_QUIET;
+	if (my_args.cache)
+		flags |= LXC_CREATE_CACHE;
 	if (!c->create(c, my_args.template, my_args.bdevtype, &spec, flags, &argv[optind])) {
 		ERROR("Error creating container %s", c->name);
 		lxc_container_put(c);
@@ -36,6 +36,7 @@
 #include "utils.h"
 #include "commands.h"
 #include "arguments.h"
+#include "bdev.h"
 
 lxc_log_define(lxc_info_ui, lxc);
 
@@ -246,6 +247,20 @@ static void print_stats(struct lxc_container *c)
 	}
 }
 
+static void print_pool_stats(struct lxc_container *c)
+{
+	char src[PATH_MAX], image[NAME_MAX + 1];
+	int users;
+
+	if (c->get_config_item(c, "lxc.rootfs", src, sizeof(src)) <= 0)
+		return;
+	users = bdev_pool_lookup(src, image, sizeof(image));
+	if (users < 0)
+		return;
+	printf("%-15s %s\n", "Pool image:", image);
+	printf("%-15s %d\n", "Pool users:", users);
+}
+
 static void print_info_msg_int(const char *key, int value)
 {
 	if (humanize)
@@ -329,6 +344,7 @@ static int print_info(const char *name, const char *lxcpath)
 	if (stats) {
 		print_stats(c);
 		print_net_stats(c);
+		print_pool_stats(c);
 	}
 
 	for(i = 0; i < keys; i++) {
@@ -45,29 +45,47 @@
 #include "utils.h"
 
 #define CLIENTFDS_CHUNK 64
+#define LXC_MONITORD_EVENTS 256
+#define LXC_MONITORD_IDLE_MS (30 * 1000)
 
 lxc_log_define(lxc_monitord, lxc);
 
 static void lxc_monitord_cleanup(void);
 
+struct lxc_monitor;
+
+/*
+ * Defines an accepted subscriber
+ * @mon : the monitor the client is connected to
+ * @fd  : the client socket
+ * @idx : position of the client in mon->clients
+ */
+struct lxc_monitor_client {
+	struct lxc_monitor *mon;
+	int fd;
+	int idx;
+};
+
 /*
  * Defines the structure to store the monitor information
  * @lxcpath        : the path being monitored
  * @fifofd         : the file descriptor for publishers (containers) to write state
  * @listenfd       : the file descriptor for subscribers (lxc-monitors) to connect
- * @clientfds      : accepted client file descriptors
- * @clientfds_size : number of file descriptors clientfds can hold
- * @clientfds_cnt  : the count of valid fds in clientfds
+ * @clients        : accepted clients
+ * @clientfds_size : number of clients the clients array can hold
+ * @clientfds_cnt  : the count of valid entries in clients
  * @descr          : the lxc_mainloop state
+ * @idle_timer     : exits the monitor once it has no clients for a while
  */
 struct lxc_monitor {
 	const char *lxcpath;
 	int fifofd;
 	int listenfd;
-	int *clientfds;
+	struct lxc_monitor_client **clients;
 	int clientfds_size;
 	int clientfds_cnt;
 	struct lxc_epoll_descr descr;
+	struct lxc_mainloop_timer *idle_timer;
 };
 
 static struct lxc_monitor mon;
@@ -110,32 +128,34 @@ static int lxc_monitord_fifo_delete(struct lxc_monitor *mon)
 	return 0;
 }
 
-static void lxc_monitord_sockfd_remove(struct lxc_monitor *mon, int fd) {
-	int i;
+static void lxc_monitord_sockfd_remove(struct lxc_monitor_client *client) {
+	struct lxc_monitor *mon = client->mon;
+	int i = client->idx;
 
-	if (lxc_mainloop_del_handler(&mon->descr, fd))
-		CRIT("fd:%d not found in mainloop", fd);
-	close(fd);
+	if (lxc_mainloop_del_handler(&mon->descr, client->fd))
+		CRIT("fd:%d not found in mainloop", client->fd);
+	close(client->fd);
 
-	for (i = 0; i < mon->clientfds_cnt; i++) {
-		if (mon->clientfds[i] == fd)
-			break;
-	}
-	if (i >= mon->clientfds_cnt) {
-		CRIT("fd:%d not found in clients array", fd);
+	if (i >= mon->clientfds_cnt || mon->clients[i] != client) {
+		CRIT("fd:%d not found in clients array", client->fd);
 		lxc_monitord_cleanup();
 		exit(EXIT_FAILURE);
 	}
 
-	memmove(&mon->clientfds[i], &mon->clientfds[i+1],
-		(mon->clientfds_cnt - i - 1) * sizeof(mon->clientfds[0]));
-	mon->clientfds_cnt--;
+	/* order does not matter, move the last client into the hole */
+	mon->clients[i] = mon->clients[--mon->clientfds_cnt];
+	mon->clients[i]->idx = i;
+	free(client);
+
+	if (!mon->clientfds_cnt && mon->idle_timer)
+		lxc_mainloop_mod_timer(&mon->descr, mon->idle_timer,
+				       LXC_MONITORD_IDLE_MS);
 }
 
 static int lxc_monitord_sock_handler(int fd, uint32_t events, void *data,
 				     struct lxc_epoll_descr *descr)
 {
-	struct lxc_monitor *mon = data;
+	struct lxc_monitor_client *client = data;
 
 	if (events & EPOLLIN) {
 		int rc;
@@ -147,7 +167,7 @@ static int lxc_monitord_sock_handler(int fd, uint32_t events, void *data,
 	}
 
 	if (events & EPOLLHUP)
-		lxc_monitord_sockfd_remove(mon, fd);
+		lxc_monitord_sockfd_remove(client);
 	return quit;
 }
 
@@ -156,6 +176,7 @@ static int lxc_monitord_sock_accept(int fd, uint32_t events, void *data,
 {
 	int ret,clientfd;
 	struct lxc_monitor *mon = data;
+	struct lxc_monitor_client *client;
 	struct ucred cred;
 	socklen_t credsz = sizeof(cred);
 
@@ -183,31 +204,42 @@ static int lxc_monitord_sock_accept(int fd, uint32_t events, void *data,
 	}
 
 	if (mon->clientfds_cnt + 1 > mon->clientfds_size) {
-		int *clientfds;
+		struct lxc_monitor_client **clients;
 		DEBUG("realloc space for %d clientfds",
 		      mon->clientfds_size + CLIENTFDS_CHUNK);
-		clientfds = realloc(mon->clientfds,
-				    (mon->clientfds_size + CLIENTFDS_CHUNK) *
-				     sizeof(mon->clientfds[0]));
-		if (clientfds == NULL) {
+		clients = realloc(mon->clients,
+				  (mon->clientfds_size + CLIENTFDS_CHUNK) *
+				   sizeof(mon->clients[0]));
+		if (clients == NULL) {
 			ERROR("failed to realloc memory for clientfds");
 			goto err1;
 		}
-		mon->clientfds = clientfds;
+		mon->clients = clients;
 		mon->clientfds_size += CLIENTFDS_CHUNK;
 	}
 
+	client = malloc(sizeof(*client));
+	if (!client) {
+		ERROR("failed to allocate client");
+		goto err1;
+	}
+	client->mon = mon;
+	client->fd = clientfd;
+	client->idx = mon->clientfds_cnt;
+
 	ret = lxc_mainloop_add_handler(&mon->descr, clientfd,
-				       lxc_monitord_sock_handler, mon);
+				       lxc_monitord_sock_handler, client);
 	if (ret) {
 		ERROR("failed to add socket handler");
-		goto err1;
+		goto err2;
 	}
 
-	mon->clientfds[mon->clientfds_cnt++] = clientfd;
+	mon->clients[mon->clientfds_cnt++] = client;
 	INFO("accepted client fd:%d clients:%d", clientfd, mon->clientfds_cnt);
 	goto out;
 
+err2:
+	free(client);
 err1:
 	close(clientfd);
 out:
@@ -268,8 +300,9 @@ static void lxc_monitord_delete(struct lxc_monitor *mon)
 	lxc_monitord_fifo_delete(mon);
 
 	for (i = 0; i < mon->clientfds_cnt; i++) {
-		lxc_mainloop_del_handler(&mon->descr, mon->clientfds[i]);
-		close(mon->clientfds[i]);
+		lxc_mainloop_del_handler(&mon->descr, mon->clients[i]->fd);
+		close(mon->clients[i]->fd);
+		free(mon->clients[i]);
 	}
 	mon->clientfds_cnt = 0;
 }
@@ -288,17 +321,25 @@ static int lxc_monitord_fifo_handler(int fd, uint32_t events, void *data,
 	}
 
 	for (i = 0; i < mon->clientfds_cnt; i++) {
-		DEBUG("writing client fd:%d", mon->clientfds[i]);
-		ret = write(mon->clientfds[i], &msglxc, sizeof(msglxc));
+		DEBUG("writing client fd:%d", mon->clients[i]->fd);
+		ret = write(mon->clients[i]->fd, &msglxc, sizeof(msglxc));
 		if (ret < 0) {
 			ERROR("write failed to client sock:%d %d %s",
-			      mon->clientfds[i], errno, strerror(errno));
+			      mon->clients[i]->fd, errno, strerror(errno));
 		}
 	}
 
 	return 0;
 }
 
+static int lxc_monitord_idle_handler(void *data, struct lxc_epoll_descr *descr)
+{
+	struct lxc_monitor *mon = data;
+
+	/* rearmed when the last client goes away */
+	return mon->clientfds_cnt <= 0;
+}
+
 static int lxc_monitord_mainloop_add(struct lxc_monitor *mon)
 {
 	int ret;
@@ -317,6 +358,14 @@ static int lxc_monitord_mainloop_add(struct lxc_monitor *mon)
 		return -1;
 	}
 
+	mon->idle_timer = lxc_mainloop_add_timer(&mon->descr,
+						 LXC_MONITORD_IDLE_MS, 0,
+						 lxc_monitord_idle_handler, mon);
+	if (!mon->idle_timer) {
+		ERROR("failed to add to mainloop monitor idle timer");
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -377,7 +426,7 @@ int main(int argc, char *argv[])
 	ret = EXIT_FAILURE;
 	memset(&mon, 0, sizeof(mon));
 	mon.lxcpath = lxcpath;
-	if (lxc_mainloop_open(&mon.descr)) {
+	if (lxc_mainloop_open_size(&mon.descr, LXC_MONITORD_EVENTS)) {
 		ERROR("failed to create mainloop");
 		goto out;
 	}
@@ -403,7 +452,7 @@ int main(int argc, char *argv[])
 
 	NOTICE("monitoring lxcpath %s", mon.lxcpath);
 	for(;;) {
-		ret = lxc_mainloop(&mon.descr, 1000 * 30);
+		ret = lxc_mainloop(&mon.descr, -1);
 		if (mon.clientfds_cnt <= 0)
 		{
 			NOTICE("no remaining clients, exiting");
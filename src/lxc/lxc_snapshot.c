@@ -37,13 +37,18 @@ lxc_log_define(lxc_snapshot_ui, lxc);
 
 static char *newname;
 static char *snapshot;
+static char *basesnap;
+static int export_flags;
 
 #define DO_SNAP 0
 #define DO_LIST 1
 #define DO_RESTORE 2
 #define DO_DESTROY 3
+#define DO_EXPORT 4
+#define DO_IMPORT 5
 static int action;
 static int print_comments;
+static int print_sizes;
 static char *commentfile;
 
 static int do_snapshot(struct lxc_container *c)
@@ -77,10 +82,34 @@ static void print_file(char *path)
 	fclose(f);
 }
 
+static void print_size(struct lxc_snapshot_info *info, int ninfo, char *name)
+{
+	const char *units = "KMGT";
+	double size;
+	int i, u;
+
+	for (i = 0; i < ninfo; i++)
+		if (strcmp(info[i].name, name) == 0)
+			break;
+	if (i == ninfo) {
+		printf("\n");
+		return;
+	}
+
+	size = info[i].size;
+	for (u = -1; size >= 1024 && u < 3; u++)
+		size /= 1024;
+	if (u < 0)
+		printf(" %s %.0fB\n", info[i].bdev_type, size);
+	else
+		printf(" %s %.1f%ciB\n", info[i].bdev_type, size, units[u]);
+}
+
 static int do_list_snapshots(struct lxc_container *c)
 {
 	struct lxc_snapshot *s;
-	int i, n;
+	struct lxc_snapshot_info *info = NULL;
+	int i, n, ninfo = 0;
 
 	n = c->snapshot_list(c, &s);
 	if (n < 0) {
@@ -91,13 +120,23 @@ static int do_list_snapshots(struct lxc_container *c)
 		printf("No snapshots\n");
 		return 0;
 	}
+	if (print_sizes) {
+		ninfo = lxc_snapshot_index(c, &info);
+		if (ninfo < 0)
+			ninfo = 0;
+	}
 	for (i=0; i<n; i++) {
-		printf("%s (%s) %s\n", s[i].name, s[i].lxcpath, s[i].timestamp);
+		printf("%s (%s) %s", s[i].name, s[i].lxcpath, s[i].timestamp);
+		if (print_sizes)
+			print_size(info, ninfo, s[i].name);
+		else
+			printf("\n");
 		if (print_comments)
 			print_file(s[i].comment_pathname);
 		s[i].free(&s[i]);
 	}
 	free(s);
+	lxc_snapshot_info_free(info, ninfo);
 	return 0;
 }
 
@@ -119,6 +158,29 @@ static int do_destroy_snapshots(struct lxc_container *c)
 	return -1;
 }
 
+static int do_export_snapshot(struct lxc_container *c)
+{
+	if (isatty(STDOUT_FILENO)) {
+		ERROR("Not writing the stream to a terminal");
+		return -1;
+	}
+	if (lxc_snapshot_export(c, snapshot, basesnap, export_flags,
+				STDOUT_FILENO) == 0)
+		return 0;
+
+	ERROR("Error exporting snapshot %s", snapshot);
+	return -1;
+}
+
+static int do_import_snapshot(const char *name, const char *lxcpath)
+{
+	if (lxc_snapshot_import(name, lxcpath, STDIN_FILENO) == 0)
+		return 0;
+
+	ERROR("Error importing %s", name);
+	return -1;
+}
+
 static int my_parser(struct lxc_arguments* args, int c, char* arg)
 {
 	switch (c) {
@@ -127,6 +189,11 @@ static int my_parser(struct lxc_arguments* args, int c, char* arg)
 	case 'd': snapshot = arg; action = DO_DESTROY; break;
 	case 'c': commentfile = arg; break;
 	case 'C': print_comments = true; break;
+	case 'S': print_sizes = true; break;
+	case 'e': snapshot = arg; action = DO_EXPORT; break;
+	case 'b': basesnap = arg; break;
+	case 't': export_flags |= LXC_EXPORT_TAR; break;
+	case 'i': action = DO_IMPORT; break;
 	}
 	return 0;
 }
@@ -137,6 +204,11 @@ static const struct option my_longopts[] = {
 	{"destroy", required_argument, 0, 'd'},
 	{"comment", required_argument, 0, 'c'},
 	{"showcomments", no_argument, 0, 'C'},
+	{"showsizes", no_argument, 0, 'S'},
+	{"export", required_argument, 0, 'e'},
+	{"base", required_argument, 0, 'b'},
+	{"tar", no_argument, 0, 't'},
+	{"import", no_argument, 0, 'i'},
 	LXC_COMMON_OPTIONS
 };
 
@@ -144,7 +216,8 @@ static const struct option my_longopts[] = {
 static struct lxc_arguments my_args = {
 	.progname = "lxc-snapshot",
 	.help     = "\
---name=NAME [-P lxcpath] [-L [-C]] [-c commentfile] [-r snapname [newname]]\n\
+--name=NAME [-P lxcpath] [-L [-C] [-S]] [-c commentfile] [-r snapname [newname]]\n\
+       [-e snapname [-b basename] [-t]] [-i]\n\
 \n\
 lxc-snapshot snapshots a container\n\
 \n\
@@ -152,9 +225,14 @@ Options :\n\
   -n, --name=NAME   NAME for name of the container\n\
   -L, --list          list snapshots\n\
   -C, --showcomments  show snapshot comments in list\n\
+  -S, --showsizes     show snapshot backing store types and sizes in list\n\
   -c, --comment=file  add file as a comment\n\
   -r, --restore=name  restore snapshot name, i.e. 'snap0'\n\
-  -d, --destroy=name  destroy snapshot name, i.e. 'snap0'\n",
+  -d, --destroy=name  destroy snapshot name, i.e. 'snap0'\n\
+  -e, --export=name   write snapshot name to stdout as a stream\n\
+  -b, --base=name     only export the changes since snapshot name\n\
+  -t, --tar           export the rootfs as tar, even from btrfs or zfs\n\
+  -i, --import        create or update the container from a stream on stdin\n",
 	.options  = my_longopts,
 	.parser   = my_parser,
 	.checker  = NULL,
@@ -164,6 +242,7 @@ Options :\n\
  * lxc-snapshot -P lxcpath -n container
  * lxc-snapshot -P lxcpath -n container -l
  * lxc-snapshot -P lxcpath -n container -r snap3 recovered_1
+ * lxc-snapshot -P lxcpath -n container -e snap3 -b snap2 | ssh host lxc-snapshot -n container -i
  */
 
 int main(int argc, char *argv[])
@@ -196,6 +275,9 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (action == DO_IMPORT)
+		exit(do_import_snapshot(my_args.name, my_args.lxcpath[0]));
+
 	c = lxc_container_new(my_args.name, my_args.lxcpath[0]);
 	if (!c) {
 		fprintf(stderr, "System error loading container\n");
@@ -221,6 +303,9 @@ int main(int argc, char *argv[])
 	case DO_DESTROY:
 		ret = do_destroy_snapshots(c);
 		break;
+	case DO_EXPORT:
+		ret = do_export_snapshot(c);
+		break;
 	}
 
 	lxc_container_put(c);
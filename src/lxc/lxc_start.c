@@ -81,6 +81,7 @@ static int ensure_path(char **confpath, const char *path)
 			goto err;
 		}
 
+		free(*confpath);
 		*confpath = strdup(fullpath);
 		if (!*confpath) {
 			ERROR("failed to dup string '%s'", fullpath);
@@ -0,0 +1,36 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "supervisor.h"
+
+int main(int argc, char *argv[])
+{
+	if (argc != 3) {
+		fprintf(stderr,
+			"Usage: lxc-supervisor lxcpath sync-pipe-fd\n\n"
+			"NOTE: lxc-supervisor is intended for use by lxc internally\n"
+			"      and does not need to be run by hand\n\n");
+		exit(EXIT_FAILURE);
+	}
+
+	return lxc_supervisor_main(argv[1], atoi(argv[2]));
+}
@@ -34,8 +34,13 @@
 #include <arpa/inet.h>
 #include <libgen.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <grp.h>
 #include <sys/syscall.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/utsname.h>
+#include <linux/netlink.h>
 
 #include <lxc/lxccontainer.h>
 #include <lxc/version.h>
@@ -55,6 +60,12 @@
 #include "monitor.h"
 #include "namespace.h"
 #include "lxclock.h"
+#include "supervisor.h"
+#include "nl.h"
+#include "network.h"
+#include "idshift.h"
+#include "asyncop.h"
+#include "snapstream.h"
 
 #if HAVE_IFADDRS_H
 #include <ifaddrs.h>
@@ -216,6 +227,28 @@ static void remove_partial(struct lxc_container *c, int fd)
  * Do not ever use a lxccontainer whose numthreads you did not bump.
  */
 
+/*
+ * Route netlink socket living in the network namespace of a running
+ * container, kept around so that get_interfaces and get_ips do not have
+ * to fork and setns on every call.  The namespace inode tells whether
+ * the container has been restarted since the socket was opened.
+ */
+struct lxc_netns_cache {
+	dev_t dev;
+	ino_t ino;
+	struct nl_handler nlh;
+};
+
+static void netns_cache_drop(struct lxc_container *c)
+{
+	if (!c->netns)
+		return;
+
+	netlink_close(&c->netns->nlh);
+	free(c->netns);
+	c->netns = NULL;
+}
+
 static void lxc_container_free(struct lxc_container *c)
 {
 	if (!c)
@@ -249,6 +282,7 @@ static void lxc_container_free(struct lxc_container *c)
 		free(c->config_path);
 		c->config_path = NULL;
 	}
+	netns_cache_drop(c);
 
 	free(c);
 }
@@ -405,6 +439,15 @@ static int lxcapi_console(struct lxc_container *c, int ttynum, int stdinfd,
 	return lxc_console(c, ttynum, stdinfd, stdoutfd, stderrfd, escape);
 }
 
+static int lxcapi_console_log(struct lxc_container *c,
+			      struct lxc_console_log *log)
+{
+	if (!c || !log)
+		return -EINVAL;
+
+	return lxc_cmd_console_log(c->name, c->config_path, log);
+}
+
 static pid_t lxcapi_init_pid(struct lxc_container *c)
 {
 	if (!c)
@@ -605,6 +648,17 @@ static bool lxcapi_start(struct lxc_container *c, int useinit, char * const argv
 	if (daemonize) {
 		lxc_monitord_spawn(c->config_path);
 
+		if (conf->monitor_shared) {
+			/* the supervisor outlives the container, there is no
+			 * monitor pid to record */
+			if (c->pidfile) {
+				ERROR("a pidfile can not be used for '%s', it is monitored by the supervisor of %s",
+				      c->name, c->config_path);
+				return false;
+			}
+			return lxc_supervisor_start(c->name, c->config_path, argv) == 0;
+		}
+
 		pid_t pid = fork();
 		if (pid < 0)
 			return false;
@@ -767,6 +821,55 @@ static bool create_container_dir(struct lxc_container *c)
 static const char *lxcapi_get_config_path(struct lxc_container *c);
 static bool lxcapi_set_config_item(struct lxc_container *c, const char *key, const char *v);
 
+/*
+ * For '-B pool', default the pool to our lxcpath, and if the image is not
+ * in the pool yet but a container by that name exists, register a copy of
+ * its rootfs.
+ */
+static bool pool_prepare(struct lxc_container *c, struct bdev_specs *specs)
+{
+	struct lxc_container *base;
+	char rootfs[MAXPATHLEN];
+	bool ret = false;
+
+	if (!specs || !specs->pool.image) {
+		ERROR("pool backing store needs an image");
+		return false;
+	}
+	if (!specs->pool.lxcpath)
+		specs->pool.lxcpath = c->config_path;
+
+	base = lxc_container_new(specs->pool.image, specs->pool.lxcpath);
+	if (!base || !base->is_defined(base)) {
+		/* already registered from elsewhere, bdev_create will tell */
+		ret = true;
+		goto out;
+	}
+	if (base->get_config_item(base, "lxc.rootfs", rootfs, MAXPATHLEN) <= 0) {
+		ERROR("%s has no rootfs", specs->pool.image);
+		goto out;
+	}
+	/*
+	 * The base container stays usable, so the pool gets a copy of its
+	 * rootfs rather than sharing it as a lower layer which could change
+	 * under its users.  The copy is only consistent if it is stopped.
+	 */
+	if (!is_stopped(base)) {
+		ERROR("%s must be stopped to be copied into the pool", specs->pool.image);
+		goto out;
+	}
+	if (bdev_pool_add(specs->pool.lxcpath, specs->pool.image, rootfs,
+			  BDEV_POOL_COPY) < 0) {
+		ERROR("Failed to add %s to the image pool", specs->pool.image);
+		goto out;
+	}
+	ret = true;
+out:
+	if (base)
+		lxc_container_put(base);
+	return ret;
+}
+
 /*
  * do_bdev_create: thin wrapper around bdev_create().  Like bdev_create(),
  * it returns a mounted bdev on success, NULL on error.
@@ -794,6 +897,9 @@ static struct bdev *do_bdev_create(struct lxc_container *c, const char *type,
 	if (ret < 0 || ret >= len)
 		return NULL;
 
+	if (type && strcmp(type, "pool") == 0 && !pool_prepare(c, specs))
+		return NULL;
+
 	bdev = bdev_create(dest, type, c->name, specs);
 	if (!bdev) {
 		ERROR("Failed to create backing store type %s", type);
@@ -801,6 +907,9 @@ static struct bdev *do_bdev_create(struct lxc_container *c, const char *type,
 	}
 
 	lxcapi_set_config_item(c, "lxc.rootfs", bdev->src);
+	lxcapi_set_config_item(c, "lxc.rootfs.backend", bdev->type);
+	if (bdev->fstype)
+		lxcapi_set_config_item(c, "lxc.rootfs.fstype", bdev->fstype);
 
 	/* if we are not root, chown the rootfs dir to root in the
 	 * target uidmap */
@@ -1210,6 +1319,249 @@ static void lxcapi_clear_config(struct lxc_container *c)
 }
 
 static bool lxcapi_destroy(struct lxc_container *c);
+static bool has_snapshots(struct lxc_container *c);
+static bool add_rdepends(struct lxc_container *c, struct lxc_container *c0);
+static bool mod_rdep(struct lxc_container *c, bool inc);
+
+/*
+ * Template cache: with LXC_CREATE_CACHE, the result of a template run is
+ * kept as the container $lxcpath/.cache/$key, key hashing the template
+ * script, its arguments, the arch and release they select, the backing
+ * store and the starting configuration.  Creates with the same key are
+ * snapshot clones of that container: a btrfs, zfs or lvm snapshot, or an
+ * overlayfs over a dir.  Backing stores which can't snapshot are copied.
+ */
+#define TMPL_CACHE_DIR ".cache"
+
+/* the value of a template option given as '-o val', '--opt val' or '--opt=val' */
+static const char *tmpl_option(char *const argv[], const char *shortopt,
+			       const char *longopt)
+{
+	size_t len = strlen(longopt);
+	int i;
+
+	if (!argv)
+		return NULL;
+	for (i = 0; argv[i]; i++) {
+		if ((strcmp(argv[i], shortopt) == 0 ||
+		     strcmp(argv[i], longopt) == 0) && argv[i+1])
+			return argv[i+1];
+		if (strncmp(argv[i], longopt, len) == 0 && argv[i][len] == '=')
+			return argv[i] + len + 1;
+	}
+	return NULL;
+}
+
+static uint64_t tmpl_hash_str(const char *s, uint64_t h)
+{
+	if (!s)
+		s = "";
+	/* with the terminator, so that "ab" "c" differs from "a" "bc" */
+	return fnv_64a_buf((void *)s, strlen(s) + 1, h);
+}
+
+static bool tmpl_cache_key(struct lxc_container *c, const char *tpath,
+			   const char *bdevtype, struct bdev_specs *specs,
+			   char *const argv[], char *key, size_t size)
+{
+	uint64_t h = FNV1A_64_INIT;
+	struct utsname uts;
+	const char *arch;
+	char buf[4096], *conf = NULL;
+	size_t len = 0;
+	ssize_t n;
+	FILE *f;
+	int fd, i, ret;
+
+	/* the script itself, so that updating it does not use stale results */
+	fd = open(tpath, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		SYSERROR("failed to open template %s", tpath);
+		return false;
+	}
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		h = fnv_64a_buf(buf, n, h);
+	close(fd);
+	if (n < 0)
+		return false;
+	h = tmpl_hash_str(tpath, h);
+
+	for (i = 0; argv && argv[i]; i++)
+		h = tmpl_hash_str(argv[i], h);
+	arch = tmpl_option(argv, "-a", "--arch");
+	if (!arch && uname(&uts) == 0)
+		arch = uts.machine;
+	h = tmpl_hash_str(arch, h);
+	h = tmpl_hash_str(tmpl_option(argv, "-r", "--release"), h);
+
+	h = tmpl_hash_str(bdevtype, h);
+	if (specs) {
+		h = tmpl_hash_str(specs->fstype, h);
+		h = fnv_64a_buf(&specs->fssize, sizeof(specs->fssize), h);
+		h = tmpl_hash_str(specs->zfs.zfsroot, h);
+		h = tmpl_hash_str(specs->lvm.vg, h);
+		h = tmpl_hash_str(specs->lvm.thinpool, h);
+	}
+
+	f = open_memstream(&conf, &len);
+	if (!f)
+		return false;
+	write_config(f, c->lxc_conf);
+	fclose(f);
+	h = fnv_64a_buf(conf, len, h);
+	free(conf);
+
+	ret = snprintf(key, size, "%016llx", (unsigned long long)h);
+	return ret > 0 && ret < size;
+}
+
+/*
+ * Create c as a snapshot clone of the cached result of template t,
+ * running t into the cache first if needed.
+ */
+static bool create_from_cache(struct lxc_container *c, const char *t,
+			      const char *tpath, const char *bdevtype,
+			      struct bdev_specs *specs, int flags,
+			      char *const argv[])
+{
+	char key[17], cachepath[MAXPATHLEN], path[MAXPATHLEN];
+	struct lxc_container *base, *c2;
+	struct bdev_specs bspecs;
+	int fd, ret, cflags;
+	bool bret = false;
+
+	if (!tmpl_cache_key(c, tpath, bdevtype, specs, argv, key, sizeof(key)))
+		return false;
+	ret = snprintf(cachepath, MAXPATHLEN, "%s/" TMPL_CACHE_DIR, c->config_path);
+	if (ret < 0 || ret >= MAXPATHLEN || mkdir_p(cachepath, 0755) < 0)
+		return false;
+
+	/* serialize the creates which would fill the same entry */
+	ret = snprintf(path, MAXPATHLEN, "%s/%s.lock", cachepath, key);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return false;
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		SYSERROR("failed to open %s", path);
+		return false;
+	}
+	if (flock(fd, LOCK_EX) < 0) {
+		SYSERROR("failed to lock %s", path);
+		close(fd);
+		return false;
+	}
+
+	base = lxc_container_new(key, cachepath);
+	if (!base)
+		goto out;
+
+	if (!lxcapi_is_defined(base)) {
+		INFO("caching the result of template %s as %s", t, key);
+		ret = snprintf(path, MAXPATHLEN, "%s/%s.config", cachepath, key);
+		if (ret < 0 || ret >= MAXPATHLEN)
+			goto out;
+		if (!c->save_config(c, path) || !base->load_config(base, path)) {
+			ERROR("failed to set up the configuration of %s", key);
+			unlink(path);
+			goto out;
+		}
+		unlink(path);
+
+		/* the lv and the rootfs dir are the new container's */
+		memset(&bspecs, 0, sizeof(bspecs));
+		if (specs) {
+			bspecs = *specs;
+			bspecs.lvm.lv = NULL;
+			bspecs.dir = NULL;
+		}
+		if (!base->create(base, t, bdevtype, &bspecs,
+				  flags & ~LXC_CREATE_CACHE, argv)) {
+			ERROR("failed to run template %s into the cache", t);
+			goto out;
+		}
+	} else {
+		INFO("using the cached result %s of template %s", key, t);
+	}
+
+	cflags = LXC_CLONE_SNAPSHOT;
+	if (!base->lxc_conf->rootfs.backend ||
+	    strcmp(base->lxc_conf->rootfs.backend, "dir"))
+		cflags |= LXC_CLONE_KEEPBDEVTYPE | LXC_CLONE_MAYBE_SNAPSHOT;
+	c2 = base->clone(base, c->name, c->config_path, cflags, NULL, NULL,
+			 specs ? specs->fssize : 0, NULL);
+	if (!c2) {
+		ERROR("failed to clone the cached result %s of template %s", key, t);
+		goto out;
+	}
+	/*
+	 * copy_storage() only records that an overlay depends on its lower
+	 * dir.  A btrfs, zfs or lvm snapshot depends on the entry as well,
+	 * which lxc_template_cache_flush() must then keep.
+	 */
+	if (c2->lxc_conf->rootfs.backend &&
+	    (strcmp(c2->lxc_conf->rootfs.backend, "btrfs") == 0 ||
+	     strcmp(c2->lxc_conf->rootfs.backend, "zfs") == 0 ||
+	     strcmp(c2->lxc_conf->rootfs.backend, "lvm") == 0)) {
+		if (!add_rdepends(c2, base) || !mod_rdep(base, true))
+			WARN("Error adding reverse dependency from %s to %s",
+			     c->name, key);
+	}
+	lxc_container_put(c2);
+	bret = true;
+
+out:
+	if (base)
+		lxc_container_put(base);
+	close(fd);
+	return bret;
+}
+
+int lxc_template_cache_flush(const char *lxcpath)
+{
+	struct lxc_container **cs = NULL;
+	char cachepath[MAXPATHLEN];
+	int i, n, ret = 0;
+
+	if (!lxcpath)
+		lxcpath = lxc_global_config_value("lxc.lxcpath");
+	n = snprintf(cachepath, MAXPATHLEN, "%s/" TMPL_CACHE_DIR, lxcpath);
+	if (n < 0 || n >= MAXPATHLEN)
+		return -1;
+	if (access(cachepath, F_OK) < 0)
+		return 0;
+
+	n = list_defined_containers(cachepath, NULL, &cs);
+	if (n < 0)
+		return -1;
+	for (i = 0; i < n; i++) {
+		char path[MAXPATHLEN];
+		int fd = -1;
+
+		/* not while a create fills or clones it */
+		if (snprintf(path, MAXPATHLEN, "%s/%s.lock", cachepath,
+			     cs[i]->name) < MAXPATHLEN)
+			fd = open(path, O_RDWR | O_CLOEXEC);
+		if (fd >= 0 && flock(fd, LOCK_EX) < 0) {
+			close(fd);
+			fd = -1;
+		}
+
+		/* entries with clones layered on them stay */
+		if (has_snapshots(cs[i])) {
+			INFO("keeping cached %s, which has clones", cs[i]->name);
+		} else if (lxcapi_destroy(cs[i])) {
+			if (fd >= 0)
+				unlink(path);
+			ret++;
+		}
+		if (fd >= 0)
+			close(fd);
+		lxc_container_put(cs[i]);
+	}
+	free(cs);
+	return ret;
+}
+
 /*
  * lxcapi_create:
  * create a container with the given parameters.
@@ -1271,7 +1623,9 @@ static bool lxcapi_create(struct lxc_container *c, const char *t,
 	 * if both template and rootfs.path are set, template is setup as rootfs.path.
 	 * container is already created if we have a config and rootfs.path is accessible
 	 */
-	if (!c->lxc_conf->rootfs.path && !tpath)
+	if (!c->lxc_conf->rootfs.path && !tpath &&
+	    !(bdevtype && (strcmp(bdevtype, "pool") == 0 ||
+			   strcmp(bdevtype, "image") == 0)))
 		/* no template passed in and rootfs does not exist: error */
 		goto out;
 	if (c->lxc_conf->rootfs.path && access(c->lxc_conf->rootfs.path, F_OK) != 0)
@@ -1284,6 +1638,21 @@ static bool lxcapi_create(struct lxc_container *c, const char *t,
 		goto out;
 	}
 
+	if ((flags & LXC_CREATE_CACHE) && tpath) {
+		if (lxcapi_is_defined(c) || (specs && specs->dir) ||
+		    (bdevtype && (strcmp(bdevtype, "pool") == 0 ||
+				  strcmp(bdevtype, "image") == 0))) {
+			INFO("not using the template cache for %s", c->name);
+		} else {
+			if (!create_from_cache(c, t, tpath, bdevtype, specs,
+					       flags, argv))
+				goto out;
+			lxcapi_clear_config(c);
+			ret = load_config_locked(c, c->configfile);
+			goto out;
+		}
+	}
+
 	/* Mark that this container is being created */
 	if ((partial_fd = create_partial(c)) < 0)
 		goto out;
@@ -1297,6 +1666,7 @@ static bool lxcapi_create(struct lxc_container *c, const char *t,
 	 * After you 'zfs create', zfs mounts the fs only in the initial
 	 * namespace.
 	 */
+	lxc_op_report_phase(LXC_OP_STORAGE);
 	pid = fork();
 	if (pid < 0) {
 		SYSERROR("failed to fork task for container creation template");
@@ -1331,6 +1701,7 @@ static bool lxcapi_create(struct lxc_container *c, const char *t,
 	if (!load_config_locked(c, c->configfile))
 		goto out_unlock;
 
+	lxc_op_report_phase(LXC_OP_TEMPLATE);
 	if (!create_run_template(c, tpath, !!(flags & LXC_CREATE_QUIET), argv))
 		goto out_unlock;
 
@@ -1561,7 +1932,7 @@ static bool remove_from_array(char ***names, char *cname, int size)
 	return false;
 }
 
-static char** lxcapi_get_interfaces(struct lxc_container *c)
+static char** get_interfaces_forked(struct lxc_container *c)
 {
 	pid_t pid;
 	int i, count = 0, pipefd[2];
@@ -1648,7 +2019,7 @@ static char** lxcapi_get_interfaces(struct lxc_container *c)
 	return interfaces;
 }
 
-static char** lxcapi_get_ips(struct lxc_container *c, const char* interface, const char* family, int scope)
+static char** get_ips_forked(struct lxc_container *c, const char* interface, const char* family, int scope)
 {
 	pid_t pid;
 	int i, count = 0, pipefd[2];
@@ -1765,101 +2136,530 @@ static char** lxcapi_get_ips(struct lxc_container *c, const char* interface, con
 	return addresses;
 }
 
-static int lxcapi_get_config_item(struct lxc_container *c, const char *key, char *retv, int inlen)
+/*
+ * Return the cached netlink socket of c's network namespace, opening it
+ * if needed.  Returns NULL with *fallback set if the namespace cannot be
+ * joined from here (typically an unprivileged caller), in which case the
+ * forked helpers have to be used.  Called with the container mem lock.
+ */
+static struct nl_handler *netns_cache_get(struct lxc_container *c, bool *fallback)
 {
-	int ret;
+	char path[MAXPATHLEN];
+	struct lxc_netns_cache *cache;
+	struct stat st;
+	pid_t pid;
+	int fd, ret;
 
-	if (!c || !c->lxc_conf)
-		return -1;
-	if (container_mem_lock(c))
-		return -1;
-	ret = lxc_get_config_item(c->lxc_conf, key, retv, inlen);
-	container_mem_unlock(c);
-	return ret;
-}
+	*fallback = false;
 
-static char* lxcapi_get_running_config_item(struct lxc_container *c, const char *key)
-{
-	char *ret;
+	pid = lxcapi_init_pid(c);
+	if (pid < 0) {
+		netns_cache_drop(c);
+		return NULL;
+	}
 
-	if (!c || !c->lxc_conf)
+	ret = snprintf(path, MAXPATHLEN, "/proc/%d/ns/net", pid);
+	if (ret < 0 || ret >= MAXPATHLEN)
 		return NULL;
-	if (container_mem_lock(c))
+
+	if (c->netns) {
+		if (stat(path, &st) == 0 && st.st_dev == c->netns->dev &&
+		    st.st_ino == c->netns->ino)
+			return &c->netns->nlh;
+		netns_cache_drop(c);
+	}
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		SYSERROR("failed to open %s", path);
 		return NULL;
-	ret = lxc_cmd_get_config_item(c->name, key, c->get_config_path(c));
-	container_mem_unlock(c);
-	return ret;
+	}
+
+	cache = malloc(sizeof(*cache));
+	if (!cache || fstat(fd, &st)) {
+		free(cache);
+		close(fd);
+		return NULL;
+	}
+
+	ret = lxc_netns_netlink_open(&cache->nlh, fd);
+	close(fd);
+	if (ret < 0) {
+		DEBUG("cannot open a netlink socket in %s: %s", path,
+		      strerror(-ret));
+		free(cache);
+		*fallback = true;
+		return NULL;
+	}
+
+	cache->dev = st.st_dev;
+	cache->ino = st.st_ino;
+	c->netns = cache;
+	return &cache->nlh;
 }
 
-static int lxcapi_get_keys(struct lxc_container *c, const char *key, char *retv, int inlen)
+struct netns_link {
+	int ifindex;
+	char ifname[IFNAMSIZ];
+};
+
+struct netns_query {
+	struct netns_link *links;
+	int nlinks;
+	/* filter applied to addresses, as documented for get_ips */
+	const char *interface;
+	const char *family;
+	int scope;
+	char **addresses;
+	int naddresses;
+};
+
+static int netns_query_link(int ifindex, const char *ifname, void *data)
 {
-	if (!key)
-		return lxc_listconfigs(retv, inlen);
-	/*
-	 * Support 'lxc.network.<idx>', i.e. 'lxc.network.0'
-	 * This is an intelligent result to show which keys are valid given
-	 * the type of nic it is
-	 */
-	if (!c || !c->lxc_conf)
-		return -1;
-	if (container_mem_lock(c))
-		return -1;
-	int ret = -1;
-	if (strncmp(key, "lxc.network.", 12) == 0)
-		ret = lxc_list_nicconfigs(c->lxc_conf, key, retv, inlen);
-	container_mem_unlock(c);
-	return ret;
+	struct netns_query *q = data;
+	struct netns_link *links;
+
+	links = realloc(q->links, (q->nlinks + 1) * sizeof(*links));
+	if (!links)
+		return -ENOMEM;
+
+	q->links = links;
+	links[q->nlinks].ifindex = ifindex;
+	strncpy(links[q->nlinks].ifname, ifname, IFNAMSIZ - 1);
+	links[q->nlinks].ifname[IFNAMSIZ - 1] = '\0';
+	q->nlinks++;
+	return 0;
 }
 
-static bool lxcapi_save_config(struct lxc_container *c, const char *alt_file)
+static int netns_query_addr(int ifindex, int family, const void *addr, void *data)
 {
-	FILE *fout;
-	bool ret = false, need_disklock = false;
-	int lret;
-
-	if (!alt_file)
-		alt_file = c->configfile;
-	if (!alt_file)
-		return false; // should we write to stdout if no file is specified?
+	struct netns_query *q = data;
+	char address[INET6_ADDRSTRLEN];
+	const char *ifname = NULL;
+	int i;
 
-	// If we haven't yet loaded a config, load the stock config
-	if (!c->lxc_conf) {
-		if (!c->load_config(c, lxc_global_config_value("lxc.default_config"))) {
-			ERROR("Error loading default configuration file %s while saving %s", lxc_global_config_value("lxc.default_config"), c->name);
-			return false;
+	for (i = 0; i < q->nlinks; i++) {
+		if (q->links[i].ifindex == ifindex) {
+			ifname = q->links[i].ifname;
+			break;
 		}
 	}
+	if (!ifname)
+		return 0;
 
-	if (!create_container_dir(c))
-		return false;
+	if (family == AF_INET) {
+		if (q->family && strcmp(q->family, "inet"))
+			return 0;
+	} else {
+		/* getifaddrs only sets sin6_scope_id for link-local
+		 * addresses, where it is the interface index */
+		const struct in6_addr *in6 = addr;
+		int scope_id = 0;
 
-	/*
-	 * If we're writing to the container's config file, take the
-	 * disk lock.  Otherwise just take the memlock to protect the
-	 * struct lxc_container while we're traversing it.
-	 */
-	if (strcmp(c->configfile, alt_file) == 0)
-		need_disklock = true;
+		if (q->family && strcmp(q->family, "inet6"))
+			return 0;
 
-	if (need_disklock)
-		lret = container_disk_lock(c);
-	else
-		lret = container_mem_lock(c);
+		if (IN6_IS_ADDR_LINKLOCAL(in6) || IN6_IS_ADDR_MC_LINKLOCAL(in6))
+			scope_id = ifindex;
+		if (scope_id != q->scope)
+			return 0;
+	}
 
-	if (lret)
-		return false;
+	if (q->interface && strcmp(q->interface, ifname))
+		return 0;
+	else if (!q->interface && strcmp("lo", ifname) == 0)
+		return 0;
 
-	fout = fopen(alt_file, "w");
-	if (!fout)
-		goto out;
-	write_config(fout, c->lxc_conf);
-	fclose(fout);
-	ret = true;
+	if (!inet_ntop(family, addr, address, sizeof(address)))
+		return 0;
 
-out:
-	if (need_disklock)
-		container_disk_unlock(c);
-	else
+	if (!add_to_array(&q->addresses, address, q->naddresses))
+		return -ENOMEM;
+	q->naddresses++;
+	return 0;
+}
+
+static void netns_query_free(struct netns_query *q)
+{
+	int i;
+
+	for (i = 0; i < q->naddresses; i++)
+		free(q->addresses[i]);
+	free(q->addresses);
+	free(q->links);
+}
+
+/*
+ * Fill q with the links of c and, if want_addrs, with its addresses.
+ * Returns 0 on success, -1 on error and 1 if the caller should fall back
+ * to the forked helpers.
+ */
+static int netns_query(struct lxc_container *c, struct netns_query *q, bool want_addrs)
+{
+	struct nl_handler *nlh;
+	bool fallback;
+	int ret;
+
+	if (container_mem_lock(c))
+		return -1;
+
+	nlh = netns_cache_get(c, &fallback);
+	if (!nlh) {
+		container_mem_unlock(c);
+		return fallback ? 1 : -1;
+	}
+
+	ret = lxc_netlink_list_links(nlh, netns_query_link, q);
+	if (!ret && want_addrs)
+		ret = lxc_netlink_list_addrs(nlh, netns_query_addr, q);
+
+	/* the reply may not have been read in full, don't reuse it */
+	if (ret)
+		netns_cache_drop(c);
+
+	container_mem_unlock(c);
+
+	if (ret) {
+		ERROR("failed to query the network of '%s': %s", c->name,
+		      strerror(-ret));
+		return -1;
+	}
+
+	return 0;
+}
+
+static char **netns_query_interfaces(struct netns_query *q)
+{
+	char **interfaces = NULL;
+	int i, count = 0;
+
+	for (i = 0; i < q->nlinks; i++) {
+		if (array_contains(&interfaces, q->links[i].ifname, count))
+			continue;
+
+		if (!add_to_array(&interfaces, q->links[i].ifname, count)) {
+			ERROR("add_to_array failed");
+			break;
+		}
+		count++;
+	}
+
+	if (interfaces)
+		interfaces = (char **)lxc_append_null_to_array((void **)interfaces, count);
+
+	return interfaces;
+}
+
+static char **netns_query_addresses(struct netns_query *q)
+{
+	char **addresses = q->addresses;
+
+	if (addresses)
+		addresses = (char **)lxc_append_null_to_array((void **)addresses, q->naddresses);
+
+	/* now owned by the caller */
+	q->addresses = NULL;
+	q->naddresses = 0;
+	return addresses;
+}
+
+static char** lxcapi_get_interfaces(struct lxc_container *c)
+{
+	struct netns_query q = { 0 };
+	char **interfaces;
+	int ret;
+
+	if (!c)
+		return NULL;
+
+	ret = netns_query(c, &q, false);
+	if (ret > 0)
+		return get_interfaces_forked(c);
+
+	interfaces = ret ? NULL : netns_query_interfaces(&q);
+	netns_query_free(&q);
+	return interfaces;
+}
+
+static char** lxcapi_get_ips(struct lxc_container *c, const char* interface, const char* family, int scope)
+{
+	struct netns_query q = { 0 };
+	char **addresses;
+	int ret;
+
+	if (!c)
+		return NULL;
+
+	q.interface = interface;
+	q.family = family;
+	q.scope = scope;
+
+	ret = netns_query(c, &q, true);
+	if (ret > 0)
+		return get_ips_forked(c, interface, family, scope);
+
+	addresses = ret ? NULL : netns_query_addresses(&q);
+	netns_query_free(&q);
+	return addresses;
+}
+
+int lxc_get_netinfo(struct lxc_container **cs, int count, const char *family,
+		    int scope, struct lxc_netinfo **ret)
+{
+	struct lxc_netinfo *info;
+	int i, failed = 0;
+
+	if (!cs || count < 0 || !ret)
+		return -1;
+
+	info = calloc(count ? count : 1, sizeof(*info));
+	if (!info)
+		return -1;
+
+	for (i = 0; i < count; i++) {
+		struct netns_query q = { 0 };
+		int r;
+
+		info[i].c = cs[i];
+		if (!cs[i]) {
+			failed++;
+			continue;
+		}
+
+		q.family = family;
+		q.scope = scope;
+
+		r = netns_query(cs[i], &q, true);
+		if (r > 0) {
+			info[i].interfaces = get_interfaces_forked(cs[i]);
+			info[i].ips = get_ips_forked(cs[i], NULL, family, scope);
+		} else if (r == 0) {
+			info[i].interfaces = netns_query_interfaces(&q);
+			info[i].ips = netns_query_addresses(&q);
+		}
+		netns_query_free(&q);
+
+		if (!info[i].interfaces)
+			failed++;
+	}
+
+	*ret = info;
+	return failed;
+}
+
+void lxc_netinfo_free(struct lxc_netinfo *info, int count)
+{
+	int i, j;
+
+	if (!info)
+		return;
+
+	for (i = 0; i < count; i++) {
+		for (j = 0; info[i].interfaces && info[i].interfaces[j]; j++)
+			free(info[i].interfaces[j]);
+		free(info[i].interfaces);
+		for (j = 0; info[i].ips && info[i].ips[j]; j++)
+			free(info[i].ips[j]);
+		free(info[i].ips);
+	}
+	free(info);
+}
+
+static int shift_rootfs_child(struct lxc_container *c, struct lxc_container *ref,
+			      int threads, struct lxc_shift_stats *stats)
+{
+	struct lxc_conf *conf = c->lxc_conf;
+	struct bdev *bdev;
+	char *src = conf->rootfs.path;
+
+	bdev = bdev_init(src, conf->rootfs.mount, NULL);
+	if (!bdev) {
+		ERROR("Error opening rootfs");
+		return -1;
+	}
+	if (strcmp(bdev->type, "dir") == 0) {
+		src = bdev->src;
+	} else {
+		if (unshare(CLONE_NEWNS) < 0) {
+			SYSERROR("error unsharing mounts");
+			return -1;
+		}
+		if (detect_shared_rootfs() &&
+		    mount(NULL, "/", NULL, MS_SLAVE|MS_REC, NULL))
+			SYSERROR("Failed to make / rslave");
+		if (bdev->ops->mount(bdev) < 0) {
+			ERROR("Error mounting rootfs");
+			return -1;
+		}
+		src = bdev->dest;
+	}
+	return lxc_idshift(src, ref ? &ref->lxc_conf->id_map : NULL,
+			   &conf->id_map, threads, stats);
+}
+
+bool lxc_shift_rootfs(struct lxc_container *c, struct lxc_container *ref,
+		int threads, struct lxc_shift_stats *stats)
+{
+	struct lxc_shift_stats s;
+	bool ret = false;
+	int p[2];
+	pid_t pid;
+
+	if (!c || !c->lxc_conf || !c->lxc_conf->rootfs.path)
+		return false;
+	if (ref && !ref->lxc_conf)
+		return false;
+	if (geteuid() != 0) {
+		ERROR("Only root can shift the ids of a rootfs");
+		return false;
+	}
+	/*
+	 * The lower layer of an overlay is shared with the container it was
+	 * made from: shifting only the upper layer would leave most of the
+	 * rootfs with the old ids, and shifting the lower one would break
+	 * the other container.
+	 */
+	if (strncmp(c->lxc_conf->rootfs.path, "overlayfs:", 10) == 0 ||
+	    strncmp(c->lxc_conf->rootfs.path, "aufs:", 5) == 0) {
+		ERROR("The ids of the overlay rootfs of %s can not be shifted", c->name);
+		return false;
+	}
+	if (c->is_running(c)) {
+		ERROR("Container %s is running", c->name);
+		return false;
+	}
+
+	if (container_disk_lock(c))
+		return false;
+
+	/* in a child, as mounting the rootfs needs a private mount namespace */
+	if (pipe2(p, O_CLOEXEC) < 0) {
+		SYSERROR("Failed to create pipe");
+		goto out;
+	}
+	pid = fork();
+	if (pid < 0) {
+		SYSERROR("Failed to fork");
+		close(p[0]);
+		close(p[1]);
+		goto out;
+	}
+	if (pid == 0) {
+		int r;
+
+		close(p[0]);
+		memset(&s, 0, sizeof(s));
+		r = shift_rootfs_child(c, ref, threads, &s);
+		if (write(p[1], &s, sizeof(s)) != sizeof(s))
+			r = -1;
+		_exit(r < 0 ? 1 : 0);
+	}
+
+	close(p[1]);
+	if (read(p[0], &s, sizeof(s)) == sizeof(s) && stats)
+		*stats = s;
+	close(p[0]);
+	ret = wait_for_pid(pid) == 0;
+out:
+	container_disk_unlock(c);
+	return ret;
+}
+
+static int lxcapi_get_config_item(struct lxc_container *c, const char *key, char *retv, int inlen)
+{
+	int ret;
+
+	if (!c || !c->lxc_conf)
+		return -1;
+	if (container_mem_lock(c))
+		return -1;
+	ret = lxc_get_config_item(c->lxc_conf, key, retv, inlen);
+	container_mem_unlock(c);
+	return ret;
+}
+
+static char* lxcapi_get_running_config_item(struct lxc_container *c, const char *key)
+{
+	char *ret;
+
+	if (!c || !c->lxc_conf)
+		return NULL;
+	if (container_mem_lock(c))
+		return NULL;
+	ret = lxc_cmd_get_config_item(c->name, key, c->get_config_path(c));
+	container_mem_unlock(c);
+	return ret;
+}
+
+static int lxcapi_get_keys(struct lxc_container *c, const char *key, char *retv, int inlen)
+{
+	if (!key)
+		return lxc_listconfigs(retv, inlen);
+	/*
+	 * Support 'lxc.network.<idx>', i.e. 'lxc.network.0'
+	 * This is an intelligent result to show which keys are valid given
+	 * the type of nic it is
+	 */
+	if (!c || !c->lxc_conf)
+		return -1;
+	if (container_mem_lock(c))
+		return -1;
+	int ret = -1;
+	if (strncmp(key, "lxc.network.", 12) == 0)
+		ret = lxc_list_nicconfigs(c->lxc_conf, key, retv, inlen);
+	container_mem_unlock(c);
+	return ret;
+}
+
+static bool lxcapi_save_config(struct lxc_container *c, const char *alt_file)
+{
+	FILE *fout;
+	bool ret = false, need_disklock = false;
+	int lret;
+
+	if (!alt_file)
+		alt_file = c->configfile;
+	if (!alt_file)
+		return false; // should we write to stdout if no file is specified?
+
+	// If we haven't yet loaded a config, load the stock config
+	if (!c->lxc_conf) {
+		if (!c->load_config(c, lxc_global_config_value("lxc.default_config"))) {
+			ERROR("Error loading default configuration file %s while saving %s", lxc_global_config_value("lxc.default_config"), c->name);
+			return false;
+		}
+	}
+
+	if (!create_container_dir(c))
+		return false;
+
+	/*
+	 * If we're writing to the container's config file, take the
+	 * disk lock.  Otherwise just take the memlock to protect the
+	 * struct lxc_container while we're traversing it.
+	 */
+	if (strcmp(c->configfile, alt_file) == 0)
+		need_disklock = true;
+
+	if (need_disklock)
+		lret = container_disk_lock(c);
+	else
+		lret = container_mem_lock(c);
+
+	if (lret)
+		return false;
+
+	fout = fopen(alt_file, "w");
+	if (!fout)
+		goto out;
+	write_config(fout, c->lxc_conf);
+	fclose(fout);
+	ret = true;
+
+out:
+	if (need_disklock)
+		container_disk_unlock(c);
+	else
 		container_mem_unlock(c);
 	return ret;
 }
@@ -2012,7 +2812,8 @@ static bool lxcapi_destroy(struct lxc_container *c)
 	}
 
 	if (!am_unpriv() && c->lxc_conf && c->lxc_conf->rootfs.path && c->lxc_conf->rootfs.mount) {
-		r = bdev_init(c->lxc_conf->rootfs.path, c->lxc_conf->rootfs.mount, NULL);
+		r = bdev_init_rootfs(c->lxc_conf->rootfs.path, c->lxc_conf->rootfs.mount,
+			NULL, &c->lxc_conf->rootfs.backend);
 		if (r) {
 			if (r->ops->destroy(r) < 0) {
 				bdev_put(r);
@@ -2439,6 +3240,10 @@ static int copy_storage(struct lxc_container *c0, struct lxc_container *c,
 	}
 	free(c->lxc_conf->rootfs.path);
 	c->lxc_conf->rootfs.path = strdup(bdev->src);
+	free(c->lxc_conf->rootfs.backend);
+	c->lxc_conf->rootfs.backend = strdup(bdev->type);
+	free(c->lxc_conf->rootfs.fstype);
+	c->lxc_conf->rootfs.fstype = bdev->fstype ? strdup(bdev->fstype) : NULL;
 	bdev_put(bdev);
 	if (!c->lxc_conf->rootfs.path) {
 		ERROR("Out of memory while setting storage path");
@@ -2492,7 +3297,8 @@ static int clone_update_rootfs(struct clone_update_data *data)
 
 	if (unshare(CLONE_NEWNS) < 0)
 		return -1;
-	bdev = bdev_init(c->lxc_conf->rootfs.path, c->lxc_conf->rootfs.mount, NULL);
+	bdev = bdev_init_rootfs(c->lxc_conf->rootfs.path, c->lxc_conf->rootfs.mount,
+			NULL, &c->lxc_conf->rootfs.backend);
 	if (!bdev)
 		return -1;
 	if (strcmp(bdev->type, "dir") != 0) {
@@ -2678,10 +3484,15 @@ static struct lxc_container *lxcapi_clone(struct lxc_container *c, const char *n
 	}
 
 	// copy/snapshot rootfs's
+	lxc_op_report_phase(LXC_OP_STORAGE);
 	ret = copy_storage(c, c2, bdevtype, flags, bdevdata, newsize);
 	if (ret < 0)
 		goto out;
 
+	// We've now successfully created c2's storage, so clear it out if we
+	// fail after this
+	storage_copied = 1;
+
 	// update utsname
 	if (!set_config_item_locked(c2, "lxc.utsname", newname)) {
 		ERROR("Error setting new hostname");
@@ -2704,13 +3515,10 @@ static struct lxc_container *lxcapi_clone(struct lxc_container *c, const char *n
 	if (!(flags & LXC_CLONE_KEEPMACADDR))
 		network_new_hwaddrs(c2);
 
-	// We've now successfully created c2's storage, so clear it out if we
-	// fail after this
-	storage_copied = 1;
-
 	if (!c2->save_config(c2, NULL))
 		goto out;
 
+	lxc_op_report_phase(LXC_OP_SETUP);
 	if ((pid = fork()) < 0) {
 		SYSERROR("fork");
 		goto out;
@@ -2749,15 +3557,47 @@ out:
 	return NULL;
 }
 
-static bool lxcapi_rename(struct lxc_container *c, const char *newname)
+int lxc_clone_many(struct lxc_container *c, const char * const *newnames,
+		int count, const char *lxcpath, int flags, uint64_t newsize,
+		struct lxc_container **clones)
 {
-	struct bdev *bdev;
-	struct lxc_container *newc;
+	struct lvm_prepared *prepared = NULL;
+	int i, n = 0;
 
-	if (!c || !c->name || !c->config_path || !c->lxc_conf)
-		return false;
+	if (!c || !newnames || count <= 0 || !clones || !c->is_defined(c))
+		return -1;
+
+	/* the snapshots can be made at once, before the clones */
+	if ((flags & LXC_CLONE_SNAPSHOT) && !container_mem_lock(c)) {
+		if (is_stopped(c))
+			prepared = bdev_lvm_prepare(c, newnames, count,
+					lxcpath ? lxcpath : c->config_path, newsize);
+		container_mem_unlock(c);
+	}
+
+	for (i = 0; i < count; i++) {
+		clones[i] = lxcapi_clone(c, newnames[i], lxcpath, flags, NULL,
+				NULL, newsize, NULL);
+		if (clones[i])
+			n++;
+		else
+			ERROR("failed to clone %s as %s", c->name, newnames[i]);
+	}
 
-	bdev = bdev_init(c->lxc_conf->rootfs.path, c->lxc_conf->rootfs.mount, NULL);
+	bdev_lvm_release(prepared);
+	return n;
+}
+
+static bool lxcapi_rename(struct lxc_container *c, const char *newname)
+{
+	struct bdev *bdev;
+	struct lxc_container *newc;
+
+	if (!c || !c->name || !c->config_path || !c->lxc_conf)
+		return false;
+
+	bdev = bdev_init_rootfs(c->lxc_conf->rootfs.path, c->lxc_conf->rootfs.mount,
+			NULL, &c->lxc_conf->rootfs.backend);
 	if (!bdev) {
 		ERROR("Failed to find original backing store type");
 		return false;
@@ -2807,6 +3647,8 @@ static int lxcapi_attach_run_wait(struct lxc_container *c, lxc_attach_options_t
 	return lxc_wait_for_pid_status(pid);
 }
 
+static void snapshot_index_update(char *snappath, char *add, const char *remove);
+
 static int get_next_index(const char *lxcpath, char *cname)
 {
 	char *fname;
@@ -2899,9 +3741,11 @@ static int lxcapi_snapshot(struct lxc_container *c, const char *commentfile)
 		int len = strlen(snappath) + strlen(newname) + 10;
 		char *path = alloca(len);
 		sprintf(path, "%s/%s/comment", snappath, newname);
-		return copy_file(commentfile, path) < 0 ? -1 : i;
+		if (copy_file(commentfile, path) < 0)
+			return -1;
 	}
 
+	snapshot_index_update(snappath, newname, NULL);
 	return i;
 }
 
@@ -2963,84 +3807,434 @@ static char *get_timestamp(char* snappath, char *name)
 	return s;
 }
 
-static int lxcapi_snapshot_list(struct lxc_container *c, struct lxc_snapshot **ret_snaps)
+/*
+ * The snapshots of a container are indexed in ${lxcpath}snaps/${name}/.index,
+ * with a line of tab-separated name, timestamp, backing store type, size
+ * and whether it has a comment per snapshot, so that listing them does
+ * not need to read the config, ts and comment files of each.  Every
+ * update of the index, including the one made when listing, reads and
+ * rewrites it under a lock of the snapshot directory.  Snapshots it does
+ * not know of, i.e. made by an older lxc, are added to it when listed.
+ * Sizes take a walk of the snapshot's tree: they are only computed, and
+ * then recorded, once asked for.  Until then the index holds '-'.
+ */
+#define SNAPSHOT_INDEX ".index"
+#define SNAPSHOT_SIZE_UNKNOWN UINT64_MAX
+
+static void snapshot_info_clear(struct lxc_snapshot_info *info)
 {
-	char snappath[MAXPATHLEN], path2[MAXPATHLEN];
-	int dirlen, count = 0, ret;
-	struct dirent dirent, *direntp;
-	struct lxc_snapshot *snaps =NULL, *nsnaps;
-	DIR *dir;
+	free(info->name);
+	free(info->timestamp);
+	free(info->bdev_type);
+	memset(info, 0, sizeof(*info));
+}
 
-	if (!c || !lxcapi_is_defined(c))
+void lxc_snapshot_info_free(struct lxc_snapshot_info *info, int count)
+{
+	int i;
+
+	if (!info)
+		return;
+	for (i = 0; i < count; i++)
+		snapshot_info_clear(&info[i]);
+	free(info);
+}
+
+/* the size of snapshot name, as used by its backing store itself */
+static uint64_t snapshot_size(char *snappath, const char *name)
+{
+	struct lxc_container *snap;
+	struct bdev *bdev = NULL;
+	uint64_t size = 0;
+
+	snap = lxc_container_new(name, snappath);
+	if (!snap)
+		return 0;
+	if (snap->lxc_conf && snap->lxc_conf->rootfs.path)
+		bdev = bdev_init_rootfs(snap->lxc_conf->rootfs.path, NULL, NULL,
+					&snap->lxc_conf->rootfs.backend);
+	lxc_container_put(snap);
+	if (bdev) {
+		if (bdev_disk_usage(bdev, &size) < 0)
+			size = 0;
+		bdev_put(bdev);
+	}
+	return size;
+}
+
+/* describe snapshot name from its own files, but for its size */
+static int snapshot_info_load(char *snappath, char *name,
+			      struct lxc_snapshot_info *info)
+{
+	struct lxc_container *snap;
+	struct bdev *bdev = NULL;
+	char *comment;
+
+	memset(info, 0, sizeof(*info));
+	snap = lxc_container_new(name, snappath);
+	if (!snap || !lxcapi_is_defined(snap)) {
+		if (snap)
+			lxc_container_put(snap);
 		return -1;
+	}
+	if (snap->lxc_conf->rootfs.path)
+		bdev = bdev_init_rootfs(snap->lxc_conf->rootfs.path, NULL, NULL,
+					&snap->lxc_conf->rootfs.backend);
+	lxc_container_put(snap);
 
-	// snappath is ${lxcpath}snaps/${lxcname}/
-	dirlen = snprintf(snappath, MAXPATHLEN, "%ssnaps/%s", c->config_path, c->name);
-	if (dirlen < 0 || dirlen >= MAXPATHLEN) {
-		ERROR("path name too long");
+	info->name = strdup(name);
+	info->timestamp = get_timestamp(snappath, name);
+	if (!info->timestamp)
+		info->timestamp = strdup("");
+	comment = get_snapcomment_path(snappath, name);
+	info->has_comment = comment && file_exists(comment);
+	free(comment);
+	info->size = SNAPSHOT_SIZE_UNKNOWN;
+	if (bdev) {
+		info->bdev_type = strdup(bdev->type);
+		bdev_put(bdev);
+	} else {
+		info->bdev_type = strdup("none");
+	}
+
+	if (!info->name || !info->timestamp || !info->bdev_type) {
+		snapshot_info_clear(info);
+		return -1;
+	}
+	return 0;
+}
+
+static int snapshot_index_read(const char *snappath,
+			       struct lxc_snapshot_info **ret)
+{
+	struct lxc_snapshot_info *infos = NULL, *ninfos, *info;
+	char path[MAXPATHLEN], *line = NULL, *p, *fields[5];
+	size_t sz = 0;
+	int count = 0, i, ret2;
+	FILE *f;
+
+	*ret = NULL;
+	ret2 = snprintf(path, MAXPATHLEN, "%s/" SNAPSHOT_INDEX, snappath);
+	if (ret2 < 0 || ret2 >= MAXPATHLEN)
+		return -1;
+	f = fopen(path, "r");
+	if (!f)
+		return errno == ENOENT ? 0 : -1;
+
+	while (getline(&line, &sz, f) != -1) {
+		line[strcspn(line, "\n")] = '\0';
+		p = line;
+		for (i = 0; i < 5; i++) {
+			fields[i] = strsep(&p, "\t");
+			if (!fields[i])
+				break;
+		}
+		if (i < 5) {
+			WARN("ignoring bad line in %s", path);
+			continue;
+		}
+
+		ninfos = realloc(infos, (count + 1) * sizeof(*infos));
+		if (!ninfos)
+			goto err;
+		infos = ninfos;
+		info = &infos[count++];
+		info->name = strdup(fields[0]);
+		info->timestamp = strdup(fields[1]);
+		info->bdev_type = strdup(fields[2]);
+		if (strcmp(fields[3], "-") == 0)
+			info->size = SNAPSHOT_SIZE_UNKNOWN;
+		else
+			info->size = strtoull(fields[3], NULL, 10);
+		info->has_comment = strcmp(fields[4], "1") == 0;
+		if (!info->name || !info->timestamp || !info->bdev_type)
+			goto err;
+	}
+
+	free(line);
+	fclose(f);
+	*ret = infos;
+	return count;
+
+err:
+	ERROR("Out of memory reading %s", path);
+	free(line);
+	fclose(f);
+	lxc_snapshot_info_free(infos, count);
+	return -1;
+}
+
+/* replace the index with infos, the caller holds the index lock */
+static int snapshot_index_write(const char *snappath,
+				struct lxc_snapshot_info *infos, int count)
+{
+	char path[MAXPATHLEN], tmp[MAXPATHLEN];
+	int i, ret;
+	FILE *f;
+
+	ret = snprintf(path, MAXPATHLEN, "%s/" SNAPSHOT_INDEX, snappath);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -1;
+	ret = snprintf(tmp, MAXPATHLEN, "%s.tmp", path);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -1;
+
+	f = fopen(tmp, "w");
+	if (!f) {
+		SYSERROR("failed to open %s", tmp);
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		char size[32];
+
+		if (infos[i].size == SNAPSHOT_SIZE_UNKNOWN)
+			strcpy(size, "-");
+		else
+			snprintf(size, sizeof(size), "%" PRIu64, infos[i].size);
+		if (fprintf(f, "%s\t%s\t%s\t%s\t%d\n", infos[i].name,
+			    infos[i].timestamp, infos[i].bdev_type, size,
+			    infos[i].has_comment) < 0)
+			break;
+	}
+	ret = fclose(f);
+	if (i < count || ret != 0 || rename(tmp, path) < 0) {
+		SYSERROR("failed to write %s", path);
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+static int snapshot_index_lock(const char *snappath)
+{
+	int fd;
+
+	fd = open(snappath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		SYSERROR("failed to open %s", snappath);
 		return -1;
 	}
+	if (flock(fd, LOCK_EX) < 0) {
+		SYSERROR("failed to lock %s", snappath);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* add snapshot add to, and/or remove snapshot remove from, the index */
+static void snapshot_index_update(char *snappath, char *add, const char *remove)
+{
+	struct lxc_snapshot_info *infos, *ninfos;
+	int count, fd, i;
+
+	fd = snapshot_index_lock(snappath);
+	if (fd < 0)
+		return;
+
+	count = snapshot_index_read(snappath, &infos);
+	if (count < 0)
+		goto out;
+	for (i = 0; i < count; i++) {
+		if ((add && strcmp(infos[i].name, add) == 0) ||
+		    (remove && strcmp(infos[i].name, remove) == 0)) {
+			snapshot_info_clear(&infos[i]);
+			infos[i--] = infos[--count];
+		}
+	}
+	if (add) {
+		ninfos = realloc(infos, (count + 1) * sizeof(*infos));
+		if (!ninfos)
+			goto out;
+		infos = ninfos;
+		if (snapshot_info_load(snappath, add, &infos[count]) < 0)
+			goto out;
+		count++;
+	}
+	snapshot_index_write(snappath, infos, count);
+
+out:
+	if (count > 0)
+		lxc_snapshot_info_free(infos, count);
+	else
+		free(infos);
+	close(fd);
+}
+
+static int snapshot_info_cmp(const void *a, const void *b)
+{
+	const struct lxc_snapshot_info *ia = a, *ib = b;
+	int ret;
+
+	ret = strcmp(ia->timestamp, ib->timestamp);
+	if (ret)
+		return ret;
+	return strverscmp(ia->name, ib->name);
+}
+
+/*
+ * List the snapshots in snappath, oldest first.  What the index knows of
+ * is taken from it, the others are added to it.  If sizes is set, the
+ * sizes still unknown are computed and added to it as well.
+ */
+static int snapshot_index_load(char *snappath, struct lxc_snapshot_info **ret,
+			       bool sizes)
+{
+	struct lxc_snapshot_info *infos = NULL, *ninfos, *idx;
+	char path[MAXPATHLEN];
+	struct dirent *direntp;
+	bool stale = false;
+	int count = 0, nidx, i, fd, ret2;
+	DIR *dir;
+
+	*ret = NULL;
+	fd = snapshot_index_lock(snappath);
+	if (fd < 0) {
+		INFO("failed to open %s - assuming no snapshots", snappath);
+		return 0;
+	}
 	dir = opendir(snappath);
 	if (!dir) {
 		INFO("failed to open %s - assuming no snapshots", snappath);
+		close(fd);
 		return 0;
 	}
 
-	while (!readdir_r(dir, &dirent, &direntp)) {
-		if (!direntp)
-			break;
-
-		if (!strcmp(direntp->d_name, "."))
-			continue;
+	nidx = snapshot_index_read(snappath, &idx);
+	if (nidx < 0) {
+		nidx = 0;
+		stale = true;
+	}
 
-		if (!strcmp(direntp->d_name, ".."))
+	while ((direntp = readdir(dir))) {
+		if (!strcmp(direntp->d_name, ".") || !strcmp(direntp->d_name, ".."))
 			continue;
 
-		ret = snprintf(path2, MAXPATHLEN, "%s/%s/config", snappath, direntp->d_name);
-		if (ret < 0 || ret >= MAXPATHLEN) {
-			ERROR("pathname too long");
+		ninfos = realloc(infos, (count + 1) * sizeof(*infos));
+		if (!ninfos) {
+			SYSERROR("Out of memory");
 			goto out_free;
 		}
-		if (!file_exists(path2))
+		infos = ninfos;
+
+		for (i = 0; i < nidx; i++)
+			if (idx[i].name && strcmp(idx[i].name, direntp->d_name) == 0)
+				break;
+		if (i < nidx) {
+			infos[count++] = idx[i];
+			memset(&idx[i], 0, sizeof(idx[i]));
 			continue;
-		nsnaps = realloc(snaps, (count + 1)*sizeof(*snaps));
-		if (!nsnaps) {
-			SYSERROR("Out of memory");
-			goto out_free;
 		}
-		snaps = nsnaps;
-		snaps[count].free = lxcsnap_free;
-		snaps[count].name = strdup(direntp->d_name);
-		if (!snaps[count].name)
-			goto out_free;
-		snaps[count].lxcpath = strdup(snappath);
-		if (!snaps[count].lxcpath) {
-			free(snaps[count].name);
+
+		ret2 = snprintf(path, MAXPATHLEN, "%s/%s/config", snappath, direntp->d_name);
+		if (ret2 < 0 || ret2 >= MAXPATHLEN) {
+			ERROR("pathname too long");
 			goto out_free;
 		}
-		snaps[count].comment_pathname = get_snapcomment_path(snappath, direntp->d_name);
-		snaps[count].timestamp = get_timestamp(snappath, direntp->d_name);
+		if (!file_exists(path))
+			continue;
+		if (snapshot_info_load(snappath, direntp->d_name, &infos[count]) < 0)
+			continue;
 		count++;
+		stale = true;
 	}
-
 	if (closedir(dir))
 		WARN("failed to close directory");
 
-	*ret_snaps = snaps;
+	/* snapshots which were removed behind our back */
+	for (i = 0; i < nidx; i++)
+		if (idx[i].name)
+			stale = true;
+	lxc_snapshot_info_free(idx, nidx);
+
+	for (i = 0; sizes && i < count; i++) {
+		if (infos[i].size != SNAPSHOT_SIZE_UNKNOWN)
+			continue;
+		infos[i].size = snapshot_size(snappath, infos[i].name);
+		stale = true;
+	}
+
+	qsort(infos, count, sizeof(*infos), snapshot_info_cmp);
+	if (stale)
+		snapshot_index_write(snappath, infos, count);
+	close(fd);
+
+	*ret = infos;
 	return count;
 
 out_free:
-	if (snaps) {
-		int i;
-		for (i=0; i<count; i++)
-			lxcsnap_free(&snaps[i]);
-		free(snaps);
-	}
 	if (closedir(dir))
 		WARN("failed to close directory");
+	close(fd);
+	lxc_snapshot_info_free(idx, nidx);
+	lxc_snapshot_info_free(infos, count);
 	return -1;
 }
 
+static int lxcapi_snapshot_list(struct lxc_container *c, struct lxc_snapshot **ret_snaps)
+{
+	char snappath[MAXPATHLEN];
+	struct lxc_snapshot_info *infos;
+	struct lxc_snapshot *snaps;
+	int dirlen, count, i;
+
+	if (!c || !lxcapi_is_defined(c))
+		return -1;
+
+	// snappath is ${lxcpath}snaps/${lxcname}/
+	dirlen = snprintf(snappath, MAXPATHLEN, "%ssnaps/%s", c->config_path, c->name);
+	if (dirlen < 0 || dirlen >= MAXPATHLEN) {
+		ERROR("path name too long");
+		return -1;
+	}
+
+	count = snapshot_index_load(snappath, &infos, false);
+	if (count <= 0)
+		return count;
+
+	snaps = calloc(count, sizeof(*snaps));
+	if (!snaps) {
+		SYSERROR("Out of memory");
+		lxc_snapshot_info_free(infos, count);
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		snaps[i].free = lxcsnap_free;
+		snaps[i].name = infos[i].name;
+		snaps[i].timestamp = infos[i].timestamp;
+		infos[i].name = infos[i].timestamp = NULL;
+		snaps[i].lxcpath = strdup(snappath);
+		snaps[i].comment_pathname = get_snapcomment_path(snappath, snaps[i].name);
+		if (!snaps[i].lxcpath || !snaps[i].comment_pathname)
+			goto out_free;
+	}
+	lxc_snapshot_info_free(infos, count);
+
+	*ret_snaps = snaps;
+	return count;
+
+out_free:
+	for (i = 0; i < count; i++)
+		lxcsnap_free(&snaps[i]);
+	free(snaps);
+	lxc_snapshot_info_free(infos, count);
+	return -1;
+}
+
+int lxc_snapshot_index(struct lxc_container *c, struct lxc_snapshot_info **ret)
+{
+	char snappath[MAXPATHLEN];
+	int ret2;
+
+	if (!c || !ret || !lxcapi_is_defined(c))
+		return -1;
+
+	ret2 = snprintf(snappath, MAXPATHLEN, "%ssnaps/%s", c->config_path, c->name);
+	if (ret2 < 0 || ret2 >= MAXPATHLEN)
+		return -1;
+	return snapshot_index_load(snappath, ret, true);
+}
+
 static bool lxcapi_snapshot_restore(struct lxc_container *c, const char *snapname, const char *newname)
 {
 	char clonelxcpath[MAXPATHLEN];
@@ -3052,7 +4246,8 @@ static bool lxcapi_snapshot_restore(struct lxc_container *c, const char *snapnam
 	if (!c || !c->name || !c->config_path)
 		return false;
 
-	bdev = bdev_init(c->lxc_conf->rootfs.path, c->lxc_conf->rootfs.mount, NULL);
+	bdev = bdev_init_rootfs(c->lxc_conf->rootfs.path, c->lxc_conf->rootfs.mount,
+			NULL, &c->lxc_conf->rootfs.backend);
 	if (!bdev) {
 		ERROR("Failed to find original backing store type");
 		return false;
@@ -3119,6 +4314,7 @@ static bool lxcapi_snapshot_destroy(struct lxc_container *c, const char *snapnam
 		goto err;
 	}
 	lxc_container_put(snap);
+	snapshot_index_update(clonelxcpath, NULL, snapname);
 
 	return true;
 err:
@@ -3127,6 +4323,437 @@ err:
 	return false;
 }
 
+/*
+ * Snapshot streams.  lxc_snapshot_export writes a header of lines
+ *	lxc-stream 1
+ *	format tar|btrfs|zfs
+ *	snapshot <snapname> <timestamp>
+ *	base <snapname> <timestamp>	(incremental streams only)
+ *	config <length>			followed by the configuration
+ *	fstab <length>			followed by the lxc.mount file, if any
+ *	data
+ * and then the rootfs (see snapstream.c).  The importing side records
+ * the snapshot line in $lxcpath/$name/imported, which the base line of
+ * the next stream has to match.
+ */
+#define STREAM_VERSION "lxc-stream 1"
+#define STREAM_IMPORTED "imported"
+
+static char *stream_read_file(const char *path, size_t *len)
+{
+	char *buf = NULL;
+	FILE *f;
+	long n;
+
+	f = fopen(path, "r");
+	if (!f) {
+		SYSERROR("Failed to open %s", path);
+		return NULL;
+	}
+	if (fseek(f, 0, SEEK_END) < 0 || (n = ftell(f)) < 0 ||
+	    fseek(f, 0, SEEK_SET) < 0)
+		goto out;
+	buf = malloc(n + 1);
+	if (!buf)
+		goto out;
+	if (fread(buf, 1, n, f) != n) {
+		SYSERROR("Failed to read %s", path);
+		free(buf);
+		buf = NULL;
+		goto out;
+	}
+	buf[n] = '\0';
+	*len = n;
+out:
+	fclose(f);
+	return buf;
+}
+
+static int stream_write_file(const char *path, const char *buf, size_t len)
+{
+	FILE *f;
+
+	f = fopen(path, "w");
+	if (!f) {
+		SYSERROR("Failed to create %s", path);
+		return -1;
+	}
+	if (fwrite(buf, 1, len, f) != len) {
+		SYSERROR("Failed to write %s", path);
+		fclose(f);
+		return -1;
+	}
+	if (fclose(f) != 0) {
+		SYSERROR("Failed to write %s", path);
+		return -1;
+	}
+	return 0;
+}
+
+static struct bdev *stream_rootfs(struct lxc_container *c)
+{
+	struct bdev *bdev;
+
+	bdev = bdev_init_rootfs(c->lxc_conf->rootfs.path, c->lxc_conf->rootfs.mount,
+			NULL, &c->lxc_conf->rootfs.backend);
+	if (!bdev)
+		ERROR("Failed to find the backing store of %s", c->name);
+	return bdev;
+}
+
+static struct lxc_container *stream_snapshot(const char *snappath,
+		const char *snapname)
+{
+	struct lxc_container *snap;
+
+	snap = lxc_container_new(snapname, snappath);
+	if (!snap || !lxcapi_is_defined(snap) || !snap->lxc_conf) {
+		ERROR("Could not open snapshot %s", snapname);
+		if (snap)
+			lxc_container_put(snap);
+		return NULL;
+	}
+	return snap;
+}
+
+int lxc_snapshot_export(struct lxc_container *c, const char *snapname,
+		const char *base, int flags, int fd)
+{
+	char snappath[MAXPATHLEN], *origroot;
+	struct lxc_container *snap = NULL, *b = NULL;
+	struct bdev *orig = NULL, *sb = NULL, *bb = NULL;
+	char *stamp = NULL, *bstamp = NULL, *conf = NULL, *fstab = NULL;
+	char *hdr = NULL;
+	size_t conflen, fstablen = 0, hdrlen;
+	const char *format;
+	FILE *f;
+	int ret = -1;
+
+	if (!c || !c->name || !c->config_path || !snapname)
+		return -1;
+	if (geteuid()) {
+		ERROR("Exporting a snapshot requires root");
+		return -1;
+	}
+
+	ret = snprintf(snappath, MAXPATHLEN, "%ssnaps/%s", c->config_path, c->name);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -1;
+	ret = -1;
+	if (!(snap = stream_snapshot(snappath, snapname)))
+		goto out;
+	if (base && !(b = stream_snapshot(snappath, base)))
+		goto out;
+	if (!(orig = stream_rootfs(c)) || !(sb = stream_rootfs(snap)) ||
+	    (b && !(bb = stream_rootfs(b))))
+		goto out;
+
+	if (flags & LXC_EXPORT_TAR)
+		format = "tar";
+	else
+		format = lxc_stream_format(orig, sb, snapname, bb, base);
+
+	// the rootfs is where the importing side puts it
+	f = open_memstream(&conf, &conflen);
+	if (!f)
+		goto out;
+	origroot = snap->lxc_conf->rootfs.path;
+	snap->lxc_conf->rootfs.path = NULL;
+	write_config(f, snap->lxc_conf);
+	snap->lxc_conf->rootfs.path = origroot;
+	if (fclose(f) != 0)
+		goto out;
+	if (snap->lxc_conf->fstab &&
+	    !(fstab = stream_read_file(snap->lxc_conf->fstab, &fstablen)))
+		goto out;
+
+	stamp = get_timestamp(snappath, (char *)snapname);
+	f = open_memstream(&hdr, &hdrlen);
+	if (!f)
+		goto out;
+	fprintf(f, STREAM_VERSION "\nformat %s\nsnapshot %s %s\n", format,
+		snapname, stamp ? stamp : "-");
+	if (base) {
+		bstamp = get_timestamp(snappath, (char *)base);
+		fprintf(f, "base %s %s\n", base, bstamp ? bstamp : "-");
+	}
+	fprintf(f, "config %zu\n", conflen);
+	fwrite(conf, 1, conflen, f);
+	if (fstab) {
+		fprintf(f, "fstab %zu\n", fstablen);
+		fwrite(fstab, 1, fstablen, f);
+	}
+	fprintf(f, "data\n");
+	if (fclose(f) != 0)
+		goto out;
+	if (lxc_write_nointr(fd, hdr, hdrlen) != hdrlen) {
+		SYSERROR("Failed to write the stream");
+		goto out;
+	}
+
+	INFO("Exporting %s of %s as %s%s", snapname, c->name, format,
+	     base ? ", incremental" : "");
+	ret = lxc_stream_send(format, orig, sb, snapname, bb, base, fd);
+	if (ret < 0)
+		ERROR("Failed to export %s of %s", snapname, c->name);
+
+out:
+	free(hdr);
+	free(conf);
+	free(fstab);
+	free(stamp);
+	free(bstamp);
+	if (orig)
+		bdev_put(orig);
+	if (sb)
+		bdev_put(sb);
+	if (bb)
+		bdev_put(bb);
+	if (snap)
+		lxc_container_put(snap);
+	if (b)
+		lxc_container_put(b);
+	return ret;
+}
+
+static int stream_read_line(int fd, char *line)
+{
+	int i;
+
+	for (i = 0; i < MAXPATHLEN; i++) {
+		if (lxc_read_nointr(fd, &line[i], 1) != 1) {
+			ERROR("Truncated stream");
+			return -1;
+		}
+		if (line[i] == '\n') {
+			line[i] = '\0';
+			return 0;
+		}
+	}
+	ERROR("Bad line in the stream");
+	return -1;
+}
+
+static char *stream_read_data(int fd, const char *size, size_t *len)
+{
+	char *buf, *end;
+	unsigned long n;
+
+	errno = 0;
+	n = strtoul(size, &end, 10);
+	if (errno || *end || n > 16 * 1024 * 1024) {
+		ERROR("Bad length %s in the stream", size);
+		return NULL;
+	}
+	buf = malloc(n + 1);
+	if (!buf)
+		return NULL;
+	if (lxc_read_nointr(fd, buf, n) != n) {
+		ERROR("Truncated stream");
+		free(buf);
+		return NULL;
+	}
+	buf[n] = '\0';
+	*len = n;
+	return buf;
+}
+
+/* the name in a 'snapname timestamp' value of the stream */
+static char *stream_snapname(const char *value)
+{
+	char *name;
+
+	if (!value)
+		return NULL;
+	name = strndup(value, strcspn(value, " "));
+	if (name && (!*name || *name == '.' || strchr(name, '/'))) {
+		ERROR("Bad snapshot name %s in the stream", name);
+		free(name);
+		return NULL;
+	}
+	return name;
+}
+
+int lxc_snapshot_import(const char *name, const char *lxcpath, int fd)
+{
+	char line[MAXPATHLEN], cpath[MAXPATHLEN], path[MAXPATHLEN];
+	char *format = NULL, *snapshot = NULL, *base = NULL;
+	char *snapname = NULL, *basesnap = NULL, *imported = NULL;
+	char *conf = NULL, *fstab = NULL, *newroot = NULL, *value, *p;
+	size_t conflen = 0, fstablen = 0, len;
+	struct lxc_container *c = NULL;
+	bool created = false;
+	FILE *fout;
+	int ret = -1;
+
+	if (!name)
+		return -1;
+	if (!lxcpath)
+		lxcpath = lxc_global_config_value("lxc.lxcpath");
+	if (geteuid()) {
+		ERROR("Importing a snapshot requires root");
+		return -1;
+	}
+
+	if (stream_read_line(fd, line) < 0)
+		return -1;
+	if (strcmp(line, STREAM_VERSION)) {
+		ERROR("Not a container stream");
+		return -1;
+	}
+	while (1) {
+		if (stream_read_line(fd, line) < 0)
+			goto out;
+		if (strcmp(line, "data") == 0)
+			break;
+		value = strchr(line, ' ');
+		if (!value) {
+			ERROR("Bad line %s in the stream", line);
+			goto out;
+		}
+		*value++ = '\0';
+		if (strcmp(line, "format") == 0) {
+			free(format);
+			format = strdup(value);
+		} else if (strcmp(line, "snapshot") == 0) {
+			free(snapshot);
+			snapshot = strdup(value);
+		} else if (strcmp(line, "base") == 0) {
+			free(base);
+			base = strdup(value);
+		} else if (strcmp(line, "config") == 0) {
+			free(conf);
+			if (!(conf = stream_read_data(fd, value, &conflen)))
+				goto out;
+		} else if (strcmp(line, "fstab") == 0) {
+			free(fstab);
+			if (!(fstab = stream_read_data(fd, value, &fstablen)))
+				goto out;
+		} else {
+			INFO("Ignoring %s in the stream", line);
+		}
+	}
+	if (!format || !conf || !(snapname = stream_snapname(snapshot)) ||
+	    (base && !(basesnap = stream_snapname(base)))) {
+		ERROR("Incomplete stream header");
+		goto out;
+	}
+
+	ret = snprintf(cpath, MAXPATHLEN, "%s/%s", lxcpath, name);
+	if (ret < 0 || ret >= MAXPATHLEN) {
+		ret = -1;
+		goto out;
+	}
+	ret = -1;
+	c = lxc_container_new(name, lxcpath);
+	if (!c)
+		goto out;
+	if (container_disk_lock(c))
+		goto out;
+
+	if (base) {
+		if (!file_exists(c->configfile)) {
+			ERROR("%s does not exist, import a full stream first", name);
+			goto out_unlock;
+		}
+		if (!is_stopped(c)) {
+			ERROR("%s is running", name);
+			goto out_unlock;
+		}
+		ret = snprintf(path, MAXPATHLEN, "%s/" STREAM_IMPORTED, cpath);
+		if (ret < 0 || ret >= MAXPATHLEN ||
+		    !(imported = stream_read_file(path, &len))) {
+			ret = -1;
+			goto out_unlock;
+		}
+		ret = -1;
+		if (strcmp(imported, base)) {
+			ERROR("%s holds snapshot %s, the stream needs %s", name,
+			      imported, base);
+			goto out_unlock;
+		}
+	} else {
+		if (file_exists(c->configfile)) {
+			ERROR("%s already exists", name);
+			goto out_unlock;
+		}
+		if (mkdir(cpath, 0755) < 0) {
+			SYSERROR("Failed to create %s", cpath);
+			goto out_unlock;
+		}
+		created = true;
+	}
+
+	INFO("Importing %s as %s, %s%s", snapname, name, format,
+	     base ? " incremental" : "");
+	newroot = lxc_stream_receive(format, cpath,
+			base ? c->lxc_conf->rootfs.path : NULL, snapname,
+			basesnap, fd);
+	if (!newroot) {
+		ERROR("Failed to import %s into %s", snapname, name);
+		goto out_unlock;
+	}
+
+	// take the configuration of the snapshot, with the local paths
+	if (stream_write_file(c->configfile, conf, conflen) < 0)
+		goto out_unlock;
+	lxcapi_clear_config(c);
+	if (!load_config_locked(c, c->configfile))
+		goto out_unlock;
+	if (!set_config_item_locked(c, "lxc.rootfs", newroot) ||
+	    !set_config_item_locked(c, "lxc.utsname", name))
+		goto out_unlock;
+	if (fstab) {
+		p = c->lxc_conf->fstab ? strrchr(c->lxc_conf->fstab, '/') : NULL;
+		ret = snprintf(path, MAXPATHLEN, "%s/%s", cpath, p ? p + 1 : "fstab");
+		if (ret < 0 || ret >= MAXPATHLEN ||
+		    stream_write_file(path, fstab, fstablen) < 0 ||
+		    !set_config_item_locked(c, "lxc.mount", path)) {
+			ret = -1;
+			goto out_unlock;
+		}
+		ret = -1;
+	}
+	fout = fopen(c->configfile, "w");
+	if (!fout) {
+		SYSERROR("Failed to write %s", c->configfile);
+		goto out_unlock;
+	}
+	write_config(fout, c->lxc_conf);
+	if (fclose(fout) != 0)
+		goto out_unlock;
+
+	ret = snprintf(path, MAXPATHLEN, "%s/" STREAM_IMPORTED, cpath);
+	if (ret < 0 || ret >= MAXPATHLEN ||
+	    stream_write_file(path, snapshot, strlen(snapshot)) < 0) {
+		ret = -1;
+		goto out_unlock;
+	}
+	ret = 0;
+
+out_unlock:
+	if (ret < 0 && created) {
+		if (newroot)
+			lxc_stream_discard(format, cpath, newroot);
+		if (lxc_rmdir_onedev(cpath) < 0)
+			WARN("Failed to remove %s", cpath);
+	}
+	container_disk_unlock(c);
+out:
+	if (c)
+		lxc_container_put(c);
+	free(format);
+	free(snapshot);
+	free(base);
+	free(snapname);
+	free(basesnap);
+	free(imported);
+	free(conf);
+	free(fstab);
+	free(newroot);
+	return ret;
+}
+
 static bool lxcapi_may_control(struct lxc_container *c)
 {
 	return lxc_try_cmd(c->name, c->config_path) == 0;
@@ -3344,6 +4971,7 @@ struct lxc_container *lxc_container_new(const char *name, const char *configpath
 	c->unfreeze = lxcapi_unfreeze;
 	c->console = lxcapi_console;
 	c->console_getfd = lxcapi_console_getfd;
+	c->console_log = lxcapi_console_log;
 	c->init_pid = lxcapi_init_pid;
 	c->load_config = lxcapi_load_config;
 	c->want_daemonize = lxcapi_want_daemonize;
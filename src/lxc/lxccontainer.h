@@ -39,16 +39,24 @@ extern "C" {
 #define LXC_CLONE_SNAPSHOT        (1 << 2) /*!< Snapshot the original filesystem(s) */
 #define LXC_CLONE_KEEPBDEVTYPE    (1 << 3) /*!< Use the same bdev type */
 #define LXC_CLONE_MAYBE_SNAPSHOT  (1 << 4) /*!< Snapshot only if bdev supports it, else copy */
-#define LXC_CLONE_MAXFLAGS        (1 << 5) /*!< Number of \c LXC_CLONE_* flags */
+#define LXC_CLONE_DEDUP           (1 << 5) /*!< Share the files a dir or loop copy has in common with other containers */
+#define LXC_CLONE_MAXFLAGS        (1 << 6) /*!< Number of \c LXC_CLONE_* flags */
 #define LXC_CREATE_QUIET          (1 << 0) /*!< Redirect \c stdin to \c /dev/zero and \c stdout and \c stderr to \c /dev/null */
-#define LXC_CREATE_MAXFLAGS       (1 << 1) /*!< Number of \c LXC_CREATE* flags */
+#define LXC_CREATE_CACHE          (1 << 1) /*!< Clone the cached result of an identical template run, see \ref lxc_template_cache_flush */
+#define LXC_CREATE_MAXFLAGS       (1 << 2) /*!< Number of \c LXC_CREATE* flags */
+#define LXC_EXPORT_TAR            (1 << 0) /*!< Stream the rootfs as tar even if btrfs or zfs could send it */
+#define LXC_EXPORT_MAXFLAGS       (1 << 1) /*!< Number of \c LXC_EXPORT_* flags */
 
 struct bdev_specs;
 
 struct lxc_snapshot;
 
+struct lxc_console_log;
+
 struct lxc_lock;
 
+struct lxc_netns_cache;
+
 /*!
  * An LXC container.
  */
@@ -305,8 +313,8 @@ struct lxc_container {
 	 * \param bdevtype Backing store type to use (if \c NULL, \c dir will be used).
 	 * \param specs Additional parameters for the backing store (for
 	 *  example LVM volume group to use).
-	 * \param flags \c LXC_CREATE_* options (currently only \ref
-	 *  LXC_CREATE_QUIET is supported).
+	 * \param flags \c LXC_CREATE_* options (\ref LXC_CREATE_QUIET,
+	 *  \ref LXC_CREATE_CACHE).
 	 * \param argv Arguments to pass to the template, terminated by \c NULL (if no
 	 *  arguments are required, just pass \c NULL).
 	 *
@@ -325,8 +333,8 @@ struct lxc_container {
 	 * \param bdevtype Backing store type to use (if \c NULL, \c dir will be used).
 	 * \param specs Additional parameters for the backing store (for
 	 *  example LVM volume group to use).
-	 * \param flags \c LXC_CREATE_* options (currently only \ref
-	 *  LXC_CREATE_QUIET is supported).
+	 * \param flags \c LXC_CREATE_* options (\ref LXC_CREATE_QUIET,
+	 *  \ref LXC_CREATE_CACHE).
 	 * \param ... Command-line to pass to init (must end in \c NULL).
 	 *
 	 * \return \c true on success, else \c false.
@@ -740,6 +748,41 @@ struct lxc_container {
 	 * \return \c true on success, else \c false.
 	 */
 	bool (*remove_device_node)(struct lxc_container *c, const char *src_path, const char *dest_path);
+
+	/*!
+	 * \brief Query the in-memory console buffer of a running container.
+	 *
+	 * \param c Container.
+	 * \param[in,out] log \ref lxc_console_log describing what to do.
+	 *
+	 * \return \c 0 on success, a negative value on failure.
+	 *
+	 * \note The buffer only exists if \c lxc.console.buffer_size was
+	 *  set when the container was started.
+	 */
+	int (*console_log)(struct lxc_container *c, struct lxc_console_log *log);
+
+	/*!
+	 * \private
+	 * Netlink socket in the network namespace of the running
+	 * container, used by \c get_interfaces and \c get_ips.
+	 * \note protected by privlock.
+	 */
+	struct lxc_netns_cache *netns;
+};
+
+/*!
+ * \brief Request for \ref console_log.
+ */
+struct lxc_console_log {
+	bool clear; /*!< Clear the console buffer (after reading it) */
+	bool read; /*!< Read the console buffer */
+	/*! In: maximum number of (most recent) bytes to read, \c 0 for all.
+	 *  Out: number of bytes read. May be \c NULL.
+	 */
+	uint64_t *read_max;
+	/*! Out: NUL terminated console output, to be free()d by the caller */
+	char *data;
 };
 
 /*!
@@ -758,6 +801,26 @@ struct lxc_snapshot {
 	void (*free)(struct lxc_snapshot *s);
 };
 
+/*!
+ * \brief An entry of the snapshot index, see \ref lxc_snapshot_index.
+ */
+struct lxc_snapshot_info {
+	char *name; /*!< Name of snapshot */
+	char *timestamp; /*!< Time snapshot was created */
+	char *bdev_type; /*!< Backing store type of snapshot */
+	uint64_t size; /*!< Bytes of storage used by the snapshot itself */
+	bool has_comment; /*!< Whether the snapshot has a comment file */
+};
+
+/*!
+ * \brief Network interfaces and addresses of a container, see \ref lxc_get_netinfo.
+ */
+struct lxc_netinfo {
+	struct lxc_container *c; /*!< Container queried */
+	char **interfaces; /*!< \c NULL terminated list as returned by \c get_interfaces, \c NULL on failure */
+	char **ips; /*!< \c NULL terminated list as returned by \c get_ips for all interfaces */
+};
+
 /*!
  * \brief Create a new container.
  *
@@ -865,6 +928,345 @@ int list_active_containers(const char *lxcpath, char ***names, struct lxc_contai
  */
 int list_all_containers(const char *lxcpath, char ***names, struct lxc_container ***cret);
 
+/*!
+ * \brief Query the network interfaces and addresses of many containers.
+ *
+ * \param cs Containers to query.
+ * \param count Number of containers in \p cs.
+ * \param family Network family (for example "inet", "inet6") of the
+ *  addresses to return, or \c NULL for all.
+ * \param scope IPv6 scope id (ignored for IPv4).
+ * \param[out] ret Dynamically-allocated array of \p count results, in
+ *  the order of \p cs, to be freed with \ref lxc_netinfo_free.
+ *
+ * \return Number of containers which could not be queried (for instance
+ *  because they are not running), or \c -1 on error.
+ *
+ * \note This is equivalent to calling \c get_interfaces and
+ *  \c get_ips(c, NULL, family, scope) on each container.
+ */
+int lxc_get_netinfo(struct lxc_container **cs, int count, const char *family,
+		int scope, struct lxc_netinfo **ret);
+
+/*!
+ * \brief Free the result of \ref lxc_get_netinfo.
+ *
+ * \param info Array returned by \ref lxc_get_netinfo.
+ * \param count Number of entries in \p info.
+ */
+void lxc_netinfo_free(struct lxc_netinfo *info, int count);
+
+/*!
+ * \brief List the snapshots of a container from its snapshot index.
+ *
+ * \param c Container.
+ * \param[out] ret Dynamically-allocated array of snapshots, oldest
+ *  first, to be freed with \ref lxc_snapshot_info_free.
+ *
+ * \return Number of snapshots, or \c -1 on error.
+ *
+ * \note Unlike \c snapshot_list, this does not read the files of each
+ *  snapshot, except for snapshots made by an older lxc, which are then
+ *  added to the index.  The size of a snapshot is computed, by walking
+ *  its storage, the first time it is listed here, and then kept in the
+ *  index.
+ */
+int lxc_snapshot_index(struct lxc_container *c, struct lxc_snapshot_info **ret);
+
+/*!
+ * \brief Free the result of \ref lxc_snapshot_index.
+ *
+ * \param info Array returned by \ref lxc_snapshot_index.
+ * \param count Number of entries in \p info.
+ */
+void lxc_snapshot_info_free(struct lxc_snapshot_info *info, int count);
+
+/*!
+ * \brief Clone a container several times.
+ *
+ * Equivalent to calling \c clone(c, newnames[i], lxcpath, flags, NULL,
+ * NULL, newsize, NULL) for each name, except that snapshots of an lvm
+ * rootfs are all created by a single lvm command run first.
+ *
+ * \param c Container to clone, which must be stopped.
+ * \param newnames Names of the clones.
+ * \param count Number of entries in \p newnames.
+ * \param lxcpath lxcpath of the clones, or \c NULL for the one of \p c.
+ * \param flags \c LXC_CLONE_* flags, as for \c clone.
+ * \param newsize Size of the new rootfs, as for \c clone.
+ * \param[out] clones Array of \p count entries, set to the clones, or to
+ *  \c NULL for those which failed, to be released with
+ *  \ref lxc_container_put.
+ *
+ * \return Number of clones created, or \c -1 on error.
+ */
+int lxc_clone_many(struct lxc_container *c, const char * const *newnames,
+		int count, const char *lxcpath, int flags, uint64_t newsize,
+		struct lxc_container **clones);
+
+/*!
+ * Counters of \ref lxc_shift_rootfs.
+ */
+struct lxc_shift_stats {
+	uint64_t inodes;   /*!< Inodes walked */
+	uint64_t changed;  /*!< Inodes re-owned */
+	uint64_t xattrs;   /*!< ACLs and file capabilities rewritten */
+	uint64_t unmapped; /*!< Ids without a mapping, left alone */
+	uint64_t copied;   /*!< Files linked from outside, replaced by a copy */
+	double seconds;    /*!< Time taken */
+};
+
+/*!
+ * \brief Re-own the rootfs of a stopped container for its id map.
+ *
+ * Files owned by container id N as mapped by \p ref (for instance the
+ * container \p c was copied from) are re-owned by the host id of N in the
+ * \c lxc.id_map of \p c.  POSIX ACLs and file capabilities are shifted
+ * along.  An overlayfs or aufs rootfs, whose lower layer is shared, is
+ * refused.  A regular file which is also linked from outside of the
+ * rootfs, as with \c LXC_CLONE_DEDUP, is first replaced by a copy.
+ *
+ * \param c Container whose rootfs to shift.
+ * \param ref Container whose id map the rootfs is currently owned under,
+ *  or \c NULL if the rootfs is not shifted (privileged).
+ * \param threads Number of threads to walk the rootfs with, or \c 0 for
+ *  the number of cpus.
+ * \param[out] stats If not \c NULL, counters of the shift.
+ *
+ * \return \c true on success, else \c false.
+ *
+ * \note Only root can shift ids.
+ */
+bool lxc_shift_rootfs(struct lxc_container *c, struct lxc_container *ref,
+		int threads, struct lxc_shift_stats *stats);
+
+/*!
+ * \brief Keep a pool of booted, frozen snapshot clones of a container.
+ *
+ * Clones \p tmpl (with \c LXC_CLONE_SNAPSHOT) as \c tmpl-warmN, starts
+ * and freezes the clones until \p count of them are ready to be handed
+ * off by \ref lxc_warmpool_take.  Warm containers which died are
+ * replaced.
+ *
+ * \param tmpl Name of the template container.
+ * \param lxcpath lxcpath of \p tmpl and of the pool, or \c NULL for the
+ *  default.
+ * \param count Number of warm containers to keep.
+ * \param boot_wait Seconds to let each clone boot before freezing it.
+ *
+ * \return Number of warm containers ready, or \c -1 on error.
+ *
+ * \note \p count and \p boot_wait are remembered for the refills done by
+ *  \ref lxc_warmpool_take.
+ */
+int lxc_warmpool_fill(const char *tmpl, const char *lxcpath, int count,
+		int boot_wait);
+
+/*!
+ * \brief Take a container out of the warm pool of \p tmpl.
+ *
+ * \param tmpl Name of the template container.
+ * \param lxcpath lxcpath of the pool, or \c NULL for the default.
+ * \param refill Whether to replace the container in the background.
+ *
+ * \return The thawed container, which is no longer part of the pool, or
+ *  \c NULL if none was ready.
+ *
+ * \note The container keeps its \c tmpl-warmN name, a running container
+ *  cannot be renamed.
+ */
+struct lxc_container *lxc_warmpool_take(const char *tmpl, const char *lxcpath,
+		bool refill);
+
+/*!
+ * \brief Empty the template cache of an lxcpath.
+ *
+ * Creates with \ref LXC_CREATE_CACHE keep the result of each template
+ * run as a container under \c lxcpath/.cache, named after a hash of the
+ * template, its arguments, arch and release, the backing store and the
+ * starting configuration, and create further containers with the same
+ * parameters as snapshot clones of it.  This removes those entries.
+ *
+ * \param lxcpath lxcpath of the cache, or \c NULL for the default.
+ *
+ * \return Number of entries removed, or \c -1 on error.
+ *
+ * \note Entries which containers created from them still depend on, as
+ *  an overlayfs, btrfs, zfs or lvm snapshot, are kept.  Containers copied
+ *  from an entry do not keep it.
+ */
+int lxc_template_cache_flush(const char *lxcpath);
+
+/*!
+ * \brief Write a snapshot of a container to a stream.
+ *
+ * The stream holds the configuration of the snapshot and its rootfs,
+ * sent by \c btrfs \c send or \c zfs \c send when the backing store
+ * allows it, else as a tar, for \ref lxc_snapshot_import to recreate the
+ * container from, i.e. on another host.
+ *
+ * \param c Container.
+ * \param snapname Name of the snapshot, i.e. \c snap1.
+ * \param base Name of an older snapshot which was imported already, to
+ *  only send what changed since, or \c NULL to send it all.
+ * \param flags Additional \c LXC_EXPORT* flags.
+ * \param fd File descriptor to write the stream to.
+ *
+ * \return \c 0 on success, else \c -1.
+ *
+ * \note A btrfs snapshot can only be the base of a btrfs stream if it
+ *  was itself exported as btrfs.
+ */
+int lxc_snapshot_export(struct lxc_container *c, const char *snapname,
+		const char *base, int flags, int fd);
+
+/*!
+ * \brief Read a stream written by \ref lxc_snapshot_export.
+ *
+ * A full stream creates container \p name, which must not exist.  An
+ * incremental one brings its rootfs and configuration up to date, after
+ * a previous import of its base snapshot.
+ *
+ * \param name Name of the container.
+ * \param lxcpath lxcpath of the container, or \c NULL for the default.
+ * \param fd File descriptor to read the stream from.
+ *
+ * \return \c 0 on success, else \c -1.
+ *
+ * \note The container must be stopped, and changes made to its rootfs
+ *  since the previous import may be lost.
+ */
+int lxc_snapshot_import(const char *name, const char *lxcpath, int fd);
+
+#define LXC_OP_QUEUED     0 /*!< Waiting for a worker */
+#define LXC_OP_STORAGE    1 /*!< Creating, copying or snapshotting the rootfs */
+#define LXC_OP_TEMPLATE   2 /*!< Running the template */
+#define LXC_OP_SETUP      3 /*!< Updating the new container (clone hooks, hostname) */
+#define LXC_OP_DONE       4 /*!< Finished successfully */
+#define LXC_OP_FAILED     5 /*!< Finished with an error */
+#define LXC_OP_CANCELLED  6 /*!< Cancelled, the partial container was removed */
+
+/*!
+ * An asynchronous clone or create, see \ref lxc_clone_async.
+ */
+struct lxc_op;
+
+/*!
+ * Progress of an asynchronous operation.
+ */
+struct lxc_op_progress {
+	int phase;      /*!< One of \c LXC_OP_* */
+	uint64_t bytes; /*!< Bytes copied so far in the \c LXC_OP_STORAGE phase */
+	uint64_t total; /*!< Estimated bytes to copy, or \c 0 if unknown */
+};
+
+/*!
+ * Notifications of an asynchronous operation.  They are called from a
+ * worker thread of liblxc, and either may be \c NULL.
+ */
+struct lxc_op_callbacks {
+	/*! Called on changes of phase and as bytes are copied */
+	void (*progress)(struct lxc_op *op, const struct lxc_op_progress *p,
+			void *data);
+	/*!
+	 * Called once the operation finished, with the new container, or
+	 * \c NULL if it failed or was cancelled.  The container is owned by
+	 * \p op, see \ref lxc_op_result.
+	 */
+	void (*done)(struct lxc_op *op, struct lxc_container *c, void *data);
+	void *data; /*!< Passed to the callbacks */
+};
+
+/*!
+ * \brief Clone a container in the background.
+ *
+ * Queues \c clone(c, newname, lxcpath, flags, bdevtype, bdevdata,
+ * newsize, hookargs) on a pool of worker threads.  Each operation runs
+ * in a child process of its worker, so that it can be cancelled at any
+ * point.  The arguments are copied.
+ *
+ * \param c Container to clone, which must be stopped until the
+ *  operation finished.
+ * \param cb Notifications, or \c NULL.
+ *
+ * (other parameters as for \c clone)
+ *
+ * \return The operation, to be released with \ref lxc_op_put, or
+ *  \c NULL on error.
+ */
+struct lxc_op *lxc_clone_async(struct lxc_container *c, const char *newname,
+		const char *lxcpath, int flags, const char *bdevtype,
+		const char *bdevdata, uint64_t newsize, char **hookargs,
+		const struct lxc_op_callbacks *cb);
+
+/*!
+ * \brief Create a container in the background.
+ *
+ * Queues \c create(c, t, bdevtype, specs, flags, argv) like \ref
+ * lxc_clone_async.  \p c itself is not updated, the created container is
+ * the result of the operation.
+ *
+ * \param c Container to create, with its starting configuration set.
+ * \param cb Notifications, or \c NULL.
+ *
+ * (other parameters as for \c create)
+ *
+ * \return The operation, to be released with \ref lxc_op_put, or
+ *  \c NULL on error.
+ */
+struct lxc_op *lxc_create_async(struct lxc_container *c, const char *t,
+		const char *bdevtype, struct bdev_specs *specs, int flags,
+		char *const argv[], const struct lxc_op_callbacks *cb);
+
+/*!
+ * \brief Cancel an asynchronous operation.
+ *
+ * Kills the process running \p op, along with rsync or the template, and
+ * removes what it created of the new container.
+ *
+ * \return \c true if \p op was still queued or running, else \c false.
+ */
+bool lxc_op_cancel(struct lxc_op *op);
+
+/*!
+ * \brief Wait for an asynchronous operation to finish.
+ *
+ * \param op Operation.
+ * \param timeout Timeout in seconds, \c -1 to wait forever.
+ *
+ * \return \c true if \p op finished, else \c false.
+ */
+bool lxc_op_wait(struct lxc_op *op, int timeout);
+
+/*!
+ * \brief Get the progress of an asynchronous operation.
+ */
+void lxc_op_get_progress(struct lxc_op *op, struct lxc_op_progress *p);
+
+/*!
+ * \brief Get the container an asynchronous operation created.
+ *
+ * \return A new reference to the container, to be released with \ref
+ *  lxc_container_put, or \c NULL if \p op did not finish successfully.
+ */
+struct lxc_container *lxc_op_result(struct lxc_op *op);
+
+/*!
+ * \brief Release an asynchronous operation.
+ *
+ * \note An operation which did not finish yet keeps running, cancel it
+ *  first to stop it.
+ */
+void lxc_op_put(struct lxc_op *op);
+
+/*!
+ * \brief Set the maximum number of asynchronous operations run at once.
+ *
+ * \param n Number of worker threads, or \c 0 for the number of cpus
+ *  (the default).
+ */
+void lxc_op_set_workers(int n);
+
 #ifdef  __cplusplus
 }
 #endif
@@ -31,30 +31,6 @@
 #include <fcntl.h>
 #include <sys/inotify.h>
 #include <sys/ioctl.h>
-#ifdef HAVE_SYS_TIMERFD_H
-#include <sys/timerfd.h>
-#else
-#include <sys/syscall.h>
-#ifndef TFD_NONBLOCK
-#define TFD_NONBLOCK O_NONBLOCK
-#endif
-
-#ifndef TFD_CLOEXEC
-#define TFD_CLOEXEC O_CLOEXEC
-#endif
-static int timerfd_create (clockid_t __clock_id, int __flags) {
-	return syscall(__NR_timerfd_create, __clock_id, __flags);
-}
-
-static int timerfd_settime (int __ufd, int __flags,
-			    const struct itimerspec *__utmr,
-			    struct itimerspec *__otmr) {
-
-	return syscall(__NR_timerfd_settime, __ufd, __flags,
-			    __utmr, __otmr);
-}
-
-#endif
 
 #include "conf.h"
 #include "cgroup.h"
@@ -132,18 +108,15 @@ struct lxc_utmp {
 #define CONTAINER_HALTING   2
 #define CONTAINER_RUNNING   4
 	char container_state;
-	int timer_fd;
+	struct lxc_mainloop_timer *timer;
 	int prev_runlevel, curr_runlevel;
 };
 
-typedef void (*lxc_mainloop_timer_t) (void *data);
-
 static int utmp_get_runlevel(struct lxc_utmp *utmp_data);
 static int utmp_get_ntasks(struct lxc_handler *handler);
-static int utmp_shutdown_handler(int fd, uint32_t events, void *data,
-				 struct lxc_epoll_descr *descr);
+static int utmp_shutdown_handler(void *data, struct lxc_epoll_descr *descr);
 static int lxc_utmp_add_timer(struct lxc_epoll_descr *descr,
-			      lxc_mainloop_callback_t callback, void *data);
+			      lxc_mainloop_timer_cb_t callback, void *data);
 static int lxc_utmp_del_timer(struct lxc_epoll_descr *descr,
 			      struct lxc_utmp *utmp_data);
 
@@ -207,7 +180,7 @@ static int utmp_handler(int fd, uint32_t events, void *data,
 	    && ((utmp_data->container_state == CONTAINER_RUNNING)
 		|| (utmp_data->container_state == CONTAINER_STARTING))) {
 		utmp_data->container_state = CONTAINER_HALTING;
-		if (utmp_data->timer_fd == -1)
+		if (!utmp_data->timer)
 			lxc_utmp_add_timer(descr, utmp_shutdown_handler, data);
 		DEBUG("Container halting");
 		goto out;
@@ -218,7 +191,7 @@ static int utmp_handler(int fd, uint32_t events, void *data,
 	    && ((utmp_data->container_state == CONTAINER_RUNNING)
 		|| (utmp_data->container_state == CONTAINER_STARTING))) {
 		utmp_data->container_state = CONTAINER_REBOOTING;
-		if (utmp_data->timer_fd == -1)
+		if (!utmp_data->timer)
 			lxc_utmp_add_timer(descr, utmp_shutdown_handler, data);
 		DEBUG("Container rebooting");
 		goto out;
@@ -227,7 +200,7 @@ static int utmp_handler(int fd, uint32_t events, void *data,
 	/* normal operation, running, from starting state. */
 	if (utmp_data->curr_runlevel > '0' && utmp_data->curr_runlevel < '6') {
 		utmp_data->container_state = CONTAINER_RUNNING;
-		if (utmp_data->timer_fd > 0)
+		if (utmp_data->timer)
 			lxc_utmp_del_timer(descr, utmp_data);
 		DEBUG("Container running");
 		goto out;
@@ -370,7 +343,7 @@ run_ok:
 
 	utmp_data->handler = handler;
 	utmp_data->container_state = CONTAINER_STARTING;
-	utmp_data->timer_fd = -1;
+	utmp_data->timer = NULL;
 	utmp_data->prev_runlevel = 'N';
 	utmp_data->curr_runlevel = 'N';
 
@@ -390,20 +363,29 @@ out:
 	return -1;
 }
 
-static int utmp_shutdown_handler(int fd, uint32_t events, void *data,
-				 struct lxc_epoll_descr *descr)
+static void utmp_cleanup(int fd, void *data, struct lxc_epoll_descr *descr)
+{
+	struct lxc_utmp *utmp_data = (struct lxc_utmp *)data;
+
+	if (utmp_data->timer)
+		lxc_utmp_del_timer(descr, utmp_data);
+
+	lxc_mainloop_del_handler(descr, fd);
+	close(fd);
+	free(utmp_data);
+}
+
+void lxc_utmp_mainloop_del(struct lxc_epoll_descr *descr)
+{
+	lxc_mainloop_for_each(descr, utmp_handler, utmp_cleanup);
+}
+
+static int utmp_shutdown_handler(void *data, struct lxc_epoll_descr *descr)
 {
 	int ntasks;
-	ssize_t nread;
 	struct lxc_utmp *utmp_data = (struct lxc_utmp *)data;
 	struct lxc_handler *handler = utmp_data->handler;
 	struct lxc_conf *conf = handler->conf;
-	uint64_t expirations;
-
-	/* read and clear notifications */
-	nread = read(fd, &expirations, sizeof(expirations));
-	if (nread < 0)
-		SYSERROR("Failed to read timer notification");
 
 	ntasks = utmp_get_ntasks(handler);
 
@@ -427,63 +409,31 @@ static int utmp_shutdown_handler(int fd, uint32_t events, void *data,
 
 }
 
-int lxc_utmp_add_timer(struct lxc_epoll_descr *descr,
-		       lxc_mainloop_callback_t callback, void *data)
+static int lxc_utmp_add_timer(struct lxc_epoll_descr *descr,
+			      lxc_mainloop_timer_cb_t callback, void *data)
 {
-	int fd, result;
-	struct itimerspec timeout;
 	struct lxc_utmp *utmp_data = (struct lxc_utmp *)data;
 
-	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
-	if (fd < 0) {
-		SYSERROR("failed to create timer");
-		return -1;
-	}
-
 	DEBUG("Setting up utmp shutdown timer");
 
 	/* set a one second timeout. Repeated. */
-	timeout.it_value.tv_sec = 1;
-	timeout.it_value.tv_nsec = 0;
-
-	timeout.it_interval.tv_sec = 1;
-	timeout.it_interval.tv_nsec = 0;
-
-	result = timerfd_settime(fd, 0, &timeout, NULL);
-
-	if (result < 0) {
-		SYSERROR("timerfd_settime:");
+	utmp_data->timer = lxc_mainloop_add_timer(descr, 1000, 1000,
+						  callback, utmp_data);
+	if (!utmp_data->timer) {
+		ERROR("failed to add utmp timer to mainloop");
 		return -1;
 	}
 
-	if (lxc_mainloop_add_handler(descr, fd, callback, utmp_data)) {
-		SYSERROR("failed to add utmp timer to mainloop");
-		close(fd);
-		return -1;
-	}
-
-	utmp_data->timer_fd = fd;
-
 	return 0;
 }
 
-int lxc_utmp_del_timer(struct lxc_epoll_descr *descr,
-		       struct lxc_utmp *utmp_data)
+static int lxc_utmp_del_timer(struct lxc_epoll_descr *descr,
+			      struct lxc_utmp *utmp_data)
 {
-	int result;
-
 	DEBUG("Clearing utmp shutdown timer");
 
-	result = lxc_mainloop_del_handler(descr, utmp_data->timer_fd);
-	if (result < 0)
-		SYSERROR("failed to del utmp timer from mainloop");
-
-	/* shutdown timer_fd */
-	close(utmp_data->timer_fd);
-	utmp_data->timer_fd = -1;
+	lxc_mainloop_del_timer(descr, utmp_data->timer);
+	utmp_data->timer = NULL;
 
-	if (result < 0)
-		return -1;
-	else
-		return 0;
+	return 0;
 }
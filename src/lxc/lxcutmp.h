@@ -28,3 +28,4 @@ struct lxc_epoll_descr;
 
 int lxc_utmp_mainloop_add(struct lxc_epoll_descr *descr,
 			  struct lxc_handler *handler);
+void lxc_utmp_mainloop_del(struct lxc_epoll_descr *descr);
@@ -0,0 +1,485 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * zfs operations for the zfs backing store.
+ *
+ * libzfs_core is loaded at runtime, so that lxc neither needs it to
+ * build nor depends on it, and so that its soname (which differs between
+ * zfs releases) is not fixed at build time.  Its functions each do one
+ * ioctl on /dev/zfs, so that a snapshot clone costs no fork and no
+ * parsing of 'zfs list'.  libzfs_core does not mount datasets, which
+ * is done here.  Without it, the zfs command is run as before.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/mount.h>
+#include <sys/param.h>
+#include <sys/wait.h>
+
+#include "log.h"
+#include "utils.h"
+#include "lxczfs.h"
+
+lxc_log_define(lxc_zfs, lxc);
+
+/*
+ * zfs command
+ */
+static int run_zfs(const char *const argv[], bool quiet)
+{
+	pid_t pid;
+	int fd;
+
+	pid = fork();
+	if (pid < 0) {
+		SYSERROR("failed to fork");
+		return -1;
+	}
+	if (pid > 0)
+		return wait_for_pid(pid);
+
+	if (quiet) {
+		fd = open("/dev/null", O_RDWR);
+		if (fd >= 0) {
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+		}
+	}
+	execvp("zfs", (char * const *)argv);
+	exit(1);
+}
+
+static int cli_create(const char *dataset, const char *mountpoint)
+{
+	char option[MAXPATHLEN];
+	int ret;
+
+	ret = snprintf(option, MAXPATHLEN, "-omountpoint=%s", mountpoint);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -1;
+	return run_zfs((const char *[]){"zfs", "create", option, dataset, NULL},
+		       false);
+}
+
+static bool cli_exists(const char *dataset)
+{
+	return run_zfs((const char *[]){"zfs", "list", "-H", "-o", "name",
+					dataset, NULL}, true) == 0;
+}
+
+static int cli_snapshot(const char *dataset, const char *snap)
+{
+	char name[MAXPATHLEN];
+	int ret;
+
+	ret = snprintf(name, MAXPATHLEN, "%s@%s", dataset, snap);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -1;
+	if (cli_exists(name) &&
+	    run_zfs((const char *[]){"zfs", "destroy", name, NULL}, false) < 0)
+		return -1;
+	return run_zfs((const char *[]){"zfs", "snapshot", name, NULL}, false);
+}
+
+static int cli_clone(const char *origin, const char *dataset,
+		     const char *mountpoint)
+{
+	char option[MAXPATHLEN];
+	int ret;
+
+	ret = snprintf(option, MAXPATHLEN, "-omountpoint=%s", mountpoint);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -1;
+	return run_zfs((const char *[]){"zfs", "clone", option, origin,
+					dataset, NULL}, false);
+}
+
+static int cli_destroy(const char *dataset, const char *mountpoint)
+{
+	return run_zfs((const char *[]){"zfs", "destroy", dataset, NULL},
+		       false);
+}
+
+static char *zfs_dataset_of(const char *path, bool scan);
+
+static const struct lxc_zfs_ops zfs_cli_ops = {
+	.name = "zfs command",
+	.create = cli_create,
+	.snapshot = cli_snapshot,
+	.clone = cli_clone,
+	.destroy = cli_destroy,
+	.exists = cli_exists,
+	.dataset_of = zfs_dataset_of,
+};
+
+/*
+ * libzfs_core, and libnvpair for the nvlists it takes.  An nvlist_t is
+ * opaque here.
+ */
+#define LZC_DATSET_TYPE_ZFS 2
+#define NV_UNIQUE_NAME 1
+
+static struct {
+	int (*init)(void);
+	int (*create)(const char *, int, void *, void *, unsigned);
+	int (*snapshot)(void *, void *, void **);
+	int (*clone)(const char *, const char *, void *);
+	int (*destroy)(const char *);
+	int (*destroy_snaps)(void *, int, void **);
+	int (*exists)(const char *);
+	int (*nvlist_alloc)(void **, unsigned, int);
+	void (*nvlist_free)(void *);
+	int (*nvlist_add_string)(void *, const char *, const char *);
+	int (*nvlist_add_boolean)(void *, const char *);
+} lzc;
+
+static void *lzc_dlopen(const char *const names[])
+{
+	void *handle;
+	int i;
+
+	for (i = 0; names[i]; i++) {
+		handle = dlopen(names[i], RTLD_NOW | RTLD_LOCAL);
+		if (handle)
+			return handle;
+	}
+	return NULL;
+}
+
+static bool lzc_load(void)
+{
+	static const char *const zfs_core[] = {
+		"libzfs_core.so.3", "libzfs_core.so.1", "libzfs_core.so", NULL
+	};
+	static const char *const nvpair[] = {
+		"libnvpair.so.3", "libnvpair.so.1", "libnvpair.so", NULL
+	};
+	void *h, *nvh;
+
+	h = lzc_dlopen(zfs_core);
+	if (!h)
+		return false;
+	nvh = lzc_dlopen(nvpair);
+	if (!nvh) {
+		dlclose(h);
+		return false;
+	}
+
+	lzc.init = dlsym(h, "libzfs_core_init");
+	lzc.create = dlsym(h, "lzc_create");
+	lzc.snapshot = dlsym(h, "lzc_snapshot");
+	lzc.clone = dlsym(h, "lzc_clone");
+	lzc.destroy = dlsym(h, "lzc_destroy");  /* not in zfs < 0.8 */
+	lzc.destroy_snaps = dlsym(h, "lzc_destroy_snaps");
+	lzc.exists = dlsym(h, "lzc_exists");
+	lzc.nvlist_alloc = dlsym(nvh, "nvlist_alloc");
+	lzc.nvlist_free = dlsym(nvh, "nvlist_free");
+	lzc.nvlist_add_string = dlsym(nvh, "nvlist_add_string");
+	lzc.nvlist_add_boolean = dlsym(nvh, "nvlist_add_boolean");
+
+	if (!lzc.init || !lzc.create || !lzc.snapshot || !lzc.clone ||
+	    !lzc.destroy_snaps || !lzc.exists || !lzc.nvlist_alloc ||
+	    !lzc.nvlist_free || !lzc.nvlist_add_string ||
+	    !lzc.nvlist_add_boolean) {
+		WARN("libzfs_core lacks functions lxc needs");
+		goto err;
+	}
+	if (lzc.init() != 0) {
+		WARN("failed to initialize libzfs_core");
+		goto err;
+	}
+	return true;
+
+err:
+	memset(&lzc, 0, sizeof(lzc));
+	dlclose(nvh);
+	dlclose(h);
+	return false;
+}
+
+/* an nvlist of one entry, a string or (if value is NULL) a boolean */
+static void *lzc_nvlist(const char *key, const char *value)
+{
+	void *nvl;
+	int ret;
+
+	if (lzc.nvlist_alloc(&nvl, NV_UNIQUE_NAME, 0) != 0)
+		return NULL;
+	if (value)
+		ret = lzc.nvlist_add_string(nvl, key, value);
+	else
+		ret = lzc.nvlist_add_boolean(nvl, key);
+	if (ret != 0) {
+		lzc.nvlist_free(nvl);
+		return NULL;
+	}
+	return nvl;
+}
+
+static int lzc_mount(const char *dataset, const char *mountpoint)
+{
+	if (mkdir_p(mountpoint, 0755) < 0) {
+		SYSERROR("failed to create %s", mountpoint);
+		return -1;
+	}
+	/* zfsutil: mounted by the zfs tools, not through fstab */
+	if (mount(dataset, mountpoint, "zfs", 0, "zfsutil") < 0) {
+		SYSERROR("failed to mount %s on %s", dataset, mountpoint);
+		return -1;
+	}
+	return 0;
+}
+
+static int lzc_create_op(const char *dataset, const char *mountpoint)
+{
+	void *props;
+	int ret;
+
+	props = lzc_nvlist("mountpoint", mountpoint);
+	if (!props)
+		return -1;
+	ret = lzc.create(dataset, LZC_DATSET_TYPE_ZFS, props, NULL, 0);
+	lzc.nvlist_free(props);
+	if (ret != 0) {
+		ERROR("failed to create %s: %s", dataset, strerror(ret));
+		return -1;
+	}
+	return lzc_mount(dataset, mountpoint);
+}
+
+static int lzc_destroy_snap(const char *name)
+{
+	void *snaps;
+	int ret;
+
+	snaps = lzc_nvlist(name, NULL);
+	if (!snaps)
+		return -1;
+	ret = lzc.destroy_snaps(snaps, 0, NULL);
+	lzc.nvlist_free(snaps);
+	if (ret != 0) {
+		ERROR("failed to destroy %s: %s", name, strerror(ret));
+		return -1;
+	}
+	return 0;
+}
+
+static int lzc_snapshot_op(const char *dataset, const char *snap)
+{
+	char name[MAXPATHLEN];
+	void *snaps;
+	int ret;
+
+	ret = snprintf(name, MAXPATHLEN, "%s@%s", dataset, snap);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -1;
+	if (lzc.exists(name) && lzc_destroy_snap(name) < 0)
+		return -1;
+
+	snaps = lzc_nvlist(name, NULL);
+	if (!snaps)
+		return -1;
+	ret = lzc.snapshot(snaps, NULL, NULL);
+	lzc.nvlist_free(snaps);
+	if (ret != 0) {
+		ERROR("failed to snapshot %s: %s", name, strerror(ret));
+		return -1;
+	}
+	return 0;
+}
+
+static int lzc_clone_op(const char *origin, const char *dataset,
+			const char *mountpoint)
+{
+	void *props;
+	int ret;
+
+	props = lzc_nvlist("mountpoint", mountpoint);
+	if (!props)
+		return -1;
+	ret = lzc.clone(dataset, origin, props);
+	lzc.nvlist_free(props);
+	if (ret != 0) {
+		ERROR("failed to clone %s as %s: %s", origin, dataset,
+		      strerror(ret));
+		return -1;
+	}
+	return lzc_mount(dataset, mountpoint);
+}
+
+static int lzc_destroy_op(const char *dataset, const char *mountpoint)
+{
+	int ret;
+
+	if (strchr(dataset, '@'))
+		return lzc_destroy_snap(dataset);
+	if (!lzc.destroy)
+		return cli_destroy(dataset, mountpoint);
+
+	if (mountpoint && umount2(mountpoint, 0) < 0 && errno != EINVAL) {
+		SYSERROR("failed to unmount %s", mountpoint);
+		return -1;
+	}
+	ret = lzc.destroy(dataset);
+	if (ret != 0) {
+		ERROR("failed to destroy %s: %s", dataset, strerror(ret));
+		return -1;
+	}
+	return 0;
+}
+
+static bool lzc_exists_op(const char *dataset)
+{
+	return lzc.exists(dataset) != 0;
+}
+
+static const struct lxc_zfs_ops zfs_lzc_ops = {
+	.name = "libzfs_core",
+	.create = lzc_create_op,
+	.snapshot = lzc_snapshot_op,
+	.clone = lzc_clone_op,
+	.destroy = lzc_destroy_op,
+	.exists = lzc_exists_op,
+	.dataset_of = zfs_dataset_of,
+};
+
+static const struct lxc_zfs_ops *zfs_ops;
+static pthread_once_t zfs_ops_once = PTHREAD_ONCE_INIT;
+
+static void zfs_ops_init(void)
+{
+	if (zfs_ops)
+		return;
+	zfs_ops = lzc_load() ? &zfs_lzc_ops : &zfs_cli_ops;
+	INFO("using %s for zfs", zfs_ops->name);
+}
+
+const struct lxc_zfs_ops *lxc_zfs_get_ops(void)
+{
+	pthread_once(&zfs_ops_once, zfs_ops_init);
+	return zfs_ops;
+}
+
+void lxc_zfs_set_ops(const struct lxc_zfs_ops *ops)
+{
+	pthread_once(&zfs_ops_once, zfs_ops_init);
+	zfs_ops = ops;
+}
+
+/* undo the octal escapes of mountinfo fields, in place */
+static void mountinfo_unescape(char *s)
+{
+	char *d = s;
+
+	while (*s) {
+		if (s[0] == '\\' && s[1] >= '0' && s[1] <= '3' &&
+		    s[2] >= '0' && s[2] <= '7' && s[3] >= '0' && s[3] <= '7') {
+			*d++ = (s[1] - '0') << 6 | (s[2] - '0') << 3 | (s[3] - '0');
+			s += 4;
+		} else {
+			*d++ = *s++;
+		}
+	}
+	*d = '\0';
+}
+
+static char *dataset_from_mountinfo(const char *path)
+{
+	char *line = NULL, *dataset = NULL, *saveptr, *tok, *mnt, *fstype, *src;
+	size_t sz = 0;
+	FILE *f;
+	int i;
+
+	f = fopen("/proc/self/mountinfo", "r");
+	if (!f)
+		return NULL;
+	while (getline(&line, &sz, f) != -1) {
+		mnt = fstype = src = NULL;
+		tok = strtok_r(line, " \n", &saveptr);
+		for (i = 0; tok; i++) {
+			if (i == 4)
+				mnt = tok;
+			else if (i > 5 && strcmp(tok, "-") == 0)
+				break;
+			tok = strtok_r(NULL, " \n", &saveptr);
+		}
+		if (!tok || !mnt)
+			continue;
+		fstype = strtok_r(NULL, " \n", &saveptr);
+		src = strtok_r(NULL, " \n", &saveptr);
+		if (!fstype || !src || strcmp(fstype, "zfs") != 0)
+			continue;
+		mountinfo_unescape(mnt);
+		if (strcmp(mnt, path) != 0)
+			continue;
+		/* the last mount on path is the visible one */
+		mountinfo_unescape(src);
+		free(dataset);
+		dataset = strdup(src);
+	}
+	free(line);
+	fclose(f);
+	return dataset;
+}
+
+static char *dataset_from_list(const char *path)
+{
+	struct lxc_popen_FILE *f;
+	char line[MAXPATHLEN * 2], *tab, *dataset = NULL;
+
+	f = lxc_popen("zfs list -H -t filesystem -o name,mountpoint 2> /dev/null");
+	if (!f) {
+		SYSERROR("popen failed");
+		return NULL;
+	}
+	while (!dataset && fgets(line, sizeof(line), f->f)) {
+		line[strcspn(line, "\n")] = '\0';
+		tab = strchr(line, '\t');
+		if (!tab)
+			continue;
+		*tab = '\0';
+		if (strcmp(tab + 1, path) == 0)
+			dataset = strdup(line);
+	}
+	(void) lxc_pclose(f);
+	return dataset;
+}
+
+static char *zfs_dataset_of(const char *path, bool scan)
+{
+	char *dataset;
+
+	dataset = dataset_from_mountinfo(path);
+	if (!dataset && scan)
+		dataset = dataset_from_list(path);
+	return dataset;
+}
+
+char *lxc_zfs_dataset_of(const char *path, bool scan)
+{
+	return lxc_zfs_get_ops()->dataset_of(path, scan);
+}
@@ -0,0 +1,56 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef __LXC_ZFS_H
+#define __LXC_ZFS_H
+
+#include <stdbool.h>
+
+/*
+ * The zfs operations of the zfs backing store.  They go through
+ * libzfs_core when it can be loaded, and through the zfs command
+ * otherwise.  All return 0 on success.
+ */
+struct lxc_zfs_ops {
+	const char *name;
+	/* create filesystem dataset, mounted on mountpoint */
+	int (*create)(const char *dataset, const char *mountpoint);
+	/* take snapshot dataset@snap, replacing an older one of that name */
+	int (*snapshot)(const char *dataset, const char *snap);
+	/* clone snapshot origin as dataset, mounted on mountpoint */
+	int (*clone)(const char *origin, const char *dataset,
+		     const char *mountpoint);
+	/* destroy dataset, unmounting it from mountpoint if not NULL */
+	int (*destroy)(const char *dataset, const char *mountpoint);
+	bool (*exists)(const char *dataset);
+	/* see lxc_zfs_dataset_of() */
+	char *(*dataset_of)(const char *path, bool scan);
+};
+
+extern const struct lxc_zfs_ops *lxc_zfs_get_ops(void);
+
+/* Use ops rather than the detected ones, i.e. a mock for testing */
+extern void lxc_zfs_set_ops(const struct lxc_zfs_ops *ops);
+
+/*
+ * The dataset whose mountpoint is path, looked up in mountinfo, or else
+ * with 'zfs list' if scan is true, by the dataset_of op.  Returns an
+ * allocated string or NULL.
+ */
+extern char *lxc_zfs_dataset_of(const char *path, bool scan);
+
+#endif
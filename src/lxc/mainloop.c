@@ -25,6 +25,8 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/epoll.h>
 
@@ -34,50 +36,384 @@ struct mainloop_handler {
 	lxc_mainloop_callback_t callback;
 	int fd;
 	void *data;
+	struct lxc_list node;
 };
 
-#define MAX_EVENTS 10
+/*
+ * Timers live in a hierarchical timing wheel: TW_LEVELS wheels of TW_SIZE
+ * slots, level n covering TW_SIZE^(n+1) ticks. Adding and removing a timer
+ * is O(1); timers of the upper levels are cascaded down as the clock
+ * reaches them. With 10ms ticks the wheel spans about 124 days, longer
+ * timeouts are parked in the last level until they come in range.
+ */
+#define TW_BITS 6
+#define TW_SIZE (1 << TW_BITS)
+#define TW_MASK (TW_SIZE - 1)
+#define TW_LEVELS 5
+#define TW_RANGE ((uint64_t)1 << (TW_BITS * TW_LEVELS))
 
-int lxc_mainloop(struct lxc_epoll_descr *descr, int timeout_ms)
+struct lxc_mainloop_timer {
+	lxc_mainloop_timer_cb_t callback;
+	void *data;
+	uint64_t expires;
+	uint64_t interval;
+	int level;
+	int pending;
+	int deleted;
+	struct lxc_list node;
+	struct lxc_list link; /* in the list of all the timers */
+};
+
+struct lxc_timer_wheel {
+	uint64_t clk; /* next tick to process */
+	int pending;
+	int count[TW_LEVELS];
+	struct lxc_mainloop_timer *running;
+	struct lxc_list timers; /* armed or not, for lxc_mainloop_close() */
+	struct lxc_list slots[TW_LEVELS][TW_SIZE];
+};
+
+static uint64_t mainloop_now_ms(void)
 {
-	int i, nfds;
-	struct mainloop_handler *handler;
-	struct epoll_event events[MAX_EVENTS];
+	struct timespec ts;
 
-	for (;;) {
+	if (clock_gettime(CLOCK_MONOTONIC, &ts))
+		return 0;
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void mainloop_list_splice(struct lxc_list *from, struct lxc_list *to)
+{
+	if (lxc_list_empty(from)) {
+		lxc_list_init(to);
+		return;
+	}
+
+	to->next = from->next;
+	to->prev = from->prev;
+	to->next->prev = to;
+	to->prev->next = to;
+	lxc_list_init(from);
+}
+
+static void timer_wheel_insert(struct lxc_timer_wheel *wheel,
+			       struct lxc_mainloop_timer *timer)
+{
+	uint64_t expires, delta;
+	int level;
+
+	if (timer->expires < wheel->clk)
+		timer->expires = wheel->clk;
 
-		nfds = epoll_wait(descr->epfd, events, MAX_EVENTS, timeout_ms);
-		if (nfds < 0) {
-			if (errno == EINTR)
+	expires = timer->expires;
+	delta = expires - wheel->clk;
+	if (delta >= TW_RANGE) {
+		expires = wheel->clk + TW_RANGE - 1;
+		delta = TW_RANGE - 1;
+	}
+
+	for (level = 0; level < TW_LEVELS - 1; level++)
+		if (delta < (uint64_t)1 << ((level + 1) * TW_BITS))
+			break;
+
+	timer->level = level;
+	timer->pending = 1;
+	lxc_list_add_tail(&wheel->slots[level][(expires >> (level * TW_BITS)) & TW_MASK],
+			  &timer->node);
+	wheel->count[level]++;
+	wheel->pending++;
+}
+
+static void timer_wheel_remove(struct lxc_timer_wheel *wheel,
+			       struct lxc_mainloop_timer *timer)
+{
+	if (!timer->pending)
+		return;
+
+	lxc_list_del(&timer->node);
+	timer->pending = 0;
+	wheel->count[timer->level]--;
+	wheel->pending--;
+}
+
+static void timer_wheel_cascade(struct lxc_timer_wheel *wheel, int level,
+				int index)
+{
+	struct lxc_list list, *iterator, *next;
+	struct lxc_mainloop_timer *timer;
+
+	mainloop_list_splice(&wheel->slots[level][index], &list);
+	lxc_list_for_each_safe(iterator, &list, next) {
+		timer = iterator->elem;
+		timer->pending = 0;
+		wheel->count[level]--;
+		wheel->pending--;
+		timer_wheel_insert(wheel, timer);
+	}
+}
+
+/* Return the tick the wheel needs to be looked at again, the earliest of
+ * the next level 0 expiry and the next cascade of a non empty slot. */
+static uint64_t timer_wheel_next(struct lxc_timer_wheel *wheel)
+{
+	uint64_t next = UINT64_MAX, base, tick;
+	int level, i, shift;
+
+	if (wheel->count[0]) {
+		for (i = 0; i < TW_SIZE; i++) {
+			if (!lxc_list_empty(&wheel->slots[0][(wheel->clk + i) & TW_MASK])) {
+				next = wheel->clk + i;
+				break;
+			}
+		}
+	}
+
+	for (level = 1; level < TW_LEVELS; level++) {
+		if (!wheel->count[level])
+			continue;
+
+		shift = level * TW_BITS;
+		base = (wheel->clk + ((uint64_t)1 << shift) - 1) >> shift;
+		for (i = 0; i < TW_SIZE; i++) {
+			if (lxc_list_empty(&wheel->slots[level][(base + i) & TW_MASK]))
 				continue;
-			return -1;
+
+			tick = (base + i) << shift;
+			if (tick < next)
+				next = tick;
+			break;
 		}
+	}
+
+	return next;
+}
 
-		for (i = 0; i < nfds; i++) {
-			handler =
-				(struct mainloop_handler *) events[i].data.ptr;
+static int timer_wheel_wait(struct lxc_epoll_descr *descr, int timeout_ms)
+{
+	struct lxc_timer_wheel *wheel = descr->timers;
+	uint64_t next, now;
+
+	if (!wheel || !wheel->pending)
+		return timeout_ms;
+
+	next = timer_wheel_next(wheel) * LXC_MAINLOOP_TICK_MS;
+	now = mainloop_now_ms();
+	if (next <= now)
+		return 0;
 
-			/* If the handler returns a positive value, exit
-			   the mainloop */
-			if (handler->callback(handler->fd, events[i].events,
-					      handler->data, descr) > 0)
-				return 0;
+	if (next - now > INT_MAX)
+		return timeout_ms;
+
+	if (timeout_ms < 0 || next - now < timeout_ms)
+		return next - now;
+
+	return timeout_ms;
+}
+
+/* Expire the timers due up to now, returns 1 if a callback asked the
+ * mainloop to stop. */
+static int timer_wheel_run(struct lxc_epoll_descr *descr)
+{
+	struct lxc_timer_wheel *wheel = descr->timers;
+	struct lxc_list work, *iterator, *next;
+	struct lxc_mainloop_timer *timer;
+	uint64_t target, tick;
+	int level, index, ret;
+
+	if (!wheel)
+		return 0;
+
+	target = mainloop_now_ms() / LXC_MAINLOOP_TICK_MS;
+	while (wheel->clk <= target) {
+		if (!wheel->pending) {
+			wheel->clk = target + 1;
+			break;
 		}
 
-		if (nfds == 0 && timeout_ms != 0)
+		if (!(wheel->clk & TW_MASK)) {
+			for (level = 1; level < TW_LEVELS; level++) {
+				index = (wheel->clk >> (level * TW_BITS)) & TW_MASK;
+				timer_wheel_cascade(wheel, level, index);
+				if (index)
+					break;
+			}
+		}
+
+		/* nothing can expire before the next cascade, skip ahead */
+		if (!wheel->count[0]) {
+			for (level = 1; level < TW_LEVELS - 1; level++)
+				if (wheel->count[level])
+					break;
+
+			tick = ((wheel->clk >> (level * TW_BITS)) + 1) << (level * TW_BITS);
+			wheel->clk = tick < target + 1 ? tick : target + 1;
+			continue;
+		}
+
+		mainloop_list_splice(&wheel->slots[0][wheel->clk & TW_MASK], &work);
+		tick = wheel->clk++;
+
+		while (!lxc_list_empty(&work)) {
+			timer = work.next->elem;
+			timer_wheel_remove(wheel, timer);
+
+			wheel->running = timer;
+			ret = timer->callback(timer->data, descr);
+			wheel->running = NULL;
+
+			if (timer->deleted) {
+				lxc_list_del(&timer->link);
+				free(timer);
+			} else if (timer->interval && !timer->pending) {
+				timer->expires = tick + timer->interval;
+				timer_wheel_insert(wheel, timer);
+			}
+
+			if (ret > 0) {
+				/* put back what did not run, it is due at the
+				 * next tick */
+				lxc_list_for_each_safe(iterator, &work, next) {
+					timer = iterator->elem;
+					timer_wheel_remove(wheel, timer);
+					timer_wheel_insert(wheel, timer);
+				}
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static void mainloop_reap(struct lxc_epoll_descr *descr)
+{
+	struct lxc_list *iterator, *next;
+
+	lxc_list_for_each_safe(iterator, &descr->zombies, next) {
+		lxc_list_del(iterator);
+		free(iterator->elem);
+	}
+}
+
+/* Wait up to wait_ms for events and dispatch them along with the due timers.
+ * Returns 1 if a callback asked the mainloop to stop, -1 on error. */
+static int mainloop_dispatch(struct lxc_epoll_descr *descr, int wait_ms,
+			     int *nfds_ret)
+{
+	int i, nfds, ret = 0;
+	struct mainloop_handler *handler;
+
+	*nfds_ret = 0;
+
+	nfds = epoll_wait(descr->epfd, descr->events, descr->max_events,
+			  wait_ms);
+	if (nfds < 0) {
+		if (errno == EINTR)
 			return 0;
+		return -1;
+	}
+
+	descr->dispatching = 1;
+	for (i = 0; i < nfds; i++) {
+		handler = (struct mainloop_handler *) descr->events[i].data.ptr;
+
+		/* removed by a callback earlier in this batch */
+		if (handler->fd < 0)
+			continue;
+
+		/* If the handler returns a positive value, exit
+		   the mainloop */
+		if (handler->callback(handler->fd, descr->events[i].events,
+				      handler->data, descr) > 0) {
+			ret = 1;
+			break;
+		}
+	}
+	descr->dispatching = 0;
+	mainloop_reap(descr);
 
-		if (lxc_list_empty(&descr->handlers))
+	*nfds_ret = nfds;
+	if (ret)
+		return 1;
+
+	return timer_wheel_run(descr);
+}
+
+int lxc_mainloop(struct lxc_epoll_descr *descr, int timeout_ms)
+{
+	int nfds, ret, wait_ms;
+	uint64_t now, deadline = 0;
+
+	if (timeout_ms > 0)
+		deadline = mainloop_now_ms() + timeout_ms;
+
+	for (;;) {
+
+		wait_ms = timeout_ms;
+		if (timeout_ms > 0) {
+			now = mainloop_now_ms();
+			wait_ms = now < deadline ? deadline - now : 0;
+		}
+
+		ret = mainloop_dispatch(descr, timer_wheel_wait(descr, wait_ms),
+					&nfds);
+		if (ret < 0)
+			return -1;
+		if (ret > 0)
+			return 0;
+
+		/* the timeout is an inactivity timeout */
+		if (nfds > 0 && timeout_ms > 0)
+			deadline = mainloop_now_ms() + timeout_ms;
+		else if (nfds == 0 && timeout_ms > 0 &&
+			 mainloop_now_ms() >= deadline)
+			return 0;
+
+		if (lxc_list_empty(&descr->handlers) &&
+		    (!descr->timers || !descr->timers->pending))
 			return 0;
 	}
 }
 
+int lxc_mainloop_once(struct lxc_epoll_descr *descr)
+{
+	int nfds;
+
+	return mainloop_dispatch(descr, 0, &nfds);
+}
+
+int lxc_mainloop_next_timeout(struct lxc_epoll_descr *descr)
+{
+	return timer_wheel_wait(descr, -1);
+}
+
 int lxc_mainloop_add_handler(struct lxc_epoll_descr *descr, int fd,
 			     lxc_mainloop_callback_t callback, void *data)
 {
 	struct epoll_event ev;
-	struct mainloop_handler *handler;
-	struct lxc_list *item;
+	struct mainloop_handler *handler, **fdtable;
+	int size;
+
+	if (fd < 0) {
+		errno = EBADF;
+		return -1;
+	}
+
+	if (fd >= descr->fdtable_size) {
+		size = descr->fdtable_size ? descr->fdtable_size : 64;
+		while (size <= fd)
+			size *= 2;
+
+		fdtable = realloc(descr->fdtable, size * sizeof(*fdtable));
+		if (!fdtable)
+			return -1;
+
+		memset(fdtable + descr->fdtable_size, 0,
+		       (size - descr->fdtable_size) * sizeof(*fdtable));
+		descr->fdtable = fdtable;
+		descr->fdtable_size = size;
+	}
 
 	handler = malloc(sizeof(*handler));
 	if (!handler)
@@ -86,6 +422,7 @@ int lxc_mainloop_add_handler(struct lxc_epoll_descr *descr, int fd,
 	handler->callback = callback;
 	handler->fd = fd;
 	handler->data = data;
+	handler->node.elem = handler;
 
 	ev.events = EPOLLIN;
 	ev.data.ptr = handler;
@@ -93,12 +430,8 @@ int lxc_mainloop_add_handler(struct lxc_epoll_descr *descr, int fd,
 	if (epoll_ctl(descr->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
 		goto out_free_handler;
 
-	item = malloc(sizeof(*item));
-	if (!item)
-		goto out_free_handler;
-
-	item->elem = handler;
-	lxc_list_add(&descr->handlers, item);
+	descr->fdtable[fd] = handler;
+	lxc_list_add(&descr->handlers, &handler->node);
 	return 0;
 
 out_free_handler:
@@ -106,59 +439,213 @@ out_free_handler:
 	return -1;
 }
 
+static struct mainloop_handler *mainloop_handler_get(struct lxc_epoll_descr *descr,
+						     int fd)
+{
+	if (fd < 0 || fd >= descr->fdtable_size)
+		return NULL;
+
+	return descr->fdtable[fd];
+}
+
+int lxc_mainloop_mod_handler(struct lxc_epoll_descr *descr, int fd,
+			     uint32_t events)
+{
+	struct epoll_event ev;
+	struct mainloop_handler *handler;
+
+	handler = mainloop_handler_get(descr, fd);
+	if (!handler) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	ev.events = events;
+	ev.data.ptr = handler;
+	return epoll_ctl(descr->epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
 int lxc_mainloop_del_handler(struct lxc_epoll_descr *descr, int fd)
 {
 	struct mainloop_handler *handler;
-	struct lxc_list *iterator;
 
-	lxc_list_for_each(iterator, &descr->handlers) {
+	handler = mainloop_handler_get(descr, fd);
+	if (!handler)
+		return -1;
+
+	if (epoll_ctl(descr->epfd, EPOLL_CTL_DEL, fd, NULL))
+		return -1;
+
+	descr->fdtable[fd] = NULL;
+	lxc_list_del(&handler->node);
+
+	/* the current batch may still reference it, free it once the
+	 * batch is dispatched */
+	if (descr->dispatching) {
+		handler->fd = -1;
+		lxc_list_add_tail(&descr->zombies, &handler->node);
+		return 0;
+	}
+
+	free(handler);
+	return 0;
+}
+
+void lxc_mainloop_for_each(struct lxc_epoll_descr *descr,
+			   lxc_mainloop_callback_t callback,
+			   void (*fn)(int fd, void *data,
+				      struct lxc_epoll_descr *descr))
+{
+	struct mainloop_handler *handler;
+	struct lxc_list *iterator, *next;
+
+	lxc_list_for_each_safe(iterator, &descr->handlers, next) {
 		handler = iterator->elem;
+		if (handler->callback == callback)
+			fn(handler->fd, handler->data, descr);
+	}
+}
 
-		if (handler->fd == fd) {
-			/* found */
-			if (epoll_ctl(descr->epfd, EPOLL_CTL_DEL, fd, NULL))
-				return -1;
+struct lxc_mainloop_timer *lxc_mainloop_add_timer(struct lxc_epoll_descr *descr,
+						  unsigned int timeout_ms,
+						  unsigned int interval_ms,
+						  lxc_mainloop_timer_cb_t callback,
+						  void *data)
+{
+	struct lxc_mainloop_timer *timer;
+	int i, j;
 
-			lxc_list_del(iterator);
-			free(iterator->elem);
-			free(iterator);
-			return 0;
-		}
+	if (!descr->timers) {
+		descr->timers = malloc(sizeof(*descr->timers));
+		if (!descr->timers)
+			return NULL;
+
+		memset(descr->timers, 0, sizeof(*descr->timers));
+		lxc_list_init(&descr->timers->timers);
+		for (i = 0; i < TW_LEVELS; i++)
+			for (j = 0; j < TW_SIZE; j++)
+				lxc_list_init(&descr->timers->slots[i][j]);
+		descr->timers->clk = mainloop_now_ms() / LXC_MAINLOOP_TICK_MS;
 	}
 
-	return -1;
+	timer = malloc(sizeof(*timer));
+	if (!timer)
+		return NULL;
+
+	memset(timer, 0, sizeof(*timer));
+	timer->callback = callback;
+	timer->data = data;
+	timer->node.elem = timer;
+	timer->link.elem = timer;
+	lxc_list_add_tail(&descr->timers->timers, &timer->link);
+	if (interval_ms)
+		timer->interval = (interval_ms + LXC_MAINLOOP_TICK_MS - 1) /
+				  LXC_MAINLOOP_TICK_MS;
+
+	lxc_mainloop_mod_timer(descr, timer, timeout_ms);
+	return timer;
 }
 
-int lxc_mainloop_open(struct lxc_epoll_descr *descr)
+int lxc_mainloop_mod_timer(struct lxc_epoll_descr *descr,
+			   struct lxc_mainloop_timer *timer,
+			   unsigned int timeout_ms)
+{
+	struct lxc_timer_wheel *wheel = descr->timers;
+
+	if (!wheel || timer->deleted) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	timer_wheel_remove(wheel, timer);
+	timer->expires = (mainloop_now_ms() + timeout_ms +
+			  LXC_MAINLOOP_TICK_MS - 1) / LXC_MAINLOOP_TICK_MS;
+	timer_wheel_insert(wheel, timer);
+	return 0;
+}
+
+void lxc_mainloop_del_timer(struct lxc_epoll_descr *descr,
+			    struct lxc_mainloop_timer *timer)
+{
+	struct lxc_timer_wheel *wheel = descr->timers;
+
+	if (!timer || !wheel)
+		return;
+
+	timer_wheel_remove(wheel, timer);
+
+	/* deleted from its own callback */
+	if (wheel->running == timer) {
+		timer->deleted = 1;
+		return;
+	}
+
+	lxc_list_del(&timer->link);
+	free(timer);
+}
+
+int lxc_mainloop_open_size(struct lxc_epoll_descr *descr, int max_events)
 {
+	if (max_events <= 0)
+		max_events = LXC_MAINLOOP_MAX_EVENTS;
+
+	memset(descr, 0, sizeof(*descr));
+
+	descr->events = malloc(max_events * sizeof(*descr->events));
+	if (!descr->events)
+		return -1;
+	descr->max_events = max_events;
+
 	/* hint value passed to epoll create */
 	descr->epfd = epoll_create(2);
 	if (descr->epfd < 0)
-		return -1;
+		goto out_free;
 
 	if (fcntl(descr->epfd, F_SETFD, FD_CLOEXEC)) {
 		close(descr->epfd);
-		return -1;
+		goto out_free;
 	}
 
 	lxc_list_init(&descr->handlers);
+	lxc_list_init(&descr->zombies);
 	return 0;
+
+out_free:
+	free(descr->events);
+	descr->events = NULL;
+	return -1;
+}
+
+int lxc_mainloop_open(struct lxc_epoll_descr *descr)
+{
+	return lxc_mainloop_open_size(descr, LXC_MAINLOOP_MAX_EVENTS);
 }
 
 int lxc_mainloop_close(struct lxc_epoll_descr *descr)
 {
 	struct lxc_list *iterator, *next;
 
-	iterator = descr->handlers.next;
-	while (iterator != &descr->handlers) {
-		next = iterator->next;
-
+	lxc_list_for_each_safe(iterator, &descr->handlers, next) {
 		lxc_list_del(iterator);
 		free(iterator->elem);
-		free(iterator);
-		iterator = next;
 	}
+	mainloop_reap(descr);
+
+	if (descr->timers) {
+		/* the one-shot timers which fired are in no slot */
+		lxc_list_for_each_safe(iterator, &descr->timers->timers, next) {
+			lxc_list_del(iterator);
+			free(iterator->elem);
+		}
+		free(descr->timers);
+		descr->timers = NULL;
+	}
+
+	free(descr->fdtable);
+	descr->fdtable = NULL;
+	descr->fdtable_size = 0;
+	free(descr->events);
+	descr->events = NULL;
 
 	return close(descr->epfd);
 }
-
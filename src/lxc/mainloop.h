@@ -25,26 +25,103 @@
 #define _mainloop_h
 
 #include <stdint.h>
+#include <sys/epoll.h>
 #include "list.h"
 
+struct mainloop_handler;
+struct lxc_timer_wheel;
+
+/*
+ * Default number of events fetched by one epoll_wait() call. Loops serving
+ * many file descriptors (lxc-monitord, consoles with several peers) can ask
+ * for larger batches through lxc_mainloop_open_size().
+ */
+#define LXC_MAINLOOP_MAX_EVENTS 32
+
 struct lxc_epoll_descr {
 	int epfd;
 	struct lxc_list handlers;
+	struct mainloop_handler **fdtable;
+	int fdtable_size;
+	struct epoll_event *events;
+	int max_events;
+	struct lxc_list zombies;
+	int dispatching;
+	struct lxc_timer_wheel *timers;
 };
 
 typedef int (*lxc_mainloop_callback_t)(int fd, uint32_t event, void *data,
 				       struct lxc_epoll_descr *descr);
 
+/*
+ * Timer callbacks follow the same convention as fd handlers: a positive
+ * return value makes lxc_mainloop() return.
+ */
+typedef int (*lxc_mainloop_timer_cb_t)(void *data,
+				       struct lxc_epoll_descr *descr);
+
+struct lxc_mainloop_timer;
+
 extern int lxc_mainloop(struct lxc_epoll_descr *descr, int timeout_ms);
 
+/*
+ * Dispatch the pending events and the due timers without blocking, for
+ * loops nested into another one. Returns 1 if a callback asked to stop,
+ * -1 on error. lxc_mainloop_next_timeout() tells, in milliseconds, when the
+ * next timer of the loop is due (-1 if none).
+ */
+extern int lxc_mainloop_once(struct lxc_epoll_descr *descr);
+
+extern int lxc_mainloop_next_timeout(struct lxc_epoll_descr *descr);
+
 extern int lxc_mainloop_add_handler(struct lxc_epoll_descr *descr, int fd,
 				    lxc_mainloop_callback_t callback,
 				    void *data);
 
+/*
+ * Change the epoll events (EPOLLIN, EPOLLOUT, ...) a handler is woken up
+ * for. Handlers are registered for EPOLLIN only by default.
+ */
+extern int lxc_mainloop_mod_handler(struct lxc_epoll_descr *descr, int fd,
+				    uint32_t events);
+
 extern int lxc_mainloop_del_handler(struct lxc_epoll_descr *descr, int fd);
 
+/*
+ * Call fn on every handler registered with callback. fn may delete the
+ * handler it is called on, but no other one.
+ */
+extern void lxc_mainloop_for_each(struct lxc_epoll_descr *descr,
+				  lxc_mainloop_callback_t callback,
+				  void (*fn)(int fd, void *data,
+					     struct lxc_epoll_descr *descr));
+
+/*
+ * Arm a timer firing after timeout_ms, then every interval_ms if interval_ms
+ * is not 0. Timers have a resolution of LXC_MAINLOOP_TICK_MS and stay owned
+ * by the caller: a one-shot timer which fired can be re-armed with
+ * lxc_mainloop_mod_timer() and must be released with lxc_mainloop_del_timer()
+ * (or lxc_mainloop_close()).
+ */
+#define LXC_MAINLOOP_TICK_MS 10
+
+extern struct lxc_mainloop_timer *lxc_mainloop_add_timer(
+	struct lxc_epoll_descr *descr, unsigned int timeout_ms,
+	unsigned int interval_ms, lxc_mainloop_timer_cb_t callback,
+	void *data);
+
+extern int lxc_mainloop_mod_timer(struct lxc_epoll_descr *descr,
+				  struct lxc_mainloop_timer *timer,
+				  unsigned int timeout_ms);
+
+extern void lxc_mainloop_del_timer(struct lxc_epoll_descr *descr,
+				   struct lxc_mainloop_timer *timer);
+
 extern int lxc_mainloop_open(struct lxc_epoll_descr *descr);
 
+extern int lxc_mainloop_open_size(struct lxc_epoll_descr *descr,
+				  int max_events);
+
 extern int lxc_mainloop_close(struct lxc_epoll_descr *descr);
 
 #endif
@@ -31,6 +31,7 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <time.h>
+#include <sched.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
@@ -48,6 +49,7 @@
 #include "nl.h"
 #include "network.h"
 #include "conf.h"
+#include "utils.h"
 
 #if HAVE_IFADDRS_H
 #include <ifaddrs.h>
@@ -1305,3 +1307,197 @@ int setup_private_host_hw_addr(char *veth1)
 
 	return 0;
 }
+
+int lxc_netns_netlink_open(struct nl_handler *nlh, int netns_fd)
+{
+	char path[MAXPATHLEN];
+	int ret, self;
+
+	/* a namespace switch only affects the calling thread, make sure
+	 * we come back to the namespace of that thread */
+	ret = snprintf(path, MAXPATHLEN, "/proc/self/task/%ld/ns/net",
+		       (long)syscall(SYS_gettid));
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -ENAMETOOLONG;
+
+	self = open(path, O_RDONLY | O_CLOEXEC);
+	if (self < 0)
+		return -errno;
+
+	if (setns(netns_fd, CLONE_NEWNET)) {
+		ret = -errno;
+		close(self);
+		return ret;
+	}
+
+	/* the socket stays bound to the namespace it was created in */
+	ret = netlink_open(nlh, NETLINK_ROUTE);
+
+	if (setns(self, CLONE_NEWNET)) {
+		if (!ret)
+			netlink_close(nlh);
+		ret = -errno;
+	}
+
+	close(self);
+	return ret;
+}
+
+static int netlink_dump(struct nl_handler *nlh, int type,
+			int (*cb)(struct nlmsghdr *msg, void *data),
+			void *data)
+{
+	struct nlmsg *nlmsg = NULL, *answer = NULL;
+	struct link_req *link_req;
+	struct nlmsghdr *msg;
+	int err;
+	int recv_len = 0, answer_len;
+	int readmore = 0;
+	int reply = type == RTM_GETLINK ? RTM_NEWLINK : RTM_NEWADDR;
+
+	err = -ENOMEM;
+	nlmsg = nlmsg_alloc(NLMSG_GOOD_SIZE);
+	if (!nlmsg)
+		goto out;
+
+	answer = nlmsg_alloc(NLMSG_GOOD_SIZE);
+	if (!answer)
+		goto out;
+
+	answer_len = answer->nlmsghdr.nlmsg_len;
+
+	/* ifinfomsg is the larger of the two headers, an address dump
+	 * only looks at the family, which is AF_UNSPEC for both */
+	link_req = (struct link_req *)nlmsg;
+	link_req->nlmsg.nlmsghdr.nlmsg_len = type == RTM_GETLINK ?
+		NLMSG_LENGTH(sizeof(struct ifinfomsg)) :
+		NLMSG_LENGTH(sizeof(struct ifaddrmsg));
+	link_req->nlmsg.nlmsghdr.nlmsg_flags = NLM_F_REQUEST|NLM_F_DUMP;
+	link_req->nlmsg.nlmsghdr.nlmsg_type = type;
+	link_req->nlmsg.nlmsghdr.nlmsg_seq = ++nlh->seq;
+	link_req->ifinfomsg.ifi_family = AF_UNSPEC;
+
+	err = netlink_send(nlh, nlmsg);
+	if (err < 0)
+		goto out;
+	err = 0;
+
+	do {
+		answer->nlmsghdr.nlmsg_len = answer_len;
+
+		recv_len = netlink_rcv(nlh, answer);
+		if (recv_len < 0) {
+			err = recv_len;
+			goto out;
+		}
+
+		msg = &answer->nlmsghdr;
+
+		while (NLMSG_OK(msg, recv_len)) {
+			if (msg->nlmsg_type == NLMSG_DONE) {
+				/* a dump failing midway reports it here */
+				if (!err && msg->nlmsg_len >= NLMSG_LENGTH(sizeof(int)))
+					err = *(int *)NLMSG_DATA(msg);
+				readmore = 0;
+				break;
+			}
+
+			/* keep draining the dump on errors or when the
+			 * callback is not interested anymore, the socket
+			 * gets reused */
+			if (msg->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *errmsg = (struct nlmsgerr*)NLMSG_DATA(msg);
+				if (!err)
+					err = errmsg->error;
+			} else if (!err && msg->nlmsg_type == reply) {
+				err = cb(msg, data);
+			}
+
+			readmore = (msg->nlmsg_flags & NLM_F_MULTI);
+			msg = NLMSG_NEXT(msg, recv_len);
+		}
+	} while (readmore);
+
+out:
+	nlmsg_free(answer);
+	nlmsg_free(nlmsg);
+	return err;
+}
+
+struct netlink_list_links {
+	int (*cb)(int ifindex, const char *ifname, void *data);
+	void *data;
+};
+
+static int netlink_link_cb(struct nlmsghdr *msg, void *data)
+{
+	struct netlink_list_links *args = data;
+	struct ifinfomsg *ifi = NLMSG_DATA(msg);
+	struct rtattr *rta = IFLA_RTA(ifi);
+	int attr_len = msg->nlmsg_len - NLMSG_LENGTH(sizeof(*ifi));
+
+	while (RTA_OK(rta, attr_len)) {
+		if (rta->rta_type == IFLA_IFNAME)
+			return args->cb(ifi->ifi_index, RTA_DATA(rta),
+					args->data);
+		rta = RTA_NEXT(rta, attr_len);
+	}
+
+	return 0;
+}
+
+int lxc_netlink_list_links(struct nl_handler *nlh,
+			   int (*cb)(int ifindex, const char *ifname, void *data),
+			   void *data)
+{
+	struct netlink_list_links args = { cb, data };
+
+	return netlink_dump(nlh, RTM_GETLINK, netlink_link_cb, &args);
+}
+
+struct netlink_list_addrs {
+	int (*cb)(int ifindex, int family, const void *addr, void *data);
+	void *data;
+};
+
+static int netlink_addr_cb(struct nlmsghdr *msg, void *data)
+{
+	struct netlink_list_addrs *args = data;
+	struct ifaddrmsg *ifa = NLMSG_DATA(msg);
+	struct rtattr *rta = IFA_RTA(ifa);
+	int attr_len = IFA_PAYLOAD(msg);
+	void *addr = NULL;
+	int addrlen;
+
+	if (ifa->ifa_family != AF_INET && ifa->ifa_family != AF_INET6)
+		return 0;
+
+	addrlen = ifa->ifa_family == AF_INET ? sizeof(struct in_addr) :
+		sizeof(struct in6_addr);
+
+	/* like getifaddrs, prefer IFA_LOCAL over IFA_ADDRESS */
+	while (RTA_OK(rta, attr_len)) {
+		if ((rta->rta_type == IFA_LOCAL ||
+		     rta->rta_type == IFA_ADDRESS) &&
+		    RTA_PAYLOAD(rta) == addrlen) {
+			addr = RTA_DATA(rta);
+			if (rta->rta_type == IFA_LOCAL)
+				break;
+		}
+		rta = RTA_NEXT(rta, attr_len);
+	}
+
+	if (!addr)
+		return 0;
+
+	return args->cb(ifa->ifa_index, ifa->ifa_family, addr, args->data);
+}
+
+int lxc_netlink_list_addrs(struct nl_handler *nlh,
+			   int (*cb)(int ifindex, int family, const void *addr, void *data),
+			   void *data)
+{
+	struct netlink_list_addrs args = { cb, data };
+
+	return netlink_dump(nlh, RTM_GETADDR, netlink_addr_cb, &args);
+}
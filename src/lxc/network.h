@@ -139,4 +139,25 @@ extern char *lxc_mkifname(char *template);
 extern const char *lxc_net_type_to_str(int type);
 extern int setup_private_host_hw_addr(char *veth1);
 extern int netdev_get_mtu(int ifindex);
+
+struct nl_handler;
+
+/*
+ * Open a route netlink socket in the network namespace referred to by
+ * netns_fd. The calling thread joins that namespace for the duration
+ * of the call only.
+ */
+extern int lxc_netns_netlink_open(struct nl_handler *nlh, int netns_fd);
+
+/*
+ * Dump the links (resp. the IPv4 and IPv6 addresses) seen by a route
+ * netlink socket, calling cb for each of them. A non-zero return from
+ * cb is returned once the dump has been read to its end.
+ */
+extern int lxc_netlink_list_links(struct nl_handler *nlh,
+				  int (*cb)(int ifindex, const char *ifname, void *data),
+				  void *data);
+extern int lxc_netlink_list_addrs(struct nl_handler *nlh,
+				  int (*cb)(int ifindex, int family, const void *addr, void *data),
+				  void *data);
 #endif
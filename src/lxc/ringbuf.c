@@ -0,0 +1,169 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "ringbuf.h"
+
+int lxc_ringbuf_create(struct lxc_ringbuf *buf, size_t size)
+{
+	memset(buf, 0, sizeof(*buf));
+	if (!size)
+		return -EINVAL;
+
+	buf->addr = malloc(size);
+	if (!buf->addr)
+		return -ENOMEM;
+
+	buf->size = size;
+	return 0;
+}
+
+void lxc_ringbuf_release(struct lxc_ringbuf *buf)
+{
+	free(buf->addr);
+	memset(buf, 0, sizeof(*buf));
+}
+
+void lxc_ringbuf_clear(struct lxc_ringbuf *buf)
+{
+	buf->r_off = buf->w_off = 0;
+}
+
+size_t lxc_ringbuf_write(struct lxc_ringbuf *buf, const char *msg,
+			 size_t len, bool overwrite)
+{
+	size_t pos, chunk, stored;
+
+	if (!buf->size)
+		return 0;
+
+	if (overwrite) {
+		/* only the tail of a message larger than the buffer survives */
+		if (len > buf->size) {
+			msg += len - buf->size;
+			len = buf->size;
+		}
+		if (len > lxc_ringbuf_free(buf))
+			lxc_ringbuf_consume(buf, len - lxc_ringbuf_free(buf));
+	} else if (len > lxc_ringbuf_free(buf)) {
+		len = lxc_ringbuf_free(buf);
+	}
+
+	stored = len;
+	while (len) {
+		pos = buf->w_off % buf->size;
+		chunk = buf->size - pos;
+		if (chunk > len)
+			chunk = len;
+		memcpy(buf->addr + pos, msg, chunk);
+		buf->w_off += chunk;
+		msg += chunk;
+		len -= chunk;
+	}
+
+	return stored;
+}
+
+static void lxc_ringbuf_copy(struct lxc_ringbuf *buf, uint64_t off,
+			     char *out, size_t len)
+{
+	size_t pos, chunk;
+
+	while (len) {
+		pos = off % buf->size;
+		chunk = buf->size - pos;
+		if (chunk > len)
+			chunk = len;
+		memcpy(out, buf->addr + pos, chunk);
+		off += chunk;
+		out += chunk;
+		len -= chunk;
+	}
+}
+
+size_t lxc_ringbuf_peek(struct lxc_ringbuf *buf, char *out, size_t len)
+{
+	if (len > lxc_ringbuf_used(buf))
+		len = lxc_ringbuf_used(buf);
+
+	lxc_ringbuf_copy(buf, buf->r_off, out, len);
+	return len;
+}
+
+size_t lxc_ringbuf_tail(struct lxc_ringbuf *buf, char *out, size_t len)
+{
+	if (len > lxc_ringbuf_used(buf))
+		len = lxc_ringbuf_used(buf);
+
+	lxc_ringbuf_copy(buf, buf->w_off - len, out, len);
+	return len;
+}
+
+void lxc_ringbuf_consume(struct lxc_ringbuf *buf, size_t len)
+{
+	if (len > lxc_ringbuf_used(buf))
+		len = lxc_ringbuf_used(buf);
+	buf->r_off += len;
+	/* keep the offsets small when we are drained */
+	if (buf->r_off == buf->w_off)
+		buf->r_off = buf->w_off = 0;
+}
+
+ssize_t lxc_ringbuf_flush(struct lxc_ringbuf *buf, int fd)
+{
+	struct iovec iov[2];
+	size_t used, pos, first;
+	ssize_t ret, total = 0;
+	int iovcnt;
+
+	while ((used = lxc_ringbuf_used(buf)) > 0) {
+		/* the buffered data wraps at most once */
+		pos = buf->r_off % buf->size;
+		first = buf->size - pos;
+		if (first > used)
+			first = used;
+		iov[0].iov_base = buf->addr + pos;
+		iov[0].iov_len = first;
+		iovcnt = 1;
+		if (used > first) {
+			iov[1].iov_base = buf->addr;
+			iov[1].iov_len = used - first;
+			iovcnt = 2;
+		}
+
+		ret = writev(fd, iov, iovcnt);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -1;
+		}
+		if (ret == 0)
+			break;
+
+		lxc_ringbuf_consume(buf, ret);
+		total += ret;
+	}
+
+	return total;
+}
@@ -0,0 +1,94 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __lxc_ringbuf_h
+#define __lxc_ringbuf_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * A simple byte ring buffer.
+ *
+ * @addr  : the backing storage
+ * @size  : size of the backing storage
+ * @r_off : total number of bytes consumed so far
+ * @w_off : total number of bytes produced so far
+ *
+ * The offsets only ever grow, the position in @addr is the offset
+ * modulo @size. The number of buffered bytes is thus w_off - r_off.
+ */
+struct lxc_ringbuf {
+	char *addr;
+	size_t size;
+	uint64_t r_off;
+	uint64_t w_off;
+};
+
+extern int lxc_ringbuf_create(struct lxc_ringbuf *buf, size_t size);
+extern void lxc_ringbuf_release(struct lxc_ringbuf *buf);
+extern void lxc_ringbuf_clear(struct lxc_ringbuf *buf);
+
+static inline size_t lxc_ringbuf_used(struct lxc_ringbuf *buf)
+{
+	return buf->w_off - buf->r_off;
+}
+
+static inline size_t lxc_ringbuf_free(struct lxc_ringbuf *buf)
+{
+	return buf->size - lxc_ringbuf_used(buf);
+}
+
+static inline bool lxc_ringbuf_empty(struct lxc_ringbuf *buf)
+{
+	return buf->w_off == buf->r_off;
+}
+
+/*
+ * lxc_ringbuf_write: append @len bytes of @msg to the buffer
+ *
+ * If @overwrite is true the oldest data is dropped to make room, otherwise
+ * only as much as fits is stored. Returns the number of bytes stored.
+ */
+extern size_t lxc_ringbuf_write(struct lxc_ringbuf *buf, const char *msg,
+				size_t len, bool overwrite);
+
+/*
+ * lxc_ringbuf_peek: copy up to @len of the oldest buffered bytes to @out
+ * without consuming them. Returns the number of bytes copied.
+ */
+extern size_t lxc_ringbuf_peek(struct lxc_ringbuf *buf, char *out, size_t len);
+
+/*
+ * lxc_ringbuf_tail: like lxc_ringbuf_peek() but copy the newest @len bytes
+ */
+extern size_t lxc_ringbuf_tail(struct lxc_ringbuf *buf, char *out, size_t len);
+
+extern void lxc_ringbuf_consume(struct lxc_ringbuf *buf, size_t len);
+
+/*
+ * lxc_ringbuf_flush: write buffered data to @fd until the buffer is empty
+ * or @fd would block.
+ *
+ * Returns the number of bytes written, or -1 on error other than EAGAIN.
+ */
+extern ssize_t lxc_ringbuf_flush(struct lxc_ringbuf *buf, int fd);
+
+#endif /* __lxc_ringbuf_h */
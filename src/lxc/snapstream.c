@@ -0,0 +1,910 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Rootfs payload of the snapshot streams of lxc_snapshot_export().
+ *
+ * btrfs: 'btrfs send' of a read-only snapshot of the snapshot's subvolume,
+ * kept next to it as <rootfs>.send so that it can be the parent of the
+ * next incremental send.  The one of the parent is deleted once a newer
+ * one has been sent, and btrfs_destroy() deletes it with the snapshot,
+ * so that only the last one sent is kept.  The receiving side keeps the received subvolume
+ * in imported.btrfs/<snapname> of the container and makes the rootfs a
+ * writable snapshot of it.
+ *
+ * zfs: 'zfs send' of the <dataset>@<snapname> snapshot which lxc-snapshot
+ * made of the container, received as <zfsroot>/<name>, which keeps the
+ * snapshot as the base of the next incremental receive.
+ *
+ * tar: for any backing store.  The NUL-terminated paths to delete,
+ * ended by an empty one, followed by a tar of the entries which are new
+ * or changed since the base snapshot (or of all of them).  An entry is
+ * changed if its type, mode, owner, size or mtime differ, as rsync
+ * checks them.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sched.h>
+#include <sys/mount.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "bdev.h"
+#include "conf.h"
+#include "log.h"
+#include "lxczfs.h"
+#include "snapstream.h"
+#include "utils.h"
+
+lxc_log_define(lxc_snapstream, lxc);
+
+#define STREAM_BTRFS_DIR "imported.btrfs"
+
+/* run argv with stdin and stdout redirected to in and out if >= 0 */
+static int run_stream_cmd(const char *const argv[], int in, int out)
+{
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0) {
+		SYSERROR("failed to fork");
+		return -1;
+	}
+	if (pid > 0)
+		return wait_for_pid(pid);
+
+	if ((in >= 0 && dup2(in, STDIN_FILENO) < 0) ||
+	    (out >= 0 && dup2(out, STDOUT_FILENO) < 0))
+		exit(1);
+	execvp(argv[0], (char * const *)argv);
+	SYSERROR("failed to exec %s", argv[0]);
+	exit(1);
+}
+
+/*
+ * btrfs
+ */
+static int btrfs_send_path(struct bdev *bdev, char *path)
+{
+	int ret;
+
+	ret = snprintf(path, MAXPATHLEN, "%s.send", bdev->src);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -1;
+	return 0;
+}
+
+static bool btrfs_streamable(struct bdev *snap, struct bdev *base)
+{
+	char path[MAXPATHLEN];
+
+	if (strcmp(snap->type, "btrfs"))
+		return false;
+	if (!base)
+		return true;
+	/* the parent must be the one the other side received */
+	return strcmp(base->type, "btrfs") == 0 &&
+	       btrfs_send_path(base, path) == 0 && access(path, F_OK) == 0;
+}
+
+static int btrfs_send(struct bdev *snap, struct bdev *base, int fd)
+{
+	char path[MAXPATHLEN], parent[MAXPATHLEN];
+
+	if (btrfs_send_path(snap, path) < 0)
+		return -1;
+	if (access(path, F_OK) < 0 &&
+	    run_stream_cmd((const char *[]){"btrfs", "subvolume", "snapshot",
+			   "-r", snap->src, path, NULL}, -1, STDERR_FILENO) < 0) {
+		ERROR("Failed to make a read-only snapshot of %s", snap->src);
+		return -1;
+	}
+
+	if (!base)
+		return run_stream_cmd((const char *[]){"btrfs", "send", path,
+				      NULL}, -1, fd);
+	if (btrfs_send_path(base, parent) < 0)
+		return -1;
+	if (run_stream_cmd((const char *[]){"btrfs", "send", "-p", parent,
+			   path, NULL}, -1, fd) < 0)
+		return -1;
+
+	/* the next incremental send starts from this one */
+	if (run_stream_cmd((const char *[]){"btrfs", "subvolume", "delete",
+			   parent, NULL}, -1, STDERR_FILENO) < 0)
+		WARN("Failed to delete %s", parent);
+	return 0;
+}
+
+/* the subvolume 'btrfs receive' created in dir */
+static int btrfs_received(const char *dir, char *path)
+{
+	struct dirent *direntp;
+	DIR *d;
+	int ret = -1;
+
+	d = opendir(dir);
+	if (!d) {
+		SYSERROR("Failed to open %s", dir);
+		return -1;
+	}
+	while ((direntp = readdir(d))) {
+		if (strcmp(direntp->d_name, ".") == 0 ||
+		    strcmp(direntp->d_name, "..") == 0)
+			continue;
+		ret = snprintf(path, MAXPATHLEN, "%s/%s", dir, direntp->d_name);
+		if (ret < 0 || ret >= MAXPATHLEN)
+			ret = -1;
+		else
+			ret = 0;
+		break;
+	}
+	closedir(d);
+	return ret;
+}
+
+/* delete what 'btrfs receive' left in dir, and dir */
+static void btrfs_discard_received(const char *dir)
+{
+	char sub[MAXPATHLEN];
+
+	if (btrfs_received(dir, sub) == 0 &&
+	    run_stream_cmd((const char *[]){"btrfs", "subvolume", "delete",
+			   sub, NULL}, -1, STDERR_FILENO) < 0)
+		WARN("Failed to delete %s", sub);
+	if (rmdir(dir) < 0)
+		WARN("Failed to remove %s: %s", dir, strerror(errno));
+}
+
+/* delete the subvolumes an import into cpath created */
+static void btrfs_discard(const char *cpath, const char *rootfs)
+{
+	char dir[MAXPATHLEN], path[MAXPATHLEN];
+	struct dirent *direntp;
+	DIR *d;
+	int ret;
+
+	if (rootfs && run_stream_cmd((const char *[]){"btrfs", "subvolume",
+				     "delete", rootfs, NULL}, -1,
+				     STDERR_FILENO) < 0)
+		WARN("Failed to delete %s", rootfs);
+
+	ret = snprintf(dir, MAXPATHLEN, "%s/" STREAM_BTRFS_DIR, cpath);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return;
+	d = opendir(dir);
+	if (!d)
+		return;
+	while ((direntp = readdir(d))) {
+		if (strcmp(direntp->d_name, ".") == 0 ||
+		    strcmp(direntp->d_name, "..") == 0)
+			continue;
+		ret = snprintf(path, MAXPATHLEN, "%s/%s", dir, direntp->d_name);
+		if (ret > 0 && ret < MAXPATHLEN)
+			btrfs_discard_received(path);
+	}
+	closedir(d);
+	if (rmdir(dir) < 0)
+		WARN("Failed to remove %s: %s", dir, strerror(errno));
+}
+
+static char *btrfs_receive(const char *cpath, const char *rootfs,
+			   const char *snapname, const char *basesnap, int fd)
+{
+	char dir[MAXPATHLEN], sub[MAXPATHLEN], newroot[MAXPATHLEN];
+	int ret;
+
+	ret = snprintf(dir, MAXPATHLEN, "%s/" STREAM_BTRFS_DIR "/%s", cpath,
+		       snapname);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return NULL;
+	if (mkdir_p(dir, 0755) < 0) {
+		ERROR("Failed to create %s", dir);
+		return NULL;
+	}
+	if (run_stream_cmd((const char *[]){"btrfs", "receive", dir, NULL},
+			   fd, STDERR_FILENO) < 0 ||
+	    btrfs_received(dir, sub) < 0) {
+		ERROR("Failed to receive snapshot %s into %s", snapname, dir);
+		goto err;
+	}
+
+	if (rootfs) {
+		if (run_stream_cmd((const char *[]){"btrfs", "subvolume",
+				   "delete", rootfs, NULL}, -1,
+				   STDERR_FILENO) < 0) {
+			ERROR("Failed to delete %s", rootfs);
+			goto err;
+		}
+		ret = snprintf(newroot, MAXPATHLEN, "%s", rootfs);
+	} else {
+		ret = snprintf(newroot, MAXPATHLEN, "%s/rootfs", cpath);
+	}
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return NULL;
+	if (run_stream_cmd((const char *[]){"btrfs", "subvolume", "snapshot",
+			   sub, newroot, NULL}, -1, STDERR_FILENO) < 0) {
+		ERROR("Failed to snapshot %s as %s", sub, newroot);
+		/* the received subvolume is all that is left of the rootfs */
+		if (!rootfs)
+			btrfs_discard(cpath, NULL);
+		return NULL;
+	}
+
+	/* only the latest received snapshot is needed as a parent */
+	if (basesnap) {
+		ret = snprintf(dir, MAXPATHLEN, "%s/" STREAM_BTRFS_DIR "/%s",
+			       cpath, basesnap);
+		if (ret > 0 && ret < MAXPATHLEN && btrfs_received(dir, sub) == 0 &&
+		    (run_stream_cmd((const char *[]){"btrfs", "subvolume",
+				    "delete", sub, NULL}, -1, STDERR_FILENO) < 0 ||
+		     rmdir(dir) < 0))
+			WARN("Failed to remove the received snapshot %s", basesnap);
+	}
+
+	return strdup(newroot);
+
+err:
+	if (rootfs)
+		btrfs_discard_received(dir);
+	else
+		btrfs_discard(cpath, NULL);
+	return NULL;
+}
+
+/*
+ * zfs
+ */
+static bool zfs_has_snapshot(const char *dataset, const char *snapname)
+{
+	char name[MAXPATHLEN];
+	int ret;
+
+	ret = snprintf(name, MAXPATHLEN, "%s@%s", dataset, snapname);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return false;
+	return lxc_zfs_get_ops()->exists(name);
+}
+
+static bool zfs_streamable(struct bdev *orig, struct bdev *snap,
+			   const char *snapname, struct bdev *base,
+			   const char *basesnap)
+{
+	char *dataset;
+	bool ret;
+
+	if (!orig || strcmp(orig->type, "zfs") || strcmp(snap->type, "zfs") ||
+	    (base && strcmp(base->type, "zfs")))
+		return false;
+	dataset = lxc_zfs_dataset_of(orig->src, true);
+	if (!dataset)
+		return false;
+	ret = zfs_has_snapshot(dataset, snapname) &&
+	      (!base || zfs_has_snapshot(dataset, basesnap));
+	free(dataset);
+	return ret;
+}
+
+static int zfs_send(struct bdev *orig, const char *snapname,
+		    const char *basesnap, int fd)
+{
+	char name[MAXPATHLEN], from[MAXPATHLEN];
+	char *dataset;
+	int ret;
+
+	dataset = lxc_zfs_dataset_of(orig->src, true);
+	if (!dataset) {
+		ERROR("zfs entry for %s not found", orig->src);
+		return -1;
+	}
+	ret = snprintf(name, MAXPATHLEN, "%s@%s", dataset, snapname);
+	free(dataset);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -1;
+
+	if (!basesnap)
+		return run_stream_cmd((const char *[]){"zfs", "send", name,
+				      NULL}, -1, fd);
+	ret = snprintf(from, MAXPATHLEN, "@%s", basesnap);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -1;
+	return run_stream_cmd((const char *[]){"zfs", "send", "-i", from,
+			      name, NULL}, -1, fd);
+}
+
+/* the dataset a full import into cpath receives */
+static int zfs_import_dataset(const char *cpath, char *dataset)
+{
+	const char *p;
+	int ret;
+
+	p = strrchr(cpath, '/');
+	ret = snprintf(dataset, MAXPATHLEN, "%s/%s",
+		       lxc_global_config_value("lxc.bdev.zfs.root"),
+		       p ? p + 1 : cpath);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -1;
+	return 0;
+}
+
+/* destroy the dataset of a full import, with its received snapshot */
+static void zfs_discard(const char *cpath)
+{
+	char dataset[MAXPATHLEN];
+
+	if (zfs_import_dataset(cpath, dataset) < 0 ||
+	    !lxc_zfs_get_ops()->exists(dataset))
+		return;
+	if (run_stream_cmd((const char *[]){"zfs", "destroy", "-r", dataset,
+			   NULL}, -1, STDERR_FILENO) < 0)
+		WARN("Failed to destroy %s", dataset);
+}
+
+static char *zfs_receive(const char *cpath, const char *rootfs, int fd)
+{
+	char dataset[MAXPATHLEN], newroot[MAXPATHLEN], option[MAXPATHLEN];
+	char *d;
+	int ret;
+
+	if (rootfs) {
+		/* -F rolls back what changed since the base snapshot */
+		d = lxc_zfs_dataset_of(rootfs, true);
+		if (!d) {
+			ERROR("zfs entry for %s not found", rootfs);
+			return NULL;
+		}
+		ret = run_stream_cmd((const char *[]){"zfs", "receive", "-F", d,
+				     NULL}, fd, STDERR_FILENO);
+		free(d);
+		return ret < 0 ? NULL : strdup(rootfs);
+	}
+
+	if (zfs_import_dataset(cpath, dataset) < 0)
+		return NULL;
+	ret = snprintf(newroot, MAXPATHLEN, "%s/rootfs", cpath);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return NULL;
+	ret = snprintf(option, MAXPATHLEN, "mountpoint=%s", newroot);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return NULL;
+	if (run_stream_cmd((const char *[]){"zfs", "receive", "-o", option,
+			   dataset, NULL}, fd, STDERR_FILENO) < 0) {
+		ERROR("Failed to receive %s", dataset);
+		zfs_discard(cpath);
+		return NULL;
+	}
+	return strdup(newroot);
+}
+
+/*
+ * tar
+ */
+static const char *tar_opts[] = {
+	"tar", "--numeric-owner", "--xattrs", "--xattrs-include=*", NULL
+};
+#define TAR_NOPTS (sizeof(tar_opts) / sizeof(tar_opts[0]) - 1)
+
+struct tar_delta {
+	const char *snap;
+	const char *base; /* NULL for a full stream */
+	FILE *list;       /* changed entries, for tar -T */
+	int fd;           /* stream, the entries to delete are written to */
+};
+
+static bool entry_changed(struct stat *a, struct stat *b)
+{
+	if (a->st_mode != b->st_mode || a->st_uid != b->st_uid ||
+	    a->st_gid != b->st_gid)
+		return true;
+	if ((S_ISCHR(a->st_mode) || S_ISBLK(a->st_mode)) &&
+	    a->st_rdev != b->st_rdev)
+		return true;
+	return a->st_size != b->st_size ||
+	       a->st_mtim.tv_sec != b->st_mtim.tv_sec ||
+	       a->st_mtim.tv_nsec != b->st_mtim.tv_nsec;
+}
+
+/*
+ * List the new and changed entries under rel, which is a directory in
+ * the base too if inbase, and write those which are gone to the stream.
+ */
+static int tar_delta_dir(struct tar_delta *d, const char *rel, bool inbase)
+{
+	char path[MAXPATHLEN], sub[MAXPATHLEN];
+	struct dirent *direntp;
+	struct stat st, bst;
+	bool found;
+	DIR *dir;
+	int ret, failed = 0;
+
+	ret = snprintf(path, MAXPATHLEN, "%s/%s", d->snap, rel);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -1;
+	dir = opendir(path);
+	if (!dir) {
+		SYSERROR("Failed to open %s", path);
+		return -1;
+	}
+	while (!failed && (direntp = readdir(dir))) {
+		if (strcmp(direntp->d_name, ".") == 0 ||
+		    strcmp(direntp->d_name, "..") == 0)
+			continue;
+		ret = snprintf(sub, MAXPATHLEN, "%s/%s", rel, direntp->d_name);
+		if (ret < 0 || ret >= MAXPATHLEN) {
+			failed = 1;
+			break;
+		}
+		ret = snprintf(path, MAXPATHLEN, "%s/%s", d->snap, sub);
+		if (ret < 0 || ret >= MAXPATHLEN || lstat(path, &st) < 0) {
+			SYSERROR("Failed to stat %s", sub);
+			failed = 1;
+			break;
+		}
+		found = false;
+		if (inbase) {
+			ret = snprintf(path, MAXPATHLEN, "%s/%s", d->base, sub);
+			found = ret > 0 && ret < MAXPATHLEN && lstat(path, &bst) == 0;
+		}
+		if (!found || entry_changed(&st, &bst))
+			fprintf(d->list, "%s%c", sub, '\0');
+		if (S_ISDIR(st.st_mode) &&
+		    tar_delta_dir(d, sub, found && S_ISDIR(bst.st_mode)) < 0)
+			failed = 1;
+	}
+	closedir(dir);
+	if (failed || !inbase)
+		return failed ? -1 : 0;
+
+	ret = snprintf(path, MAXPATHLEN, "%s/%s", d->base, rel);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -1;
+	dir = opendir(path);
+	if (!dir) {
+		SYSERROR("Failed to open %s", path);
+		return -1;
+	}
+	while ((direntp = readdir(dir))) {
+		if (strcmp(direntp->d_name, ".") == 0 ||
+		    strcmp(direntp->d_name, "..") == 0)
+			continue;
+		ret = snprintf(sub, MAXPATHLEN, "%s/%s", rel, direntp->d_name);
+		if (ret < 0 || ret >= MAXPATHLEN) {
+			failed = 1;
+			break;
+		}
+		ret = snprintf(path, MAXPATHLEN, "%s/%s", d->snap, sub);
+		if (ret > 0 && ret < MAXPATHLEN && lstat(path, &st) == 0) {
+			ret = snprintf(path, MAXPATHLEN, "%s/%s", d->base, sub);
+			if (ret < 0 || ret >= MAXPATHLEN || lstat(path, &bst) < 0 ||
+			    (st.st_mode & S_IFMT) == (bst.st_mode & S_IFMT))
+				continue;
+		}
+		/* gone, or replaced by an entry of another type */
+		if (lxc_write_nointr(d->fd, sub, strlen(sub) + 1) < 0) {
+			SYSERROR("Failed to write to the stream");
+			failed = 1;
+			break;
+		}
+	}
+	closedir(dir);
+	return failed ? -1 : 0;
+}
+
+static int stream_private_ns(void)
+{
+	if (unshare(CLONE_NEWNS) < 0) {
+		SYSERROR("unshare CLONE_NEWNS");
+		return -1;
+	}
+	if (detect_shared_rootfs() &&
+	    mount(NULL, "/", NULL, MS_SLAVE|MS_REC, NULL) < 0) {
+		SYSERROR("Failed to make / rslave");
+		return -1;
+	}
+	return 0;
+}
+
+static int stream_mount(struct bdev *bdev, const char *mnt)
+{
+	free(bdev->dest);
+	bdev->dest = strdup(mnt);
+	if (!bdev->dest || mkdir(mnt, 0755) < 0 || bdev->ops->mount(bdev) < 0) {
+		ERROR("Failed to mount %s onto %s", bdev->src, mnt);
+		return -1;
+	}
+	return 0;
+}
+
+/* runs in a child, in a private mount namespace, and execs tar */
+static void tar_send_child(struct bdev *snap, struct bdev *base,
+			   const char *tmpdir, int fd)
+{
+	char snapmnt[MAXPATHLEN], basemnt[MAXPATHLEN], list[MAXPATHLEN];
+	const char *argv[TAR_NOPTS + 10];
+	struct tar_delta d;
+	struct stat st, bst;
+	int i, ret;
+
+	if (stream_private_ns() < 0)
+		exit(1);
+	ret = snprintf(snapmnt, MAXPATHLEN, "%s/snap", tmpdir);
+	if (ret < 0 || ret >= MAXPATHLEN || stream_mount(snap, snapmnt) < 0)
+		exit(1);
+
+	for (i = 0; i < TAR_NOPTS; i++)
+		argv[i] = tar_opts[i];
+	argv[i++] = "-C";
+	argv[i++] = snapmnt;
+
+	if (!base) {
+		argv[i++] = "-cf";
+		argv[i++] = "-";
+		argv[i++] = ".";
+		argv[i] = NULL;
+		if (lxc_write_nointr(fd, "", 1) < 0)
+			exit(1);
+		if (dup2(fd, STDOUT_FILENO) < 0)
+			exit(1);
+		execvp("tar", (char * const *)argv);
+		SYSERROR("failed to exec tar");
+		exit(1);
+	}
+
+	ret = snprintf(basemnt, MAXPATHLEN, "%s/base", tmpdir);
+	if (ret < 0 || ret >= MAXPATHLEN || stream_mount(base, basemnt) < 0)
+		exit(1);
+	ret = snprintf(list, MAXPATHLEN, "%s/list", tmpdir);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		exit(1);
+	d.snap = snapmnt;
+	d.base = basemnt;
+	d.fd = fd;
+	d.list = fopen(list, "w");
+	if (!d.list) {
+		SYSERROR("Failed to create %s", list);
+		exit(1);
+	}
+	if (lstat(snapmnt, &st) < 0 || lstat(basemnt, &bst) < 0)
+		exit(1);
+	if (entry_changed(&st, &bst))
+		fprintf(d.list, ".%c", '\0');
+	if (tar_delta_dir(&d, ".", true) < 0 || fclose(d.list) != 0) {
+		ERROR("Failed to compare %s to %s", snap->src, base->src);
+		exit(1);
+	}
+	if (lxc_write_nointr(fd, "", 1) < 0)
+		exit(1);
+
+	argv[i++] = "--null";
+	argv[i++] = "--no-recursion";
+	argv[i++] = "-T";
+	argv[i++] = list;
+	argv[i++] = "-cf";
+	argv[i++] = "-";
+	argv[i] = NULL;
+	if (dup2(fd, STDOUT_FILENO) < 0)
+		exit(1);
+	execvp("tar", (char * const *)argv);
+	SYSERROR("failed to exec tar");
+	exit(1);
+}
+
+static int tar_send(struct bdev *snap, struct bdev *base, int fd)
+{
+	char tmpdir[] = "/tmp/lxc-stream-XXXXXX", path[MAXPATHLEN];
+	const char *subs[] = { "list", "base", "snap", NULL };
+	pid_t pid;
+	int i, ret;
+
+	if (!mkdtemp(tmpdir)) {
+		SYSERROR("Failed to create a temporary directory");
+		return -1;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		SYSERROR("failed to fork");
+		ret = -1;
+	} else if (pid == 0) {
+		tar_send_child(snap, base, tmpdir, fd);
+	} else {
+		ret = wait_for_pid(pid);
+	}
+
+	/* the mounts went away with the child's namespace */
+	for (i = 0; subs[i]; i++) {
+		if (snprintf(path, MAXPATHLEN, "%s/%s", tmpdir, subs[i]) < MAXPATHLEN)
+			(void)remove(path);
+	}
+	if (rmdir(tmpdir) < 0)
+		WARN("Failed to remove %s: %s", tmpdir, strerror(errno));
+	return ret;
+}
+
+/* read a NUL-terminated path from the stream, "" at the end of the list */
+static int tar_read_path(int fd, char *path)
+{
+	int i;
+
+	for (i = 0; i < MAXPATHLEN; i++) {
+		if (lxc_read_nointr(fd, &path[i], 1) != 1) {
+			ERROR("Truncated stream");
+			return -1;
+		}
+		if (path[i] == '\0')
+			return 0;
+	}
+	ERROR("Bad path in the stream");
+	return -1;
+}
+
+/* remove the entries listed in the stream, chrooted in the rootfs */
+static int tar_delete(const char *root, int fd)
+{
+	char path[MAXPATHLEN];
+	struct stat st;
+	size_t len;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0) {
+		SYSERROR("failed to fork");
+		return -1;
+	}
+	if (pid > 0)
+		return wait_for_pid(pid);
+
+	if (chdir(root) < 0 || chroot(".") < 0) {
+		SYSERROR("Failed to chroot into %s", root);
+		exit(1);
+	}
+	while (tar_read_path(fd, path) == 0) {
+		len = strlen(path);
+		if (len == 0)
+			exit(0);
+		if (len < 3 || strncmp(path, "./", 2) || strstr(path, "/../") ||
+		    strcmp(path + len - 3, "/..") == 0) {
+			ERROR("Bad path %s in the stream", path);
+			exit(1);
+		}
+		if (lstat(path, &st) < 0) {
+			if (errno == ENOENT)
+				continue;
+			SYSERROR("Failed to stat %s", path);
+			exit(1);
+		}
+		if (S_ISDIR(st.st_mode) ? lxc_rmdir_onedev(path) < 0 :
+		    unlink(path) < 0) {
+			ERROR("Failed to delete %s", path);
+			exit(1);
+		}
+		DEBUG("Deleted %s", path);
+	}
+	exit(1);
+}
+
+/* the host directories tar runs from, read-only in its root */
+static const char *tar_root_dirs[] = {
+	"bin", "sbin", "usr", "lib", "lib32", "lib64", "libx32", "etc", NULL
+};
+
+/*
+ * Build in root, a directory of the private mount namespace, a read-only
+ * tree holding the host's tar and libraries and, writable at root/rootfs,
+ * the rootfs mounted on mnt.  Chrooted in it, tar can not be led out of
+ * the rootfs by the entries it extracts, such as a symlink to /etc.
+ */
+static int tar_make_root(const char *root, const char *mnt)
+{
+	char src[MAXPATHLEN], dest[MAXPATHLEN], target[MAXPATHLEN];
+	struct stat st;
+	ssize_t len;
+	int i, ret;
+
+	if (mkdir(root, 0755) < 0 ||
+	    mount("tmpfs", root, "tmpfs", 0, "mode=0755") < 0) {
+		SYSERROR("Failed to mount a tmpfs on %s", root);
+		return -1;
+	}
+	for (i = 0; tar_root_dirs[i]; i++) {
+		ret = snprintf(src, MAXPATHLEN, "/%s", tar_root_dirs[i]);
+		if (ret < 0 || ret >= MAXPATHLEN || lstat(src, &st) < 0)
+			continue;
+		ret = snprintf(dest, MAXPATHLEN, "%s/%s", root, tar_root_dirs[i]);
+		if (ret < 0 || ret >= MAXPATHLEN)
+			return -1;
+		/* /lib -> usr/lib and the like */
+		if (S_ISLNK(st.st_mode)) {
+			len = readlink(src, target, MAXPATHLEN - 1);
+			if (len < 0)
+				return -1;
+			target[len] = '\0';
+			if (symlink(target, dest) < 0) {
+				SYSERROR("Failed to create %s", dest);
+				return -1;
+			}
+			continue;
+		}
+		if (!S_ISDIR(st.st_mode))
+			continue;
+		if (mkdir(dest, 0755) < 0 ||
+		    mount(src, dest, NULL, MS_BIND | MS_REC, NULL) < 0 ||
+		    mount(NULL, dest, NULL, MS_BIND | MS_REMOUNT | MS_RDONLY, NULL) < 0) {
+			SYSERROR("Failed to bind %s read-only onto %s", src, dest);
+			return -1;
+		}
+	}
+
+	ret = snprintf(dest, MAXPATHLEN, "%s/rootfs", root);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -1;
+	if (mkdir(dest, 0755) < 0 ||
+	    mount(mnt, dest, NULL, MS_BIND | MS_REC, NULL) < 0) {
+		SYSERROR("Failed to bind %s onto %s", mnt, dest);
+		return -1;
+	}
+	if (mount(NULL, root, NULL, MS_REMOUNT | MS_RDONLY, "mode=0755") < 0) {
+		SYSERROR("Failed to make %s read-only", root);
+		return -1;
+	}
+	return 0;
+}
+
+static void tar_receive_child(struct bdev *bdev, const char *tmpdir,
+			      const char *mnt, int fd)
+{
+	const char *argv[TAR_NOPTS + 5];
+	char root[MAXPATHLEN];
+	int i, ret;
+
+	if (stream_private_ns() < 0 || stream_mount(bdev, mnt) < 0)
+		exit(1);
+	if (tar_delete(mnt, fd) < 0)
+		exit(1);
+
+	ret = snprintf(root, MAXPATHLEN, "%s/root", tmpdir);
+	if (ret < 0 || ret >= MAXPATHLEN || tar_make_root(root, mnt) < 0)
+		exit(1);
+	if (chdir(root) < 0 || chroot(".") < 0) {
+		SYSERROR("Failed to chroot into %s", root);
+		exit(1);
+	}
+
+	for (i = 0; i < TAR_NOPTS; i++)
+		argv[i] = tar_opts[i];
+	argv[i++] = "-C";
+	argv[i++] = "/rootfs";
+	argv[i++] = "-xpf";
+	argv[i++] = "-";
+	argv[i] = NULL;
+	if (dup2(fd, STDIN_FILENO) < 0)
+		exit(1);
+	execvp("tar", (char * const *)argv);
+	SYSERROR("failed to exec tar");
+	exit(1);
+}
+
+static char *tar_receive(const char *cpath, const char *rootfs, int fd)
+{
+	char tmpdir[] = "/tmp/lxc-stream-XXXXXX", mnt[MAXPATHLEN];
+	char newroot[MAXPATHLEN];
+	struct bdev *bdev;
+	pid_t pid;
+	int ret;
+
+	if (rootfs) {
+		ret = snprintf(newroot, MAXPATHLEN, "%s", rootfs);
+	} else {
+		ret = snprintf(newroot, MAXPATHLEN, "%s/rootfs", cpath);
+		if (ret > 0 && ret < MAXPATHLEN && mkdir(newroot, 0755) < 0) {
+			SYSERROR("Failed to create %s", newroot);
+			return NULL;
+		}
+	}
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return NULL;
+
+	bdev = bdev_init(newroot, NULL, NULL);
+	if (!bdev) {
+		ERROR("Failed to find the backing store of %s", newroot);
+		return NULL;
+	}
+	if (!mkdtemp(tmpdir)) {
+		SYSERROR("Failed to create a temporary directory");
+		bdev_put(bdev);
+		return NULL;
+	}
+	ret = snprintf(mnt, MAXPATHLEN, "%s/rootfs", tmpdir);
+	if (ret < 0 || ret >= MAXPATHLEN) {
+		ret = -1;
+		goto out;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		SYSERROR("failed to fork");
+		ret = -1;
+	} else if (pid == 0) {
+		tar_receive_child(bdev, tmpdir, mnt, fd);
+	} else {
+		ret = wait_for_pid(pid);
+	}
+	/* the mounts went away with the child's namespace */
+	(void)rmdir(mnt);
+	if (snprintf(mnt, MAXPATHLEN, "%s/root", tmpdir) < MAXPATHLEN)
+		(void)rmdir(mnt);
+out:
+	if (rmdir(tmpdir) < 0)
+		WARN("Failed to remove %s: %s", tmpdir, strerror(errno));
+	bdev_put(bdev);
+	return ret < 0 ? NULL : strdup(newroot);
+}
+
+const char *lxc_stream_format(struct bdev *orig, struct bdev *snap,
+			      const char *snapname, struct bdev *base,
+			      const char *basesnap)
+{
+	if (btrfs_streamable(snap, base))
+		return "btrfs";
+	if (zfs_streamable(orig, snap, snapname, base, basesnap))
+		return "zfs";
+	return "tar";
+}
+
+int lxc_stream_send(const char *format, struct bdev *orig, struct bdev *snap,
+		    const char *snapname, struct bdev *base,
+		    const char *basesnap, int fd)
+{
+	if (strcmp(format, "btrfs") == 0)
+		return btrfs_send(snap, base, fd);
+	if (strcmp(format, "zfs") == 0)
+		return zfs_send(orig, snapname, base ? basesnap : NULL, fd);
+	return tar_send(snap, base, fd);
+}
+
+void lxc_stream_discard(const char *format, const char *cpath,
+			const char *rootfs)
+{
+	if (strcmp(format, "btrfs") == 0)
+		btrfs_discard(cpath, rootfs);
+	else if (strcmp(format, "zfs") == 0)
+		zfs_discard(cpath);
+}
+
+char *lxc_stream_receive(const char *format, const char *cpath,
+			 const char *rootfs, const char *snapname,
+			 const char *basesnap, int fd)
+{
+	if (strcmp(format, "btrfs") == 0)
+		return btrfs_receive(cpath, rootfs, snapname, basesnap, fd);
+	if (strcmp(format, "zfs") == 0)
+		return zfs_receive(cpath, rootfs, fd);
+	if (strcmp(format, "tar") == 0)
+		return tar_receive(cpath, rootfs, fd);
+	ERROR("Unknown stream format %s", format);
+	return NULL;
+}
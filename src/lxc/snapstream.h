@@ -0,0 +1,61 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef __LXC_SNAPSTREAM_H
+#define __LXC_SNAPSTREAM_H
+
+struct bdev;
+
+/*
+ * The format to stream the rootfs of a snapshot in: "btrfs" or "zfs"
+ * when the snapshot, the base snapshot if not NULL and, for zfs, orig
+ * (the rootfs of the container they are snapshots of) allow it, else
+ * "tar", which suits any backing store.
+ */
+extern const char *lxc_stream_format(struct bdev *orig, struct bdev *snap,
+				     const char *snapname, struct bdev *base,
+				     const char *basesnap);
+
+/*
+ * Write to fd the rootfs of snapshot snapname, whose rootfs is snap, in
+ * format, or only its changes since snapshot basesnap if base is not
+ * NULL.  Returns 0 on success.
+ */
+extern int lxc_stream_send(const char *format, struct bdev *orig,
+			   struct bdev *snap, const char *snapname,
+			   struct bdev *base, const char *basesnap, int fd);
+
+/*
+ * Read the rootfs of snapshot snapname in format from fd into the
+ * container directory cpath.  If basesnap is NULL this creates it, else
+ * this applies the changes since snapshot basesnap to the rootfs, which
+ * must hold that snapshot.  Returns the lxc.rootfs to use, allocated, or
+ * NULL on error.
+ */
+extern char *lxc_stream_receive(const char *format, const char *cpath,
+				const char *rootfs, const char *snapname,
+				const char *basesnap, int fd);
+
+/*
+ * Remove the subvolumes or datasets which a full import of format into
+ * cpath created, rootfs being what lxc_stream_receive() returned, before
+ * cpath itself is removed.
+ */
+extern void lxc_stream_discard(const char *format, const char *cpath,
+			       const char *rootfs);
+
+#endif
@@ -307,6 +307,40 @@ static int lxc_set_state(const char *name, struct lxc_handler *handler, lxc_stat
 	return 0;
 }
 
+int lxc_start_mainloop_add(struct lxc_epoll_descr *descr,
+			   struct lxc_handler *handler)
+{
+	if (lxc_console_mainloop_add(descr, handler)) {
+		ERROR("failed to add console handler to mainloop");
+		return -1;
+	}
+
+	if (lxc_cmd_mainloop_add(handler->name, descr, handler)) {
+		ERROR("failed to add command handler to mainloop");
+		return -1;
+	}
+
+	if (handler->conf->need_utmp_watch) {
+		#if HAVE_SYS_CAPABILITY_H
+		if (lxc_utmp_mainloop_add(descr, handler)) {
+			ERROR("failed to add utmp handler to mainloop");
+			return -1;
+		}
+		#else
+			DEBUG("not starting utmp handler as cap_sys_boot cannot be dropped without capabilities support");
+		#endif
+	}
+
+	return 0;
+}
+
+void lxc_start_mainloop_del(struct lxc_epoll_descr *descr,
+			    struct lxc_handler *handler)
+{
+	lxc_cmd_mainloop_del(descr, handler);
+	lxc_utmp_mainloop_del(descr);
+}
+
 static int lxc_poll(const char *name, struct lxc_handler *handler)
 {
 	int sigfd = handler->sigfd;
@@ -323,26 +357,8 @@ static int lxc_poll(const char *name, struct lxc_handler *handler)
 		goto out_mainloop_open;
 	}
 
-	if (lxc_console_mainloop_add(&descr, handler)) {
-		ERROR("failed to add console handler to mainloop");
-		goto out_mainloop_open;
-	}
-
-	if (lxc_cmd_mainloop_add(name, &descr, handler)) {
-		ERROR("failed to add command handler to mainloop");
+	if (lxc_start_mainloop_add(&descr, handler))
 		goto out_mainloop_open;
-	}
-
-	if (handler->conf->need_utmp_watch) {
-		#if HAVE_SYS_CAPABILITY_H
-		if (lxc_utmp_mainloop_add(&descr, handler)) {
-			ERROR("failed to add utmp handler to mainloop");
-			goto out_mainloop_open;
-		}
-		#else
-			DEBUG("not starting utmp handler as cap_sys_boot cannot be dropped without capabilities support");
-		#endif
-	}
 
 	return lxc_mainloop(&descr, -1);
 
@@ -353,7 +369,8 @@ out_sigfd:
 	return -1;
 }
 
-struct lxc_handler *lxc_init(const char *name, struct lxc_conf *conf, const char *lxcpath)
+static struct lxc_handler *__lxc_init(const char *name, struct lxc_conf *conf,
+				      const char *lxcpath, const sigset_t *mask)
 {
 	struct lxc_handler *handler;
 
@@ -422,11 +439,19 @@ struct lxc_handler *lxc_init(const char *name, struct lxc_conf *conf, const char
 
 	/* the signal fd has to be created before forking otherwise
 	 * if the child process exits before we setup the signal fd,
-	 * the event will be lost and the command will be stuck */
-	handler->sigfd = setup_signal_fd(&handler->oldmask);
-	if (handler->sigfd < 0) {
-		ERROR("failed to set sigchild fd handler");
-		goto out_delete_tty;
+	 * the event will be lost and the command will be stuck.
+	 * A shared monitor already blocks the signals and reaps the
+	 * containers itself, the mask is the one to give to init */
+	if (mask) {
+		handler->shared = 1;
+		handler->sigfd = -1;
+		handler->oldmask = *mask;
+	} else {
+		handler->sigfd = setup_signal_fd(&handler->oldmask);
+		if (handler->sigfd < 0) {
+			ERROR("failed to set sigchild fd handler");
+			goto out_delete_tty;
+		}
 	}
 
 	/* do this after setting up signals since it might unblock SIGWINCH */
@@ -444,7 +469,8 @@ struct lxc_handler *lxc_init(const char *name, struct lxc_conf *conf, const char
 	return handler;
 
 out_restore_sigmask:
-	sigprocmask(SIG_SETMASK, &handler->oldmask, NULL);
+	if (!handler->shared)
+		sigprocmask(SIG_SETMASK, &handler->oldmask, NULL);
 out_delete_tty:
 	lxc_delete_tty(&conf->tty_info);
 out_aborting:
@@ -460,6 +486,11 @@ out_free:
 	return NULL;
 }
 
+struct lxc_handler *lxc_init(const char *name, struct lxc_conf *conf, const char *lxcpath)
+{
+	return __lxc_init(name, conf, lxcpath, NULL);
+}
+
 static void lxc_fini(const char *name, struct lxc_handler *handler)
 {
 	/* The STOPPING state is there for future cleanup code
@@ -472,7 +503,8 @@ static void lxc_fini(const char *name, struct lxc_handler *handler)
 		ERROR("failed to run post-stop hooks for container '%s'.", name);
 
 	/* reset mask set by setup_signal_fd */
-	if (sigprocmask(SIG_SETMASK, &handler->oldmask, NULL))
+	if (!handler->shared &&
+	    sigprocmask(SIG_SETMASK, &handler->oldmask, NULL))
 		WARN("failed to restore sigprocmask");
 
 	lxc_console_delete(&handler->conf->console);
@@ -491,6 +523,15 @@ static void lxc_abort(const char *name, struct lxc_handler *handler)
 	lxc_set_state(name, handler, ABORTING);
 	if (handler->pid > 0)
 		kill(handler->pid, SIGKILL);
+
+	/* the other children of a shared monitor are other containers */
+	if (handler->shared) {
+		if (handler->pid > 0)
+			while (waitpid(handler->pid, &status, 0) < 0 &&
+			       errno == EINTR) ;
+		return;
+	}
+
 	while ((ret = waitpid(-1, &status, 0)) > 0) ;
 }
 
@@ -550,7 +591,7 @@ static int must_drop_cap_sys_boot(struct lxc_conf *conf)
 		SYSERROR("failed to clone");
 		return -1;
 	}
-	if (wait(&status) < 0) {
+	if (waitpid(pid, &status, 0) < 0) {
 		SYSERROR("unexpected wait error: %m");
 		return -1;
 	}
@@ -1000,17 +1041,18 @@ out_abort:
 	return -1;
 }
 
-int __lxc_start(const char *name, struct lxc_conf *conf,
-		struct lxc_operations* ops, void *data, const char *lxcpath)
+static struct lxc_handler *lxc_start_init(const char *name,
+					  struct lxc_conf *conf,
+					  struct lxc_operations *ops,
+					  void *data, const char *lxcpath,
+					  const sigset_t *mask)
 {
 	struct lxc_handler *handler;
-	int err = -1;
-	int status;
 
-	handler = lxc_init(name, conf, lxcpath);
+	handler = __lxc_init(name, conf, lxcpath, mask);
 	if (!handler) {
 		ERROR("failed to initialize the container");
-		return -1;
+		return NULL;
 	}
 	handler->ops = ops;
 	handler->data = data;
@@ -1026,20 +1068,19 @@ int __lxc_start(const char *name, struct lxc_conf *conf,
 		handler->conf->need_utmp_watch = 0;
 	}
 
-	err = lxc_spawn(handler);
-	if (err) {
+	if (lxc_spawn(handler)) {
 		ERROR("failed to spawn '%s'", name);
-		goto out_fini_nonet;
+		lxc_fini(name, handler);
+		return NULL;
 	}
 
-	err = lxc_poll(name, handler);
-	if (err) {
-		ERROR("mainloop exited with an error");
-		goto out_abort;
-	}
+	return handler;
+}
 
-	while (waitpid(handler->pid, &status, 0) < 0 && errno == EINTR)
-		continue;
+int lxc_start_fini(struct lxc_handler *handler, int status)
+{
+	const char *name = handler->name;
+	int err;
 
 	/*
 	 * If the child process exited but was not signaled,
@@ -1073,16 +1114,35 @@ int __lxc_start(const char *name, struct lxc_conf *conf,
 	}
 
 	err =  lxc_error_set_and_log(handler->pid, status);
-out_fini:
 	lxc_delete_network(handler);
-
-out_fini_nonet:
 	lxc_fini(name, handler);
 	return err;
+}
 
-out_abort:
-	lxc_abort(name, handler);
-	goto out_fini;
+int __lxc_start(const char *name, struct lxc_conf *conf,
+		struct lxc_operations* ops, void *data, const char *lxcpath)
+{
+	struct lxc_handler *handler;
+	int err = -1;
+	int status;
+
+	handler = lxc_start_init(name, conf, ops, data, lxcpath, NULL);
+	if (!handler)
+		return -1;
+
+	err = lxc_poll(name, handler);
+	if (err) {
+		ERROR("mainloop exited with an error");
+		lxc_abort(name, handler);
+		lxc_delete_network(handler);
+		lxc_fini(name, handler);
+		return err;
+	}
+
+	while (waitpid(handler->pid, &status, 0) < 0 && errno == EINTR)
+		continue;
+
+	return lxc_start_fini(handler, status);
 }
 
 struct start_args {
@@ -1123,3 +1183,23 @@ int lxc_start(const char *name, char *const argv[], struct lxc_conf *conf,
 	conf->need_utmp_watch = 1;
 	return __lxc_start(name, conf, &start_ops, &start_arg, lxcpath);
 }
+
+struct lxc_handler *lxc_start_spawn(const char *name, char *const argv[],
+				    struct lxc_conf *conf, const char *lxcpath,
+				    const sigset_t *mask)
+{
+	struct start_args start_arg = {
+		.argv = argv,
+	};
+
+	struct lxc_handler *handler;
+
+	conf->need_utmp_watch = 1;
+	handler = lxc_start_init(name, conf, &start_ops, &start_arg, lxcpath,
+				 mask);
+	/* the operations only run while spawning, start_arg does not
+	 * outlive this call */
+	if (handler)
+		handler->data = NULL;
+	return handler;
+}
@@ -72,6 +72,7 @@ struct lxc_handler {
 	int pinfd;
 	const char *lxcpath;
 	void *cgroup_data;
+	int shared;
 };
 
 extern struct lxc_handler *lxc_init(const char *name, struct lxc_conf *, const char *);
@@ -80,5 +81,25 @@ extern int lxc_check_inherited(struct lxc_conf *conf, int fd_to_ignore);
 int __lxc_start(const char *, struct lxc_conf *, struct lxc_operations *,
 		void *, const char *);
 
+/*
+ * lxc_start() for a monitor process serving several containers (see
+ * supervisor.c): lxc_start_spawn() starts the container without a signal
+ * fd, @mask being the signal mask to give to init, the caller registers the
+ * console, command and utmp handlers with lxc_start_mainloop_add(), reaps
+ * init itself and hands its wait status to lxc_start_fini().
+ */
+struct lxc_epoll_descr;
+
+extern struct lxc_handler *lxc_start_spawn(const char *name,
+					   char *const argv[],
+					   struct lxc_conf *conf,
+					   const char *lxcpath,
+					   const sigset_t *mask);
+extern int lxc_start_mainloop_add(struct lxc_epoll_descr *descr,
+				  struct lxc_handler *handler);
+extern void lxc_start_mainloop_del(struct lxc_epoll_descr *descr,
+				   struct lxc_handler *handler);
+extern int lxc_start_fini(struct lxc_handler *handler, int status);
+
 #endif
 
@@ -0,0 +1,893 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "af_unix.h"
+#include "conf.h"
+#include "log.h"
+#include "lxccontainer.h"
+#include "mainloop.h"
+#include "start.h"
+#include "supervisor.h"
+#include "utils.h"
+
+lxc_log_define(lxc_supervisor, lxc);
+
+#define LXC_SUPERVISOR_IDLE_MS (30 * 1000)
+#define LXC_SUPERVISOR_EVENTS 256
+#define LXC_SUPERVISOR_DATA_MAX (64 * 1024)
+
+/* start request: datalen bytes of "name\0argv[0]\0argv[1]\0..." follow */
+struct lxc_supervisor_req {
+	int datalen;
+};
+
+enum {
+	LXC_SUPERVISOR_ADD,
+	LXC_SUPERVISOR_DEL,
+	LXC_SUPERVISOR_PAUSE,
+};
+
+struct lxc_supervised;
+
+struct lxc_supervisor_msg {
+	int op;
+	struct lxc_supervised *sc;
+};
+
+struct lxc_supervisor;
+
+/*
+ * A thread serving the mainloops of some of the containers
+ * @descr   : the loop the containers' loops are nested into
+ * @pipefd  : messages from the main thread
+ * @count   : number of containers served, only used by the main thread
+ */
+struct lxc_supervisor_worker {
+	struct lxc_supervisor *sup;
+	pthread_t thread;
+	struct lxc_epoll_descr descr;
+	int pipefd[2];
+	int count;
+};
+
+/*
+ * A container served by the supervisor. The handlers which lxc_poll() would
+ * run live in @descr, which is polled by the loop of @worker.
+ * @timer  : wakes @worker up when a timer of @descr is due
+ * @status : wait status of init once reaped
+ */
+struct lxc_supervised {
+	struct lxc_container *c;
+	struct lxc_handler *handler;
+	char **argv;
+	struct lxc_epoll_descr descr;
+	struct lxc_supervisor_worker *worker;
+	struct lxc_mainloop_timer *timer;
+	int attached;
+	int status;
+	struct lxc_list node;
+};
+
+/*
+ * Starting a container clones from a threaded process: workers are parked
+ * in lxc_supervisor_worker_msg() meanwhile so that the child does not
+ * inherit a lock held by one of them (malloc's for instance).
+ */
+struct lxc_supervisor {
+	const char *lxcpath;
+	char logpath[MAXPATHLEN];
+	int listenfd;
+	int sigfd;
+	int donefd[2];
+	sigset_t oldmask;
+	struct lxc_epoll_descr descr;
+	struct lxc_mainloop_timer *idle_timer;
+	struct lxc_list containers;
+	struct lxc_supervisor_worker *workers;
+	int nworkers;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int pause_gen;
+	int paused;
+};
+
+static int lxc_supervisor_sock_name(const char *lxcpath, char *path, size_t len)
+{
+	int ret;
+
+	/* abstract socket, path[0] is left to 0 */
+	memset(path, 0, len);
+	ret = snprintf(path + 1, len - 1, "%s/supervisor", lxcpath);
+	if (ret < 0 || ret >= len - 1) {
+		ERROR("lxcpath %s too long for supervisor socket", lxcpath);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void lxc_supervisor_pause(struct lxc_supervisor *sup)
+{
+	struct lxc_supervisor_msg msg = { .op = LXC_SUPERVISOR_PAUSE };
+	int i;
+
+	for (i = 0; i < sup->nworkers; i++)
+		if (write(sup->workers[i].pipefd[1], &msg, sizeof(msg)) != sizeof(msg))
+			SYSERROR("failed to pause worker %d", i);
+
+	pthread_mutex_lock(&sup->lock);
+	while (sup->paused < sup->nworkers)
+		pthread_cond_wait(&sup->cond, &sup->lock);
+	pthread_mutex_unlock(&sup->lock);
+}
+
+static void lxc_supervisor_resume(struct lxc_supervisor *sup)
+{
+	pthread_mutex_lock(&sup->lock);
+	sup->pause_gen++;
+	pthread_cond_broadcast(&sup->cond);
+	while (sup->paused > 0)
+		pthread_cond_wait(&sup->cond, &sup->lock);
+	pthread_mutex_unlock(&sup->lock);
+}
+
+static int lxc_supervised_dispatch(struct lxc_supervised *sc,
+				   struct lxc_epoll_descr *descr);
+
+static int lxc_supervised_timer(void *data, struct lxc_epoll_descr *descr)
+{
+	return lxc_supervised_dispatch(data, descr);
+}
+
+static int lxc_supervised_handler(int fd, uint32_t events, void *data,
+				  struct lxc_epoll_descr *descr)
+{
+	return lxc_supervised_dispatch(data, descr);
+}
+
+static void lxc_supervised_detach(struct lxc_supervised *sc,
+				  struct lxc_epoll_descr *descr)
+{
+	if (!sc->attached)
+		return;
+
+	lxc_mainloop_del_handler(descr, sc->descr.epfd);
+	lxc_mainloop_del_timer(descr, sc->timer);
+	sc->timer = NULL;
+	sc->attached = 0;
+}
+
+static int lxc_supervised_dispatch(struct lxc_supervised *sc,
+				   struct lxc_epoll_descr *descr)
+{
+	int ret, timeout;
+
+	ret = lxc_mainloop_once(&sc->descr);
+	if (ret) {
+		/* as when lxc_poll() returns, stop serving the container
+		 * and wait for its init to exit */
+		if (ret < 0)
+			ERROR("mainloop of '%s' failed", sc->c->name);
+		lxc_supervised_detach(sc, descr);
+		return 0;
+	}
+
+	timeout = lxc_mainloop_next_timeout(&sc->descr);
+	if (timeout < 0)
+		return 0;
+
+	if (!sc->timer) {
+		sc->timer = lxc_mainloop_add_timer(descr, timeout, 0,
+						   lxc_supervised_timer, sc);
+		if (!sc->timer)
+			ERROR("failed to add timer for '%s'", sc->c->name);
+		return 0;
+	}
+
+	lxc_mainloop_mod_timer(descr, sc->timer, timeout);
+	return 0;
+}
+
+static int lxc_supervisor_worker_msg(int fd, uint32_t events, void *data,
+				     struct lxc_epoll_descr *descr)
+{
+	struct lxc_supervisor_worker *worker = data;
+	struct lxc_supervisor *sup = worker->sup;
+	struct lxc_supervisor_msg msg;
+	struct lxc_supervised *sc;
+	int gen;
+
+	if (lxc_read_nointr(fd, &msg, sizeof(msg)) != sizeof(msg)) {
+		SYSERROR("failed to read supervisor message");
+		return 0;
+	}
+
+	sc = msg.sc;
+	switch (msg.op) {
+	case LXC_SUPERVISOR_ADD:
+		if (lxc_mainloop_add_handler(descr, sc->descr.epfd,
+					     lxc_supervised_handler, sc)) {
+			ERROR("failed to serve '%s'", sc->c->name);
+			break;
+		}
+		sc->attached = 1;
+		break;
+	case LXC_SUPERVISOR_DEL:
+		lxc_supervised_detach(sc, descr);
+		lxc_start_mainloop_del(&sc->descr, sc->handler);
+		lxc_mainloop_close(&sc->descr);
+		if (lxc_write_nointr(sup->donefd[1], &sc, sizeof(sc)) != sizeof(sc))
+			SYSERROR("failed to hand '%s' back", sc->c->name);
+		break;
+	case LXC_SUPERVISOR_PAUSE:
+		pthread_mutex_lock(&sup->lock);
+		gen = sup->pause_gen;
+		sup->paused++;
+		pthread_cond_broadcast(&sup->cond);
+		while (sup->pause_gen == gen)
+			pthread_cond_wait(&sup->cond, &sup->lock);
+		sup->paused--;
+		pthread_cond_broadcast(&sup->cond);
+		pthread_mutex_unlock(&sup->lock);
+		break;
+	}
+
+	return 0;
+}
+
+static void *lxc_supervisor_worker_main(void *arg)
+{
+	struct lxc_supervisor_worker *worker = arg;
+
+	/* the log fd is per thread */
+	lxc_log_init(NULL, worker->sup->logpath, "NOTICE", "lxc-supervisor",
+		     1, worker->sup->lxcpath);
+
+	if (lxc_mainloop(&worker->descr, -1))
+		ERROR("worker mainloop failed");
+
+	return NULL;
+}
+
+static int lxc_supervisor_workers_init(struct lxc_supervisor *sup)
+{
+	struct lxc_supervisor_worker *worker;
+	const char *value;
+	unsigned int n = 1;
+	int i;
+
+	value = lxc_global_config_value("lxc.monitor.threads");
+	if (value && (lxc_safe_uint(value, &n) < 0 || n == 0 || n > 1024)) {
+		WARN("invalid lxc.monitor.threads '%s', using one thread", value);
+		n = 1;
+	}
+	sup->nworkers = n;
+
+	sup->workers = malloc(sup->nworkers * sizeof(*sup->workers));
+	if (!sup->workers)
+		return -1;
+	memset(sup->workers, 0, sup->nworkers * sizeof(*sup->workers));
+
+	for (i = 0; i < sup->nworkers; i++) {
+		worker = &sup->workers[i];
+		worker->sup = sup;
+
+		if (pipe2(worker->pipefd, O_CLOEXEC)) {
+			SYSERROR("failed to create worker pipe");
+			return -1;
+		}
+
+		if (lxc_mainloop_open_size(&worker->descr, LXC_SUPERVISOR_EVENTS)) {
+			ERROR("failed to create worker mainloop");
+			return -1;
+		}
+
+		if (lxc_mainloop_add_handler(&worker->descr, worker->pipefd[0],
+					     lxc_supervisor_worker_msg, worker)) {
+			ERROR("failed to add worker pipe to mainloop");
+			return -1;
+		}
+
+		if (pthread_create(&worker->thread, NULL,
+				   lxc_supervisor_worker_main, worker)) {
+			ERROR("failed to create worker thread");
+			return -1;
+		}
+	}
+
+	INFO("started %d workers", sup->nworkers);
+	return 0;
+}
+
+static int lxc_supervisor_send(struct lxc_supervised *sc, int op)
+{
+	struct lxc_supervisor_msg msg = { .op = op, .sc = sc };
+
+	if (lxc_write_nointr(sc->worker->pipefd[1], &msg, sizeof(msg)) != sizeof(msg)) {
+		SYSERROR("failed to send message for '%s'", sc->c->name);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int lxc_supervisor_launch(struct lxc_supervisor *sup,
+				 struct lxc_supervised *sc)
+{
+	struct lxc_supervisor_worker *worker = NULL;
+	int i, status;
+
+	/* the supervisor's own descriptors and those of its other
+	 * containers must not reach this container's init */
+	sc->c->lxc_conf->close_all_fds = 1;
+
+	lxc_supervisor_pause(sup);
+	sc->handler = lxc_start_spawn(sc->c->name, sc->argv, sc->c->lxc_conf,
+				      sup->lxcpath, &sup->oldmask);
+	lxc_supervisor_resume(sup);
+	if (!sc->handler)
+		return -1;
+
+	if (lxc_mainloop_open(&sc->descr)) {
+		ERROR("failed to create mainloop for '%s'", sc->c->name);
+		goto out_kill;
+	}
+
+	if (lxc_start_mainloop_add(&sc->descr, sc->handler))
+		goto out_close;
+
+	for (i = 0; i < sup->nworkers; i++)
+		if (!worker || sup->workers[i].count < worker->count)
+			worker = &sup->workers[i];
+
+	sc->worker = worker;
+	if (lxc_supervisor_send(sc, LXC_SUPERVISOR_ADD)) {
+		sc->worker = NULL;
+		goto out_close;
+	}
+	worker->count++;
+
+	INFO("'%s' started with pid %d", sc->c->name, sc->handler->pid);
+	return 0;
+
+out_close:
+	lxc_start_mainloop_del(&sc->descr, sc->handler);
+	lxc_mainloop_close(&sc->descr);
+out_kill:
+	kill(sc->handler->pid, SIGKILL);
+	while (waitpid(sc->handler->pid, &status, 0) < 0 && errno == EINTR)
+		;
+	lxc_start_fini(sc->handler, status);
+	sc->handler = NULL;
+	return -1;
+}
+
+static void lxc_supervised_free(struct lxc_supervised *sc)
+{
+	char **p;
+
+	if (sc->argv) {
+		for (p = sc->argv; *p; p++)
+			free(*p);
+		free(sc->argv);
+	}
+
+	lxc_container_put(sc->c);
+	free(sc);
+}
+
+static void lxc_supervisor_finish(struct lxc_supervisor *sup,
+				  struct lxc_supervised *sc)
+{
+	struct lxc_conf *conf = sc->c->lxc_conf;
+
+	sc->worker->count--;
+	sc->worker = NULL;
+
+	lxc_start_fini(sc->handler, sc->status);
+	sc->handler = NULL;
+
+	if (conf->reboot) {
+		INFO("container requested reboot");
+		conf->reboot = 0;
+		if (!lxc_supervisor_launch(sup, sc))
+			return;
+	}
+
+	lxc_list_del(&sc->node);
+	lxc_supervised_free(sc);
+
+	if (lxc_list_empty(&sup->containers))
+		lxc_mainloop_mod_timer(&sup->descr, sup->idle_timer,
+				       LXC_SUPERVISOR_IDLE_MS);
+}
+
+static int lxc_supervisor_done_handler(int fd, uint32_t events, void *data,
+				       struct lxc_epoll_descr *descr)
+{
+	struct lxc_supervised *sc;
+
+	if (lxc_read_nointr(fd, &sc, sizeof(sc)) != sizeof(sc)) {
+		SYSERROR("failed to read from workers");
+		return 0;
+	}
+
+	lxc_supervisor_finish(data, sc);
+	return 0;
+}
+
+static struct lxc_supervised *lxc_supervisor_lookup_pid(struct lxc_supervisor *sup,
+							 pid_t pid)
+{
+	struct lxc_supervised *sc;
+	struct lxc_list *it;
+
+	lxc_list_for_each(it, &sup->containers) {
+		sc = it->elem;
+		if (sc->handler && sc->handler->pid == pid)
+			return sc;
+	}
+
+	return NULL;
+}
+
+static int lxc_supervisor_sig_handler(int fd, uint32_t events, void *data,
+				      struct lxc_epoll_descr *descr)
+{
+	struct lxc_supervisor *sup = data;
+	struct signalfd_siginfo siginfo;
+	struct lxc_supervised *sc;
+	int status;
+	pid_t pid;
+
+	if (lxc_read_nointr(fd, &siginfo, sizeof(siginfo)) != sizeof(siginfo)) {
+		ERROR("failed to read signal info");
+		return 0;
+	}
+
+	if (siginfo.ssi_signo != SIGCHLD) {
+		INFO("ignoring signal %d", siginfo.ssi_signo);
+		return 0;
+	}
+
+	/* SIGCHLDs coalesce, reap everything which exited */
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		sc = lxc_supervisor_lookup_pid(sup, pid);
+		if (!sc)
+			continue;
+
+		/* the worker detaches it and hands it back through donefd */
+		DEBUG("init of '%s' exited", sc->c->name);
+		sc->status = status;
+		lxc_supervisor_send(sc, LXC_SUPERVISOR_DEL);
+	}
+
+	return 0;
+}
+
+static int lxc_supervisor_start_container(struct lxc_supervisor *sup,
+					  char *data, int datalen)
+{
+	struct lxc_supervised *sc;
+	struct lxc_list *it;
+	char *name = data, *p;
+	int argc = 0, i;
+
+	if (datalen <= 0 || data[datalen - 1] != '\0')
+		return -EINVAL;
+
+	lxc_list_for_each(it, &sup->containers) {
+		sc = it->elem;
+		if (!strcmp(sc->c->name, name)) {
+			ERROR("'%s' is already running", name);
+			return -EBUSY;
+		}
+	}
+
+	for (p = name + strlen(name) + 1; p < data + datalen; p += strlen(p) + 1)
+		argc++;
+
+	sc = malloc(sizeof(*sc));
+	if (!sc)
+		return -ENOMEM;
+	memset(sc, 0, sizeof(*sc));
+	sc->node.elem = sc;
+
+	sc->argv = malloc((argc + 1) * sizeof(char *));
+	if (!sc->argv)
+		goto out_free;
+	memset(sc->argv, 0, (argc + 1) * sizeof(char *));
+
+	for (i = 0, p = name + strlen(name) + 1; i < argc; i++, p += strlen(p) + 1) {
+		sc->argv[i] = strdup(p);
+		if (!sc->argv[i])
+			goto out_free;
+	}
+
+	sc->c = lxc_container_new(name, sup->lxcpath);
+	if (!sc->c || !sc->c->is_defined(sc->c)) {
+		ERROR("failed to load container '%s'", name);
+		goto out_free;
+	}
+
+	lxc_list_add_tail(&sup->containers, &sc->node);
+	if (lxc_supervisor_launch(sup, sc)) {
+		ERROR("failed to start '%s'", name);
+		lxc_list_del(&sc->node);
+		goto out_free;
+	}
+
+	return 0;
+
+out_free:
+	lxc_supervised_free(sc);
+	return -1;
+}
+
+static int lxc_supervisor_accept(int fd, uint32_t events, void *data,
+				 struct lxc_epoll_descr *descr)
+{
+	struct lxc_supervisor *sup = data;
+	struct lxc_supervisor_req req;
+	struct timeval tv = { .tv_sec = 5 };
+	struct ucred cred;
+	socklen_t credsz = sizeof(cred);
+	char *reqdata = NULL;
+	int conn, ret = -1;
+
+	conn = accept(fd, NULL, 0);
+	if (conn < 0) {
+		SYSERROR("failed to accept connection");
+		return 0;
+	}
+
+	if (fcntl(conn, F_SETFD, FD_CLOEXEC)) {
+		SYSERROR("failed to set close-on-exec on incoming connection");
+		goto out_close;
+	}
+
+	if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &credsz)) {
+		ERROR("failed to get credentials on socket");
+		goto out_close;
+	}
+	if (cred.uid && cred.uid != geteuid()) {
+		WARN("start denied for uid:%d", cred.uid);
+		ret = -EACCES;
+		goto out_reply;
+	}
+
+	/* requests are served by the main thread, don't let a client stall it */
+	setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	if (recv(conn, &req, sizeof(req), MSG_WAITALL) != sizeof(req) ||
+	    req.datalen <= 0 || req.datalen > LXC_SUPERVISOR_DATA_MAX) {
+		ERROR("bad start request");
+		goto out_reply;
+	}
+
+	reqdata = malloc(req.datalen);
+	if (!reqdata)
+		goto out_reply;
+
+	if (recv(conn, reqdata, req.datalen, MSG_WAITALL) != req.datalen) {
+		ERROR("partial start request");
+		goto out_reply;
+	}
+
+	ret = lxc_supervisor_start_container(sup, reqdata, req.datalen);
+
+out_reply:
+	if (lxc_write_nointr(conn, &ret, sizeof(ret)) != sizeof(ret))
+		WARN("failed to answer start request");
+out_close:
+	free(reqdata);
+	close(conn);
+	return 0;
+}
+
+static int lxc_supervisor_idle(void *data, struct lxc_epoll_descr *descr)
+{
+	struct lxc_supervisor *sup = data;
+
+	/* rearmed when the last container goes away */
+	return lxc_list_empty(&sup->containers);
+}
+
+static void lxc_supervisor_close_fds(int fd_to_keep)
+{
+	struct dirent *direntp;
+	DIR *dir;
+	int fd;
+
+restart:
+	dir = opendir("/proc/self/fd");
+	if (!dir)
+		return;
+
+	while ((direntp = readdir(dir))) {
+		fd = atoi(direntp->d_name);
+		if (fd <= 2 || fd == fd_to_keep || fd == dirfd(dir))
+			continue;
+
+		close(fd);
+		closedir(dir);
+		goto restart;
+	}
+
+	closedir(dir);
+}
+
+int lxc_supervisor_main(const char *lxcpath, int syncfd)
+{
+	struct lxc_supervisor sup;
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	sigset_t mask;
+	int ret;
+
+	memset(&sup, 0, sizeof(sup));
+	sup.lxcpath = lxcpath;
+	lxc_list_init(&sup.containers);
+	pthread_mutex_init(&sup.lock, NULL);
+	pthread_cond_init(&sup.cond, NULL);
+
+	/* anything else the caller of lxc_supervisor_start() did not
+	 * mark close-on-exec would end up in the containers */
+	lxc_supervisor_close_fds(syncfd);
+	lxc_log_fd = -1;
+
+	ret = snprintf(sup.logpath, sizeof(sup.logpath),
+		       "%s/lxc-supervisor.log", lxcpath);
+	if (ret < 0 || ret >= sizeof(sup.logpath))
+		return EXIT_FAILURE;
+
+	if (lxc_log_init(NULL, sup.logpath, "NOTICE", "lxc-supervisor", 1,
+			 lxcpath))
+		INFO("Failed to open log file %s, log will be lost", sup.logpath);
+	lxc_log_options_no_override();
+
+	/* the workers inherit the mask, signals are read by the main
+	 * thread only */
+	if (sigfillset(&mask) ||
+	    sigdelset(&mask, SIGILL) ||
+	    sigdelset(&mask, SIGSEGV) ||
+	    sigdelset(&mask, SIGBUS) ||
+	    sigprocmask(SIG_BLOCK, &mask, &sup.oldmask)) {
+		SYSERROR("failed to set signal mask");
+		return EXIT_FAILURE;
+	}
+
+	sup.sigfd = signalfd(-1, &mask, 0);
+	if (sup.sigfd < 0 || fcntl(sup.sigfd, F_SETFD, FD_CLOEXEC)) {
+		SYSERROR("failed to create the signal fd");
+		return EXIT_FAILURE;
+	}
+
+	if (lxc_supervisor_sock_name(lxcpath, path, sizeof(path)))
+		return EXIT_FAILURE;
+
+	sup.listenfd = lxc_abstract_unix_open(path, SOCK_STREAM, 0);
+	if (sup.listenfd < 0) {
+		/* lost the race against another supervisor, which serves */
+		INFO("supervisor socket @%s busy, already running?", &path[1]);
+		if (lxc_write_nointr(syncfd, "S", 1) != 1)
+			WARN("failed to notify the spawner: %s", strerror(errno));
+		return EXIT_SUCCESS;
+	}
+
+	if (fcntl(sup.listenfd, F_SETFD, FD_CLOEXEC) ||
+	    pipe2(sup.donefd, O_CLOEXEC)) {
+		SYSERROR("failed to setup supervisor fds");
+		return EXIT_FAILURE;
+	}
+
+	if (lxc_mainloop_open(&sup.descr)) {
+		ERROR("failed to create mainloop");
+		return EXIT_FAILURE;
+	}
+
+	if (lxc_mainloop_add_handler(&sup.descr, sup.sigfd,
+				     lxc_supervisor_sig_handler, &sup) ||
+	    lxc_mainloop_add_handler(&sup.descr, sup.listenfd,
+				     lxc_supervisor_accept, &sup) ||
+	    lxc_mainloop_add_handler(&sup.descr, sup.donefd[0],
+				     lxc_supervisor_done_handler, &sup)) {
+		ERROR("failed to add mainloop handlers");
+		return EXIT_FAILURE;
+	}
+
+	sup.idle_timer = lxc_mainloop_add_timer(&sup.descr,
+						LXC_SUPERVISOR_IDLE_MS, 0,
+						lxc_supervisor_idle, &sup);
+	if (!sup.idle_timer) {
+		ERROR("failed to add idle timer");
+		return EXIT_FAILURE;
+	}
+
+	if (lxc_supervisor_workers_init(&sup))
+		return EXIT_FAILURE;
+
+	/* sync with lxc_supervisor_spawn() */
+	if (lxc_write_nointr(syncfd, "S", 1) != 1)
+		WARN("failed to notify the spawner: %s", strerror(errno));
+	close(syncfd);
+
+	NOTICE("supervising lxcpath %s", lxcpath);
+	ret = lxc_mainloop(&sup.descr, -1);
+
+	/* stop accepting before going away */
+	close(sup.listenfd);
+	NOTICE("no remaining containers, exiting");
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+#define LXC_SUPERVISOR_PATH LIBEXECDIR "/lxc/lxc-supervisor"
+
+static int lxc_supervisor_spawn(const char *lxcpath)
+{
+	pid_t pid1, pid2;
+	int pipefd[2];
+	char pipefd_str[11];
+	char c;
+
+	char * const args[] = {
+		LXC_SUPERVISOR_PATH,
+		(char *)lxcpath,
+		pipefd_str,
+		NULL,
+	};
+
+	/* double fork to get reparented by init, as lxc_monitord_spawn() */
+	pid1 = fork();
+	if (pid1 < 0) {
+		SYSERROR("failed to fork");
+		return -1;
+	}
+
+	if (pid1)
+		return wait_for_pid(pid1);
+
+	if (pipe(pipefd) < 0) {
+		SYSERROR("failed to create pipe");
+		exit(EXIT_FAILURE);
+	}
+
+	pid2 = fork();
+	if (pid2 < 0) {
+		SYSERROR("failed to fork");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pid2) {
+		/* wait for the supervisor to listen, it closes the pipe
+		 * without a word if it fails to start */
+		close(pipefd[1]);
+		if (lxc_read_nointr(pipefd[0], &c, 1) != 1) {
+			ERROR("%s did not start", LXC_SUPERVISOR_PATH);
+			exit(EXIT_FAILURE);
+		}
+		close(pipefd[0]);
+		exit(EXIT_SUCCESS);
+	}
+
+	if (setsid() < 0) {
+		SYSERROR("failed to setsid");
+		exit(EXIT_FAILURE);
+	}
+	if (chdir("/")) {
+		SYSERROR("failed to chdir to /");
+		exit(EXIT_FAILURE);
+	}
+	close(0);
+	close(1);
+	close(2);
+	open("/dev/null", O_RDONLY);
+	open("/dev/null", O_RDWR);
+	open("/dev/null", O_RDWR);
+	close(pipefd[0]);
+	sprintf(pipefd_str, "%d", pipefd[1]);
+	execvp(args[0], args);
+	exit(EXIT_FAILURE);
+}
+
+static int lxc_supervisor_connect(const char *lxcpath)
+{
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+	if (lxc_supervisor_sock_name(lxcpath, path, sizeof(path)))
+		return -1;
+
+	return lxc_abstract_unix_connect(path);
+}
+
+int lxc_supervisor_start(const char *name, const char *lxcpath,
+			 char *const argv[])
+{
+	struct lxc_supervisor_req req;
+	char *data, *p;
+	size_t len;
+	int i, fd, ret = -1;
+
+	len = strlen(name) + 1;
+	for (i = 0; argv[i]; i++)
+		len += strlen(argv[i]) + 1;
+
+	if (len > LXC_SUPERVISOR_DATA_MAX) {
+		ERROR("command line too long");
+		return -1;
+	}
+
+	data = malloc(len);
+	if (!data)
+		return -1;
+
+	p = data;
+	strcpy(p, name);
+	p += strlen(name) + 1;
+	for (i = 0; argv[i]; i++) {
+		strcpy(p, argv[i]);
+		p += strlen(argv[i]) + 1;
+	}
+
+	fd = lxc_supervisor_connect(lxcpath);
+	if (fd < 0) {
+		if (lxc_supervisor_spawn(lxcpath)) {
+			ERROR("failed to spawn the supervisor of %s", lxcpath);
+			goto out;
+		}
+		fd = lxc_supervisor_connect(lxcpath);
+		if (fd < 0) {
+			SYSERROR("failed to connect to the supervisor of %s",
+				 lxcpath);
+			goto out;
+		}
+	}
+
+	req.datalen = len;
+	if (lxc_write_nointr(fd, &req, sizeof(req)) != sizeof(req) ||
+	    lxc_write_nointr(fd, data, len) != len) {
+		SYSERROR("failed to send start request");
+		goto out_close;
+	}
+
+	if (lxc_read_nointr(fd, &ret, sizeof(ret)) != sizeof(ret)) {
+		ERROR("no answer from the supervisor of %s", lxcpath);
+		ret = -1;
+	}
+
+out_close:
+	close(fd);
+out:
+	free(data);
+	return ret;
+}
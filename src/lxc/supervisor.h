@@ -0,0 +1,44 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __lxc_supervisor_h
+#define __lxc_supervisor_h
+
+/*
+ * A supervisor is a monitor process shared by the containers of an lxcpath
+ * which set lxc.monitor.shared. It starts them, owns their command socket
+ * and console, reaps their init and drives their mainloops on a small pool
+ * of threads (lxc.monitor.threads).
+ */
+
+/*
+ * Start container @name of @lxcpath with @argv under the supervisor of
+ * @lxcpath, spawning the supervisor if it is not running.
+ * Returns 0 once the container is running, < 0 on error.
+ */
+extern int lxc_supervisor_start(const char *name, const char *lxcpath,
+				char *const argv[]);
+
+/*
+ * The supervisor of @lxcpath, run by lxc-supervisor, which
+ * lxc_supervisor_start() spawns.  Writes a byte to @syncfd once it
+ * accepts requests.  Returns the exit status.
+ */
+extern int lxc_supervisor_main(const char *lxcpath, int syncfd);
+
+#endif
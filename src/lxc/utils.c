@@ -24,6 +24,8 @@
 #include "config.h"
 
 #include <errno.h>
+#include <ctype.h>
+#include <limits.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stddef.h>
@@ -180,7 +182,7 @@ extern int get_u16(unsigned short *val, const char *arg, int base)
 	return 0;
 }
 
-extern int mkdir_p(const char *dir, mode_t mode)
+extern int mkdirat_p(int dirfd, const char *dir, mode_t mode)
 {
 	const char *tmp = dir;
 	const char *orig = dir;
@@ -190,8 +192,10 @@ extern int mkdir_p(const char *dir, mode_t mode)
 		dir = tmp + strspn(tmp, "/");
 		tmp = dir + strcspn(dir, "/");
 		makeme = strndup(orig, dir - orig);
+		if (!makeme)
+			return -1;
 		if (*makeme) {
-			if (mkdir(makeme, mode) && errno != EEXIST) {
+			if (mkdirat(dirfd, makeme, mode) && errno != EEXIST) {
 				SYSERROR("failed to create directory '%s'", makeme);
 				free(makeme);
 				return -1;
@@ -203,6 +207,11 @@ extern int mkdir_p(const char *dir, mode_t mode)
 	return 0;
 }
 
+extern int mkdir_p(const char *dir, mode_t mode)
+{
+	return mkdirat_p(AT_FDCWD, dir, mode);
+}
+
 extern void remove_trailing_slashes(char *p)
 {
 	int l = strlen(p);
@@ -231,6 +240,7 @@ static char *copy_global_config_value(char *p)
 #define DEFAULT_VG "lxc"
 #define DEFAULT_THIN_POOL "lxc"
 #define DEFAULT_ZFSROOT "lxc"
+#define DEFAULT_MONITOR_THREADS "4"
 
 const char *lxc_global_config_value(const char *option_name)
 {
@@ -242,6 +252,7 @@ const char *lxc_global_config_value(const char *option_name)
 		{ "lxc.default_config",     NULL            },
 		{ "lxc.cgroup.pattern",     DEFAULT_CGROUP_PATTERN },
 		{ "lxc.cgroup.use",         NULL            },
+		{ "lxc.monitor.threads",    DEFAULT_MONITOR_THREADS },
 		{ NULL, NULL },
 	};
 
@@ -1092,6 +1103,27 @@ int lxc_read_from_file(const char *filename, void* buf, size_t count)
 	return ret;
 }
 
+int lxc_safe_uint(const char *numstr, unsigned int *converted)
+{
+	unsigned long long uli;
+	char *err = NULL;
+
+	while (isspace((unsigned char)*numstr))
+		numstr++;
+	if (*numstr == '-')
+		return -ERANGE;
+
+	errno = 0;
+	uli = strtoull(numstr, &err, 10);
+	if (errno == ERANGE || uli > UINT_MAX)
+		return -ERANGE;
+	if (errno || err == numstr || *err != '\0')
+		return -EINVAL;
+
+	*converted = (unsigned int)uli;
+	return 0;
+}
+
 void **lxc_append_null_to_array(void **array, size_t count)
 {
 	void **temp;
@@ -1308,3 +1340,69 @@ next_loop:
 	free(path);
 	return false;
 }
+
+/* superblock magics, by offset in the device */
+static const struct fs_magic {
+	const char *fstype;
+	off_t offset;
+	const char *magic;
+	size_t len;
+} fs_magics[] = {
+	{ "xfs",      0,             "XFSB",             4 },
+	{ "squashfs", 0,             "hsqs",             4 },
+	{ "erofs",    1024,          "\xe2\xe1\xf5\xe0", 4 },
+	{ "f2fs",     1024,          "\x10\x20\xf5\xf2", 4 },
+	{ "jfs",      32768,         "JFS1",             4 },
+	{ "iso9660",  32769,         "CD001",            5 },
+	{ "btrfs",    65536 + 64,    "_BHRfS_M",         8 },
+};
+
+#define EXT_SB_OFFSET        1024
+#define EXT_MAGIC            0xEF53
+#define EXT3_COMPAT_JOURNAL  0x0004
+/* ro_compat and incompat features ext3 does not have */
+#define EXT4_RO_COMPAT_MASK  0x0478  /* huge_file, gdt_csum, dir_nlink,
+					extra_isize, metadata_csum */
+#define EXT4_INCOMPAT_MASK   0x02c0  /* extents, 64bit, flex_bg */
+
+static const char *ext_fstype(int fd)
+{
+	unsigned char sb[104];
+
+	if (pread(fd, sb, sizeof(sb), EXT_SB_OFFSET) != sizeof(sb))
+		return NULL;
+	/* s_magic, s_feature_compat, _incompat and _ro_compat, little endian */
+	if ((sb[56] | sb[57] << 8) != EXT_MAGIC)
+		return NULL;
+	if (((sb[96] | sb[97] << 8) & EXT4_INCOMPAT_MASK) ||
+	    ((sb[100] | sb[101] << 8) & EXT4_RO_COMPAT_MASK))
+		return "ext4";
+	if ((sb[92] | sb[93] << 8) & EXT3_COMPAT_JOURNAL)
+		return "ext3";
+	return "ext2";
+}
+
+const char *lxc_probe_fstype(const char *path)
+{
+	const char *fstype;
+	char buf[8];
+	int fd, i;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	fstype = ext_fstype(fd);
+	for (i = 0; !fstype && i < sizeof(fs_magics) / sizeof(fs_magics[0]); i++) {
+		const struct fs_magic *m = &fs_magics[i];
+
+		if (pread(fd, buf, m->len, m->offset) == m->len &&
+		    memcmp(buf, m->magic, m->len) == 0)
+			fstype = m->fstype;
+	}
+	close(fd);
+
+	if (fstype)
+		DEBUG("found a %s superblock on '%s'", fstype, path);
+	return fstype;
+}
@@ -38,6 +38,7 @@ extern int lxc_rmdir_onedev(char *path);
 extern void lxc_setup_fs(void);
 extern int get_u16(unsigned short *val, const char *arg, int base);
 extern int mkdir_p(const char *dir, mode_t mode);
+extern int mkdirat_p(int dirfd, const char *dir, mode_t mode);
 extern void remove_trailing_slashes(char *p);
 extern char *get_rundir(void);
 
@@ -223,6 +224,12 @@ extern int sha1sum_file(char *fnam, unsigned char *md_value);
 extern int lxc_write_to_file(const char *filename, const void* buf, size_t count, bool add_newline);
 extern int lxc_read_from_file(const char *filename, void* buf, size_t count);
 
+/*
+ * parse a whole decimal string into an unsigned int; returns 0, or
+ * -EINVAL if it is not a number and -ERANGE if it is negative or too big
+ */
+extern int lxc_safe_uint(const char *numstr, unsigned int *converted);
+
 /* convert variadic argument lists to arrays (for execl type argument lists) */
 extern char** lxc_va_arg_list_to_argv(va_list ap, size_t skip, int do_strdup);
 extern const char** lxc_va_arg_list_to_argv_const(va_list ap, size_t skip);
@@ -280,3 +287,9 @@ uint64_t fnv_64a_buf(void *buf, size_t len, uint64_t hval);
 int detect_shared_rootfs(void);
 int detect_ramfs_rootfs(void);
 bool on_path(char *cmd);
+
+/*
+ * The filesystem type of the device or image at path, from the magic of
+ * its superblock, or NULL if it is not one we know.
+ */
+const char *lxc_probe_fstype(const char *path);
@@ -0,0 +1,532 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Warm pool: booted, frozen snapshot clones of a template container,
+ * named $template-warm$N, ready to be thawed and handed off.
+ *
+ * A container is in the pool while $lxcpath/$name/warm exists; it is
+ * only created once the container is frozen.  Taking a container renames
+ * that file, so that of several concurrent takers only one wins it, and
+ * the winner records its pid in it.  While a container boots, the pid of
+ * the filler is in $lxcpath/$name/warm.starting.  A claim or boot whose
+ * process went away is cleaned up by the next fill.
+ * $lxcpath/$template/warmpool records the size of the pool and the boot
+ * wait for the refills, and its lock serializes them.  The lock is not
+ * held while a container starts, as the container's monitor would
+ * inherit it.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <lxc/lxccontainer.h>
+
+#include "lxc.h"
+#include "log.h"
+#include "utils.h"
+
+lxc_log_define(lxc_warmpool, lxc);
+
+#define WARM_MARKER  "warm"
+#define WARM_CLAIMED "warm.claimed"
+#define WARM_STARTING "warm.starting"
+#define WARM_STATE   "warmpool"
+
+/* how long a warm container may take to get to RUNNING */
+#define WARM_START_TIMEOUT 30
+
+/* how long a taker may take to record its pid in its claim */
+#define WARM_CLAIM_TIMEOUT 10
+
+static int warm_path(char *buf, size_t size, const char *lxcpath,
+		     const char *name, const char *file)
+{
+	int ret;
+
+	ret = snprintf(buf, size, "%s/%s/%s", lxcpath, name, file);
+	if (ret < 0 || ret >= size)
+		return -1;
+	return 0;
+}
+
+/* whether name is $tmpl-warm$N */
+static bool is_warm_name(const char *name, const char *tmpl)
+{
+	size_t len = strlen(tmpl);
+	const char *p;
+
+	if (strncmp(name, tmpl, len) || strncmp(name + len, "-warm", 5))
+		return false;
+	p = name + len + 5;
+	if (!*p)
+		return false;
+	return strspn(p, "0123456789") == strlen(p);
+}
+
+static bool is_warm(const char *lxcpath, const char *name)
+{
+	char path[MAXPATHLEN];
+
+	if (warm_path(path, MAXPATHLEN, lxcpath, name, WARM_MARKER) < 0)
+		return false;
+	return access(path, F_OK) == 0;
+}
+
+static int warm_mark(const char *lxcpath, const char *name, const char *tmpl)
+{
+	char path[MAXPATHLEN];
+	FILE *f;
+
+	if (warm_path(path, MAXPATHLEN, lxcpath, name, WARM_MARKER) < 0)
+		return -1;
+	f = fopen(path, "w");
+	if (!f || fprintf(f, "%s\n", tmpl) < 0 || fclose(f) != 0) {
+		SYSERROR("failed to write %s", path);
+		return -1;
+	}
+	return 0;
+}
+
+/* record our pid in file, which may already exist */
+static int warm_own(const char *lxcpath, const char *name, const char *file)
+{
+	char path[MAXPATHLEN];
+	int fd, ret;
+
+	if (warm_path(path, MAXPATHLEN, lxcpath, name, file) < 0)
+		return -1;
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		SYSERROR("failed to open %s", path);
+		return -1;
+	}
+	ret = dprintf(fd, "pid=%d\n", getpid()) < 0 ? -1 : 0;
+	close(fd);
+	return ret;
+}
+
+/*
+ * Whether the process which owns file is alive: 1 if so, 0 if it went
+ * away, -1 if there is no such file.  A file without a pid yet is given
+ * WARM_CLAIM_TIMEOUT seconds to get one.
+ */
+static int warm_owner_alive(const char *lxcpath, const char *name,
+			    const char *file)
+{
+	char path[MAXPATHLEN], buf[64];
+	struct stat st;
+	ssize_t len;
+	int fd, pid;
+
+	if (warm_path(path, MAXPATHLEN, lxcpath, name, file) < 0)
+		return -1;
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	len = read(fd, buf, sizeof(buf) - 1);
+	buf[len > 0 ? len : 0] = '\0';
+	if (sscanf(buf, "pid=%d", &pid) == 1 && pid > 0) {
+		close(fd);
+		return kill(pid, 0) == 0 || errno == EPERM;
+	}
+	/* rename() updates the ctime, so this is the time of the claim */
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return 1;
+	}
+	close(fd);
+	return time(NULL) - st.st_ctime <= WARM_CLAIM_TIMEOUT;
+}
+
+static void warm_discard(struct lxc_container *c)
+{
+	char path[MAXPATHLEN];
+
+	if (warm_path(path, MAXPATHLEN, c->config_path, c->name, WARM_CLAIMED) == 0)
+		unlink(path);
+	if (warm_path(path, MAXPATHLEN, c->config_path, c->name, WARM_STARTING) == 0)
+		unlink(path);
+	if (warm_path(path, MAXPATHLEN, c->config_path, c->name, WARM_MARKER) == 0)
+		unlink(path);
+	if (c->is_running(c))
+		c->stop(c);
+	if (!c->destroy(c))
+		ERROR("failed to destroy warm container %s", c->name);
+}
+
+/* open and lock the pool state of tmpl */
+static int warm_lock(const char *lxcpath, const char *tmpl)
+{
+	char path[MAXPATHLEN];
+	int fd;
+
+	if (warm_path(path, MAXPATHLEN, lxcpath, tmpl, WARM_STATE) < 0)
+		return -1;
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		SYSERROR("failed to open %s", path);
+		return -1;
+	}
+	if (flock(fd, LOCK_EX) < 0) {
+		SYSERROR("failed to lock %s", path);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Open and lock the pool state of tmpl.  If count >= 0, record count and
+ * boot_wait for the refills, else read them.
+ */
+static int warm_state_lock(const char *lxcpath, const char *tmpl,
+			   int *count, int *boot_wait)
+{
+	char buf[64];
+	ssize_t len;
+	int fd;
+
+	fd = warm_lock(lxcpath, tmpl);
+	if (fd < 0)
+		return -1;
+
+	if (*count >= 0) {
+		len = snprintf(buf, sizeof(buf), "%d %d\n", *count, *boot_wait);
+		if (ftruncate(fd, 0) < 0 || pwrite(fd, buf, len, 0) != len)
+			WARN("failed to record the warm pool size of %s", tmpl);
+		return fd;
+	}
+
+	len = pread(fd, buf, sizeof(buf) - 1, 0);
+	buf[len > 0 ? len : 0] = '\0';
+	if (sscanf(buf, "%d %d", count, boot_wait) != 2) {
+		*count = 0;
+		*boot_wait = 0;
+	}
+	return fd;
+}
+
+/*
+ * A container claimed by a taker which went away before thawing it goes
+ * back to the pool.  One it thawed was handed off, only the claim goes.
+ */
+static void warm_reclaim(struct lxc_container *c)
+{
+	char claimed[MAXPATHLEN], marker[MAXPATHLEN];
+	const char *state;
+
+	if (warm_path(claimed, MAXPATHLEN, c->config_path, c->name, WARM_CLAIMED) < 0 ||
+	    warm_path(marker, MAXPATHLEN, c->config_path, c->name, WARM_MARKER) < 0)
+		return;
+
+	state = c->state(c);
+	if (state && strcmp(state, "FROZEN") == 0) {
+		WARN("reclaiming warm container %s from a dead taker", c->name);
+		if (rename(claimed, marker) < 0)
+			WARN("failed to reclaim %s: %s", c->name, strerror(errno));
+		return;
+	}
+	unlink(claimed);
+}
+
+/*
+ * Count the warm containers of tmpl, and the ones being started by a
+ * live filler, discarding the ones which are not running any more and
+ * reclaiming stale claims.  Containers being taken are not counted.
+ */
+static int warm_count(const char *lxcpath, const char *tmpl)
+{
+	struct dirent *direntp;
+	DIR *dir;
+	int n = 0;
+
+	dir = opendir(lxcpath);
+	if (!dir)
+		return -1;
+	while ((direntp = readdir(dir))) {
+		struct lxc_container *c;
+		const char *name = direntp->d_name;
+		char path[MAXPATHLEN];
+		int starting;
+
+		if (!is_warm_name(name, tmpl))
+			continue;
+		if (warm_owner_alive(lxcpath, name, WARM_CLAIMED) == 0) {
+			c = lxc_container_new(name, lxcpath);
+			if (c) {
+				warm_reclaim(c);
+				lxc_container_put(c);
+			}
+		}
+
+		starting = warm_owner_alive(lxcpath, name, WARM_STARTING);
+		if (is_warm(lxcpath, name)) {
+			/* the filler went away right after marking it */
+			if (starting == 0 &&
+			    warm_path(path, MAXPATHLEN, lxcpath, name, WARM_STARTING) == 0)
+				unlink(path);
+			starting = -1;
+		} else if (starting != 0) {
+			/* being started, or taken */
+			if (starting == 1)
+				n++;
+			continue;
+		}
+
+		c = lxc_container_new(name, lxcpath);
+		if (!c)
+			continue;
+		if (starting == 0) {
+			WARN("warm container %s was left half started, replacing it", name);
+			warm_discard(c);
+		} else if (c->is_running(c)) {
+			n++;
+		} else {
+			WARN("warm container %s died, replacing it", c->name);
+			warm_discard(c);
+		}
+		lxc_container_put(c);
+	}
+	closedir(dir);
+	return n;
+}
+
+/*
+ * Clone, boot and freeze one warm container.  The clone is made under the
+ * pool state lock *fd, which is dropped while the container boots: its
+ * monitor is forked from us and would keep the lock held for as long as
+ * the container runs.
+ */
+static int warm_one(struct lxc_container *base, const char *name, int boot_wait,
+		    int *fd)
+{
+	struct lxc_container *c;
+	char path[MAXPATHLEN];
+	int ret = -1;
+
+	c = base->clone(base, name, base->config_path, LXC_CLONE_SNAPSHOT,
+			NULL, NULL, 0, NULL);
+	if (!c) {
+		ERROR("failed to clone %s into %s", base->name, name);
+		return -1;
+	}
+	if (warm_own(c->config_path, name, WARM_STARTING) < 0)
+		goto out;
+
+	close(*fd);
+	*fd = -1;
+
+	c->want_daemonize(c, true);
+	if (!c->start(c, 0, NULL) ||
+	    !c->wait(c, "RUNNING", WARM_START_TIMEOUT)) {
+		ERROR("failed to start warm container %s", name);
+		goto out;
+	}
+	if (boot_wait > 0)
+		sleep(boot_wait);
+
+	if (lxc_freeze(name, c->config_path) < 0) {
+		ERROR("failed to freeze warm container %s", name);
+		goto out;
+	}
+	if (warm_mark(c->config_path, name, base->name) < 0)
+		goto out;
+	if (warm_path(path, MAXPATHLEN, c->config_path, name, WARM_STARTING) == 0)
+		unlink(path);
+
+	INFO("warm container %s is ready", name);
+	ret = 0;
+out:
+	if (ret < 0)
+		warm_discard(c);
+	lxc_container_put(c);
+	if (*fd < 0)
+		*fd = warm_lock(base->config_path, base->name);
+	return *fd < 0 ? -1 : ret;
+}
+
+/* fill the pool of tmpl, *fd is its state lock, which may be retaken */
+static int warm_fill_locked(const char *lxcpath, const char *tmpl, int count,
+			    int boot_wait, int *fd)
+{
+	struct lxc_container *base;
+	char name[MAXPATHLEN];
+	int have, i, ret;
+
+	have = warm_count(lxcpath, tmpl);
+	if (have < 0)
+		return -1;
+	if (have >= count)
+		return have;
+
+	base = lxc_container_new(tmpl, lxcpath);
+	if (!base || !base->is_defined(base)) {
+		ERROR("template container %s is not defined", tmpl);
+		if (base)
+			lxc_container_put(base);
+		return -1;
+	}
+
+	for (i = 0; have < count; i++) {
+		struct lxc_container *c;
+		bool defined;
+
+		ret = snprintf(name, sizeof(name), "%s-warm%d", tmpl, i);
+		if (ret < 0 || ret >= sizeof(name))
+			break;
+
+		/* names still in use, warm or handed off */
+		c = lxc_container_new(name, lxcpath);
+		if (!c)
+			break;
+		defined = c->is_defined(c);
+		lxc_container_put(c);
+		if (defined)
+			continue;
+
+		if (warm_one(base, name, boot_wait, fd) < 0)
+			break;
+		have++;
+	}
+
+	lxc_container_put(base);
+	return have;
+}
+
+int lxc_warmpool_fill(const char *tmpl, const char *lxcpath, int count,
+		      int boot_wait)
+{
+	int fd, ret;
+
+	if (!tmpl || count < 0)
+		return -1;
+	if (!lxcpath)
+		lxcpath = lxc_global_config_value("lxc.lxcpath");
+
+	fd = warm_state_lock(lxcpath, tmpl, &count, &boot_wait);
+	if (fd < 0)
+		return -1;
+	ret = warm_fill_locked(lxcpath, tmpl, count, boot_wait, &fd);
+	if (fd >= 0)
+		close(fd);
+	return ret;
+}
+
+/* refill the pool of tmpl to its recorded size, in a detached process */
+static void warm_refill_background(const char *lxcpath, const char *tmpl)
+{
+	int count = -1, boot_wait = 0, fd;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0) {
+		SYSERROR("failed to fork to refill the warm pool of %s", tmpl);
+		return;
+	}
+	if (pid > 0) {
+		wait_for_pid(pid);
+		return;
+	}
+
+	/* the refill must outlive our caller */
+	if (setsid() < 0)
+		WARN("failed to create a new session");
+	pid = fork();
+	if (pid != 0)
+		_exit(pid < 0 ? 1 : 0);
+
+	fd = warm_state_lock(lxcpath, tmpl, &count, &boot_wait);
+	if (fd < 0)
+		_exit(1);
+	if (warm_fill_locked(lxcpath, tmpl, count, boot_wait, &fd) < count)
+		ERROR("failed to refill the warm pool of %s", tmpl);
+	if (fd >= 0)
+		close(fd);
+	_exit(0);
+}
+
+struct lxc_container *lxc_warmpool_take(const char *tmpl, const char *lxcpath,
+					bool refill)
+{
+	struct lxc_container *c = NULL;
+	struct dirent *direntp;
+	char marker[MAXPATHLEN], claimed[MAXPATHLEN], starting[MAXPATHLEN];
+	DIR *dir;
+
+	if (!tmpl)
+		return NULL;
+	if (!lxcpath)
+		lxcpath = lxc_global_config_value("lxc.lxcpath");
+
+	dir = opendir(lxcpath);
+	if (!dir) {
+		SYSERROR("failed to open %s", lxcpath);
+		return NULL;
+	}
+	while (!c && (direntp = readdir(dir))) {
+		if (!is_warm_name(direntp->d_name, tmpl))
+			continue;
+		if (warm_path(marker, MAXPATHLEN, lxcpath, direntp->d_name, WARM_MARKER) < 0 ||
+		    warm_path(claimed, MAXPATHLEN, lxcpath, direntp->d_name, WARM_CLAIMED) < 0 ||
+		    warm_path(starting, MAXPATHLEN, lxcpath, direntp->d_name, WARM_STARTING) < 0)
+			continue;
+		/* lost to a concurrent taker, or not warm */
+		if (rename(marker, claimed) < 0)
+			continue;
+		if (warm_own(lxcpath, direntp->d_name, WARM_CLAIMED) < 0)
+			WARN("failed to record the claim of %s", direntp->d_name);
+		/* in case its filler did not get to it */
+		unlink(starting);
+
+		c = lxc_container_new(direntp->d_name, lxcpath);
+		if (!c) {
+			unlink(claimed);
+			continue;
+		}
+		if (lxc_unfreeze(c->name, lxcpath) < 0) {
+			ERROR("failed to thaw warm container %s", c->name);
+			warm_discard(c);
+			lxc_container_put(c);
+			c = NULL;
+			continue;
+		}
+		unlink(claimed);
+		INFO("handed off warm container %s", c->name);
+	}
+	closedir(dir);
+
+	if (!c)
+		ERROR("no warm container of %s is ready", tmpl);
+	if (refill)
+		warm_refill_background(lxcpath, tmpl);
+	return c;
+}
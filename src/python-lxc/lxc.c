@@ -1724,12 +1724,175 @@ PyVarObject_HEAD_INIT(NULL, 0)
     Container_new,                  /* tp_new */
 };
 
+struct lxc_attach_fanout_payload {
+    PyObject **objs;
+    struct lxc_container **cs;
+    int count;
+    PyObject *callback;
+    PyObject *results;
+    int error;
+    PyObject *exc_type, *exc_value, *exc_tb;
+};
+
+/* called by lxc_attach_fanout's threads, which don't hold the GIL */
+static void lxc_attach_fanout_result(struct lxc_container *c,
+                                     const lxc_attach_result_t *result,
+                                     void *data)
+{
+    struct lxc_attach_fanout_payload *payload = data;
+    PyGILState_STATE gstate;
+    PyObject *item, *ret;
+    int i;
+
+    gstate = PyGILState_Ensure();
+
+    /* stop reporting after the first exception, it's raised at the end */
+    if (payload->error)
+        goto out;
+
+    for (i = 0; i < payload->count && payload->cs[i] != c; i++);
+
+    item = Py_BuildValue("(OiNN)", payload->objs[i], result->status,
+                         PyBytes_FromStringAndSize(result->out,
+                                                   result->out_len),
+                         PyBytes_FromStringAndSize(result->err,
+                                                   result->err_len));
+    if (!item)
+        goto error;
+
+    if (payload->callback) {
+        ret = PyObject_CallObject(payload->callback, item);
+        Py_XDECREF(ret);
+    } else {
+        ret = PyList_Append(payload->results, item) < 0 ? NULL : Py_None;
+    }
+    Py_DECREF(item);
+    if (!ret)
+        goto error;
+
+out:
+    PyGILState_Release(gstate);
+    return;
+
+error:
+    /* the exception belongs to this thread, keep it for the caller's */
+    payload->error = 1;
+    PyErr_Fetch(&payload->exc_type, &payload->exc_value, &payload->exc_tb);
+    PyGILState_Release(gstate);
+}
+
+static PyObject *
+LXC_attach_fanout(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    struct lxc_attach_fanout_payload payload = { NULL, NULL, 0, NULL, NULL, 0,
+                                                 NULL, NULL, NULL };
+    lxc_attach_options_t *options = NULL;
+    lxc_attach_command_t cmd = { NULL, NULL };
+    PyObject *containers = NULL, *command = NULL, *seq = NULL;
+    PyObject *ret = NULL;
+    int i, failed, workers = 0;
+
+    if (!PyArg_ParseTuple(args, "OO|iO", &containers, &command, &workers,
+                          &payload.callback))
+        return NULL;
+
+    if (payload.callback == Py_None)
+        payload.callback = NULL;
+    if (payload.callback && !PyCallable_Check(payload.callback)) {
+        PyErr_Format(PyExc_TypeError, "attach_fanout: object not callable");
+        return NULL;
+    }
+
+    seq = PySequence_Fast(containers, "attach_fanout: expected a sequence "
+                                      "of containers");
+    if (!seq)
+        return NULL;
+
+    payload.count = PySequence_Fast_GET_SIZE(seq);
+    payload.objs = PySequence_Fast_ITEMS(seq);
+    payload.cs = calloc(payload.count ? payload.count : 1,
+                        sizeof(*payload.cs));
+    if (!payload.cs) {
+        PyErr_SetNone(PyExc_MemoryError);
+        goto out;
+    }
+
+    for (i = 0; i < payload.count; i++) {
+        if (!PyObject_TypeCheck(payload.objs[i], &_lxc_ContainerType)) {
+            PyErr_Format(PyExc_TypeError, "attach_fanout: expected a "
+                                          "sequence of containers");
+            goto out;
+        }
+        payload.cs[i] = ((Container *)payload.objs[i])->container;
+    }
+
+    cmd.argv = convert_tuple_to_char_pointer_array(command);
+    if (!cmd.argv)
+        goto out;
+    if (!cmd.argv[0]) {
+        PyErr_Format(PyExc_ValueError, "attach_fanout: empty command");
+        goto out;
+    }
+    cmd.program = cmd.argv[0];
+
+    options = lxc_attach_parse_options(kwds);
+    if (!options)
+        goto out;
+
+    if (!payload.callback) {
+        payload.results = PyList_New(0);
+        if (!payload.results)
+            goto out;
+    }
+
+#if PY_VERSION_HEX < 0x03070000
+    PyEval_InitThreads();
+#endif
+
+    Py_BEGIN_ALLOW_THREADS
+    failed = lxc_attach_fanout(payload.cs, payload.count, options, &cmd,
+                               workers, lxc_attach_fanout_result, &payload);
+    Py_END_ALLOW_THREADS
+
+    if (payload.error) {
+        PyErr_Restore(payload.exc_type, payload.exc_value, payload.exc_tb);
+        goto out;
+    }
+
+    if (failed < 0) {
+        PyErr_SetString(PyExc_ValueError, "attach_fanout: invalid arguments");
+        goto out;
+    }
+
+    if (payload.results) {
+        ret = payload.results;
+        payload.results = NULL;
+    } else {
+        ret = PyLong_FromLong(failed);
+    }
+
+out:
+    Py_XDECREF(payload.results);
+    lxc_attach_free_options(options);
+    if (cmd.argv) {
+        for (i = 0; cmd.argv[i]; i++)
+            free(cmd.argv[i]);
+        free(cmd.argv);
+    }
+    free(payload.cs);
+    Py_DECREF(seq);
+    return ret;
+}
+
 static PyMethodDef LXC_methods[] = {
     {"arch_to_personality", (PyCFunction)LXC_arch_to_personality, METH_O,
      "Returns the process personality of the corresponding architecture"},
     {"attach_run_command", (PyCFunction)LXC_attach_run_command, METH_O,
      "Runs a command when attaching, to use as the run parameter for attach "
      "or attach_wait"},
+    {"attach_fanout", (PyCFunction)LXC_attach_fanout,
+     METH_VARARGS|METH_KEYWORDS,
+     "Runs a command in many containers concurrently"},
     {"attach_run_shell", (PyCFunction)LXC_attach_run_shell, METH_O,
      "Starts up a shell when attaching, to use as the run parameter for "
      "attach or attach_wait"},
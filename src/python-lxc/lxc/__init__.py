@@ -451,6 +451,26 @@ def attach_run_command(cmd):
         return _lxc.attach_run_command((cmd, [cmd]))
 
 
+def attach_fanout(containers, command, workers=0, callback=None, **kwargs):
+    """
+        Run a command in many containers concurrently
+
+        At most workers containers are attached to at once (0 for the
+        library default). The command's output is captured; with a
+        callback, it is called as callback(container, status, stdout,
+        stderr) as each container completes and the number of containers
+        in which the command could not be run is returned. Without one, a
+        list of (container, status, stdout, stderr) is returned.
+
+        The remaining keyword arguments are the attach options, as for
+        Container.attach_wait.
+    """
+    if isinstance(command, str):
+        command = [command]
+    return _lxc.attach_fanout(containers, list(command), workers, callback,
+                              **kwargs)
+
+
 def attach_run_shell():
     """
         Run a shell when attaching
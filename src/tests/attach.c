@@ -270,6 +270,117 @@ static int test_attach_cmd(struct lxc_container *ct)
 	return 0;
 }
 
+static int test_attach_session(struct lxc_container *ct, int helpers)
+{
+	int i, ret = -1;
+	const char *argv[] = {"cmp", "-s", "/sbin/init", "/bin/busybox", NULL};
+	lxc_attach_session_t *s;
+
+	TSTOUT("Testing attach session with %d helpers...\n", helpers);
+	s = lxc_attach_session_open(ct, NULL, helpers);
+	if (!s) {
+		TSTERR("attach session open failed");
+		return -1;
+	}
+
+	for (i = 0; i < 10; i++) {
+		ret = lxc_attach_session_run_wait(s, NULL, "cmp", argv);
+		if (ret != 0) {
+			TSTERR("attach session success command got bad return %d", ret);
+			ret = -1;
+			goto out;
+		}
+	}
+
+	argv[2] = "/etc/fstab";
+	ret = lxc_attach_session_run_wait(s, NULL, "cmp", argv);
+	if (ret <= 0) {
+		TSTERR("attach session failure command got bad return %d", ret);
+		ret = -1;
+		goto out;
+	}
+	ret = 0;
+
+out:
+	lxc_attach_session_close(s);
+	return ret;
+}
+
+static int test_attach_batch(struct lxc_container *ct)
+{
+	int ret = -1;
+	char *echo[] = {"echo", "hello", NULL};
+	char *fail[] = {"cmp", "-s", "/sbin/init", "/etc/fstab", NULL};
+	char *tr[] = {"tr", "a-z", "A-Z", NULL};
+	lxc_attach_command_t cmds[] = {
+		{ "echo", echo }, { "cmp", fail }, { "echo", echo },
+	};
+	lxc_attach_command_t pipeline[] = { { "echo", echo }, { "tr", tr } };
+	lxc_attach_result_t results[3];
+	lxc_attach_session_t *s;
+
+	TSTOUT("Testing attach command batches...\n");
+	s = lxc_attach_session_open(ct, NULL, 0);
+	if (!s) {
+		TSTERR("attach session open failed");
+		return -1;
+	}
+
+	ret = lxc_attach_session_run_batch(s, NULL, cmds, 3,
+					   LXC_ATTACH_BATCH_STOP_ON_ERROR, results);
+	if (ret != 2 || results[0].status != 0 || results[1].status <= 0 ||
+	    results[2].status != -1 || !results[0].out ||
+	    strcmp(results[0].out, "hello\n")) {
+		TSTERR("attach batch got bad results %d", ret);
+		lxc_attach_result_free(results, 3);
+		ret = -1;
+		goto out;
+	}
+	lxc_attach_result_free(results, 3);
+
+	ret = lxc_attach_session_run_batch(s, NULL, pipeline, 2,
+					   LXC_ATTACH_BATCH_PIPELINE, results);
+	if (ret != 2 || results[1].status != 0 || !results[1].out ||
+	    strcmp(results[1].out, "HELLO\n")) {
+		TSTERR("attach pipeline got bad results %d", ret);
+		lxc_attach_result_free(results, 2);
+		ret = -1;
+		goto out;
+	}
+	lxc_attach_result_free(results, 2);
+	ret = 0;
+
+out:
+	lxc_attach_session_close(s);
+	return ret;
+}
+
+static void test_attach_fanout_cb(struct lxc_container *c,
+				  const lxc_attach_result_t *result, void *data)
+{
+	int *ok = data;
+
+	if (result->status == 0 && result->out && !strcmp(result->out, "hello\n"))
+		(*ok)++;
+}
+
+static int test_attach_fanout(struct lxc_container *ct)
+{
+	char *echo[] = {"echo", "hello", NULL};
+	lxc_attach_command_t cmd = { "echo", echo };
+	struct lxc_container *cs[4] = { ct, ct, ct, ct };
+	int ret, ok = 0;
+
+	TSTOUT("Testing attach fan-out...\n");
+	ret = lxc_attach_fanout(cs, 4, NULL, &cmd, 2, test_attach_fanout_cb, &ok);
+	if (ret != 0 || ok != 4) {
+		TSTERR("attach fan-out got %d failures, %d good results", ret, ok);
+		return -1;
+	}
+
+	return 0;
+}
+
 /* test_ct_destroy: stop and destroy the test container
  *
  * @ct       : the container
@@ -357,6 +468,26 @@ static int test_attach(const char *lxcpath, const char *name, const char *templa
 		goto err2;
 	}
 
+	ret = test_attach_session(ct, 0);
+	if (ret == 0)
+		ret = test_attach_session(ct, 2);
+	if (ret < 0) {
+		TSTERR("attach session test failed");
+		goto err2;
+	}
+
+	ret = test_attach_batch(ct);
+	if (ret < 0) {
+		TSTERR("attach batch test failed");
+		goto err2;
+	}
+
+	ret = test_attach_fanout(ct);
+	if (ret < 0) {
+		TSTERR("attach fan-out test failed");
+		goto err2;
+	}
+
 	if (lsm_enabled()) {
 		ret = test_attach_lsm_cmd(ct);
 		if (ret < 0) {
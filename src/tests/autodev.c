@@ -0,0 +1,126 @@
+/* autodev.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "lxc/conf.h"
+#include "lxc/utils.h"
+
+/* the command has to exist on the host as well, see check_autodev() */
+#define COMMAND "/bin/sh"
+
+static char dir[] = "/tmp/lxc-autodev-XXXXXX";
+
+static int mkpath(const char *rel, const char *target)
+{
+	char path[4096];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/rootfs%s", dir, rel);
+	if (target) {
+		unlink(path);
+		return symlink(target, path);
+	}
+
+	fd = open(path, O_WRONLY | O_CREAT, 0755);
+	if (fd < 0)
+		return -1;
+	close(fd);
+	return 0;
+}
+
+static int check(struct lxc_conf *conf, int expect, int line)
+{
+	int ret;
+
+	ret = lxc_check_autodev(conf, COMMAND);
+	if (ret != expect) {
+		fprintf(stderr, "%d: lxc_check_autodev returned %d, expected %d\n",
+			line, ret, expect);
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct lxc_conf *conf = NULL;
+	char path[4096];
+	const char *dirs[] = { "rootfs", "rootfs/bin", "rootfs/lib",
+			       "rootfs/lib/systemd" };
+	int i, ret = 1;
+
+	if (!mkdtemp(dir)) {
+		fprintf(stderr, "%d: failed to create a temporary directory\n", __LINE__);
+		exit(1);
+	}
+
+	for (i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++) {
+		snprintf(path, sizeof(path), "%s/%s", dir, dirs[i]);
+		if (mkdir(path, 0755)) {
+			fprintf(stderr, "%d: failed to create %s\n", __LINE__, path);
+			goto out;
+		}
+	}
+
+	/* /bin/sh -> /bin/sh.real -> /lib/systemd/systemd */
+	if (mkpath("/lib/systemd/systemd", NULL) || mkpath("/bin/busybox", NULL) ||
+	    mkpath("/bin/sh.real", "/lib/systemd/systemd") ||
+	    mkpath(COMMAND, "/bin/sh.real")) {
+		fprintf(stderr, "%d: failed to populate the rootfs\n", __LINE__);
+		goto out;
+	}
+
+	conf = lxc_conf_init();
+	if (!conf) {
+		fprintf(stderr, "%d: failed to allocate a configuration\n", __LINE__);
+		goto out;
+	}
+	snprintf(path, sizeof(path), "%s/rootfs", dir);
+	conf->rootfs.mount = strdup(path);
+	if (!conf->rootfs.mount)
+		goto out;
+
+	if (check(conf, 1, __LINE__))
+		goto out;
+
+	/* retargeting a link further down the chain must be noticed */
+	if (mkpath("/bin/sh.real", "/bin/busybox")) {
+		fprintf(stderr, "%d: failed to retarget the link\n", __LINE__);
+		goto out;
+	}
+	if (check(conf, 0, __LINE__))
+		goto out;
+
+	/* and a change of the target itself */
+	if (mkpath("/bin/busybox", "/lib/systemd/systemd") || check(conf, 1, __LINE__))
+		goto out;
+	if (mkpath("/bin/busybox", "/bin/true") || check(conf, 0, __LINE__))
+		goto out;
+
+	printf("All autodev tests passed\n");
+	ret = 0;
+out:
+	if (conf)
+		lxc_conf_free(conf);
+	lxc_rmdir_onedev(dir);
+	exit(ret);
+}
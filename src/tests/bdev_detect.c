@@ -0,0 +1,153 @@
+/* bdev_detect.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <lxc/lxccontainer.h>
+#include "lxc/bdev.h"
+#include "lxc/lxczfs.h"
+#include "lxc/utils.h"
+
+/*
+ * The type of a rootfs, detected from its path, or taken from the
+ * recorded lxc.rootfs.backend as long as it still fits.  zfs is mocked:
+ * $dir/zfs is the mountpoint of a dataset, which is in mountinfo.
+ */
+
+static char dir[] = "/tmp/lxc-bdev-detect-XXXXXX";
+static int scans;
+
+static char *mock_dataset_of(const char *path, bool scan)
+{
+	size_t len = strlen(dir);
+
+	if (scan)
+		scans++;
+	if (strncmp(path, dir, len) || strcmp(path + len, "/zfs"))
+		return NULL;
+	return strdup("tank/lxc/zfs");
+}
+
+static const struct lxc_zfs_ops mock_ops = {
+	.name = "mock",
+	.dataset_of = mock_dataset_of,
+};
+
+/* src is detected as expect, or as nothing if expect is NULL */
+static int check_detect(const char *src, const char *expect, int line)
+{
+	struct bdev *bdev;
+	int ret = 0;
+
+	bdev = bdev_init(src, NULL, NULL);
+	if (!bdev != !expect || (bdev && strcmp(bdev->type, expect))) {
+		fprintf(stderr, "%d: %s was detected as %s, expected %s\n", line, src,
+			bdev ? bdev->type : "nothing", expect ? expect : "nothing");
+		ret = -1;
+	}
+	if (bdev)
+		bdev_put(bdev);
+	return ret;
+}
+
+/* the rootfs src recorded as backend is taken as expect, and recorded so */
+static int check_rootfs(const char *src, const char *backend, const char *expect,
+			int line)
+{
+	struct bdev *bdev;
+	char *recorded = backend ? strdup(backend) : NULL;
+	int ret = -1;
+
+	bdev = bdev_init_rootfs(src, NULL, NULL, &recorded);
+	if (!bdev || strcmp(bdev->type, expect) || !recorded ||
+	    strcmp(recorded, expect)) {
+		fprintf(stderr, "%d: %s recorded as %s was taken as %s and recorded as %s, "
+			"expected %s\n", line, src, backend ? backend : "nothing",
+			bdev ? bdev->type : "nothing", recorded ? recorded : "nothing",
+			expect);
+		goto out;
+	}
+	ret = 0;
+out:
+	if (bdev)
+		bdev_put(bdev);
+	free(recorded);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	char path[256], zfs[256], file[256], loop[256];
+	int fd, ret = 1;
+
+	if (!mkdtemp(dir)) {
+		fprintf(stderr, "%d: failed to create a temporary directory\n", __LINE__);
+		exit(1);
+	}
+	lxc_zfs_set_ops(&mock_ops);
+
+	snprintf(path, sizeof(path), "%s/rootfs", dir);
+	snprintf(zfs, sizeof(zfs), "%s/zfs", dir);
+	snprintf(file, sizeof(file), "%s/rootdev", dir);
+	snprintf(loop, sizeof(loop), "loop:%s", file);
+	fd = open(file, O_WRONLY | O_CREAT, 0644);
+	if (fd < 0 || mkdir(path, 0755) < 0 || mkdir(zfs, 0755) < 0) {
+		fprintf(stderr, "%d: failed to populate %s\n", __LINE__, dir);
+		if (fd >= 0)
+			close(fd);
+		goto out;
+	}
+	close(fd);
+
+	/* a directory, here not on zfs or btrfs, is a dir */
+	if (check_detect(path, "dir", __LINE__) || check_rootfs(path, NULL, "dir", __LINE__))
+		goto out;
+
+	/* a loop file is known by its prefix, a file without one is nothing */
+	if (check_detect(loop, "loop", __LINE__) || check_rootfs(loop, NULL, "loop", __LINE__) ||
+	    check_detect(file, NULL, __LINE__))
+		goto out;
+
+	/* a recorded type is taken if it still fits, else detected again */
+	if (check_rootfs(path, "dir", "dir", __LINE__) ||
+	    check_rootfs(loop, "loop", "loop", __LINE__) ||
+	    check_rootfs(path, "loop", "dir", __LINE__) ||
+	    check_rootfs(loop, "dir", "loop", __LINE__))
+		goto out;
+
+	/*
+	 * a directory is zfs only if a dataset is mounted on it, which is
+	 * looked up in mountinfo rather than with 'zfs list'
+	 */
+	if (check_rootfs(zfs, "zfs", "zfs", __LINE__) ||
+	    check_rootfs(path, "zfs", "dir", __LINE__))
+		goto out;
+	if (scans) {
+		fprintf(stderr, "%d: zfs was scanned %d times\n", __LINE__, scans);
+		goto out;
+	}
+
+	printf("All bdev detect tests passed\n");
+	ret = 0;
+out:
+	lxc_rmdir_onedev(dir);
+	exit(ret);
+}
@@ -0,0 +1,226 @@
+/* clone_async.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <lxc/lxccontainer.h>
+#include "lxc/utils.h"
+
+#define MAX_PHASES 16
+
+static char dir[] = "/tmp/lxc-clone-async-XXXXXX";
+static char lxcpath[256];
+
+struct phases {
+	pthread_mutex_t lock;
+	int phase[MAX_PHASES];
+	int n;
+};
+
+/* the phases the op went through, each once */
+static void record_phase(struct lxc_op *op, const struct lxc_op_progress *p,
+			 void *data)
+{
+	struct phases *ph = data;
+
+	pthread_mutex_lock(&ph->lock);
+	if ((ph->n == 0 || ph->phase[ph->n - 1] != p->phase) && ph->n < MAX_PHASES)
+		ph->phase[ph->n++] = p->phase;
+	pthread_mutex_unlock(&ph->lock);
+}
+
+static int check_phases(struct phases *ph, const int *expect, int n, int line)
+{
+	int i;
+
+	if (ph->n != n)
+		goto err;
+	for (i = 0; i < n; i++)
+		if (ph->phase[i] != expect[i])
+			goto err;
+	return 0;
+err:
+	fprintf(stderr, "%d: the op went through phases", line);
+	for (i = 0; i < ph->n; i++)
+		fprintf(stderr, " %d", ph->phase[i]);
+	fprintf(stderr, ", expected");
+	for (i = 0; i < n; i++)
+		fprintf(stderr, " %d", expect[i]);
+	fprintf(stderr, "\n");
+	return -1;
+}
+
+static int write_file(const char *path, const char *content, mode_t mode)
+{
+	int fd, ret;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, mode);
+	if (fd < 0)
+		return -1;
+	ret = write(fd, content, strlen(content)) == strlen(content) ? 0 : -1;
+	close(fd);
+	return ret;
+}
+
+static struct lxc_container *dir_container(const char *name)
+{
+	struct lxc_container *c;
+	char path[512];
+
+	snprintf(path, sizeof(path), "%s/%s/rootfs/etc", lxcpath, name);
+	if (mkdir_p(path, 0755) < 0)
+		return NULL;
+	snprintf(path, sizeof(path), "%s/%s/rootfs/etc/hostname", lxcpath, name);
+	if (write_file(path, name, 0644) < 0)
+		return NULL;
+	c = lxc_container_new(name, lxcpath);
+	if (!c)
+		return NULL;
+	snprintf(path, sizeof(path), "%s/%s/rootfs", lxcpath, name);
+	if (!c->set_config_item(c, "lxc.utsname", name) ||
+	    !c->set_config_item(c, "lxc.rootfs", path) ||
+	    !c->save_config(c, NULL)) {
+		lxc_container_put(c);
+		return NULL;
+	}
+	return c;
+}
+
+int main(int argc, char *argv[])
+{
+	struct lxc_container *c1 = NULL, *c2 = NULL;
+	struct lxc_op *op = NULL;
+	struct lxc_op_progress p;
+	struct lxc_op_callbacks cb;
+	struct phases ph;
+	const int done[] = { LXC_OP_STORAGE, LXC_OP_SETUP, LXC_OP_DONE };
+	const int cancelled[] = { LXC_OP_STORAGE, LXC_OP_CANCELLED };
+	char path[512], *oldpath;
+	int i, ret = 1;
+
+	if (geteuid() != 0) {
+		printf("Only root can clone without an id map, skipping the async clone tests\n");
+		exit(0);
+	}
+	if (!on_path("rsync")) {
+		printf("rsync is not available, skipping the async clone tests\n");
+		exit(0);
+	}
+	if (!mkdtemp(dir)) {
+		fprintf(stderr, "%d: failed to create a temporary directory\n", __LINE__);
+		exit(1);
+	}
+	snprintf(lxcpath, sizeof(lxcpath), "%s/lxc", dir);
+
+	c1 = dir_container("c1");
+	if (!c1) {
+		fprintf(stderr, "%d: failed to set up c1\n", __LINE__);
+		goto out;
+	}
+	pthread_mutex_init(&ph.lock, NULL);
+	memset(&cb, 0, sizeof(cb));
+	cb.progress = record_phase;
+	cb.data = &ph;
+
+	/* a clone goes through the storage and setup phases */
+	ph.n = 0;
+	op = lxc_clone_async(c1, "c2", NULL, 0, NULL, NULL, 0, NULL, &cb);
+	if (!op || !lxc_op_wait(op, 60)) {
+		fprintf(stderr, "%d: the clone of c1 did not finish\n", __LINE__);
+		goto out;
+	}
+	c2 = lxc_op_result(op);
+	if (!c2 || !c2->is_defined(c2)) {
+		fprintf(stderr, "%d: failed to clone c1\n", __LINE__);
+		goto out;
+	}
+	snprintf(path, sizeof(path), "%s/c2/rootfs/etc/hostname", lxcpath);
+	if (access(path, F_OK) || check_phases(&ph, done, 3, __LINE__))
+		goto out;
+	lxc_op_put(op);
+	op = NULL;
+
+	/* an rsync which never ends, for the clone to be cancelled while copying */
+	snprintf(path, sizeof(path), "%s/bin", dir);
+	if (mkdir(path, 0755) < 0) {
+		fprintf(stderr, "%d: failed to create %s\n", __LINE__, path);
+		goto out;
+	}
+	snprintf(path, sizeof(path), "%s/bin/rsync", dir);
+	if (write_file(path, "#!/bin/sh\nexec sleep 60\n", 0755) < 0) {
+		fprintf(stderr, "%d: failed to create %s\n", __LINE__, path);
+		goto out;
+	}
+	oldpath = getenv("PATH");
+	snprintf(path, sizeof(path), "%s/bin:%s", dir, oldpath ? oldpath : "/bin:/usr/bin");
+	setenv("PATH", path, 1);
+
+	ph.n = 0;
+	op = lxc_clone_async(c1, "c3", NULL, 0, NULL, NULL, 0, NULL, &cb);
+	if (!op) {
+		fprintf(stderr, "%d: failed to start the clone of c1\n", __LINE__);
+		goto out;
+	}
+	for (i = 0; i < 100; i++) {
+		lxc_op_get_progress(op, &p);
+		if (p.phase != LXC_OP_QUEUED)
+			break;
+		usleep(100000);
+	}
+	if (p.phase != LXC_OP_STORAGE) {
+		fprintf(stderr, "%d: the clone is in phase %d, expected %d\n",
+			__LINE__, p.phase, LXC_OP_STORAGE);
+		goto out;
+	}
+	/* give the rsync stand-in time to start */
+	usleep(200000);
+	if (!lxc_op_cancel(op) || !lxc_op_wait(op, 60)) {
+		fprintf(stderr, "%d: failed to cancel the clone\n", __LINE__);
+		goto out;
+	}
+	lxc_op_get_progress(op, &p);
+	if (p.phase != LXC_OP_CANCELLED || lxc_op_result(op) ||
+	    check_phases(&ph, cancelled, 2, __LINE__))
+		goto out;
+
+	/* the partial clone is gone, storage and all */
+	snprintf(path, sizeof(path), "%s/c3", lxcpath);
+	if (access(path, F_OK) == 0) {
+		fprintf(stderr, "%d: the cancelled clone left %s\n", __LINE__, path);
+		goto out;
+	}
+
+	printf("All async clone tests passed\n");
+	ret = 0;
+out:
+	if (op) {
+		lxc_op_cancel(op);
+		lxc_op_wait(op, 60);
+		lxc_op_put(op);
+	}
+	if (c2)
+		lxc_container_put(c2);
+	if (c1)
+		lxc_container_put(c1);
+	lxc_rmdir_onedev(dir);
+	exit(ret);
+}
@@ -22,6 +22,7 @@
 #include <lxc/lxccontainer.h>
 
 #include <errno.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
@@ -53,6 +54,38 @@ static void test_console_close_all(int ttyfd[MAXCONSOLES],
 	}
 }
 
+static int test_console_log(struct lxc_container *c)
+{
+	struct lxc_console_log log;
+	uint64_t len = 0;
+	int ret;
+
+	memset(&log, 0, sizeof(log));
+	log.read = true;
+	log.read_max = &len;
+	ret = c->console_log(c, &log);
+	if (ret < 0) {
+		TSTERR("console log read failed %d", ret);
+		return -1;
+	}
+	if (!log.data || strlen(log.data) != len) {
+		TSTERR("console log returned bad data");
+		free(log.data);
+		return -1;
+	}
+	free(log.data);
+
+	memset(&log, 0, sizeof(log));
+	log.clear = true;
+	ret = c->console_log(c, &log);
+	if (ret < 0) {
+		TSTERR("console log clear failed %d", ret);
+		return -1;
+	}
+
+	return 0;
+}
+
 static int test_console_running_container(struct lxc_container *c)
 {
 	int nrconsoles, i, ret = -1;
@@ -100,7 +133,7 @@ static int test_console_running_container(struct lxc_container *c)
 		}
 		test_console_close_all(ttyfd, masterfd);
 	}
-	ret = 0;
+	ret = test_console_log(c);
 
 err2:
 	test_console_close_all(ttyfd, masterfd);
@@ -146,6 +179,7 @@ static int test_console(const char *lxcpath,
 	}
 	c->load_config(c, NULL);
 	c->set_config_item(c, "lxc.tty", TTYCNT_STR);
+	c->set_config_item(c, "lxc.console.buffer_size", "64K");
 	c->save_config(c, NULL);
 	c->want_daemonize(c, true);
 	if (!c->startl(c, 0, NULL)) {
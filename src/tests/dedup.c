@@ -0,0 +1,212 @@
+/* dedup.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <lxc/lxccontainer.h>
+#include "lxc/conf.h"
+#include "lxc/dedup.h"
+#include "lxc/idshift.h"
+#include "lxc/utils.h"
+
+/*
+ * A dedup copy hardlinks the files under usr, bin... to their source or
+ * to an identical file of the index, and copies the others.  Shifting
+ * the ids of the copy must leave the files it shares alone.
+ */
+
+/* above the size under which files are not looked up */
+#define FILE_SIZE 4096
+
+static char dir[] = "/tmp/lxc-dedup-XXXXXX";
+
+static int write_file(const char *rel, char fill, size_t size)
+{
+	char path[256], buf[FILE_SIZE];
+	int fd, ret;
+
+	memset(buf, fill, sizeof(buf));
+	snprintf(path, sizeof(path), "%s/%s", dir, rel);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0755);
+	if (fd < 0)
+		return -1;
+	ret = write(fd, buf, size) == size ? 0 : -1;
+	close(fd);
+	return ret;
+}
+
+/* rel holds size bytes of fill, and has nlink links */
+static int check_file(const char *rel, char fill, size_t size, int nlink,
+		      uid_t uid, int line)
+{
+	char path[256], buf[FILE_SIZE + 1];
+	struct stat st;
+	ssize_t n;
+	int fd, i;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, rel);
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "%d: failed to open %s\n", line, path);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	n = read(fd, buf, sizeof(buf));
+	close(fd);
+	if (n != size) {
+		fprintf(stderr, "%d: %s holds %zd bytes, expected %zu\n", line, path, n, size);
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		if (buf[i] != fill) {
+			fprintf(stderr, "%d: %s differs at byte %d\n", line, path, i);
+			return -1;
+		}
+	}
+	if (st.st_nlink != nlink || st.st_uid != uid) {
+		fprintf(stderr, "%d: %s has %d links and owner %d, expected %d and %d\n",
+			line, path, (int)st.st_nlink, (int)st.st_uid, nlink, (int)uid);
+		return -1;
+	}
+	return 0;
+}
+
+static int same_inode(const char *rel1, const char *rel2)
+{
+	char path[256];
+	struct stat st1, st2;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, rel1);
+	if (stat(path, &st1) < 0)
+		return 0;
+	snprintf(path, sizeof(path), "%s/%s", dir, rel2);
+	if (stat(path, &st2) < 0)
+		return 0;
+	return st1.st_ino == st2.st_ino;
+}
+
+static int dedup(const char *to, struct lxc_dedup_stats *stats)
+{
+	char src[256], dest[256], lxcpath[256];
+
+	snprintf(src, sizeof(src), "%s/src", dir);
+	snprintf(dest, sizeof(dest), "%s/%s", dir, to);
+	snprintf(lxcpath, sizeof(lxcpath), "%s/lxc", dir);
+	if (mkdir(dest, 0755) < 0 || lxc_dedup_copy(src, dest, lxcpath, 2, stats) < 0) {
+		fprintf(stderr, "%d: failed to copy %s to %s\n", __LINE__, src, dest);
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct lxc_dedup_stats stats;
+	struct lxc_list map, its[2];
+	struct id_map maps[2];
+	char path[256], path2[256];
+	int i, ret = 1;
+
+	if (geteuid() != 0) {
+		printf("Only root can shift ids, skipping the dedup tests\n");
+		exit(0);
+	}
+	if (!mkdtemp(dir)) {
+		fprintf(stderr, "%d: failed to create a temporary directory\n", __LINE__);
+		exit(1);
+	}
+
+	snprintf(path, sizeof(path), "%s/src/usr/bin", dir);
+	if (mkdir_p(path, 0755) < 0) {
+		fprintf(stderr, "%d: failed to create %s\n", __LINE__, path);
+		goto out;
+	}
+	snprintf(path, sizeof(path), "%s/src/etc", dir);
+	if (mkdir_p(path, 0755) < 0 ||
+	    write_file("src/usr/bin/tool", 't', FILE_SIZE) < 0 ||
+	    write_file("src/usr/bin/small", 's', 16) < 0 ||
+	    write_file("src/etc/conf", 'c', FILE_SIZE) < 0) {
+		fprintf(stderr, "%d: failed to populate %s\n", __LINE__, dir);
+		goto out;
+	}
+
+	/* the large file under usr is linked to its source, the others copied */
+	if (dedup("c1", &stats))
+		goto out;
+	if (check_file("c1/usr/bin/tool", 't', FILE_SIZE, 2, 0, __LINE__) ||
+	    check_file("c1/usr/bin/small", 's', 16, 1, 0, __LINE__) ||
+	    check_file("c1/etc/conf", 'c', FILE_SIZE, 1, 0, __LINE__))
+		goto out;
+	if (!same_inode("src/usr/bin/tool", "c1/usr/bin/tool") || stats.files != 3 ||
+	    stats.linked != 1) {
+		fprintf(stderr, "%d: %llu of %llu files linked, expected 1 of 3\n", __LINE__,
+			(unsigned long long)stats.linked, (unsigned long long)stats.files);
+		goto out;
+	}
+
+	/* a second copy finds the file through the index */
+	if (dedup("c2", &stats))
+		goto out;
+	if (check_file("c2/usr/bin/tool", 't', FILE_SIZE, 3, 0, __LINE__) ||
+	    check_file("c2/etc/conf", 'c', FILE_SIZE, 1, 0, __LINE__) ||
+	    check_file("src/usr/bin/tool", 't', FILE_SIZE, 3, 0, __LINE__))
+		goto out;
+
+	/* and a link of c1's own, which the shift must keep */
+	snprintf(path, sizeof(path), "%s/c1/usr/bin/tool", dir);
+	snprintf(path2, sizeof(path2), "%s/c1/usr/bin/tool2", dir);
+	if (link(path, path2) < 0) {
+		fprintf(stderr, "%d: failed to link %s\n", __LINE__, path);
+		goto out;
+	}
+
+	/*
+	 * shifting c1 copies up the shared file, once for both of its links,
+	 * and the other containers keep their owner
+	 */
+	lxc_list_init(&map);
+	for (i = 0; i < 2; i++) {
+		maps[i].idtype = i ? ID_TYPE_GID : ID_TYPE_UID;
+		maps[i].nsid = 0;
+		maps[i].hostid = 100000;
+		maps[i].range = 65536;
+		its[i].elem = &maps[i];
+		lxc_list_add_tail(&map, &its[i]);
+	}
+	snprintf(path, sizeof(path), "%s/c1", dir);
+	if (lxc_idshift(path, NULL, &map, 2, NULL) < 0) {
+		fprintf(stderr, "%d: failed to shift %s\n", __LINE__, path);
+		goto out;
+	}
+	if (check_file("c1/usr/bin/tool", 't', FILE_SIZE, 2, 100000, __LINE__) ||
+	    !same_inode("c1/usr/bin/tool", "c1/usr/bin/tool2") ||
+	    check_file("c1/etc/conf", 'c', FILE_SIZE, 1, 100000, __LINE__) ||
+	    check_file("src/usr/bin/tool", 't', FILE_SIZE, 2, 0, __LINE__) ||
+	    check_file("c2/usr/bin/tool", 't', FILE_SIZE, 2, 0, __LINE__))
+		goto out;
+
+	printf("All dedup tests passed\n");
+	ret = 0;
+out:
+	lxc_rmdir_onedev(dir);
+	exit(ret);
+}
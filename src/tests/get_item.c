@@ -155,6 +155,73 @@ int main(int argc, char *argv[])
 	}
 	printf("lxc.aa_profile returned %d %s\n", ret, v2);
 
+	if (!c->set_config_item(c, "lxc.console.logfile", "/tmp/console.log")) {
+		fprintf(stderr, "%d: failed to set console.logfile\n", __LINE__);
+		ret = 1;
+		goto out;
+	}
+	ret = c->get_config_item(c, "lxc.console.logfile", v2, 255);
+	if (ret < 0 || strcmp(v2, "/tmp/console.log") != 0) {
+		fprintf(stderr, "%d: get_config_item(lxc.console.logfile) returned %d %s\n", __LINE__, ret, v2);
+		ret = 1;
+		goto out;
+	}
+
+	if (!c->set_config_item(c, "lxc.console.logsize", "1M")) {
+		fprintf(stderr, "%d: failed to set console.logsize\n", __LINE__);
+		ret = 1;
+		goto out;
+	}
+	ret = c->get_config_item(c, "lxc.console.logsize", v2, 255);
+	if (ret < 0 || strcmp(v2, "1048576") != 0) {
+		fprintf(stderr, "%d: get_config_item(lxc.console.logsize) returned %d %s\n", __LINE__, ret, v2);
+		ret = 1;
+		goto out;
+	}
+
+	if (!c->set_config_item(c, "lxc.console.rotate", "3")) {
+		fprintf(stderr, "%d: failed to set console.rotate\n", __LINE__);
+		ret = 1;
+		goto out;
+	}
+	ret = c->get_config_item(c, "lxc.console.rotate", v2, 255);
+	if (ret < 0 || strcmp(v2, "3") != 0) {
+		fprintf(stderr, "%d: get_config_item(lxc.console.rotate) returned %d %s\n", __LINE__, ret, v2);
+		ret = 1;
+		goto out;
+	}
+	if (c->set_config_item(c, "lxc.console.rotate", "-1") ||
+	    c->set_config_item(c, "lxc.console.rotate", "3x") ||
+	    c->set_config_item(c, "lxc.console.rotate", "abc")) {
+		fprintf(stderr, "%d: bad console.rotate values were accepted\n", __LINE__);
+		ret = 1;
+		goto out;
+	}
+	ret = c->get_config_item(c, "lxc.console.rotate", v2, 255);
+	if (ret < 0 || strcmp(v2, "3") != 0) {
+		fprintf(stderr, "%d: rejected console.rotate changed it to %s\n", __LINE__, v2);
+		ret = 1;
+		goto out;
+	}
+
+	if (!c->set_config_item(c, "lxc.console.buffer_size", "64K")) {
+		fprintf(stderr, "%d: failed to set console.buffer_size\n", __LINE__);
+		ret = 1;
+		goto out;
+	}
+	ret = c->get_config_item(c, "lxc.console.buffer_size", v2, 255);
+	if (ret < 0 || strcmp(v2, "65536") != 0) {
+		fprintf(stderr, "%d: get_config_item(lxc.console.buffer_size) returned %d %s\n", __LINE__, ret, v2);
+		ret = 1;
+		goto out;
+	}
+	if (c->set_config_item(c, "lxc.console.buffer_size", "1G")) {
+		fprintf(stderr, "%d: oversized console.buffer_size was accepted\n", __LINE__);
+		ret = 1;
+		goto out;
+	}
+	printf("lxc.console keys passed\n");
+
 	lxc_container_put(c);
 
 	// new test with real container
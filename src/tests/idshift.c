@@ -0,0 +1,273 @@
+/* idshift.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include <lxc/lxccontainer.h>
+#include "lxc/conf.h"
+#include "lxc/idshift.h"
+#include "lxc/utils.h"
+
+#define XATTR_ACL_ACCESS "system.posix_acl_access"
+
+/* more entries than fit the 4096 bytes the ACLs used to be read into */
+#define BIG_ACL_USERS 600
+
+struct acl_entry {
+	uint16_t tag;
+	uint16_t perm;
+	uint32_t id;
+};
+
+static char dir[] = "/tmp/lxc-idshift-XXXXXX";
+
+static int mkfile(const char *rel, uid_t uid, gid_t gid, mode_t mode)
+{
+	char path[4096];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, rel);
+	fd = open(path, O_WRONLY | O_CREAT, mode);
+	if (fd < 0 || fchown(fd, uid, gid) < 0 || fchmod(fd, mode) < 0) {
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+static int check_owner(const char *rel, uid_t uid, gid_t gid, int line)
+{
+	char path[4096];
+	struct stat st;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, rel);
+	if (lstat(path, &st) < 0 || st.st_uid != uid || st.st_gid != gid) {
+		fprintf(stderr, "%d: %s is owned by %d:%d, expected %d:%d\n", line,
+			path, (int)st.st_uid, (int)st.st_gid, (int)uid, (int)gid);
+		return -1;
+	}
+	return 0;
+}
+
+/* an access ACL with users first..first+nusers-1 */
+static int set_acl(const char *rel, uint32_t first, int nusers)
+{
+	char path[4096];
+	size_t len = 4 + (nusers + 4) * sizeof(struct acl_entry);
+	struct acl_entry *e;
+	char *buf;
+	int i, n = 0, ret;
+
+	buf = calloc(1, len);
+	if (!buf)
+		return -1;
+	*(uint32_t *)buf = htole32(2);
+	e = (struct acl_entry *)(buf + 4);
+	e[n].tag = htole16(0x01); e[n].perm = htole16(6); e[n++].id = htole32(-1);
+	for (i = 0; i < nusers; i++) {
+		e[n].tag = htole16(0x02);
+		e[n].perm = htole16(4);
+		e[n++].id = htole32(first + i);
+	}
+	e[n].tag = htole16(0x04); e[n].perm = htole16(4); e[n++].id = htole32(-1);
+	e[n].tag = htole16(0x10); e[n].perm = htole16(4); e[n++].id = htole32(-1);
+	e[n].tag = htole16(0x20); e[n].perm = htole16(4); e[n++].id = htole32(-1);
+
+	snprintf(path, sizeof(path), "%s/%s", dir, rel);
+	ret = setxattr(path, XATTR_ACL_ACCESS, buf, len, 0);
+	free(buf);
+	return ret;
+}
+
+static int check_acl(const char *rel, uint32_t first, int nusers, int line)
+{
+	char path[4096];
+	struct acl_entry *e;
+	ssize_t len;
+	char *buf;
+	int i, ret = -1;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, rel);
+	len = getxattr(path, XATTR_ACL_ACCESS, NULL, 0);
+	buf = len > 0 ? malloc(len) : NULL;
+	if (!buf || getxattr(path, XATTR_ACL_ACCESS, buf, len) != len) {
+		fprintf(stderr, "%d: failed to read the ACL of %s\n", line, path);
+		goto out;
+	}
+	e = (struct acl_entry *)(buf + 4);
+	for (i = 0; i < nusers; i++) {
+		if (le32toh(e[i + 1].id) != first + i) {
+			fprintf(stderr, "%d: ACL entry %d of %s is %u, expected %u\n",
+				line, i, path, le32toh(e[i + 1].id), first + i);
+			goto out;
+		}
+	}
+	ret = 0;
+out:
+	free(buf);
+	return ret;
+}
+
+static void add_map(struct lxc_list *list, struct lxc_list *it,
+		    struct id_map *map, enum idtype type)
+{
+	map->idtype = type;
+	map->nsid = 0;
+	map->hostid = 1000;
+	map->range = 200000;
+	it->elem = map;
+	lxc_list_add_tail(list, it);
+}
+
+/* the lower layer of an overlay is shared, it must not be shifted */
+static int test_overlay(void)
+{
+	struct lxc_container *c;
+	char path[4096];
+	int ret = -1;
+
+	c = lxc_container_new("lxc-test-idshift", dir);
+	if (!c) {
+		fprintf(stderr, "%d: failed to create a container object\n", __LINE__);
+		return -1;
+	}
+	snprintf(path, sizeof(path), "overlayfs:%s/lower:%s/upper", dir, dir);
+	if (!c->set_config_item(c, "lxc.rootfs", path)) {
+		fprintf(stderr, "%d: failed to set the rootfs\n", __LINE__);
+		goto out;
+	}
+	if (lxc_shift_rootfs(c, NULL, 1, NULL)) {
+		fprintf(stderr, "%d: an overlay rootfs was shifted\n", __LINE__);
+		goto out;
+	}
+	ret = 0;
+out:
+	lxc_container_put(c);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	struct lxc_list map;
+	struct lxc_list its[2];
+	struct id_map maps[2];
+	struct lxc_shift_stats stats;
+	char path[4096], target[4096];
+	struct stat st1, st2;
+	bool acls = true, big_acl = true;
+	int ret = 1;
+
+	if (geteuid() != 0) {
+		printf("Only root can shift ids, skipping the idshift tests\n");
+		exit(0);
+	}
+	if (!mkdtemp(dir)) {
+		fprintf(stderr, "%d: failed to create a temporary directory\n", __LINE__);
+		exit(1);
+	}
+
+	/* every id N is shifted to N + 1000 */
+	lxc_list_init(&map);
+	add_map(&map, &its[0], &maps[0], ID_TYPE_UID);
+	add_map(&map, &its[1], &maps[1], ID_TYPE_GID);
+
+	snprintf(path, sizeof(path), "%s/sub", dir);
+	snprintf(target, sizeof(target), "%s/sub/suid", dir);
+	if (mkdir(path, 0755) || mkfile("sub/root", 0, 0, 0644) ||
+	    mkfile("sub/suid", 1000, 1000, 04755)) {
+		fprintf(stderr, "%d: failed to populate %s\n", __LINE__, dir);
+		goto out;
+	}
+	snprintf(path, sizeof(path), "%s/link", dir);
+	if (link(target, path)) {
+		fprintf(stderr, "%d: failed to link %s\n", __LINE__, target);
+		goto out;
+	}
+	snprintf(path, sizeof(path), "%s/symlink", dir);
+	if (symlink("sub/root", path) || lchown(path, 5, 5)) {
+		fprintf(stderr, "%d: failed to create %s\n", __LINE__, path);
+		goto out;
+	}
+	if (set_acl("sub/root", 1000, 1) < 0) {
+		printf("%s does not support ACLs, not testing them\n", dir);
+		acls = false;
+	}
+	if (!acls || set_acl("sub/suid", 2000, BIG_ACL_USERS) < 0)
+		big_acl = false;
+
+	if (lxc_idshift(dir, NULL, &map, 2, &stats)) {
+		fprintf(stderr, "%d: failed to shift %s\n", __LINE__, dir);
+		goto out;
+	}
+
+	/* the hard link is shifted once */
+	if (check_owner(".", 1000, 1000, __LINE__) ||
+	    check_owner("sub/root", 1000, 1000, __LINE__) ||
+	    check_owner("sub/suid", 2000, 2000, __LINE__) ||
+	    check_owner("link", 2000, 2000, __LINE__) ||
+	    check_owner("symlink", 1005, 1005, __LINE__))
+		goto out;
+	if (stats.inodes != 5 || stats.changed != 5) {
+		fprintf(stderr, "%d: %llu of %llu inodes shifted, expected 5 of 5\n", __LINE__,
+			(unsigned long long)stats.changed, (unsigned long long)stats.inodes);
+		goto out;
+	}
+
+	/* chown cleared the setuid bit, it must have been restored */
+	snprintf(path, sizeof(path), "%s/link", dir);
+	if (stat(target, &st1) || stat(path, &st2) || st1.st_ino != st2.st_ino ||
+	    (st1.st_mode & 07777) != 04755) {
+		fprintf(stderr, "%d: %s lost its mode or link\n", __LINE__, target);
+		goto out;
+	}
+
+	if (acls && check_acl("sub/root", 2000, 1, __LINE__))
+		goto out;
+	if (big_acl && check_acl("sub/suid", 3000, BIG_ACL_USERS, __LINE__))
+		goto out;
+
+	/* and back */
+	if (lxc_idshift(dir, &map, NULL, 1, &stats)) {
+		fprintf(stderr, "%d: failed to shift %s back\n", __LINE__, dir);
+		goto out;
+	}
+	if (check_owner("sub/root", 0, 0, __LINE__) ||
+	    check_owner("sub/suid", 1000, 1000, __LINE__) ||
+	    check_owner("symlink", 5, 5, __LINE__))
+		goto out;
+	if (acls && check_acl("sub/root", 1000, 1, __LINE__))
+		goto out;
+
+	if (test_overlay())
+		goto out;
+
+	printf("All idshift tests passed\n");
+	ret = 0;
+out:
+	lxc_rmdir_onedev(dir);
+	exit(ret);
+}
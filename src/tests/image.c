@@ -0,0 +1,238 @@
+/* image.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+
+#include <lxc/lxccontainer.h>
+#include "lxc/bdev.h"
+#include "lxc/conf.h"
+#include "lxc/utils.h"
+
+/*
+ * The image backing store: an image built from a directory, mounted
+ * under an overlay, and shared by its clones through hard links.
+ */
+
+static char dir[] = "/tmp/lxc-image-XXXXXX";
+static char lxcpath[256];
+
+static int write_file(const char *path, const char *content)
+{
+	int fd, ret;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+	ret = write(fd, content, strlen(content)) == strlen(content) ? 0 : -1;
+	close(fd);
+	return ret;
+}
+
+static int check_file(const char *path, const char *content, int line)
+{
+	char buf[64];
+	ssize_t n;
+	int fd;
+
+	memset(buf, 0, sizeof(buf));
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%d: failed to open %s\n", line, path);
+		return -1;
+	}
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n < 0 || strcmp(buf, content) != 0) {
+		fprintf(stderr, "%d: %s holds '%s', expected '%s'\n", line, path, buf, content);
+		return -1;
+	}
+	return 0;
+}
+
+/* the link count of the image of container name, 0 if it has none */
+static int image_links(const char *name)
+{
+	char path[512];
+	struct stat st;
+
+	snprintf(path, sizeof(path), "%s/%s/rootfs.img", lxcpath, name);
+	if (stat(path, &st) < 0)
+		return 0;
+	return st.st_nlink;
+}
+
+static int check_links(const char *name, int expect, int line)
+{
+	int n = image_links(name);
+
+	if (n != expect) {
+		fprintf(stderr, "%d: the image of %s has %d links, expected %d\n",
+			line, name, n, expect);
+		return -1;
+	}
+	return 0;
+}
+
+/* the image is the lower layer, writes go to the upper dir */
+static int test_mount(struct lxc_container *c)
+{
+	struct bdev *bdev;
+	char path[512];
+	int ret = -1;
+
+	bdev = bdev_init(c->lxc_conf->rootfs.path, c->lxc_conf->rootfs.mount, NULL);
+	if (!bdev || strcmp(bdev->type, "image")) {
+		fprintf(stderr, "%d: failed to set up the image bdev\n", __LINE__);
+		goto out;
+	}
+	if (c->lxc_conf->rootfs.fstype &&
+	    !(bdev->fstype = strdup(c->lxc_conf->rootfs.fstype)))
+		goto out;
+	if (bdev->ops->mount(bdev) < 0) {
+		fprintf(stderr, "%d: failed to mount %s\n", __LINE__, bdev->src);
+		goto out;
+	}
+	snprintf(path, sizeof(path), "%s/hello", bdev->dest);
+	if (check_file(path, "hello", __LINE__))
+		goto out_umount;
+	snprintf(path, sizeof(path), "%s/written", bdev->dest);
+	if (write_file(path, "written") < 0) {
+		fprintf(stderr, "%d: failed to write to %s\n", __LINE__, bdev->dest);
+		goto out_umount;
+	}
+	ret = 0;
+out_umount:
+	if (bdev->ops->umount(bdev) < 0) {
+		fprintf(stderr, "%d: failed to unmount %s\n", __LINE__, bdev->dest);
+		ret = -1;
+	}
+	if (ret == 0) {
+		snprintf(path, sizeof(path), "%s/%s/delta0/written", lxcpath, c->name);
+		ret = check_file(path, "written", __LINE__);
+	}
+out:
+	if (bdev)
+		bdev_put(bdev);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	struct lxc_container *c1 = NULL, *c2 = NULL;
+	struct bdev *bdev = NULL;
+	struct bdev_specs specs;
+	char src[256], path[512];
+	pid_t pid;
+	int rdep, ret = 1;
+
+	if (geteuid() != 0) {
+		printf("Only root can create image containers, skipping the image tests\n");
+		exit(0);
+	}
+	if (!on_path("mksquashfs")) {
+		printf("mksquashfs is not available, skipping the image tests\n");
+		exit(0);
+	}
+	if (!mkdtemp(dir)) {
+		fprintf(stderr, "%d: failed to create a temporary directory\n", __LINE__);
+		exit(1);
+	}
+	snprintf(lxcpath, sizeof(lxcpath), "%s/lxc", dir);
+	snprintf(src, sizeof(src), "%s/src", dir);
+	snprintf(path, sizeof(path), "%s/hello", src);
+	if (mkdir_p(lxcpath, 0755) < 0 || mkdir_p(src, 0755) < 0 ||
+	    write_file(path, "hello") < 0) {
+		fprintf(stderr, "%d: failed to populate %s\n", __LINE__, dir);
+		goto out;
+	}
+
+	/* create builds the image from the directory */
+	memset(&specs, 0, sizeof(specs));
+	specs.dir = src;
+	c1 = lxc_container_new("c1", lxcpath);
+	if (!c1 || !c1->set_config_item(c1, "lxc.utsname", "c1") ||
+	    !c1->create(c1, NULL, "image", &specs, 0, NULL)) {
+		fprintf(stderr, "%d: failed to create c1\n", __LINE__);
+		goto out;
+	}
+	if (strncmp(c1->lxc_conf->rootfs.path, "image:", 6) ||
+	    check_links("c1", 1, __LINE__))
+		goto out;
+
+	/* mounted in a private mount namespace, which goes away with the child */
+	pid = fork();
+	if (pid < 0)
+		goto out;
+	if (pid == 0) {
+		if (unshare(CLONE_NEWNS) || mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL)) {
+			fprintf(stderr, "can not unshare the mount namespace, skipping the mount tests\n");
+			_exit(0);
+		}
+		_exit(test_mount(c1) ? 1 : 0);
+	}
+	if (wait_for_pid(pid))
+		goto out;
+
+	/* a clone links the image and copies the upper dir */
+	snprintf(path, sizeof(path), "%s/c1/delta0/upper", lxcpath);
+	if (write_file(path, "upper") < 0)
+		goto out;
+	c2 = c1->clone(c1, "c2", NULL, 0, NULL, NULL, 0, NULL);
+	if (!c2) {
+		fprintf(stderr, "%d: failed to clone c1\n", __LINE__);
+		goto out;
+	}
+	if (check_links("c1", 2, __LINE__))
+		goto out;
+	snprintf(path, sizeof(path), "%s/c2/delta0/upper", lxcpath);
+	if (check_file(path, "upper", __LINE__))
+		goto out;
+
+	/* a failed clone leaves no link to the image behind */
+	snprintf(path, sizeof(path), "%s/c1/delta0", lxcpath);
+	if (lxc_rmdir_onedev(path) < 0)
+		goto out;
+	bdev = bdev_copy(c1, "c3", lxcpath, NULL, 0, NULL, 0, &rdep);
+	if (bdev) {
+		fprintf(stderr, "%d: clone without an upper dir succeeded\n", __LINE__);
+		goto out;
+	}
+	if (check_links("c1", 2, __LINE__) || check_links("c3", 0, __LINE__))
+		goto out;
+
+	/* destroying a clone only removes its own link */
+	if (!c2->destroy(c2) || check_links("c1", 1, __LINE__))
+		goto out;
+
+	printf("All image tests passed\n");
+	ret = 0;
+out:
+	if (bdev)
+		bdev_put(bdev);
+	if (c1)
+		lxc_container_put(c1);
+	if (c2)
+		lxc_container_put(c2);
+	lxc_rmdir_onedev(dir);
+	exit(ret);
+}
@@ -0,0 +1,186 @@
+/* loop_opts.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+
+#include <lxc/lxccontainer.h>
+#include "lxc/bdev.h"
+#include "lxc/utils.h"
+
+static char dir[] = "/tmp/lxc-loop-opts-XXXXXX";
+
+/* only valid lxc.rootfs.loop options are accepted */
+static int test_config(void)
+{
+	const char *good[] = { "direct-io", "blocksize=512", "direct-io,blocksize=4096", "" };
+	const char *bad[] = { "bogus", "direct-io,bogus", "blocksize=1000",
+			      "blocksize=0", "blocksize=1048576", "blocksize=512x",
+			      "blocksize=" };
+	struct lxc_container *c;
+	char v[256];
+	int i, ret = -1;
+
+	c = lxc_container_new("lxc-test-loop-opts", dir);
+	if (!c) {
+		fprintf(stderr, "%d: failed to create a container object\n", __LINE__);
+		return -1;
+	}
+	for (i = 0; i < sizeof(good) / sizeof(good[0]); i++) {
+		if (!c->set_config_item(c, "lxc.rootfs.loop", good[i])) {
+			fprintf(stderr, "%d: '%s' was refused\n", __LINE__, good[i]);
+			goto out;
+		}
+	}
+	if (!c->set_config_item(c, "lxc.rootfs.loop", "direct-io"))
+		goto out;
+	for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+		if (c->set_config_item(c, "lxc.rootfs.loop", bad[i])) {
+			fprintf(stderr, "%d: '%s' was accepted\n", __LINE__, bad[i]);
+			goto out;
+		}
+	}
+	/* a refused value leaves the previous one */
+	if (c->get_config_item(c, "lxc.rootfs.loop", v, sizeof(v)) <= 0 ||
+	    strcmp(v, "direct-io") != 0) {
+		fprintf(stderr, "%d: lxc.rootfs.loop is '%s'\n", __LINE__, v);
+		goto out;
+	}
+	ret = 0;
+out:
+	lxc_container_put(c);
+	return ret;
+}
+
+static int read_sysfs(const char *loname, const char *attr, char *buf, size_t size)
+{
+	char path[256];
+	int fd;
+	ssize_t n;
+
+	snprintf(path, sizeof(path), "/sys/block/%s/%s", loname, attr);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	n = read(fd, buf, size - 1);
+	close(fd);
+	if (n < 0)
+		return -1;
+	buf[n] = '\0';
+	buf[strcspn(buf, "\n")] = '\0';
+	return 0;
+}
+
+/* the options are applied to the loop device the rootfs is mounted from */
+static int test_mount(void)
+{
+	struct bdev *bdev;
+	char img[256], src[512], mnt[256], lo[256], fdpath[64], buf[64];
+	ssize_t n;
+	int ret = -1;
+
+	snprintf(img, sizeof(img), "%s/rootfs.img", dir);
+	snprintf(src, sizeof(src), "loop:%s", img);
+	snprintf(mnt, sizeof(mnt), "%s/rootfs", dir);
+	if (mkdir(mnt, 0755)) {
+		fprintf(stderr, "%d: failed to create %s\n", __LINE__, mnt);
+		return -1;
+	}
+	bdev = bdev_init(src, mnt, NULL);
+	if (!bdev || strcmp(bdev->type, "loop")) {
+		fprintf(stderr, "%d: failed to set up the loop bdev\n", __LINE__);
+		goto out;
+	}
+	bdev->loopopts = strdup("direct-io,blocksize=4096");
+	if (!bdev->loopopts || bdev->ops->mount(bdev) < 0) {
+		fprintf(stderr, "%d: failed to mount %s\n", __LINE__, src);
+		goto out;
+	}
+
+	snprintf(fdpath, sizeof(fdpath), "/proc/self/fd/%d", bdev->lofd);
+	n = readlink(fdpath, lo, sizeof(lo) - 1);
+	if (n < 0) {
+		fprintf(stderr, "%d: failed to find the loop device\n", __LINE__);
+		goto out;
+	}
+	lo[n] = '\0';
+	if (read_sysfs(basename(lo), "queue/logical_block_size", buf, sizeof(buf)) < 0 ||
+	    strcmp(buf, "4096") != 0) {
+		fprintf(stderr, "%d: %s has block size %s, expected 4096\n", __LINE__, lo, buf);
+		goto out;
+	}
+	/* direct-io is only a hint which the backing filesystem may refuse */
+	if (read_sysfs(basename(lo), "loop/dio", buf, sizeof(buf)) == 0 &&
+	    strcmp(buf, "1") != 0)
+		printf("direct-io was not enabled on %s\n", lo);
+	if (bdev->ops->umount(bdev) < 0) {
+		fprintf(stderr, "%d: failed to unmount %s\n", __LINE__, src);
+		goto out;
+	}
+	ret = 0;
+out:
+	if (bdev)
+		bdev_put(bdev);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	char cmd[512];
+	pid_t pid;
+	int ret = 1;
+
+	if (!mkdtemp(dir)) {
+		fprintf(stderr, "%d: failed to create a temporary directory\n", __LINE__);
+		exit(1);
+	}
+
+	if (test_config())
+		goto out;
+
+	snprintf(cmd, sizeof(cmd), "truncate -s 32M %s/rootfs.img && "
+		 "mkfs.ext4 -q -b 4096 %s/rootfs.img >/dev/null 2>&1", dir, dir);
+	if (geteuid() != 0 || access("/dev/loop-control", F_OK) || system(cmd) != 0) {
+		printf("can not create loop devices, skipping the mount tests\n");
+	} else {
+		/* mounted in a private mount namespace, which goes away with the child */
+		pid = fork();
+		if (pid < 0)
+			goto out;
+		if (pid == 0) {
+			if (unshare(CLONE_NEWNS) || mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL)) {
+				fprintf(stderr, "can not unshare the mount namespace, skipping the mount tests\n");
+				_exit(0);
+			}
+			_exit(test_mount() ? 1 : 0);
+		}
+		if (wait_for_pid(pid))
+			goto out;
+	}
+
+	printf("All loop option tests passed\n");
+	ret = 0;
+out:
+	lxc_rmdir_onedev(dir);
+	exit(ret);
+}
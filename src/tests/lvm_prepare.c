@@ -0,0 +1,173 @@
+/* lvm_prepare.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <lxc/lxccontainer.h>
+#include "lxc/bdev.h"
+#include "lxc/utils.h"
+
+/*
+ * Snapshots prepared by bdev_lvm_prepare() on a volume group on a loop
+ * device: each set is released on its own, the other one is kept.
+ */
+
+static char dir[] = "/tmp/lxc-lvm-prepare-XXXXXX";
+static char vg[64], loopdev[64];
+
+static int run(const char *fmt, const char *arg1, const char *arg2)
+{
+	char cmd[1024];
+
+	snprintf(cmd, sizeof(cmd), fmt, arg1, arg2);
+	return system(cmd) == 0 ? 0 : -1;
+}
+
+static bool lv_exists(const char *lv)
+{
+	return run("lvs %s/%s >/dev/null 2>&1", vg, lv) == 0;
+}
+
+static int check_lvs(const char * const *lvs, bool exist, int line)
+{
+	int i;
+
+	for (i = 0; lvs[i]; i++) {
+		if (lv_exists(lvs[i]) != exist) {
+			fprintf(stderr, "%d: %s/%s %s\n", line, vg, lvs[i],
+				exist ? "was not created" : "was not removed");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int setup_vg(void)
+{
+	char img[256], cmd[512];
+	FILE *f;
+
+	if (run("which lvcreate vgcreate pvcreate losetup >/dev/null 2>&1", "", "") < 0)
+		return 1;
+
+	snprintf(img, sizeof(img), "%s/disk.img", dir);
+	if (run("truncate -s 128M %s%s", img, "") < 0)
+		return -1;
+	snprintf(cmd, sizeof(cmd), "losetup -f --show %s", img);
+	f = popen(cmd, "r");
+	if (!f)
+		return -1;
+	if (!fgets(loopdev, sizeof(loopdev), f)) {
+		pclose(f);
+		return 1;
+	}
+	pclose(f);
+	loopdev[strcspn(loopdev, "\n")] = '\0';
+
+	snprintf(vg, sizeof(vg), "lxctest%d", getpid());
+	if (run("pvcreate -q %s >/dev/null 2>&1%s", loopdev, "") < 0)
+		return 1;
+	if (run("vgcreate -q %s %s >/dev/null 2>&1", vg, loopdev) < 0)
+		return 1;
+	if (run("lvcreate -q -L 8M -n c0 %s >/dev/null 2>&1%s", vg, "") < 0)
+		return -1;
+	return 0;
+}
+
+static void teardown_vg(void)
+{
+	if (vg[0])
+		run("vgremove -q -f %s >/dev/null 2>&1%s", vg, "");
+	if (loopdev[0]) {
+		run("pvremove -q -f %s >/dev/null 2>&1%s", loopdev, "");
+		run("losetup -d %s%s", loopdev, "");
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct lxc_container *c = NULL;
+	struct lvm_prepared *p1 = NULL, *p2 = NULL;
+	const char * const set1[] = { "a1", "a2", NULL };
+	const char * const set2[] = { "b1", "b2", NULL };
+	char path[256];
+	int ret = 1;
+
+	if (geteuid() != 0) {
+		printf("Only root can create volume groups, skipping the lvm tests\n");
+		exit(0);
+	}
+	if (!mkdtemp(dir)) {
+		fprintf(stderr, "%d: failed to create a temporary directory\n", __LINE__);
+		exit(1);
+	}
+
+	switch (setup_vg()) {
+	case 0:
+		break;
+	case 1:
+		printf("lvm is not available, skipping the lvm tests\n");
+		ret = 0;
+		goto out;
+	default:
+		fprintf(stderr, "%d: failed to set up the volume group\n", __LINE__);
+		goto out;
+	}
+
+	c = lxc_container_new("c0", dir);
+	snprintf(path, sizeof(path), "/dev/%s/c0", vg);
+	if (!c || !c->set_config_item(c, "lxc.rootfs", path) ||
+	    !c->set_config_item(c, "lxc.rootfs.backend", "lvm")) {
+		fprintf(stderr, "%d: failed to set up the container\n", __LINE__);
+		goto out;
+	}
+
+	p1 = bdev_lvm_prepare(c, set1, 2, dir, 0);
+	p2 = bdev_lvm_prepare(c, set2, 2, dir, 0);
+	if (!p1 || !p2) {
+		fprintf(stderr, "%d: failed to prepare the snapshots\n", __LINE__);
+		goto out;
+	}
+	if (check_lvs(set1, true, __LINE__) || check_lvs(set2, true, __LINE__))
+		goto out;
+
+	/* releasing one set must not touch the snapshots of the other */
+	bdev_lvm_release(p1);
+	p1 = NULL;
+	if (check_lvs(set1, false, __LINE__) || check_lvs(set2, true, __LINE__))
+		goto out;
+	bdev_lvm_release(p2);
+	p2 = NULL;
+	if (check_lvs(set2, false, __LINE__) || !lv_exists("c0")) {
+		fprintf(stderr, "%d: unexpected volumes left\n", __LINE__);
+		goto out;
+	}
+
+	printf("All lvm prepare tests passed\n");
+	ret = 0;
+out:
+	bdev_lvm_release(p1);
+	bdev_lvm_release(p2);
+	if (c)
+		lxc_container_put(c);
+	teardown_vg();
+	lxc_rmdir_onedev(dir);
+	exit(ret);
+}
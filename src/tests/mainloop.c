@@ -0,0 +1,139 @@
+/* mainloop.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lxc/mainloop.h"
+
+static int fired[16];
+static int nfired;
+
+struct ticker {
+	struct lxc_mainloop_timer *timer;
+	int count;
+};
+
+static int record(void *data, struct lxc_epoll_descr *descr)
+{
+	if (nfired < 16)
+		fired[nfired] = (int)(long)data;
+	nfired++;
+	return 0;
+}
+
+static int stop(void *data, struct lxc_epoll_descr *descr)
+{
+	return 1;
+}
+
+/* a periodic timer which deletes itself from its third run */
+static int tick(void *data, struct lxc_epoll_descr *descr)
+{
+	struct ticker *t = data;
+
+	if (++t->count == 3)
+		lxc_mainloop_del_timer(descr, t->timer);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct lxc_epoll_descr descr;
+	struct lxc_mainloop_timer *cancelled, *far, *st;
+	struct ticker t = { NULL, 0 };
+	/* 700ms is past the first wheel level and needs a cascade */
+	int expect[] = { 20, 30, 50, 80, 700 };
+	int i, ret = 1;
+
+	if (lxc_mainloop_open(&descr)) {
+		fprintf(stderr, "%d: failed to open the mainloop\n", __LINE__);
+		exit(1);
+	}
+
+	if (lxc_mainloop_next_timeout(&descr) != -1) {
+		fprintf(stderr, "%d: a timeout was reported with no timers\n", __LINE__);
+		goto out;
+	}
+
+	/* added out of order, they must fire in order of expiry */
+	if (!lxc_mainloop_add_timer(&descr, 50, 0, record, (void *)50L) ||
+	    !lxc_mainloop_add_timer(&descr, 700, 0, record, (void *)700L) ||
+	    !lxc_mainloop_add_timer(&descr, 20, 0, record, (void *)20L) ||
+	    !lxc_mainloop_add_timer(&descr, 80, 0, record, (void *)80L) ||
+	    !lxc_mainloop_add_timer(&descr, 30, 0, record, (void *)30L)) {
+		fprintf(stderr, "%d: failed to add timers\n", __LINE__);
+		goto out;
+	}
+
+	cancelled = lxc_mainloop_add_timer(&descr, 40, 0, record, (void *)40L);
+	far = lxc_mainloop_add_timer(&descr, 10000000, 0, record, (void *)-1L);
+	t.timer = lxc_mainloop_add_timer(&descr, 10, 10, tick, &t);
+	st = lxc_mainloop_add_timer(&descr, 800, 0, stop, NULL);
+	if (!cancelled || !far || !t.timer || !st) {
+		fprintf(stderr, "%d: failed to add timers\n", __LINE__);
+		goto out;
+	}
+	lxc_mainloop_del_timer(&descr, cancelled);
+
+	i = lxc_mainloop_next_timeout(&descr);
+	if (i < 0 || i > 2 * LXC_MAINLOOP_TICK_MS) {
+		fprintf(stderr, "%d: next timeout is %d, not within two ticks\n", __LINE__, i);
+		goto out;
+	}
+
+	if (lxc_mainloop(&descr, -1)) {
+		fprintf(stderr, "%d: the mainloop failed\n", __LINE__);
+		goto out;
+	}
+
+	if (nfired != sizeof(expect) / sizeof(expect[0])) {
+		fprintf(stderr, "%d: %d timers fired, expected %zu\n", __LINE__,
+			nfired, sizeof(expect) / sizeof(expect[0]));
+		goto out;
+	}
+	for (i = 0; i < nfired; i++) {
+		if (fired[i] != expect[i]) {
+			fprintf(stderr, "%d: timer %d fired in position %d, expected %d\n",
+				__LINE__, fired[i], i, expect[i]);
+			goto out;
+		}
+	}
+	if (t.count != 3) {
+		fprintf(stderr, "%d: periodic timer ran %d times, not 3\n", __LINE__, t.count);
+		goto out;
+	}
+
+	/* only the parked far timer is left */
+	i = lxc_mainloop_next_timeout(&descr);
+	if (i >= 0 && i < 1000) {
+		fprintf(stderr, "%d: next timeout is %d with only a far timer\n", __LINE__, i);
+		goto out;
+	}
+	lxc_mainloop_del_timer(&descr, far);
+	lxc_mainloop_del_timer(&descr, st);
+	if (lxc_mainloop_next_timeout(&descr) != -1) {
+		fprintf(stderr, "%d: a timeout was reported after deleting all timers\n", __LINE__);
+		goto out;
+	}
+
+	printf("All mainloop timer tests passed\n");
+	ret = 0;
+out:
+	lxc_mainloop_close(&descr);
+	exit(ret);
+}
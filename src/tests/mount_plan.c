@@ -0,0 +1,247 @@
+/* mount_plan.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+
+#include <lxc/lxccontainer.h>
+#include "lxc/conf.h"
+#include "lxc/utils.h"
+
+static char dir[] = "/tmp/lxc-mount-plan-XXXXXX";
+
+static int write_file(const char *rel, const char *content)
+{
+	char path[4096];
+	int fd, ret;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, rel);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+	ret = write(fd, content, strlen(content)) == strlen(content) ? 0 : -1;
+	close(fd);
+	return ret;
+}
+
+static int check_file(const char *rel, const char *content, int line)
+{
+	char path[4096], buf[64];
+	int fd;
+	ssize_t n;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, rel);
+	memset(buf, 0, sizeof(buf));
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%d: failed to open %s\n", line, path);
+		return -1;
+	}
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n < 0 || strcmp(buf, content) != 0) {
+		fprintf(stderr, "%d: %s holds '%s', expected '%s'\n", line, path, buf, content);
+		return -1;
+	}
+	return 0;
+}
+
+static int add_entry(struct lxc_list *plan, const char *fmt, const char *arg1,
+		     const char *arg2)
+{
+	struct lxc_mount_entry *e;
+	struct lxc_list *it;
+	char line[4096];
+
+	snprintf(line, sizeof(line), fmt, dir, arg1, dir, arg2);
+	e = lxc_mount_entry_compile(line);
+	it = malloc(sizeof(*it));
+	if (!e || !it) {
+		fprintf(stderr, "failed to compile '%s'\n", line);
+		lxc_mount_entry_free(e);
+		free(it);
+		return -1;
+	}
+	it->elem = e;
+	lxc_list_add_tail(plan, it);
+	return 0;
+}
+
+static int test_compile(void)
+{
+	struct lxc_mount_entry *e;
+	int ret = -1;
+
+	e = lxc_mount_entry_compile("/a\\040b /mnt none bind,ro,optional,create=dir,size=10 0 0");
+	if (!e || strcmp(e->fsname, "/a b") || strcmp(e->target, "/mnt") ||
+	    !(e->flags & MS_BIND) || !(e->flags & MS_RDONLY) || !e->optional ||
+	    e->create != LXC_MOUNT_CREATE_DIR || !e->data || strcmp(e->data, "size=10")) {
+		fprintf(stderr, "%d: entry was not compiled as expected\n", __LINE__);
+		goto out;
+	}
+	lxc_mount_entry_free(e);
+
+	e = lxc_mount_entry_compile("proc /proc proc");
+	if (!e || e->flags || e->data || e->optional || e->create) {
+		fprintf(stderr, "%d: entry without options was not compiled as expected\n", __LINE__);
+		goto out;
+	}
+	lxc_mount_entry_free(e);
+
+	e = lxc_mount_entry_compile("hi there");
+	if (e || errno != EINVAL) {
+		fprintf(stderr, "%d: invalid entry was compiled\n", __LINE__);
+		goto out;
+	}
+	ret = 0;
+out:
+	lxc_mount_entry_free(e);
+	return ret;
+}
+
+/* a bad lxc.mount.entry is skipped, not a configuration error */
+static int test_config(void)
+{
+	struct lxc_container *c;
+	char v[256];
+	int ret = -1;
+
+	c = lxc_container_new("lxc-test-mount-plan", dir);
+	if (!c) {
+		fprintf(stderr, "%d: failed to create a container object\n", __LINE__);
+		return -1;
+	}
+	if (!c->set_config_item(c, "lxc.mount.entry", "hi there")) {
+		fprintf(stderr, "%d: invalid lxc.mount.entry failed the configuration\n", __LINE__);
+		goto out;
+	}
+	if (c->get_config_item(c, "lxc.mount.entry", v, sizeof(v)) <= 0 ||
+	    strcmp(v, "hi there\n") != 0) {
+		fprintf(stderr, "%d: invalid lxc.mount.entry was not kept: '%s'\n", __LINE__, v);
+		goto out;
+	}
+	if (!lxc_list_empty(&c->lxc_conf->mount_plan)) {
+		fprintf(stderr, "%d: invalid lxc.mount.entry is to be mounted\n", __LINE__);
+		goto out;
+	}
+	ret = 0;
+out:
+	lxc_container_put(c);
+	return ret;
+}
+
+/*
+ * Bind sources are looked up when they are mounted: root/mnt/inner is
+ * only reachable once b is mounted on root/mnt.
+ */
+static int test_apply(void)
+{
+	struct lxc_rootfs rootfs;
+	struct lxc_list plan, *it, *next;
+	const char *dirs[] = { "b", "b/inner", "root", "root/mnt",
+			       "root/mnt/inner" };
+	char root[4096], path[4096];
+	int i, ret = -1;
+
+	lxc_list_init(&plan);
+	for (i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++) {
+		snprintf(path, sizeof(path), "%s/%s", dir, dirs[i]);
+		if (mkdir(path, 0755)) {
+			fprintf(stderr, "%d: failed to create %s\n", __LINE__, path);
+			return -1;
+		}
+	}
+	if (write_file("root/mnt/inner/file", "old") || write_file("b/inner/file", "b")) {
+		fprintf(stderr, "%d: failed to populate the tree\n", __LINE__);
+		return -1;
+	}
+
+	if (add_entry(&plan, "%s/%s %s/root/mnt none bind 0 0", "b", "") ||
+	    add_entry(&plan, "%s/%s %s/%s none bind,create=dir 0 0", "root/mnt/inner", "root/x") ||
+	    add_entry(&plan, "%s/%s %s/%s none bind,create=dir 0 0", "root/mnt/inner", "root/y") ||
+	    add_entry(&plan, "%s/%s %s/%s none bind,optional,create=dir 0 0", "missing", "root/z"))
+		goto out;
+
+	snprintf(root, sizeof(root), "%s/root", dir);
+	memset(&rootfs, 0, sizeof(rootfs));
+	rootfs.path = root;
+	rootfs.mount = root;
+
+	if (lxc_mount_plan_apply(&rootfs, &plan, "lxc-test-mount-plan")) {
+		fprintf(stderr, "%d: failed to apply the mount plan\n", __LINE__);
+		goto out;
+	}
+	if (check_file("root/x/file", "b", __LINE__) || check_file("root/y/file", "b", __LINE__))
+		goto out;
+
+	/* a failing entry which is not optional fails the plan */
+	if (add_entry(&plan, "%s/%s %s/%s none bind,create=dir 0 0", "missing", "root/w"))
+		goto out;
+	if (!lxc_mount_plan_apply(&rootfs, &plan, "lxc-test-mount-plan")) {
+		fprintf(stderr, "%d: missing bind source did not fail the plan\n", __LINE__);
+		goto out;
+	}
+	ret = 0;
+out:
+	lxc_list_for_each_safe(it, &plan, next) {
+		lxc_list_del(it);
+		lxc_mount_entry_free(it->elem);
+		free(it);
+	}
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	pid_t pid;
+	int ret = 1;
+
+	if (!mkdtemp(dir)) {
+		fprintf(stderr, "%d: failed to create a temporary directory\n", __LINE__);
+		exit(1);
+	}
+
+	if (test_compile() || test_config())
+		goto out;
+
+	/* the mounts are done in a private mount namespace, which goes away
+	 * with the child */
+	pid = fork();
+	if (pid < 0)
+		goto out;
+	if (pid == 0) {
+		if (unshare(CLONE_NEWNS) || mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL)) {
+			fprintf(stderr, "can not unshare the mount namespace, skipping the mount tests\n");
+			_exit(0);
+		}
+		_exit(test_apply() ? 1 : 0);
+	}
+	if (wait_for_pid(pid))
+		goto out;
+
+	printf("All mount plan tests passed\n");
+	ret = 0;
+out:
+	lxc_rmdir_onedev(dir);
+	exit(ret);
+}
@@ -0,0 +1,128 @@
+/* netlink_dump.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+
+#include "lxc/nl.h"
+#include "lxc/network.h"
+
+struct links {
+	int nlinks;
+	int lo;
+	int stop_after;
+};
+
+static int count_link(int ifindex, const char *ifname, void *data)
+{
+	struct links *l = data;
+	char name[IF_NAMESIZE];
+
+	/* the dump must agree with the kernel's index to name mapping */
+	if (!if_indextoname(ifindex, name) || strcmp(name, ifname) != 0) {
+		fprintf(stderr, "link %d is %s, not %s\n", ifindex, name, ifname);
+		return -1;
+	}
+	if (strcmp(ifname, "lo") == 0)
+		l->lo = ifindex;
+	if (++l->nlinks == l->stop_after)
+		return 42;
+	return 0;
+}
+
+static int find_loopback(int ifindex, int family, const void *addr, void *data)
+{
+	int *lo = data;
+	struct in_addr a;
+
+	if (family != AF_INET)
+		return 0;
+	inet_pton(AF_INET, "127.0.0.1", &a);
+	if (memcmp(addr, &a, sizeof(a)) == 0)
+		*lo = ifindex;
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct nl_handler nlh;
+	struct links l;
+	int netns, ret, lo_addr = 0, i;
+
+	netns = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+	if (netns < 0) {
+		fprintf(stderr, "%d: failed to open the network namespace\n", __LINE__);
+		exit(1);
+	}
+
+	if (lxc_netns_netlink_open(&nlh, netns)) {
+		fprintf(stderr, "%d: failed to open a netlink socket\n", __LINE__);
+		close(netns);
+		exit(1);
+	}
+	close(netns);
+	ret = 1;
+
+	memset(&l, 0, sizeof(l));
+	if (lxc_netlink_list_links(&nlh, count_link, &l) || !l.lo) {
+		fprintf(stderr, "%d: link dump failed or missed lo\n", __LINE__);
+		goto out;
+	}
+
+	/*
+	 * A callback stopping early gets its value back, and the rest of
+	 * the dump must have been drained for the socket to be reused.
+	 */
+	for (i = 0; i < 3; i++) {
+		int nlinks = l.nlinks;
+
+		memset(&l, 0, sizeof(l));
+		l.stop_after = 1;
+		if (lxc_netlink_list_links(&nlh, count_link, &l) != 42 || l.nlinks != 1) {
+			fprintf(stderr, "%d: stopped dump returned after %d links\n", __LINE__, l.nlinks);
+			goto out;
+		}
+
+		memset(&l, 0, sizeof(l));
+		if (lxc_netlink_list_links(&nlh, count_link, &l) || l.nlinks != nlinks) {
+			fprintf(stderr, "%d: dump after a stopped one saw %d links, not %d\n",
+				__LINE__, l.nlinks, nlinks);
+			goto out;
+		}
+	}
+
+	if (lxc_netlink_list_addrs(&nlh, find_loopback, &lo_addr)) {
+		fprintf(stderr, "%d: address dump failed\n", __LINE__);
+		goto out;
+	}
+	if (lo_addr && lo_addr != l.lo) {
+		fprintf(stderr, "%d: 127.0.0.1 is on link %d, lo is %d\n", __LINE__, lo_addr, l.lo);
+		goto out;
+	}
+
+	printf("All netlink dump tests passed\n");
+	ret = 0;
+out:
+	netlink_close(&nlh);
+	exit(ret);
+}
@@ -0,0 +1,234 @@
+/* pool.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+
+#include <lxc/lxccontainer.h>
+#include "lxc/bdev.h"
+#include "lxc/conf.h"
+#include "lxc/utils.h"
+
+/*
+ * The image pool: a directory registered as an image, mounted read-only,
+ * and containers of the pool backing store layered on it, which hold the
+ * image until they are destroyed.  The pool is mounted in a private
+ * mount namespace, which goes away with the test.
+ */
+
+static char dir[] = "/tmp/lxc-pool-XXXXXX";
+static char lxcpath[256];
+
+static int write_file(const char *path, const char *content)
+{
+	int fd, ret;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+	ret = write(fd, content, strlen(content)) == strlen(content) ? 0 : -1;
+	close(fd);
+	return ret;
+}
+
+/* the pool holds image from source, with users users, or nothing if !image */
+static int check_stats(const char *image, const char *source, int users, int line)
+{
+	struct bdev_pool_stat *stats;
+	int n, ret = -1;
+
+	n = bdev_pool_stats(lxcpath, &stats);
+	if (n < 0) {
+		fprintf(stderr, "%d: failed to get the pool stats\n", line);
+		return -1;
+	}
+	if (!image) {
+		if (n == 0)
+			return 0;
+		fprintf(stderr, "%d: the pool holds %d images, expected none\n", line, n);
+		goto out;
+	}
+	if (n != 1 || strcmp(stats[0].image, image) || strcmp(stats[0].source, source) ||
+	    stats[0].users != users || !stats[0].mounted) {
+		fprintf(stderr, "%d: the pool holds %d images, the first %s from %s with "
+			"%d users, expected %s from %s with %d users, mounted\n", line, n,
+			n ? stats[0].image : "-", n ? stats[0].source : "-",
+			n ? stats[0].users : 0, image, source, users);
+		goto out;
+	}
+	ret = 0;
+out:
+	bdev_pool_stats_free(stats, n);
+	return ret;
+}
+
+/* clones are overlayfs mounts, which lxc mounts as "overlayfs" */
+static int has_overlayfs(void)
+{
+	char line[128];
+	FILE *f;
+	int ret = 0;
+
+	f = fopen("/proc/filesystems", "r");
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f))
+		if (strcmp(line, "nodev\toverlayfs\n") == 0)
+			ret = 1;
+	fclose(f);
+	return ret;
+}
+
+static int check_lookup(struct lxc_container *c, int users, int line)
+{
+	char image[64];
+	int n;
+
+	n = bdev_pool_lookup(c->lxc_conf->rootfs.path, image, sizeof(image));
+	if (n != users || strcmp(image, "base")) {
+		fprintf(stderr, "%d: %s is layered on %s with %d users, expected base with %d\n",
+			line, c->name, n < 0 ? "nothing" : image, n, users);
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct lxc_container *c1 = NULL, *c2 = NULL;
+	struct bdev_specs specs;
+	char src[256], other[256], path[512];
+	int ret = 1;
+
+	if (geteuid() != 0) {
+		printf("Only root can mount pool images, skipping the pool tests\n");
+		exit(0);
+	}
+	if (unshare(CLONE_NEWNS) || mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL)) {
+		printf("can not unshare the mount namespace, skipping the pool tests\n");
+		exit(0);
+	}
+	if (!mkdtemp(dir)) {
+		fprintf(stderr, "%d: failed to create a temporary directory\n", __LINE__);
+		exit(1);
+	}
+	snprintf(lxcpath, sizeof(lxcpath), "%s/lxc", dir);
+	snprintf(src, sizeof(src), "%s/src", dir);
+	snprintf(other, sizeof(other), "%s/other", dir);
+	snprintf(path, sizeof(path), "%s/hello", src);
+	if (mkdir_p(lxcpath, 0755) < 0 || mkdir_p(src, 0755) < 0 ||
+	    mkdir_p(other, 0755) < 0 || write_file(path, "hello") < 0) {
+		fprintf(stderr, "%d: failed to populate %s\n", __LINE__, dir);
+		goto out;
+	}
+
+	/* an image is registered and mounted read-only */
+	if (check_stats(NULL, NULL, 0, __LINE__))
+		goto out;
+	if (bdev_pool_add(lxcpath, "base", src, 0) < 0) {
+		fprintf(stderr, "%d: failed to add %s to the pool\n", __LINE__, src);
+		goto out;
+	}
+	if (check_stats("base", src, 0, __LINE__))
+		goto out;
+	snprintf(path, sizeof(path), "%s/.pool/base/rootfs/written", lxcpath);
+	if (write_file(path, "written") == 0) {
+		fprintf(stderr, "%d: the pool image is writable\n", __LINE__);
+		goto out;
+	}
+
+	/* again from the same source only */
+	if (bdev_pool_add(lxcpath, "base", src, 0) < 0 ||
+	    bdev_pool_add(lxcpath, "base", other, 0) == 0) {
+		fprintf(stderr, "%d: base was registered again from %s\n", __LINE__, other);
+		goto out;
+	}
+
+	/* a pool container is user of the image */
+	memset(&specs, 0, sizeof(specs));
+	specs.pool.image = "base";
+	specs.pool.lxcpath = lxcpath;
+	c1 = lxc_container_new("c1", lxcpath);
+	if (!c1 || !c1->set_config_item(c1, "lxc.utsname", "c1") ||
+	    !c1->create(c1, NULL, "pool", &specs, 0, NULL)) {
+		fprintf(stderr, "%d: failed to create c1\n", __LINE__);
+		goto out;
+	}
+	if (check_stats("base", src, 1, __LINE__) || check_lookup(c1, 1, __LINE__))
+		goto out;
+
+	/* the image stays while it is used */
+	if (bdev_pool_remove(lxcpath, "base") == 0) {
+		fprintf(stderr, "%d: base was removed while c1 uses it\n", __LINE__);
+		goto out;
+	}
+
+	/* a snapshot clone of c1 is user of the image as well, and holds it */
+	if (has_overlayfs()) {
+		c2 = c1->clone(c1, "c2", NULL, LXC_CLONE_SNAPSHOT, NULL, NULL, 0, NULL);
+		if (!c2) {
+			fprintf(stderr, "%d: failed to clone c1\n", __LINE__);
+			goto out;
+		}
+		if (check_stats("base", src, 2, __LINE__) || check_lookup(c2, 2, __LINE__))
+			goto out;
+	} else {
+		printf("overlayfs is not available, skipping the pool clone tests\n");
+	}
+	if (!c1->destroy(c1)) {
+		fprintf(stderr, "%d: failed to destroy c1\n", __LINE__);
+		goto out;
+	}
+	if (c2) {
+		if (check_stats("base", src, 1, __LINE__))
+			goto out;
+		if (bdev_pool_remove(lxcpath, "base") == 0) {
+			fprintf(stderr, "%d: base was removed while c2 uses it\n", __LINE__);
+			goto out;
+		}
+		if (!c2->destroy(c2)) {
+			fprintf(stderr, "%d: failed to destroy c2\n", __LINE__);
+			goto out;
+		}
+	}
+	if (check_stats("base", src, 0, __LINE__))
+		goto out;
+	if (bdev_pool_remove(lxcpath, "base") < 0) {
+		fprintf(stderr, "%d: failed to remove base\n", __LINE__);
+		goto out;
+	}
+	snprintf(path, sizeof(path), "%s/.pool/base", lxcpath);
+	if (check_stats(NULL, NULL, 0, __LINE__) || access(path, F_OK) == 0)
+		goto out;
+
+	printf("All pool tests passed\n");
+	ret = 0;
+out:
+	if (c1)
+		lxc_container_put(c1);
+	if (c2)
+		lxc_container_put(c2);
+	snprintf(path, sizeof(path), "%s/.pool/base/rootfs", lxcpath);
+	umount2(path, MNT_DETACH);
+	lxc_rmdir_onedev(dir);
+	exit(ret);
+}
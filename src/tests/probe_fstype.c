@@ -0,0 +1,131 @@
+/* probe_fstype.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "lxc/utils.h"
+
+/* large enough for the btrfs superblock at 64k */
+#define IMAGE_SIZE (128 * 1024)
+
+/* ext superblock fields, relative to its start at 1024 */
+#define EXT_MAGIC_OFF        56
+#define EXT_COMPAT_OFF       92
+#define EXT_INCOMPAT_OFF     96
+
+static char dir[] = "/tmp/lxc-probe-fstype-XXXXXX";
+
+struct image {
+	const char *expect;
+	off_t offset;
+	const char *data;
+	size_t len;
+	off_t offset2;
+	const char *data2;
+	size_t len2;
+};
+
+static const struct image images[] = {
+	{ "xfs",      0,          "XFSB",             4 },
+	{ "squashfs", 0,          "hsqs",             4 },
+	{ "erofs",    1024,       "\xe2\xe1\xf5\xe0", 4 },
+	{ "f2fs",     1024,       "\x10\x20\xf5\xf2", 4 },
+	{ "jfs",      32768,      "JFS1",             4 },
+	{ "iso9660",  32769,      "CD001",            5 },
+	{ "btrfs",    65536 + 64, "_BHRfS_M",         8 },
+	{ "ext2",     1024 + EXT_MAGIC_OFF, "\x53\xef", 2 },
+	{ "ext3",     1024 + EXT_MAGIC_OFF, "\x53\xef", 2,
+		      1024 + EXT_COMPAT_OFF, "\x04", 1 },
+	/* extents */
+	{ "ext4",     1024 + EXT_MAGIC_OFF, "\x53\xef", 2,
+		      1024 + EXT_INCOMPAT_OFF, "\x40", 1 },
+	/* a magic at the wrong offset is not enough */
+	{ NULL,       512,        "XFSB",             4 },
+	{ NULL,       0,          "",                 0 },
+};
+
+static int write_image(const char *path, const struct image *img)
+{
+	int fd, ret = -1;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+	if (ftruncate(fd, IMAGE_SIZE) < 0)
+		goto out;
+	if (img->len && pwrite(fd, img->data, img->len, img->offset) != img->len)
+		goto out;
+	if (img->len2 && pwrite(fd, img->data2, img->len2, img->offset2) != img->len2)
+		goto out;
+	ret = 0;
+out:
+	close(fd);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *fstype;
+	char path[256];
+	int i, ret = 1;
+
+	if (!mkdtemp(dir)) {
+		fprintf(stderr, "%d: failed to create a temporary directory\n", __LINE__);
+		exit(1);
+	}
+
+	for (i = 0; i < sizeof(images) / sizeof(images[0]); i++) {
+		const struct image *img = &images[i];
+
+		snprintf(path, sizeof(path), "%s/image%d", dir, i);
+		if (write_image(path, img) < 0) {
+			fprintf(stderr, "%d: failed to write %s\n", __LINE__, path);
+			goto out;
+		}
+		fstype = lxc_probe_fstype(path);
+		if ((fstype == NULL) != (img->expect == NULL) ||
+		    (fstype && strcmp(fstype, img->expect))) {
+			fprintf(stderr, "%d: image %d probed as %s, expected %s\n",
+				__LINE__, i, fstype ? fstype : "(none)",
+				img->expect ? img->expect : "(none)");
+			goto out;
+		}
+	}
+
+	/* a short file and a missing one are no filesystems */
+	snprintf(path, sizeof(path), "%s/short", dir);
+	if (write_image(path, &images[0]) < 0 || truncate(path, 2) < 0 ||
+	    lxc_probe_fstype(path)) {
+		fprintf(stderr, "%d: a truncated image was probed\n", __LINE__);
+		goto out;
+	}
+	snprintf(path, sizeof(path), "%s/missing", dir);
+	if (lxc_probe_fstype(path)) {
+		fprintf(stderr, "%d: a missing image was probed\n", __LINE__);
+		goto out;
+	}
+
+	printf("All fstype probe tests passed\n");
+	ret = 0;
+out:
+	lxc_rmdir_onedev(dir);
+	exit(ret);
+}
@@ -0,0 +1,124 @@
+/* ringbuf.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lxc/ringbuf.h"
+
+static int check(struct lxc_ringbuf *buf, const char *want, int line)
+{
+	char out[16];
+	size_t len;
+
+	memset(out, 0, sizeof(out));
+	len = lxc_ringbuf_peek(buf, out, sizeof(out) - 1);
+	if (len != strlen(want) || lxc_ringbuf_used(buf) != len ||
+	    strcmp(out, want) != 0) {
+		fprintf(stderr, "%d: buffer holds '%s' (%zu), expected '%s'\n",
+			line, out, lxc_ringbuf_used(buf), want);
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct lxc_ringbuf buf;
+	char out[16];
+	int p[2], ret = 1;
+	ssize_t n;
+
+	if (lxc_ringbuf_create(&buf, 0) == 0) {
+		fprintf(stderr, "%d: created an empty ring buffer\n", __LINE__);
+		exit(1);
+	}
+	if (lxc_ringbuf_create(&buf, 8)) {
+		fprintf(stderr, "%d: failed to create the ring buffer\n", __LINE__);
+		exit(1);
+	}
+
+	if (lxc_ringbuf_write(&buf, "abcde", 5, false) != 5 || check(&buf, "abcde", __LINE__))
+		goto out;
+
+	/* without overwrite only what fits is stored */
+	if (lxc_ringbuf_write(&buf, "fghij", 5, false) != 3 || check(&buf, "abcdefgh", __LINE__))
+		goto out;
+	if (lxc_ringbuf_free(&buf) != 0) {
+		fprintf(stderr, "%d: full buffer has %zu bytes free\n", __LINE__, lxc_ringbuf_free(&buf));
+		goto out;
+	}
+
+	/* writes past the end wrap to the start */
+	lxc_ringbuf_consume(&buf, 6);
+	if (lxc_ringbuf_write(&buf, "12345", 5, false) != 5 || check(&buf, "gh12345", __LINE__))
+		goto out;
+
+	memset(out, 0, sizeof(out));
+	if (lxc_ringbuf_tail(&buf, out, 3) != 3 || strcmp(out, "345") != 0) {
+		fprintf(stderr, "%d: tail is '%s', expected '345'\n", __LINE__, out);
+		goto out;
+	}
+
+	/* overwrite drops the oldest bytes */
+	if (lxc_ringbuf_write(&buf, "XYZW", 4, true) != 4 || check(&buf, "2345XYZW", __LINE__))
+		goto out;
+
+	/* and keeps only the tail of a message larger than the buffer */
+	if (lxc_ringbuf_write(&buf, "0123456789abcdefghij", 20, true) != 8 ||
+	    check(&buf, "cdefghij", __LINE__))
+		goto out;
+
+	/* flush the wrapped content in order */
+	lxc_ringbuf_consume(&buf, 5);
+	lxc_ringbuf_write(&buf, "klmno", 5, false);
+	if (check(&buf, "hijklmno", __LINE__))
+		goto out;
+
+	if (pipe(p)) {
+		fprintf(stderr, "%d: failed to create a pipe\n", __LINE__);
+		goto out;
+	}
+	n = lxc_ringbuf_flush(&buf, p[1]);
+	close(p[1]);
+	if (n != 8 || !lxc_ringbuf_empty(&buf)) {
+		fprintf(stderr, "%d: flush wrote %zd bytes, left %zu\n", __LINE__, n, lxc_ringbuf_used(&buf));
+		close(p[0]);
+		goto out;
+	}
+	memset(out, 0, sizeof(out));
+	n = read(p[0], out, sizeof(out) - 1);
+	close(p[0]);
+	if (n != 8 || strcmp(out, "hijklmno") != 0) {
+		fprintf(stderr, "%d: flushed '%s', expected 'hijklmno'\n", __LINE__, out);
+		goto out;
+	}
+
+	lxc_ringbuf_write(&buf, "abc", 3, false);
+	lxc_ringbuf_clear(&buf);
+	if (!lxc_ringbuf_empty(&buf) || lxc_ringbuf_free(&buf) != 8) {
+		fprintf(stderr, "%d: cleared buffer is not empty\n", __LINE__);
+		goto out;
+	}
+
+	printf("All ringbuf tests passed\n");
+	ret = 0;
+out:
+	lxc_ringbuf_release(&buf);
+	exit(ret);
+}
@@ -0,0 +1,229 @@
+/* snapshot_index.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <lxc/lxccontainer.h>
+#include "lxc/utils.h"
+
+#define NAME "c1"
+#define NLISTERS 4
+
+static char dir[] = "/tmp/lxc-snapshot-index-XXXXXX";
+static char lxcpath[256], snappath[256];
+
+static int write_file(const char *path, const char *content)
+{
+	int fd, ret;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+	ret = write(fd, content, strlen(content)) == strlen(content) ? 0 : -1;
+	close(fd);
+	return ret;
+}
+
+/* a dir-backed snapshot as an older lxc made them, without the index */
+static int make_snapshot(const char *name, const char *ts, size_t datalen)
+{
+	char path[4096], conf[8192], *data;
+	int ret;
+
+	snprintf(path, sizeof(path), "%s/%s/rootfs", snappath, name);
+	if (mkdir_p(path, 0755) < 0)
+		return -1;
+	snprintf(conf, sizeof(conf), "lxc.utsname = %s\nlxc.rootfs = %s\n", NAME, path);
+	snprintf(path, sizeof(path), "%s/%s/config", snappath, name);
+	if (write_file(path, conf) < 0)
+		return -1;
+	snprintf(path, sizeof(path), "%s/%s/ts", snappath, name);
+	if (write_file(path, ts) < 0)
+		return -1;
+
+	data = malloc(datalen + 1);
+	if (!data)
+		return -1;
+	memset(data, 'x', datalen);
+	data[datalen] = '\0';
+	snprintf(path, sizeof(path), "%s/%s/rootfs/data", snappath, name);
+	ret = write_file(path, data);
+	free(data);
+	return ret;
+}
+
+/* the size field of snapshot name in the index, or NULL */
+static char *index_size(const char *name, char *buf, size_t size)
+{
+	char path[4096], line[1024], *p;
+	size_t len = strlen(name);
+	FILE *f;
+	int i;
+
+	snprintf(path, sizeof(path), "%s/.index", snappath);
+	f = fopen(path, "r");
+	if (!f)
+		return NULL;
+	while (fgets(line, sizeof(line), f)) {
+		if (strncmp(line, name, len) || line[len] != '\t')
+			continue;
+		for (p = line, i = 0; p && i < 3; i++)
+			p = strchr(p, '\t') ? strchr(p, '\t') + 1 : NULL;
+		if (!p)
+			break;
+		p[strcspn(p, "\t\n")] = '\0';
+		snprintf(buf, size, "%s", p);
+		fclose(f);
+		return buf;
+	}
+	fclose(f);
+	return NULL;
+}
+
+static int count_snapshots(struct lxc_container *c, int expect, int line)
+{
+	struct lxc_snapshot *s;
+	int i, n;
+
+	n = c->snapshot_list(c, &s);
+	for (i = 0; i < n; i++)
+		s[i].free(&s[i]);
+	if (n > 0)
+		free(s);
+	if (n != expect) {
+		fprintf(stderr, "%d: %d snapshots listed, expected %d\n", line, n, expect);
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct lxc_container *c = NULL;
+	struct lxc_snapshot_info *info = NULL;
+	char path[4096], size[64];
+	int i, n = 0, ret = 1;
+	pid_t pids[NLISTERS];
+
+	if (!mkdtemp(dir)) {
+		fprintf(stderr, "%d: failed to create a temporary directory\n", __LINE__);
+		exit(1);
+	}
+	snprintf(lxcpath, sizeof(lxcpath), "%s/lxc", dir);
+	snprintf(snappath, sizeof(snappath), "%s/lxcsnaps/%s", dir, NAME);
+	snprintf(path, sizeof(path), "%s/%s/rootfs", lxcpath, NAME);
+	if (mkdir_p(path, 0755) < 0) {
+		fprintf(stderr, "%d: failed to create %s\n", __LINE__, path);
+		goto out;
+	}
+	snprintf(path, sizeof(path), "%s/%s/config", lxcpath, NAME);
+	if (write_file(path, "lxc.utsname = " NAME "\n") < 0 ||
+	    make_snapshot("snap1", "2014:01:02 00:00:00", 100000) < 0 ||
+	    make_snapshot("snap0", "2014:01:01 00:00:00", 10)) {
+		fprintf(stderr, "%d: failed to populate %s\n", __LINE__, dir);
+		goto out;
+	}
+
+	c = lxc_container_new(NAME, lxcpath);
+	if (!c || !c->is_defined(c)) {
+		fprintf(stderr, "%d: failed to load %s\n", __LINE__, NAME);
+		goto out;
+	}
+
+	/* snapshots unknown to the index are added, without their size */
+	if (count_snapshots(c, 2, __LINE__))
+		goto out;
+	if (!index_size("snap0", size, sizeof(size)) || strcmp(size, "-") != 0) {
+		fprintf(stderr, "%d: snap0 has size '%s' in the index, expected '-'\n",
+			__LINE__, index_size("snap0", size, sizeof(size)) ? size : "(none)");
+		goto out;
+	}
+
+	/* asking for the sizes computes and records them */
+	n = lxc_snapshot_index(c, &info);
+	if (n != 2 || strcmp(info[0].name, "snap0") || strcmp(info[1].name, "snap1") ||
+	    strcmp(info[0].bdev_type, "dir") || info[1].size < 100000 ||
+	    info[0].size >= info[1].size) {
+		fprintf(stderr, "%d: unexpected snapshot index\n", __LINE__);
+		goto out;
+	}
+	snprintf(path, sizeof(path), "%llu", (unsigned long long)info[1].size);
+	if (!index_size("snap1", size, sizeof(size)) || strcmp(size, path) != 0) {
+		fprintf(stderr, "%d: snap1 size was not recorded\n", __LINE__);
+		goto out;
+	}
+
+	/* concurrent listings and an update must not lose entries */
+	for (i = 0; i < NLISTERS; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0)
+			goto out;
+		if (pids[i] == 0) {
+			struct lxc_snapshot_info *inf;
+			int j, k;
+
+			for (j = 0; j < 20; j++) {
+				k = lxc_snapshot_index(c, &inf);
+				lxc_snapshot_info_free(inf, k > 0 ? k : 0);
+				if (k < 2)
+					_exit(1);
+			}
+			_exit(0);
+		}
+	}
+	if (make_snapshot("snap2", "2014:01:03 00:00:00", 10) < 0)
+		goto out;
+	for (i = 0; i < NLISTERS; i++) {
+		if (wait_for_pid(pids[i])) {
+			fprintf(stderr, "%d: a concurrent listing failed\n", __LINE__);
+			goto out;
+		}
+	}
+	if (count_snapshots(c, 3, __LINE__))
+		goto out;
+
+	/* snapshot_destroy drops the entry, a removed directory is dropped too */
+	if (!c->snapshot_destroy(c, "snap0")) {
+		fprintf(stderr, "%d: failed to destroy snap0\n", __LINE__);
+		goto out;
+	}
+	if (index_size("snap0", size, sizeof(size))) {
+		fprintf(stderr, "%d: snap0 is still in the index\n", __LINE__);
+		goto out;
+	}
+	snprintf(path, sizeof(path), "%s/snap2", snappath);
+	if (lxc_rmdir_onedev(path) < 0 || count_snapshots(c, 1, __LINE__))
+		goto out;
+	if (index_size("snap2", size, sizeof(size))) {
+		fprintf(stderr, "%d: removed snap2 is still in the index\n", __LINE__);
+		goto out;
+	}
+
+	printf("All snapshot index tests passed\n");
+	ret = 0;
+out:
+	lxc_snapshot_info_free(info, n > 0 ? n : 0);
+	if (c)
+		lxc_container_put(c);
+	lxc_rmdir_onedev(dir);
+	exit(ret);
+}
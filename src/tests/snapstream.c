@@ -0,0 +1,266 @@
+/* snapstream.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <lxc/lxccontainer.h>
+#include "lxc/utils.h"
+
+/*
+ * Snapshots of a directory backed container exported as tar streams and
+ * imported into a second lxcpath: a full stream, then an incremental one,
+ * and a forged one whose tar writes through a symlink of the rootfs.
+ */
+
+static char dir[] = "/tmp/lxc-snapstream-XXXXXX";
+static char lxcpath1[128], lxcpath2[128];
+
+static int write_file(const char *path, const char *content)
+{
+	int fd, ret;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+	ret = write(fd, content, strlen(content)) == strlen(content) ? 0 : -1;
+	close(fd);
+	return ret;
+}
+
+/* rel in the rootfs of c2 holds content, or does not exist if NULL */
+static int check_file(const char *rel, const char *content, int line)
+{
+	char path[512], buf[64];
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/c2/rootfs/%s", lxcpath2, rel);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (!content)
+			return 0;
+		fprintf(stderr, "%d: failed to open %s\n", line, path);
+		return -1;
+	}
+	memset(buf, 0, sizeof(buf));
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (!content || n < 0 || strcmp(buf, content) != 0) {
+		fprintf(stderr, "%d: %s holds '%s', expected %s\n", line, path, buf,
+			content ? content : "no file");
+		return -1;
+	}
+	return 0;
+}
+
+static int export(struct lxc_container *c, const char *snapname,
+		  const char *base, const char *file)
+{
+	char path[256];
+	int fd, ret;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return -1;
+	ret = lxc_snapshot_export(c, snapname, base, 0, fd);
+	close(fd);
+	if (ret < 0)
+		fprintf(stderr, "%d: failed to export %s\n", __LINE__, snapname);
+	return ret;
+}
+
+static int import(const char *file)
+{
+	char path[256];
+	int fd, ret;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	ret = lxc_snapshot_import("c2", lxcpath2, fd);
+	close(fd);
+	return ret;
+}
+
+/*
+ * The header and list of removals of stream 'from', followed by a tar
+ * of ./esc/pwned, which lands outside of the rootfs if tar follows the
+ * esc symlink of the rootfs on the host.
+ */
+static int forge(const char *from, const char *file)
+{
+	char path[256], cmd[1024], *buf, *data, *p;
+	size_t len;
+	FILE *f;
+	int ret = -1;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, from);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	buf = malloc(1 << 20);
+	len = buf ? fread(buf, 1, 1 << 20, f) : 0;
+	fclose(f);
+	data = buf ? memmem(buf, len, "\ndata\n", 6) : NULL;
+	if (!data)
+		goto out;
+	/* the removals end with an empty path */
+	for (p = data + 6; p < buf + len && *p; p += strlen(p) + 1)
+		;
+	if (p >= buf + len)
+		goto out;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	f = fopen(path, "w");
+	if (!f)
+		goto out;
+	ret = fwrite(buf, 1, p + 1 - buf, f) == p + 1 - buf ? 0 : -1;
+	if (fclose(f) != 0)
+		ret = -1;
+	if (ret < 0)
+		goto out;
+
+	snprintf(cmd, sizeof(cmd), "mkdir -p %s/forged/esc && echo pwned > %s/forged/esc/pwned && "
+		 "tar -cf - -C %s/forged ./esc/pwned >> %s", dir, dir, dir, path);
+	ret = system(cmd) == 0 ? 0 : -1;
+out:
+	free(buf);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	struct lxc_container *c1 = NULL;
+	char path[512], target[256], outside[128];
+	ssize_t n;
+	int ret = 1;
+
+	if (geteuid() != 0) {
+		printf("Only root can import snapshots, skipping the snapshot stream tests\n");
+		exit(0);
+	}
+	if (!on_path("rsync") || !on_path("tar")) {
+		printf("rsync or tar is not available, skipping the snapshot stream tests\n");
+		exit(0);
+	}
+	if (!mkdtemp(dir)) {
+		fprintf(stderr, "%d: failed to create a temporary directory\n", __LINE__);
+		exit(1);
+	}
+	snprintf(lxcpath1, sizeof(lxcpath1), "%s/a", dir);
+	snprintf(lxcpath2, sizeof(lxcpath2), "%s/b", dir);
+	snprintf(outside, sizeof(outside), "%s/outside", dir);
+
+	/* c1 holds a symlink to a host directory */
+	snprintf(path, sizeof(path), "%s/c1/rootfs/etc", lxcpath1);
+	if (mkdir_p(path, 0755) < 0 || mkdir_p(lxcpath2, 0755) < 0 ||
+	    mkdir(outside, 0755) < 0)
+		goto out;
+	snprintf(path, sizeof(path), "%s/c1/rootfs/hello", lxcpath1);
+	if (write_file(path, "hello") < 0)
+		goto out;
+	snprintf(path, sizeof(path), "%s/c1/rootfs/gone", lxcpath1);
+	if (write_file(path, "gone") < 0)
+		goto out;
+	snprintf(path, sizeof(path), "%s/c1/rootfs/esc", lxcpath1);
+	if (symlink(outside, path) < 0)
+		goto out;
+	c1 = lxc_container_new("c1", lxcpath1);
+	snprintf(path, sizeof(path), "%s/c1/rootfs", lxcpath1);
+	if (!c1 || !c1->set_config_item(c1, "lxc.utsname", "c1") ||
+	    !c1->set_config_item(c1, "lxc.rootfs", path) ||
+	    !c1->save_config(c1, NULL)) {
+		fprintf(stderr, "%d: failed to set up c1\n", __LINE__);
+		goto out;
+	}
+
+	/* a full stream creates c2 */
+	if (c1->snapshot(c1, NULL) != 0) {
+		fprintf(stderr, "%d: failed to snapshot c1\n", __LINE__);
+		goto out;
+	}
+	if (export(c1, "snap0", NULL, "s0") < 0)
+		goto out;
+	if (import("s0") < 0) {
+		fprintf(stderr, "%d: failed to import snap0\n", __LINE__);
+		goto out;
+	}
+	snprintf(path, sizeof(path), "%s/c2/rootfs/esc", lxcpath2);
+	n = readlink(path, target, sizeof(target) - 1);
+	if (check_file("hello", "hello", __LINE__) || check_file("gone", "gone", __LINE__) ||
+	    n < 0 || (target[n] = '\0', strcmp(target, outside))) {
+		fprintf(stderr, "%d: snap0 was not imported as it was\n", __LINE__);
+		goto out;
+	}
+
+	/* an incremental one brings the changes */
+	snprintf(path, sizeof(path), "%s/c1/rootfs/hello", lxcpath1);
+	if (write_file(path, "hello again") < 0)
+		goto out;
+	snprintf(path, sizeof(path), "%s/c1/rootfs/new", lxcpath1);
+	if (write_file(path, "new") < 0)
+		goto out;
+	snprintf(path, sizeof(path), "%s/c1/rootfs/gone", lxcpath1);
+	if (unlink(path) < 0)
+		goto out;
+	if (c1->snapshot(c1, NULL) != 1) {
+		fprintf(stderr, "%d: failed to snapshot c1\n", __LINE__);
+		goto out;
+	}
+	if (export(c1, "snap1", "snap0", "s1") < 0)
+		goto out;
+
+	/* extracting does not follow the symlinks of the rootfs on the host */
+	if (forge("s1", "s1-forged") < 0) {
+		fprintf(stderr, "%d: failed to forge a stream\n", __LINE__);
+		goto out;
+	}
+	import("s1-forged");
+	snprintf(path, sizeof(path), "%s/pwned", outside);
+	if (access(path, F_OK) == 0) {
+		fprintf(stderr, "%d: the stream wrote %s\n", __LINE__, path);
+		goto out;
+	}
+
+	if (import("s1") < 0) {
+		fprintf(stderr, "%d: failed to import snap1\n", __LINE__);
+		goto out;
+	}
+	if (check_file("hello", "hello again", __LINE__) ||
+	    check_file("new", "new", __LINE__) || check_file("gone", NULL, __LINE__))
+		goto out;
+
+	/* only once */
+	if (import("s1") == 0) {
+		fprintf(stderr, "%d: snap1 was imported twice\n", __LINE__);
+		goto out;
+	}
+
+	printf("All snapshot stream tests passed\n");
+	ret = 0;
+out:
+	if (c1)
+		lxc_container_put(c1);
+	lxc_rmdir_onedev(dir);
+	exit(ret);
+}
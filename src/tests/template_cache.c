@@ -0,0 +1,198 @@
+/* template_cache.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <lxc/lxccontainer.h>
+#include "lxc/utils.h"
+
+/*
+ * Creates with LXC_CREATE_CACHE from a stub template, which records each
+ * of its runs in a file, into dir backed containers: overlayfs clones of
+ * the cached result.
+ */
+
+static char dir[] = "/tmp/lxc-template-cache-XXXXXX";
+static char lxcpath[256], tmpl[256], runs[256];
+
+static int write_file(const char *path, const char *content, mode_t mode)
+{
+	int fd, ret;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, mode);
+	if (fd < 0)
+		return -1;
+	ret = write(fd, content, strlen(content)) == strlen(content) ? 0 : -1;
+	close(fd);
+	return ret;
+}
+
+/* the number of times the template ran */
+static int count_runs(void)
+{
+	char buf[4096];
+	ssize_t n;
+	int fd, i, count = 0;
+
+	fd = open(runs, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	n = read(fd, buf, sizeof(buf));
+	close(fd);
+	for (i = 0; i < n; i++)
+		if (buf[i] == '\n')
+			count++;
+	return count;
+}
+
+/* clones of a dir are overlayfs mounts, which lxc mounts as "overlayfs" */
+static int has_overlayfs(void)
+{
+	char line[128];
+	FILE *f;
+	int ret = 0;
+
+	f = fopen("/proc/filesystems", "r");
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f))
+		if (strcmp(line, "nodev\toverlayfs\n") == 0)
+			ret = 1;
+	fclose(f);
+	return ret;
+}
+
+/* create name with release as template argument and tty ttys */
+static int create(const char *name, const char *release, const char *tty,
+		  int expect_runs, int line)
+{
+	struct lxc_container *c;
+	char *const args[] = { "-r", (char *)release, NULL };
+	int ret = -1;
+
+	c = lxc_container_new(name, lxcpath);
+	if (!c || !c->set_config_item(c, "lxc.utsname", "tc") ||
+	    !c->set_config_item(c, "lxc.tty", tty) ||
+	    !c->create(c, tmpl, NULL, NULL, LXC_CREATE_CACHE, args)) {
+		fprintf(stderr, "%d: failed to create %s\n", line, name);
+		goto out;
+	}
+	if (!c->is_defined(c) || count_runs() != expect_runs) {
+		fprintf(stderr, "%d: the template ran %d times, expected %d\n",
+			line, count_runs(), expect_runs);
+		goto out;
+	}
+	ret = 0;
+out:
+	if (c)
+		lxc_container_put(c);
+	return ret;
+}
+
+static int destroy(const char *name)
+{
+	struct lxc_container *c;
+	bool ret;
+
+	c = lxc_container_new(name, lxcpath);
+	if (!c)
+		return -1;
+	ret = c->destroy(c);
+	lxc_container_put(c);
+	if (!ret) {
+		fprintf(stderr, "%d: failed to destroy %s\n", __LINE__, name);
+		return -1;
+	}
+	return 0;
+}
+
+static int flush(int expect, int line)
+{
+	int ret;
+
+	ret = lxc_template_cache_flush(lxcpath);
+	if (ret != expect) {
+		fprintf(stderr, "%d: the flush removed %d entries, expected %d\n",
+			line, ret, expect);
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	char script[512];
+	int ret = 1;
+
+	if (geteuid() != 0) {
+		printf("Only root can create without an id map, skipping the template cache tests\n");
+		exit(0);
+	}
+	if (!has_overlayfs()) {
+		printf("overlayfs is not available, skipping the template cache tests\n");
+		exit(0);
+	}
+	if (!mkdtemp(dir)) {
+		fprintf(stderr, "%d: failed to create a temporary directory\n", __LINE__);
+		exit(1);
+	}
+	snprintf(lxcpath, sizeof(lxcpath), "%s/lxc", dir);
+	snprintf(tmpl, sizeof(tmpl), "%s/lxc-stub", dir);
+	snprintf(runs, sizeof(runs), "%s/runs", dir);
+	snprintf(script, sizeof(script),
+		 "#!/bin/sh\n"
+		 "for arg; do\n"
+		 "\tcase \"$arg\" in --rootfs=*) rootfs=\"${arg#--rootfs=}\";; esac\n"
+		 "done\n"
+		 "mkdir -p \"$rootfs/etc\" && echo \"$*\" >> %s\n", runs);
+	if (mkdir(lxcpath, 0755) < 0 || write_file(tmpl, script, 0755) < 0) {
+		fprintf(stderr, "%d: failed to set up %s\n", __LINE__, dir);
+		goto out;
+	}
+
+	/* the first create runs the template, the second clones its result */
+	if (create("c1", "a", "1", 1, __LINE__) || create("c2", "a", "1", 1, __LINE__))
+		goto out;
+
+	/* another argument, or another configuration, is another entry */
+	if (create("c3", "b", "1", 2, __LINE__) || create("c4", "a", "2", 3, __LINE__))
+		goto out;
+
+	/* all the entries have clones */
+	if (flush(0, __LINE__))
+		goto out;
+
+	/* the entry of c3 goes with its only clone, not the one of c1 and c2 */
+	if (destroy("c3") || flush(1, __LINE__))
+		goto out;
+	if (destroy("c1") || flush(0, __LINE__) || destroy("c2") || flush(1, __LINE__))
+		goto out;
+
+	/* so a create runs the template again */
+	if (create("c5", "a", "1", 4, __LINE__) || create("c6", "a", "2", 4, __LINE__))
+		goto out;
+
+	printf("All template cache tests passed\n");
+	ret = 0;
+out:
+	lxc_rmdir_onedev(dir);
+	exit(ret);
+}
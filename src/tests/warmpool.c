@@ -0,0 +1,242 @@
+/* warmpool.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <lxc/lxccontainer.h>
+#include "lxc/lxc.h"
+#include "lxc/state.h"
+#include "lxc/utils.h"
+
+/*
+ * The pool of dir backed stub containers, put in it by hand rather than
+ * booted: the state and the freezer of the containers are stubbed below,
+ * over the ones of liblxc.
+ */
+
+#define MAX_WARM 8
+
+static char dir[] = "/tmp/lxc-warmpool-XXXXXX";
+static char lxcpath[256];
+
+static lxc_state_t states[MAX_WARM];
+static int thawed[MAX_WARM];
+
+/* N of t-warmN, or -1 */
+static int warm_index(const char *name)
+{
+	int i;
+
+	if (sscanf(name, "t-warm%d", &i) != 1 || i < 0 || i >= MAX_WARM)
+		return -1;
+	return i;
+}
+
+lxc_state_t lxc_getstate(const char *name, const char *lxcpath)
+{
+	int i = warm_index(name);
+
+	return i < 0 ? STOPPED : states[i];
+}
+
+int lxc_freeze(const char *name, const char *lxcpath)
+{
+	return -1;
+}
+
+int lxc_unfreeze(const char *name, const char *lxcpath)
+{
+	int i = warm_index(name);
+
+	if (i < 0 || states[i] != FROZEN)
+		return -1;
+	states[i] = RUNNING;
+	thawed[i]++;
+	return 0;
+}
+
+static int write_file(const char *path, const char *content)
+{
+	int fd, ret;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+	ret = write(fd, content, strlen(content)) == strlen(content) ? 0 : -1;
+	close(fd);
+	return ret;
+}
+
+static int exists(const char *name, const char *file)
+{
+	char path[512];
+
+	snprintf(path, sizeof(path), "%s/%s/%s", lxcpath, name, file);
+	return access(path, F_OK) == 0;
+}
+
+/* a dir backed container, with file holding content if file is not NULL */
+static int stub_container(const char *name, const char *file, const char *content)
+{
+	struct lxc_container *c;
+	char path[512];
+	bool ret;
+
+	snprintf(path, sizeof(path), "%s/%s/rootfs", lxcpath, name);
+	if (mkdir_p(path, 0755) < 0)
+		return -1;
+	c = lxc_container_new(name, lxcpath);
+	if (!c)
+		return -1;
+	ret = c->set_config_item(c, "lxc.utsname", name) &&
+	      c->set_config_item(c, "lxc.rootfs", path) &&
+	      c->save_config(c, NULL);
+	lxc_container_put(c);
+	if (!ret)
+		return -1;
+	if (!file)
+		return 0;
+	snprintf(path, sizeof(path), "%s/%s/%s", lxcpath, name, file);
+	return write_file(path, content);
+}
+
+/* the pid of a process which went away */
+static pid_t dead_pid(void)
+{
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0)
+		return -1;
+	if (pid == 0)
+		_exit(0);
+	waitpid(pid, NULL, 0);
+	return pid;
+}
+
+/* take a container, expecting one of the first n warm ones not taken yet */
+static int take(int n, int *taken, int line)
+{
+	struct lxc_container *c;
+	int i;
+
+	c = lxc_warmpool_take("t", lxcpath, false);
+	if (!c) {
+		fprintf(stderr, "%d: no container was taken\n", line);
+		return -1;
+	}
+	i = warm_index(c->name);
+	if (i < 0 || i >= n || taken[i] || thawed[i] != 1 || states[i] != RUNNING) {
+		fprintf(stderr, "%d: took %s, thawed %d times\n", line, c->name,
+			i < 0 ? -1 : thawed[i]);
+		lxc_container_put(c);
+		return -1;
+	}
+	taken[i] = 1;
+	/* handed off, so out of the pool */
+	if (exists(c->name, "warm") || exists(c->name, "warm.claimed")) {
+		fprintf(stderr, "%d: %s is still marked as warm\n", line, c->name);
+		lxc_container_put(c);
+		return -1;
+	}
+	lxc_container_put(c);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct lxc_container *c;
+	int taken[MAX_WARM];
+	char buf[64];
+	int i, ret = 1;
+
+	if (!mkdtemp(dir)) {
+		fprintf(stderr, "%d: failed to create a temporary directory\n", __LINE__);
+		exit(1);
+	}
+	snprintf(lxcpath, sizeof(lxcpath), "%s/lxc", dir);
+	memset(taken, 0, sizeof(taken));
+
+	/* two frozen warm containers of t */
+	if (stub_container("t", NULL, NULL) ||
+	    stub_container("t-warm0", "warm", "t\n") ||
+	    stub_container("t-warm1", "warm", "t\n")) {
+		fprintf(stderr, "%d: failed to set up the pool\n", __LINE__);
+		goto out;
+	}
+	states[0] = states[1] = FROZEN;
+
+	/* each take claims and thaws another one, until none is left */
+	if (take(2, taken, __LINE__) || take(2, taken, __LINE__))
+		goto out;
+	c = lxc_warmpool_take("t", lxcpath, false);
+	if (c) {
+		fprintf(stderr, "%d: took %s from an empty pool\n", __LINE__, c->name);
+		lxc_container_put(c);
+		goto out;
+	}
+
+	/*
+	 * Claims of takers which went away: t-warm2 is still frozen and goes
+	 * back to the pool, t-warm3 was thawed and is left alone.  t-warm4
+	 * was left half started by its filler.
+	 */
+	snprintf(buf, sizeof(buf), "pid=%d\n", dead_pid());
+	if (stub_container("t-warm2", "warm.claimed", buf) ||
+	    stub_container("t-warm3", "warm.claimed", buf) ||
+	    stub_container("t-warm4", "warm.starting", buf)) {
+		fprintf(stderr, "%d: failed to set up the claims\n", __LINE__);
+		goto out;
+	}
+	states[2] = FROZEN;
+	states[3] = RUNNING;
+
+	/* the pool has its container, without booting another one */
+	i = lxc_warmpool_fill("t", lxcpath, 1, 0);
+	if (i != 1) {
+		fprintf(stderr, "%d: the pool holds %d containers, expected 1\n", __LINE__, i);
+		goto out;
+	}
+	if (!exists("t-warm2", "warm") || exists("t-warm2", "warm.claimed")) {
+		fprintf(stderr, "%d: t-warm2 was not reclaimed\n", __LINE__);
+		goto out;
+	}
+	if (exists("t-warm3", "warm") || exists("t-warm3", "warm.claimed") ||
+	    !exists("t-warm3", "config")) {
+		fprintf(stderr, "%d: the handed off t-warm3 was changed\n", __LINE__);
+		goto out;
+	}
+	if (exists("t-warm4", "config")) {
+		fprintf(stderr, "%d: the half started t-warm4 was not discarded\n", __LINE__);
+		goto out;
+	}
+
+	/* and hands off the reclaimed one */
+	if (take(3, taken, __LINE__) || !taken[2])
+		goto out;
+
+	printf("All warm pool tests passed\n");
+	ret = 0;
+out:
+	lxc_rmdir_onedev(dir);
+	exit(ret);
+}
@@ -0,0 +1,243 @@
+/* zfs_ops.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <lxc/lxccontainer.h>
+#include "lxc/bdev.h"
+#include "lxc/lxczfs.h"
+#include "lxc/utils.h"
+
+/*
+ * The zfs backing store driven through mocked zfs ops: which datasets
+ * it snapshots, clones and destroys, and that failures are passed on.
+ */
+
+static char dir[] = "/tmp/lxc-zfs-ops-XXXXXX";
+static char calls[8192];
+static const char *fail_op;
+
+static void record(const char *op, const char *a, const char *b, const char *c)
+{
+	size_t len = strlen(calls);
+
+	snprintf(calls + len, sizeof(calls) - len, "%s %s%s%s%s%s;", op, a,
+		 b ? " " : "", b ? b : "", c ? " " : "", c ? c : "");
+}
+
+static int mock_create(const char *dataset, const char *mountpoint)
+{
+	record("create", dataset, mountpoint, NULL);
+	return fail_op && !strcmp(fail_op, "create") ? -1 : 0;
+}
+
+static int mock_snapshot(const char *dataset, const char *snap)
+{
+	record("snapshot", dataset, snap, NULL);
+	return fail_op && !strcmp(fail_op, "snapshot") ? -1 : 0;
+}
+
+static int mock_clone(const char *origin, const char *dataset,
+		      const char *mountpoint)
+{
+	record("clone", origin, dataset, mountpoint);
+	return fail_op && !strcmp(fail_op, "clone") ? -1 : 0;
+}
+
+static int mock_destroy(const char *dataset, const char *mountpoint)
+{
+	record("destroy", dataset, mountpoint, NULL);
+	return fail_op && !strcmp(fail_op, "destroy") ? -1 : 0;
+}
+
+static bool mock_exists(const char *dataset)
+{
+	return true;
+}
+
+/* $dir/$name/rootfs is the mountpoint of tank/lxc/$name, but for c3 */
+static char *mock_dataset_of(const char *path, bool scan)
+{
+	char *name, *p, *ret = NULL;
+	size_t len = strlen(dir);
+
+	if (strncmp(path, dir, len) || path[len] != '/')
+		return NULL;
+	name = strdup(path + len + 1);
+	if (!name)
+		return NULL;
+	p = strchr(name, '/');
+	if (p && !strcmp(p, "/rootfs") && strncmp(name, "c3", 2)) {
+		*p = '\0';
+		if (asprintf(&ret, "tank/lxc/%s", name) < 0)
+			ret = NULL;
+	}
+	free(name);
+	return ret;
+}
+
+static const struct lxc_zfs_ops mock_ops = {
+	.name = "mock",
+	.create = mock_create,
+	.snapshot = mock_snapshot,
+	.clone = mock_clone,
+	.destroy = mock_destroy,
+	.exists = mock_exists,
+	.dataset_of = mock_dataset_of,
+};
+
+static struct lxc_container *zfs_container(const char *name)
+{
+	struct lxc_container *c;
+	char path[4096];
+
+	snprintf(path, sizeof(path), "%s/%s/rootfs", dir, name);
+	if (mkdir_p(path, 0755) < 0)
+		return NULL;
+	c = lxc_container_new(name, dir);
+	if (!c)
+		return NULL;
+	if (!c->set_config_item(c, "lxc.rootfs", path) ||
+	    !c->set_config_item(c, "lxc.rootfs.backend", "zfs")) {
+		lxc_container_put(c);
+		return NULL;
+	}
+	return c;
+}
+
+static int check_calls(const char *expect, int line)
+{
+	if (strcmp(calls, expect) != 0) {
+		fprintf(stderr, "%d: zfs calls were\n\t%s\nexpected\n\t%s\n", line,
+			calls, expect);
+		return -1;
+	}
+	calls[0] = '\0';
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct lxc_container *c1 = NULL, *c3 = NULL;
+	struct bdev *bdev = NULL;
+	char expect[8192], path[256];
+	char *backend = NULL;
+	int rdep, ret = 1;
+
+	if (!mkdtemp(dir)) {
+		fprintf(stderr, "%d: failed to create a temporary directory\n", __LINE__);
+		exit(1);
+	}
+	lxc_zfs_set_ops(&mock_ops);
+
+	c1 = zfs_container("c1");
+	c3 = zfs_container("c3");
+	if (!c1 || !c3) {
+		fprintf(stderr, "%d: failed to set up the containers\n", __LINE__);
+		goto out;
+	}
+
+	/* a snapshot clone is made next to the original dataset */
+	bdev = bdev_copy(c1, "c2", dir, NULL, LXC_CLONE_SNAPSHOT, NULL, 0, &rdep);
+	if (!bdev || strcmp(bdev->type, "zfs")) {
+		fprintf(stderr, "%d: failed to clone c1\n", __LINE__);
+		goto out;
+	}
+	snprintf(path, sizeof(path), "%s/c2/rootfs", dir);
+	if (strcmp(bdev->src, path)) {
+		fprintf(stderr, "%d: clone is at %s, not %s\n", __LINE__, bdev->src, path);
+		goto out;
+	}
+	snprintf(expect, sizeof(expect),
+		 "snapshot tank/lxc/c1 c2;clone tank/lxc/c1@c2 tank/lxc/c2 %s;", path);
+	if (check_calls(expect, __LINE__))
+		goto out;
+
+	/* destroy finds the dataset mounted on the rootfs */
+	if (bdev->ops->destroy(bdev) < 0) {
+		fprintf(stderr, "%d: failed to destroy c2\n", __LINE__);
+		goto out;
+	}
+	snprintf(expect, sizeof(expect), "destroy tank/lxc/c2 %s;", path);
+	if (check_calls(expect, __LINE__))
+		goto out;
+	bdev_put(bdev);
+
+	/* a rootfs recorded as zfs without a dataset is detected again */
+	snprintf(path, sizeof(path), "%s/c3/rootfs", dir);
+	backend = strdup("zfs");
+	bdev = bdev_init_rootfs(path, NULL, NULL, &backend);
+	if (!bdev || strcmp(bdev->type, "dir") || !backend || strcmp(backend, "dir")) {
+		fprintf(stderr, "%d: %s without a dataset was taken as %s\n", __LINE__,
+			path, bdev ? bdev->type : "nothing");
+		goto out;
+	}
+	if (check_calls("", __LINE__))
+		goto out;
+	bdev_put(bdev);
+	free(backend);
+	backend = NULL;
+
+	/* failures are passed on, and stop the clone */
+	fail_op = "snapshot";
+	bdev = bdev_copy(c1, "c5", dir, NULL, LXC_CLONE_SNAPSHOT, NULL, 0, &rdep);
+	if (bdev) {
+		fprintf(stderr, "%d: clone succeeded with a failing snapshot\n", __LINE__);
+		goto out;
+	}
+	if (check_calls("snapshot tank/lxc/c1 c5;", __LINE__))
+		goto out;
+
+	fail_op = "destroy";
+	snprintf(path, sizeof(path), "%s/c1/rootfs", dir);
+	backend = strdup("zfs");
+	bdev = bdev_init_rootfs(path, NULL, NULL, &backend);
+	if (!bdev || strcmp(bdev->type, "zfs") || bdev->ops->destroy(bdev) == 0) {
+		fprintf(stderr, "%d: destroy succeeded with a failing zfs destroy\n", __LINE__);
+		goto out;
+	}
+	snprintf(expect, sizeof(expect), "destroy tank/lxc/c1 %s;", path);
+	if (check_calls(expect, __LINE__))
+		goto out;
+
+	/* a rootfs which is no dataset is not destroyed */
+	fail_op = NULL;
+	free(bdev->src);
+	snprintf(path, sizeof(path), "%s/c3/rootfs", dir);
+	bdev->src = strdup(path);
+	if (!bdev->src || bdev->ops->destroy(bdev) == 0 || check_calls("", __LINE__)) {
+		fprintf(stderr, "%d: destroyed a rootfs without a dataset\n", __LINE__);
+		goto out;
+	}
+
+	printf("All zfs ops tests passed\n");
+	ret = 0;
+out:
+	if (bdev)
+		bdev_put(bdev);
+	free(backend);
+	if (c1)
+		lxc_container_put(c1);
+	if (c3)
+		lxc_container_put(c3);
+	lxc_rmdir_onedev(dir);
+	exit(ret);
+}